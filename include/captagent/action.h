@@ -1,6 +1,21 @@
 #ifndef action_h
 #define action_h
 
+#include <stdint.h>
+#include <pthread.h>
+
+/* one MODULE_T call of a capture plan, counters only move with action_profile on */
+typedef struct action_prof {
+        char *plan;
+        char *name;
+        int line;
+        uint64_t calls;
+        uint64_t ret_true;      /* > 0, continue */
+        uint64_t ret_false;     /* < 0 */
+        uint64_t ret_drop;      /* 0, stops the plan */
+        uint64_t cycles;
+        struct action_prof *next;
+} action_prof_t;
 
 struct action{
         int type;  /* forward, drop, log, send ...*/
@@ -14,8 +29,18 @@ struct action{
                 void* data;
         }p1, p2, p3;
         struct action* next;
+        action_prof_t *prof;
 };
 
+extern int action_profile_enabled;
+extern action_prof_t *action_prof_list;
+/* held while walking action_prof_list, reloads unlink the old entries */
+extern pthread_mutex_t action_prof_lock;
+/* "tsc" or "ns", whatever action_prof_t.cycles counts */
+extern const char *action_profile_unit;
+
+void action_profile_add(struct action *a, char *name);
+
 
 struct run_act_ctx{
         int rec_lev;
@@ -25,6 +50,15 @@ struct run_act_ctx{
 
 int do_action(struct run_act_ctx* c, struct action* a, msg_t *msg);
 int run_actions(struct run_act_ctx* c, struct action* a, msg_t* msg);
+/* runs capture plan idx of main_ct, what the capture threads call per packet.
+ * Lock free, a reload swaps the plan under it and frees the old one only
+ * after every thread has left it */
+int run_capture(struct run_act_ctx* c, int idx, msg_t* msg);
+/* runs plan idx over a vector of messages inside one batch scope, for socket
+ * modules receiving several packets per call. c is reset for every message.
+ * Returns count */
+#define CAPTURE_BATCH_MAX 256
+int run_capture_batch(struct run_act_ctx* c, int idx, msg_t** msgs, int count);
 
 #endif
 
@@ -26,13 +26,53 @@
 #ifndef CAPTURE_H_
 #define CAPTURE_H_
 
+#include <stddef.h>
+
+#define CAPTURE_MAX 20
+
 struct capture_list{
-        struct action* clist[20];        
+        struct action* clist[CAPTURE_MAX];        
         int idx; 
         int entries; 
-        char names[20][100]; 
+        char names[CAPTURE_MAX][100]; 
+        char *files[CAPTURE_MAX];       /* plan file of each capture, for reloads */
 };
 
+/* parses a capture plan file into main_ct, returns the index to run it with */
+int capture_plan_load(char *file);
+/* parses every loaded plan file again and swaps the new plans in while the
+ * capture threads keep running. Returns the number of plans swapped or -1 if
+ * one of them failed to parse, that one keeps running the old plan */
+int capture_plan_reload(void);
+
+/* called after every reload that swapped a plan in, from the reloading
+ * thread. remove() returns once fn is not running any more */
+#define CAPTURE_MAX_WATCHERS 8
+
+typedef void (*capture_plan_watch_f)(void *arg);
+
+int capture_plan_watch_add(capture_plan_watch_f fn, void *arg);
+void capture_plan_watch_remove(capture_plan_watch_f fn, void *arg);
+
+/* Batch scope of the calling thread, scopes nest. While one is open actions
+ * that queue work (send_hep) may hold it back, the outermost end() calls every
+ * flush hook in that thread to hand it over in one go. remove() returns once
+ * fn is not running any more */
+#define CAPTURE_MAX_FLUSHERS 8
+
+typedef void (*capture_batch_flush_f)(void *arg);
+
+void capture_batch_begin(void);
+void capture_batch_end(void);
+int capture_batch_active(void);
+int capture_batch_flush_add(capture_batch_flush_f fn, void *arg);
+void capture_batch_flush_remove(capture_batch_flush_f fn, void *arg);
+
+/* BPF for the msg_check() calls guarding all of plan idx, only pure L3/L4
+ * ones. It lets through at least what the plan does, the checks stay in the
+ * plan. Returns 1 with the checks taken listed in report, 0 if none */
+int capture_plan_bpf(int idx, char *buf, size_t size, char *report, size_t rlen);
+
 #define FILTER_LEN 4080
 
 /* our payload range between 0 - 191 */
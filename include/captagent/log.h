@@ -29,24 +29,36 @@
 
 #include <syslog.h>
 
+#define LOG_RATE_DEFAULT 1000	/* lines per second written by the async writer */
+
+extern int log_level;
+
 void init_log(char *_prgname, int _use_syslog);
 
 void set_log_level(int level);
 
 void destroy_log(void);
 
+/* hand the output to a writer thread, rate: lines per second, 0 unlimited.
+ * Start it after daemonize(), a thread does not survive fork() */
+int log_async_start(int rate);
+void log_async_stop(void);
+
 void data_log(int priority, const char * fmt, ...);
 
 #define PA_GCC_PRINTF_ATTR(a,b) __attribute__ ((format (printf, a, b)));
 
-#define LEMERG(fmt, args...) data_log(LOG_EMERG, "[DEBUG] %s:%d " fmt, __FILE__, __LINE__, ## args)
-#define LALERT(fmt, args...) data_log(LOG_ALERT, "[ALERT] %s:%d " fmt, __FILE__, __LINE__, ## args)
-#define LCRIT(fmt, args...) data_log(LOG_CRIT, "[CRIT] %s:%d " fmt, __FILE__, __LINE__, ## args)
-#define LERR(fmt, args...) data_log(LOG_ERR, "[ERR] %s:%d " fmt, __FILE__, __LINE__, ## args)
-#define LWARNING(fmt, args...) data_log(LOG_WARNING, "[WARNING] %s:%d " fmt, __FILE__, __LINE__, ## args)
-#define LNOTICE(fmt, args...) data_log(LOG_NOTICE, "[NOTICE] " fmt, ## args)
-#define LINFO(fmt, args...) data_log(LOG_INFO, "[INFO] %s:%d " fmt, __FILE__, __LINE__, ## args)
-#define LDEBUG(fmt, args...) data_log(LOG_DEBUG, "[DEBUG] %s:%d " fmt, __FILE__, __LINE__, ## args)
-#define LMESSAGE(fmt, args...) data_log(LOG_ERR, "[MESSAGE] " fmt, ## args)
+/* the level is checked before the arguments are evaluated */
+#define LOG_ENABLED(priority) ((priority) <= log_level)
+
+#define LEMERG(fmt, args...) (LOG_ENABLED(LOG_EMERG) ? data_log(LOG_EMERG, "[DEBUG] %s:%d " fmt, __FILE__, __LINE__, ## args) : (void) 0)
+#define LALERT(fmt, args...) (LOG_ENABLED(LOG_ALERT) ? data_log(LOG_ALERT, "[ALERT] %s:%d " fmt, __FILE__, __LINE__, ## args) : (void) 0)
+#define LCRIT(fmt, args...) (LOG_ENABLED(LOG_CRIT) ? data_log(LOG_CRIT, "[CRIT] %s:%d " fmt, __FILE__, __LINE__, ## args) : (void) 0)
+#define LERR(fmt, args...) (LOG_ENABLED(LOG_ERR) ? data_log(LOG_ERR, "[ERR] %s:%d " fmt, __FILE__, __LINE__, ## args) : (void) 0)
+#define LWARNING(fmt, args...) (LOG_ENABLED(LOG_WARNING) ? data_log(LOG_WARNING, "[WARNING] %s:%d " fmt, __FILE__, __LINE__, ## args) : (void) 0)
+#define LNOTICE(fmt, args...) (LOG_ENABLED(LOG_NOTICE) ? data_log(LOG_NOTICE, "[NOTICE] " fmt, ## args) : (void) 0)
+#define LINFO(fmt, args...) (LOG_ENABLED(LOG_INFO) ? data_log(LOG_INFO, "[INFO] %s:%d " fmt, __FILE__, __LINE__, ## args) : (void) 0)
+#define LDEBUG(fmt, args...) (LOG_ENABLED(LOG_DEBUG) ? data_log(LOG_DEBUG, "[DEBUG] %s:%d " fmt, __FILE__, __LINE__, ## args) : (void) 0)
+#define LMESSAGE(fmt, args...) (LOG_ENABLED(LOG_ERR) ? data_log(LOG_ERR, "[MESSAGE] " fmt, ## args) : (void) 0)
 
 #endif /* LOG_H_ */
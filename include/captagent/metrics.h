@@ -0,0 +1,234 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Metrics registry, per-thread counters aggregated on scrape
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define METRIC_COUNTER 0
+#define METRIC_GAUGE 1
+#define METRIC_HISTOGRAM 2
+
+/* threads with an own cell, all later threads share the last one */
+#define METRIC_MAX_THREADS 64
+#define METRIC_CACHE_LINE 64
+
+typedef struct metric_cell {
+	uint64_t value;
+	char pad[METRIC_CACHE_LINE - sizeof(uint64_t)];
+} __attribute__((aligned(METRIC_CACHE_LINE))) metric_cell_t;
+
+/*
+ * HDR style histogram of microseconds: values below 8 are exact, above that
+ * every power of two is split into 8 buckets (12.5% resolution) up to 2^36us.
+ */
+#define METRIC_HIST_SUB_BITS 3
+#define METRIC_HIST_SUB (1 << METRIC_HIST_SUB_BITS)
+#define METRIC_HIST_MAX_SHIFT 32
+#define METRIC_HIST_BUCKETS ((METRIC_HIST_MAX_SHIFT + 2) * METRIC_HIST_SUB)
+
+typedef struct metric_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[METRIC_HIST_BUCKETS];
+} metric_hist_t;
+
+/* gauge evaluated at scrape time, e.g. a queue depth */
+typedef int64_t (*metric_read_f)(void *arg);
+
+typedef struct metric {
+	char *name;
+	char *help;
+	char *labels;
+	int type;
+	metric_read_f read_f;
+	void *arg;
+	metric_cell_t *cells;
+	/* histograms: per thread, allocated on the first observation */
+	metric_hist_t **hist;
+	struct metric *next;
+} metric_t;
+
+extern __thread int metric_thread_slot;
+
+/* core setting latency_stats, 0 disables all capture-to-stage timestamps */
+extern int metric_latency_enabled;
+
+int metric_slot_init(void);
+
+/*
+ * name is exported as captagent_<name>, labels is either NULL or a ready
+ * label list like 'profile="hepsocket"'. Modules register in load_module()
+ * and unregister in unload_module() once their threads are gone. Capture
+ * threads of other modules may still count on it, so unregister only hides
+ * the metric; the core frees it once no plan can be running any more.
+ */
+metric_t *metric_counter(const char *name, const char *help, const char *labels);
+metric_t *metric_gauge(const char *name, const char *help, const char *labels);
+metric_t *metric_gauge_fn(const char *name, const char *help, const char *labels, metric_read_f read_f, void *arg);
+metric_t *metric_histogram(const char *name, const char *help, const char *labels);
+void metric_unregister(metric_t *m);
+/* takes the unregistered metrics, metric_free() them once nobody holds one */
+metric_t *metric_retired(void);
+void metric_free(metric_t *m);
+
+int64_t metric_value(metric_t *m);
+
+metric_hist_t *metric_hist_cell(metric_t *m, int slot);
+/* sum of all threads into *out */
+void metric_hist_merge(metric_t *m, metric_hist_t *out);
+/* upper bound in us of the bucket holding quantile q (0..1) */
+uint64_t metric_hist_quantile(metric_hist_t *h, double q);
+
+/* calls fn for every metric of a type, with the registry locked */
+void metric_foreach(int type, void (*fn)(metric_t *m, void *arg), void *arg);
+
+/*
+ * Every lost packet or message is counted in drops_total with the module,
+ * the profile and one of the reasons below, so one query shows where
+ * capture loses data.
+ */
+#define METRIC_DROPS "drops_total"
+#define DROP_KERNEL "kernel"                    /* socket buffer / ring full */
+#define DROP_INTERFACE "interface"              /* dropped by the NIC or driver */
+#define DROP_REASSEMBLY "reassembly"            /* fragment or segment rejected */
+#define DROP_REASSEMBLY_TIMEOUT "reassembly_timeout"
+#define DROP_REASSEMBLY_OVERLAP "reassembly_overlap"  /* overlapping IP fragments */
+#define DROP_QUEUE_FULL "queue_full"            /* internal queue or ring full */
+#define DROP_LOAD_SHED "load_shed"              /* low priority traffic shed under overload */
+#define DROP_SEND_ERROR "send_error"
+#define DROP_WRITE_ERROR "write_error"
+#define DROP_TOO_BIG "too_big"                  /* over the length field of the format */
+
+metric_t *metric_drops(const char *module, const char *profile, const char *reason);
+
+/*
+ * Called about once a second from one core thread, for counters that
+ * have to be polled (pcap_stats(), PACKET_STATISTICS). remove() returns
+ * once fn is not running any more.
+ */
+#define METRIC_COLLECT_INTERVAL 1
+#define METRIC_MAX_COLLECTORS 32
+
+typedef void (*metric_collect_f)(void *arg);
+
+int metric_collector_add(metric_collect_f fn, void *arg);
+void metric_collector_remove(metric_collect_f fn, void *arg);
+
+/* Prometheus text format of all registered metrics, free() the result */
+char *metrics_prometheus(size_t *len);
+
+/* the cell of a thread has one writer, no locked instruction needed */
+static inline void metric_add(metric_t *m, int64_t n)
+{
+	metric_cell_t *cell;
+	int slot = metric_thread_slot;
+
+	if(!m) return;
+	if(slot < 0) slot = metric_slot_init();
+
+	cell = &m->cells[slot];
+
+	if(slot < METRIC_MAX_THREADS - 1)
+		__atomic_store_n(&cell->value, __atomic_load_n(&cell->value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&cell->value, n, __ATOMIC_RELAXED);
+}
+
+#define metric_inc(m) metric_add(m, 1)
+#define metric_dec(m) metric_add(m, -1)
+
+#define METRIC_OWN_ADD(p, n) __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+static inline unsigned int metric_hist_bucket(uint64_t v)
+{
+	unsigned int shift;
+
+	if(v < METRIC_HIST_SUB) return v;
+
+	shift = 63 - __builtin_clzll(v) - METRIC_HIST_SUB_BITS;
+	if(shift > METRIC_HIST_MAX_SHIFT) return METRIC_HIST_BUCKETS - 1;
+
+	return (shift + 1) * METRIC_HIST_SUB + ((v >> shift) & (METRIC_HIST_SUB - 1));
+}
+
+static inline void metric_observe(metric_t *m, uint64_t v)
+{
+	metric_hist_t *h;
+	unsigned int b;
+	int slot = metric_thread_slot;
+
+	if(!m) return;
+	if(slot < 0) slot = metric_slot_init();
+
+	if((h = __atomic_load_n(&m->hist[slot], __ATOMIC_ACQUIRE)) == NULL
+			&& (h = metric_hist_cell(m, slot)) == NULL) return;
+
+	b = metric_hist_bucket(v);
+
+	if(slot < METRIC_MAX_THREADS - 1) {
+		METRIC_OWN_ADD(&h->buckets[b], 1);
+		METRIC_OWN_ADD(&h->count, 1);
+		METRIC_OWN_ADD(&h->sum, v);
+		if(v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+	else {
+		__atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+		/* max of the shared cell may miss a concurrent update */
+		if(v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+/* microseconds since a capture timestamp, 0 if that is in the future */
+static inline uint64_t metric_since_us(uint32_t sec, uint32_t usec)
+{
+	struct timespec ts;
+	int64_t d;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	d = ((int64_t) ts.tv_sec - sec) * 1000000 + ts.tv_nsec / 1000 - usec;
+
+	return d > 0 ? (uint64_t) d : 0;
+}
+
+/* no clock read at all with latency_stats off, messages without a capture time are skipped */
+#define metric_latency(m, sec, usec) do { \
+	if(metric_latency_enabled && (m) && (sec)) metric_observe(m, metric_since_us(sec, usec)); \
+} while(0)
+
+/* gauges are either set from one place or moved with metric_add(), not both */
+static inline void metric_set(metric_t *m, int64_t value)
+{
+	if(m) __atomic_store_n(&m->cells[0].value, (uint64_t) value, __ATOMIC_RELAXED);
+}
+
+#endif /* METRICS_H_ */
@@ -63,6 +63,8 @@ typedef int (*send_message_t)(msg_t *msg);
 typedef int (*send_stats_t)(stats_msg_t *stats_msg);
 typedef int (*reload_t)(char *erbuf, int len);
 typedef int (*apply_filter_t)(filter_msg_t *filter);
+typedef int (*dump_pcap_t)(pcap_dump_filter_t *filter, pcap_dump_write_f write, void *arg);
+typedef int (*dump_call_t)(str *callid, pcap_dump_write_f write, void *arg);
 
 typedef int (*update_db_t)(const db_msg_t *msg, const db_value_t* _v, const int _n);
 typedef int (*delete_db_t)(const db_msg_t *msg, const db_value_t* _v, const int _n);
@@ -82,6 +84,8 @@ typedef struct socket_module_api {
         unsigned int  	nat_flag;   /*! nat_flag module parameter */
         reload_t        reload_f;
         apply_filter_t  apply_filter_f;
+        dump_pcap_t     dump_pcap_f;
+        dump_call_t     dump_call_f;
         ul_set_keepalive_timeout_t set_keepalive_timeout;
 
 } socket_module_api_t;
@@ -167,6 +171,27 @@ typedef struct profile_socket {
                 struct profile_socket *next;
                 void *reasm_t;
                 uint8_t erspan;
+                uint32_t flight_recorder;
+                uint8_t flight_hugepages;
+                uint32_t call_index;
+                uint32_t call_index_minutes;
+                uint8_t plan_pushdown;
+                uint32_t tcp_flow_buffer;
+                uint32_t tcp_memory;
+                uint32_t reasm_memory;
+                uint32_t dedup_window;
+                uint32_t dedup_size;
+                uint8_t merge;
+                uint32_t merge_window;
+                uint32_t merge_ring;
+                uint32_t offline_workers;
+                uint32_t offline_readers;
+                double offline_speed;
+                uint32_t batch;
+                uint8_t shed;
+                char *shed_order;
+                uint32_t shed_lag;
+                uint32_t shed_hold;
 } profile_socket_t;
 
 
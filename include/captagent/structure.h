@@ -53,11 +53,33 @@ typedef struct stats_msg {
         uint32_t value;
 } stats_msg_t;
 
+/* filter_msg_t value: data goes on top of the configured filter instead of
+ * replacing it, NULL data takes it away again */
+#define FILTER_GENERATED 1
+/* set on return: queued, a capture thread has not confirmed taking it yet */
+#define FILTER_PENDING 2
+
 typedef struct filter_msg {
         char *data;
         uint32_t value;
+        char *profile;          /* NULL: every profile of the module */
+        char error[256];        /* why the filter was refused */
 } filter_msg_t;
 
+/* packets to dump from a socket module's recorder, zero fields match all */
+typedef struct pcap_dump_filter {
+        char *profile;          /* NULL: the first profile that records */
+        uint32_t from;          /* capture time, unix seconds */
+        uint32_t to;
+        int family;             /* AF_INET, AF_INET6 or 0 for any address */
+        uint8_t ip[16];         /* source or destination */
+        uint16_t port;          /* source or destination */
+        str callid;             /* searched in the frame */
+} pcap_dump_filter_t;
+
+/* receives the pcap stream, header first. Non zero stops the dump */
+typedef int (*pcap_dump_write_f)(void *arg, const void *buf, size_t len);
+
 
 typedef struct db_msg {
        str key_name;
@@ -0,0 +1,70 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  USDT static tracepoints
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _CAPTAGENT_TRACE_H_
+#define _CAPTAGENT_TRACE_H_
+
+#include "config.h"
+
+/*
+ * Static tracepoints in the provider "captagent". With sys/sdt.h at configure
+ * time every probe is a single nop until a tracer attaches, without it they
+ * compile to nothing. Probes live in the binary or module .so that fires them:
+ *
+ *   bpftrace -e 'usdt:/usr/local/lib/captagent/modules/socket_pcap.so:captagent:packet_receive
+ *       { @len = hist(arg2); }'
+ *
+ *   packet_receive(char *module, int profile, int len)    socket_*
+ *   ip_reasm_done(int len), tcp_reasm_done(int len)       socket_pcap
+ *   sip_parse_start(char *data, int len)                  protocol_sip
+ *   sip_parse_end(int ret, char *callid, int callid_len)  protocol_sip
+ *   plan_entry(msg_t *msg, int len)                       captagent
+ *   plan_exit(msg_t *msg, int ret)                        captagent
+ *   hep_encode(int profile, int len)                      transport_hep
+ *   send_enqueue(int len)                                 transport_hep, transport_json (async)
+ *   send_done(int status)                                 transport_hep, transport_json (per batch)
+ *   correlation_hit(char *sessionid), correlation_miss()  database_hash
+ */
+
+#ifdef USE_USDT
+
+#include <sys/sdt.h>
+
+#define TRACE_PROBE(name)                  DTRACE_PROBE(captagent, name)
+#define TRACE_PROBE1(name, a)              DTRACE_PROBE1(captagent, name, a)
+#define TRACE_PROBE2(name, a, b)           DTRACE_PROBE2(captagent, name, a, b)
+#define TRACE_PROBE3(name, a, b, c)        DTRACE_PROBE3(captagent, name, a, b, c)
+
+#else
+
+#define TRACE_PROBE(name)                  do { } while(0)
+#define TRACE_PROBE1(name, a)              do { } while(0)
+#define TRACE_PROBE2(name, a, b)           do { } while(0)
+#define TRACE_PROBE3(name, a, b, c)        do { } while(0)
+
+#endif /* USE_USDT */
+
+#endif /* _CAPTAGENT_TRACE_H_ */
@@ -14,6 +14,8 @@ AC_CONFIG_FILES([
 	src/modules/socket/tzsp/captureplan/Makefile
 	src/modules/transport/hep/Makefile
 	src/modules/transport/json/Makefile	
+	src/modules/transport/shm/Makefile
+	src/modules/transport/file/Makefile
 	src/modules/interface/http/Makefile
 	src/modules/database/redis/Makefile
 ])
@@ -19,6 +19,7 @@
 #include <captagent/modules_api.h>
 #include <captagent/modules.h>
 #include "conf_function.h"
+#include <captagent/action.h>
 #include <captagent/globals.h>
 #include "config.h"
 
@@ -114,21 +115,25 @@ capture_name:      ID              { capturename = $1; $$=$1; }
 
 
 
-capture_stm:	CAPTURE LBRACE actions RBRACE { push($3, &main_ct.clist[DEFAULT_CT]); }
+capture_stm:	CAPTURE LBRACE actions RBRACE { push($3, &parse_ct->clist[DEFAULT_CT]); }
 
                 | CAPTURE LBRACK capture_name RBRACK LBRACE actions RBRACE { 
                         
-                                i_tmp=capture_get(&main_ct, $3);
+                                i_tmp=capture_get(parse_ct, $3);
                                 if (i_tmp==-1){
                                         yyerror("internal error");
                                         YYABORT;
                                 }
-                                if (main_ct.clist[i_tmp]){
+                                if (i_tmp>=CAPTURE_MAX){
+                                        yyerror("too many captures");
+                                        YYABORT;
+                                }
+                                if (parse_ct->clist[i_tmp]){
                                         yyerror("duplicate capture");
                                         YYABORT;
                                 }
                                 
-		                push($6, &main_ct.clist[i_tmp]);
+		                push($6, &parse_ct->clist[i_tmp]);
                 }
 		| CAPTURE error { yyerror("invalid  capture  statement"); }
 	;
@@ -207,6 +212,7 @@ cmd:		SEND LPAREN STRING RPAREN { $$=mk_action(	SEND_T,
 														f_tmp,
 														0
 													);
+										action_profile_add($$, $1);
 									   }
 									}
 		| ID LPAREN STRING RPAREN { f_tmp=(void*)find_export($1, 1, 0);
@@ -221,6 +227,7 @@ cmd:		SEND LPAREN STRING RPAREN { $$=mk_action(	SEND_T,
 														f_tmp,
 														$3
 													);
+										action_profile_add($$, $1);
 									}
 								  }
 		| ID LPAREN STRING  COMMA STRING RPAREN 
@@ -238,6 +245,7 @@ cmd:		SEND LPAREN STRING RPAREN { $$=mk_action(	SEND_T,
 														$3,
 														$5
 													);
+										action_profile_add($$, $1);
 									}
 								  }
 		| ID LPAREN error RPAREN { $$=0; yyerror("bad arguments"); }
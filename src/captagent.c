@@ -46,6 +46,8 @@
 #include <captagent/modules_api.h>
 #include <captagent/modules.h>
 #include <captagent/log.h>
+#include <captagent/metrics.h>
+#include <captagent/action.h>
 
 #include "md5.h"
 #include <captagent/globals.h>
@@ -61,6 +63,8 @@ int debug = 0;
 int nofork = 1;
 int foreground = 0;
 int debug_level = 1;
+int log_async = 0;
+int log_rate = LOG_RATE_DEFAULT;
 char *usefile = NULL;
 char *global_license = NULL;
 char *global_chroot = NULL;
@@ -208,7 +212,8 @@ void usage(int8_t e) {
 					"   -h  is help/usage\n"
 					"   -v  is version information\n"
 					"   -f  is the config file\n"
-					"   -D  is use specified pcap file instead of a device from the config\n"
+					"   -D  is use specified pcap file instead of a device from the config,\n"
+					"       a directory or a quoted glob reads many files in parallel\n"
 					"   -c  is checkout\n"
 					"   -d  is daemon mode\n"
 					"   -n  is foreground mode\n"
@@ -232,6 +237,8 @@ int main(int argc, char *argv[]) {
 	bool global = FALSE;
 	int errout = 1;
 	char *k;
+	sigset_t sighup;
+	int sig;
 
 	/* how much entries */
 	main_ct.entries = 0;
@@ -308,6 +315,17 @@ int main(int argc, char *argv[]) {
 		exit(-1);
 	}
 
+	/* SIGHUP reloads the capture plans. Blocked before any thread exists, so
+	 * all of them inherit the mask and only sigwait() below takes it */
+	sigemptyset(&sighup);
+	sigaddset(&sighup, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sighup, NULL);
+
+	/* capture threads must not wait for syslog or stdout */
+	if (log_async && log_async_start(log_rate) != 0) {
+		LERR("Could not start the log writer, logging synchronously");
+	}
+
 	/* do register modules */
 	register_modules(tree);
 
@@ -315,7 +333,11 @@ int main(int argc, char *argv[]) {
 
 	LDEBUG("The Captagent is ready");
 
-	select(0, NULL, NULL, NULL, NULL);
+	for (;;) {
+		if (sigwait(&sighup, &sig) != 0) continue;
+		LNOTICE("SIGHUP received, reloading capture plans");
+		capture_plan_reload();
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -478,6 +500,14 @@ int core_config(xml_node *config) {
 				global_capture_plan_path = strdup(value);
 			else if (!strncmp(key, "backup", 6))
 				backup_dir = strdup(value);
+			else if (!strncmp(key, "latency_stats", 13) && !strncmp(value, "false", 5))
+				metric_latency_enabled = 0;
+			else if (!strncmp(key, "action_profile", 14) && !strncmp(value, "true", 4))
+				action_profile_enabled = 1;
+			else if (!strncmp(key, "log_async", 9) && !strncmp(value, "true", 4))
+				log_async = 1;
+			else if (!strncmp(key, "log_rate", 8))
+				log_rate = atoi(value);
 		}
 		next:
 
@@ -500,6 +530,9 @@ int core_config(xml_node *config) {
 		global_capture_plan_path = strdup(AGENT_PLAN_DIR);		
 	}	
 
+	/* timestamps of a pcap file say nothing about our latency */
+	if(usefile) metric_latency_enabled = 0;
+
 	/* reinit syslog */
 	destroy_log();
 	set_log_level(debug_level);
@@ -31,6 +31,7 @@
 #include <signal.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdarg.h>
 
 #include <sys/ioctl.h>
 #include <net/if.h>
@@ -50,13 +51,132 @@
 #include <captagent/globals.h>
 #include <captagent/capture.h>
 #include <captagent/action.h>
+#include <captagent/trace.h>
+#include <captagent/metrics.h>
 #include "conf_function.h"
 
+/* core setting action_profile */
+int action_profile_enabled = 0;
+/* every profiled action in plan order, grows while plans are parsed */
+action_prof_t *action_prof_list = NULL;
+static action_prof_t **action_prof_tail = &action_prof_list;
+pthread_mutex_t action_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the parser builds captures into this list, a reload points it elsewhere */
+struct capture_list *parse_ct = &main_ct;
+
+/* serializes the plan parser, it is neither reentrant nor thread safe */
+static pthread_mutex_t plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Epoch based reclamation of swapped out plans. Every thread running a plan
+ * owns a reader that holds the epoch it entered with, 0 while outside any
+ * plan. The list only grows, plan_synchronize() walks it unlocked: a thread
+ * that exits (offline workers, merge) hands its reader back for the next one */
+typedef struct plan_reader {
+        uint64_t epoch;
+        int nest;
+        int used;
+        struct plan_reader *next;
+} plan_reader_t;
+
+static uint64_t plan_epoch = 1;
+static plan_reader_t *plan_readers = NULL;
+static __thread plan_reader_t *plan_self = NULL;
+static pthread_key_t plan_reader_key;
+static pthread_once_t plan_reader_once = PTHREAD_ONCE_INIT;
+
+/* told after a reload swapped plans in, see capture_plan_watch_add() */
+static struct {
+        capture_plan_watch_f fn;
+        void *arg;
+} plan_watchers[CAPTURE_MAX_WATCHERS];
+static pthread_mutex_t plan_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* called by every capture thread leaving its outermost batch scope, see
+ * capture_batch_begin(). Readers hold the lock while the hooks run */
+static struct {
+        capture_batch_flush_f fn;
+        void *arg;
+} batch_flushers[CAPTURE_MAX_FLUSHERS];
+static pthread_rwlock_t batch_flush_lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int batch_nest = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *action_profile_unit = "tsc";
+
+static inline uint64_t action_clock(void)
+{
+        return __builtin_ia32_rdtsc();
+}
+#else
+const char *action_profile_unit = "ns";
+
+static inline uint64_t action_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
 #define E_UNSPEC      -1
 #define MAX_REC_LEV 100 /* maximum number of recursive calls */
 #define ROUTE_MAX_REC_LEV 10 /* maximum number of recursive calls
                                                            for capture()*/
 
+/* capture threads share the plan, so the counters are atomic */
+static inline void action_profile_count(action_prof_t *p, int ret, uint64_t cycles)
+{
+        __atomic_fetch_add(&p->calls, 1, __ATOMIC_RELAXED);
+        if (ret > 0) __atomic_fetch_add(&p->ret_true, 1, __ATOMIC_RELAXED);
+        else if (ret < 0) __atomic_fetch_add(&p->ret_false, 1, __ATOMIC_RELAXED);
+        else __atomic_fetch_add(&p->ret_drop, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&p->cycles, cycles, __ATOMIC_RELAXED);
+}
+
+/* called by the plan parser for every module call, line is the lexer position */
+void action_profile_add(struct action *a, char *name)
+{
+        extern int line;
+        extern char *capturename;
+        action_prof_t *p;
+
+        if (!a) return;
+
+        if ((p = calloc(1, sizeof(action_prof_t))) == NULL) {
+                LERR("no memory for the action profile of [%s]", name);
+                return;
+        }
+
+        p->plan = strdup(capturename ? capturename : "default");
+        p->name = strdup(name);
+        p->line = line;
+        pthread_mutex_lock(&action_prof_lock);
+        *action_prof_tail = p;
+        action_prof_tail = &p->next;
+        pthread_mutex_unlock(&action_prof_lock);
+        a->prof = p;
+}
+
+static void action_profile_del(action_prof_t *d)
+{
+        action_prof_t **pp;
+
+        pthread_mutex_lock(&action_prof_lock);
+        for (pp = &action_prof_list; *pp; pp = &(*pp)->next) {
+                if (*pp != d) continue;
+                *pp = d->next;
+                if (action_prof_tail == &d->next) action_prof_tail = pp;
+                break;
+        }
+        pthread_mutex_unlock(&action_prof_lock);
+
+        free(d->plan);
+        free(d->name);
+        free(d);
+}
+
 /* ret= 0! if action -> end of list(e.g DROP),
       > 0 to continue processing next actions
    and <0 on error */
@@ -107,7 +227,11 @@ int do_action(struct run_act_ctx* h, struct action* a, msg_t* msg)
                         break;   
                     
                case MODULE_T:
-                        if ( ((a->p1_type==CMDF_ST)&&a->p1.data)){
+                        if ( ((a->p1_type==CMDF_ST)&&a->p1.data) && action_profile_enabled && a->prof){
+                                uint64_t start = action_clock();
+                                ret=((cmd_function)(a->p1.data))(msg, (char*)a->p2.data, (char*)a->p3.data);
+                                action_profile_count(a->prof, ret, action_clock() - start);
+                        }else if ( ((a->p1_type==CMDF_ST)&&a->p1.data)){
                                 ret=((cmd_function)(a->p1.data))(msg, (char*)a->p2.data, (char*)a->p3.data);
                         }else{
                                 LERR("BUG: do_action: bad module call\n");
@@ -214,6 +338,7 @@ int run_actions(struct run_act_ctx* h, struct action* a, msg_t* msg)
         //printf("RUN: [%d]", h->rec_lev);
 
         h->rec_lev++;
+        if (h->rec_lev==1) TRACE_PROBE2(plan_entry, msg, msg->len);
         if (h->rec_lev>ROUTE_MAX_REC_LEV){
                 printf("WARNING: too many recursive routing table lookups (%d)"
                                         " giving up!\n", h->rec_lev);
@@ -237,6 +362,7 @@ int run_actions(struct run_act_ctx* h, struct action* a, msg_t* msg)
         }
 
         h->rec_lev--;
+        if (h->rec_lev==0) TRACE_PROBE2(plan_exit, msg, ret);
         /* process module onbreak handlers if present */
         if (h->rec_lev==0 && ret==0)
                 for (mod=modules;mod;mod=mod->next)
@@ -253,6 +379,167 @@ error:
 }
 
 
+/* thread exit: outside any plan by now, the reader is free for another thread */
+static void plan_reader_release(void *arg)
+{
+        plan_reader_t *r = (plan_reader_t *) arg;
+
+        r->nest = 0;
+        __atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void plan_reader_key_init(void)
+{
+        pthread_key_create(&plan_reader_key, plan_reader_release);
+}
+
+static plan_reader_t *plan_reader_register(void)
+{
+        plan_reader_t *r;
+        int unused;
+
+        pthread_once(&plan_reader_once, plan_reader_key_init);
+
+        /* one left behind by an exited thread first */
+        for (r = __atomic_load_n(&plan_readers, __ATOMIC_SEQ_CST); r; r = r->next) {
+                unused = 0;
+                if (__atomic_compare_exchange_n(&r->used, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        }
+
+        if (!r) {
+                if ((r = calloc(1, sizeof(plan_reader_t))) == NULL) return NULL;
+                r->used = 1;
+
+                r->next = __atomic_load_n(&plan_readers, __ATOMIC_SEQ_CST);
+                while (!__atomic_compare_exchange_n(&plan_readers, &r->next, r, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                        ;
+        }
+
+        pthread_setspecific(plan_reader_key, r);
+        plan_self = r;
+        return r;
+}
+
+int run_capture(struct run_act_ctx* h, int idx, msg_t* msg)
+{
+        plan_reader_t *r = plan_self;
+        struct action *a;
+        int ret;
+
+        if (!r && !(r = plan_reader_register())) {
+                LERR("no memory for the plan reader, packet skipped");
+                return E_UNSPEC;
+        }
+
+        /* announce the epoch before loading the plan. Pairs with the swap in
+         * capture_plan_reload(): either plan_synchronize() sees this epoch
+         * and waits for us, or we already load the new plan */
+        if (r->nest++ == 0)
+                __atomic_store_n(&r->epoch, __atomic_load_n(&plan_epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+
+        a = __atomic_load_n(&main_ct.clist[idx], __ATOMIC_SEQ_CST);
+        ret = run_actions(h, a, msg);
+
+        if (--r->nest == 0) __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+
+        return ret;
+}
+
+void capture_batch_begin(void)
+{
+        batch_nest++;
+}
+
+void capture_batch_end(void)
+{
+        int i;
+
+        if (batch_nest == 0 || --batch_nest > 0) return;
+
+        pthread_rwlock_rdlock(&batch_flush_lock);
+        for (i = 0; i < CAPTURE_MAX_FLUSHERS; i++) {
+                if (batch_flushers[i].fn) batch_flushers[i].fn(batch_flushers[i].arg);
+        }
+        pthread_rwlock_unlock(&batch_flush_lock);
+}
+
+int capture_batch_active(void)
+{
+        return batch_nest > 0;
+}
+
+int capture_batch_flush_add(capture_batch_flush_f fn, void *arg)
+{
+        int i, ret = -1;
+
+        pthread_rwlock_wrlock(&batch_flush_lock);
+
+        for (i = 0; i < CAPTURE_MAX_FLUSHERS; i++) {
+                if (batch_flushers[i].fn) continue;
+                batch_flushers[i].fn = fn;
+                batch_flushers[i].arg = arg;
+                ret = 0;
+                break;
+        }
+
+        pthread_rwlock_unlock(&batch_flush_lock);
+
+        if (ret < 0) LERR("too many batch flush hooks, max %d", CAPTURE_MAX_FLUSHERS);
+
+        return ret;
+}
+
+void capture_batch_flush_remove(capture_batch_flush_f fn, void *arg)
+{
+        int i;
+
+        pthread_rwlock_wrlock(&batch_flush_lock);
+
+        for (i = 0; i < CAPTURE_MAX_FLUSHERS; i++) {
+                if (batch_flushers[i].fn == fn && batch_flushers[i].arg == arg) {
+                        batch_flushers[i].fn = NULL;
+                        batch_flushers[i].arg = NULL;
+                }
+        }
+
+        pthread_rwlock_unlock(&batch_flush_lock);
+}
+
+int run_capture_batch(struct run_act_ctx* h, int idx, msg_t** msgs, int count)
+{
+        plan_reader_t *r = plan_self;
+        struct action *a;
+        int i;
+
+        if (count <= 0) return 0;
+
+        if (!r && !(r = plan_reader_register())) {
+                LERR("no memory for the plan reader, %d packets skipped", count);
+                return E_UNSPEC;
+        }
+
+        capture_batch_begin();
+
+        /* one epoch and one plan load for the whole vector, see run_capture() */
+        if (r->nest++ == 0)
+                __atomic_store_n(&r->epoch, __atomic_load_n(&plan_epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+
+        a = __atomic_load_n(&main_ct.clist[idx], __ATOMIC_SEQ_CST);
+
+        for (i = 0; i < count; i++) {
+                memset(h, 0, sizeof(struct run_act_ctx));
+                run_actions(h, a, msgs[i]);
+        }
+
+        if (--r->nest == 0) __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+
+        /* leave the plan before the hooks, they may block on a transport */
+        capture_batch_end();
+
+        return count;
+}
+
 int capture_get(struct capture_list* rt, char* name)
 {
         int len;
@@ -287,6 +574,401 @@ void push(struct action* a, struct action** head)
         t->next=a;
 }
 
+static void free_actions(struct action *a);
+
+static void free_expr(struct expr *e)
+{
+        if (!e) return;
+
+        if (e->type == EXP_T) {
+                free_expr(e->l.expr);
+                free_expr(e->r.expr);
+        }
+        else if (e->subtype == STRING_ST) free(e->r.param);
+        else if (e->subtype == ACTIONS_ST) free_actions(e->r.param);
+
+        free(e);
+}
+
+static void free_param(int type, void *data)
+{
+        switch (type) {
+                case STRING_ST:
+                        free(data);
+                        break;
+                case EXPR_ST:
+                        free_expr(data);
+                        break;
+                case ACTIONS_ST:
+                        free_actions(data);
+                        break;
+        }
+}
+
+/* frees a plan no thread can reach anymore, with its profile entries */
+static void free_actions(struct action *a)
+{
+        struct action *next;
+
+        for (; a; a = next) {
+                next = a->next;
+                free_param(a->p1_type, a->p1.data);
+                free_param(a->p2_type, a->p2.data);
+                free_param(a->p3_type, a->p3.data);
+                if (a->prof) action_profile_del(a->prof);
+                free(a);
+        }
+}
+
+/* returns once no thread can still be running a plan swapped out before */
+static void plan_synchronize(void)
+{
+        struct timespec ts = { 0, 1000000 };
+        plan_reader_t *r;
+        uint64_t epoch, e;
+
+        epoch = __atomic_add_fetch(&plan_epoch, 1, __ATOMIC_SEQ_CST);
+
+        for (r = __atomic_load_n(&plan_readers, __ATOMIC_SEQ_CST); r; r = r->next) {
+                while ((e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST)) != 0 && e < epoch)
+                        nanosleep(&ts, NULL);
+        }
+}
+
+/* runs the parser over file into ct, plan_lock held */
+static int plan_parse(char *file, struct capture_list *ct)
+{
+        extern void yyrestart(FILE *f);
+        extern int yyparse();
+        extern int line;
+        extern char *capturename;
+        FILE *f;
+        int ret;
+
+        if ((f = fopen(file, "r")) == NULL) {
+                LERR("loading capture plan (%s): %s", file, strerror(errno));
+                return -1;
+        }
+
+        /* a failed parse stops before EOF, where the lexer resets these */
+        line = 1;
+        capturename = 0;
+        cfg_errors = 0;
+
+        parse_ct = ct;
+        yyrestart(f);
+        ret = yyparse();
+        parse_ct = &main_ct;
+
+        fclose(f);
+
+        if (ret != 0 || cfg_errors) {
+                LERR("bad capture plan %s (%d errors)", file, cfg_errors);
+                return -1;
+        }
+
+        return 0;
+}
+
+int capture_plan_load(char *file)
+{
+        int idx;
+
+        pthread_mutex_lock(&plan_lock);
+
+        idx = main_ct.idx;
+        plan_parse(file, &main_ct);
+
+        /* remember where the capture came from, so it can be reloaded */
+        if (main_ct.idx != idx && main_ct.idx >= 0 && main_ct.idx < CAPTURE_MAX && !main_ct.files[main_ct.idx])
+                main_ct.files[main_ct.idx] = strdup(file);
+
+        idx = main_ct.idx;
+
+        pthread_mutex_unlock(&plan_lock);
+
+        return idx;
+}
+
+int capture_plan_reload(void)
+{
+        struct capture_list ct;
+        struct action *plan, *old[CAPTURE_MAX];
+        metric_t *retired;
+        int i, j, swapped = 0, failed = 0;
+
+        pthread_mutex_lock(&plan_lock);
+
+        /* unregistered before this reload, a plan thread may still count on them */
+        retired = metric_retired();
+
+        for (i = 0; i <= main_ct.idx && i < CAPTURE_MAX; i++) {
+
+                old[i] = NULL;
+                if (!main_ct.files[i]) continue;
+
+                memset(&ct, 0, sizeof(ct));
+                ct.idx = -1;
+
+                if (plan_parse(main_ct.files[i], &ct) != 0) {
+                        for (j = 0; j < CAPTURE_MAX; j++) free_actions(ct.clist[j]);
+                        failed++;
+                        continue;
+                }
+
+                /* one capture per plan file, named or the default one */
+                j = ct.idx >= 0 ? ct.idx : DEFAULT_CT;
+                plan = ct.clist[j];
+                ct.clist[j] = NULL;
+                for (j = 0; j < CAPTURE_MAX; j++) free_actions(ct.clist[j]);
+
+                /* the capture threads pick it up with their next packet */
+                old[i] = __atomic_exchange_n(&main_ct.clist[i], plan, __ATOMIC_SEQ_CST);
+                swapped++;
+        }
+
+        /* the old plans are unreachable now, wait for threads still inside */
+        if (swapped || retired) plan_synchronize();
+
+        for (j = 0; j < i; j++) free_actions(old[j]);
+        metric_free(retired);
+
+        pthread_mutex_unlock(&plan_lock);
+
+        LNOTICE("capture plans reloaded: [%d], failed: [%d]", swapped, failed);
+
+        if (swapped) {
+                pthread_mutex_lock(&plan_watch_lock);
+                for (j = 0; j < CAPTURE_MAX_WATCHERS; j++) {
+                        if (plan_watchers[j].fn) plan_watchers[j].fn(plan_watchers[j].arg);
+                }
+                pthread_mutex_unlock(&plan_watch_lock);
+        }
+
+        return failed ? -1 : swapped;
+}
+
+int capture_plan_watch_add(capture_plan_watch_f fn, void *arg)
+{
+        int i, ret = -1;
+
+        pthread_mutex_lock(&plan_watch_lock);
+
+        for (i = 0; i < CAPTURE_MAX_WATCHERS; i++) {
+                if (plan_watchers[i].fn) continue;
+                plan_watchers[i].fn = fn;
+                plan_watchers[i].arg = arg;
+                ret = 0;
+                break;
+        }
+
+        pthread_mutex_unlock(&plan_watch_lock);
+
+        if (ret < 0) LERR("too many capture plan watchers, max %d", CAPTURE_MAX_WATCHERS);
+
+        return ret;
+}
+
+void capture_plan_watch_remove(capture_plan_watch_f fn, void *arg)
+{
+        int i;
+
+        pthread_mutex_lock(&plan_watch_lock);
+
+        for (i = 0; i < CAPTURE_MAX_WATCHERS; i++) {
+                if (plan_watchers[i].fn == fn && plan_watchers[i].arg == arg) {
+                        plan_watchers[i].fn = NULL;
+                        plan_watchers[i].arg = NULL;
+                }
+        }
+
+        pthread_mutex_unlock(&plan_watch_lock);
+}
+
+/* malloc'd printf, NULL without memory */
+static char *bpf_printf(const char *fmt, ...)
+{
+        va_list ap;
+        char *buf;
+        int len;
+
+        va_start(ap, fmt);
+        len = vsnprintf(NULL, 0, fmt, ap);
+        va_end(ap);
+
+        if (len < 0 || (buf = malloc(len + 1)) == NULL) return NULL;
+
+        va_start(ap, fmt);
+        vsnprintf(buf, len + 1, fmt, ap);
+        va_end(ap);
+
+        return buf;
+}
+
+/* msg_check() compares the text of the address with strncmp(), so "10.0.0.1"
+ * also takes 10.0.0.10-19 and 10.0.0.100-199. The complete octets become a
+ * net, a last partial one the byte ranges it is a prefix of. IPv4 only, off
+ * is 12 for the source and 16 for the destination address */
+static char *bpf_ip_prefix(const char *dir, int off, const char *s)
+{
+        unsigned int oct[4] = { 0, 0, 0, 0 }, v;
+        int k = 0, digits, partial = -1;
+        char range[160];
+        const char *p = s;
+
+        for (;;) {
+                for (v = 0, digits = 0; isdigit((unsigned char) *p) && digits < 4; p++, digits++)
+                        v = v * 10 + (*p - '0');
+
+                if (!digits) {
+                        /* "a." "a.b." "a.b.c." */
+                        if (*p == '\0' && k > 0) break;
+                        return NULL;
+                }
+                /* inet_ntop() never prints leading zeros */
+                if (digits > 3 || v > 255 || (digits > 1 && p[-digits] == '0')) return NULL;
+
+                if (*p == '.' && k < 3) {
+                        oct[k++] = v;
+                        p++;
+                        continue;
+                }
+                if (*p != '\0') return NULL;
+
+                partial = v;
+                break;
+        }
+
+        if (partial >= 0) {
+                off += k;
+                v = partial;
+                if (v == 0) snprintf(range, sizeof(range), "ip[%d] = 0", off);
+                else if (v * 10 > 255) snprintf(range, sizeof(range), "ip[%d] = %u", off, v);
+                else if (v * 100 > 255) snprintf(range, sizeof(range), "(ip[%d] = %u or (ip[%d] >= %u and ip[%d] <= %u))",
+                                off, v, off, v * 10, off, v * 10 + 9 > 255 ? 255 : v * 10 + 9);
+                else snprintf(range, sizeof(range), "(ip[%d] = %u or (ip[%d] >= %u and ip[%d] <= %u) or (ip[%d] >= %u and ip[%d] <= %u))",
+                                off, v, off, v * 10, off, v * 10 + 9, off, v * 100, off, v * 100 + 99 > 255 ? 255 : v * 100 + 99);
+
+                if (k == 0) return bpf_printf("(ip and %s)", range);
+
+                return bpf_printf("(ip %s net %u.%u.%u.%u/%d and %s)", dir, oct[0], oct[1], oct[2], oct[3], k * 8, range);
+        }
+
+        return bpf_printf("ip %s net %u.%u.%u.%u/%d", dir, oct[0], oct[1], oct[2], oct[3], k * 8);
+}
+
+/* same prefix cascade as w_proto_check_size() of protocol_sip. Matches a
+ * superset of what msg_check() lets through, NULL if it can't be expressed */
+static char *bpf_msg_check(char *name, char *value)
+{
+        int n;
+
+        if (!name || !value) return NULL;
+
+        if (!strncmp("size", name, 4)) {
+                /* the plan sees reassembled TCP, a segment may be shorter */
+                n = atoi(value);
+                return n >= 0 ? bpf_printf("(tcp or greater %d)", n + 1) : NULL;
+        }
+        else if (!strncmp("src_ip", name, 6)) return bpf_ip_prefix("src", 12, value);
+        else if (!strncmp("destination_ip", name, 14)) return bpf_ip_prefix("dst", 16, value);
+        else if (!strncmp("src_port", name, 8) || !strncmp("dst_port", name, 8)) {
+                /* _gt and _lt fall into the equality branch there as well */
+                n = atoi(value);
+                if (n < 1 || n > 65535) return NULL;
+                return bpf_printf("%s port %d", name[0] == 's' ? "src" : "dst", n);
+        }
+
+        return NULL;
+}
+
+/* BPF for e, NULL where some part of it can't be pushed down. The pushed
+ * msg_check() calls are listed in report */
+static char *bpf_expr(struct expr *e, cmd_function check, char *report, size_t rlen)
+{
+        struct action *a;
+        char *l, *r, *ret = NULL;
+        size_t pos = strlen(report);
+
+        if (!e) return NULL;
+
+        if (e->type == EXP_T) {
+                switch (e->op) {
+                        case AND_OP:
+                                /* one side alone still only lets more through */
+                                l = bpf_expr(e->l.expr, check, report, rlen);
+                                r = bpf_expr(e->r.expr, check, report, rlen);
+                                if (l && r) ret = bpf_printf("(%s and %s)", l, r);
+                                else if (l) ret = l, l = NULL;
+                                else if (r) ret = r, r = NULL;
+                                free(l);
+                                free(r);
+                                break;
+                        case OR_OP:
+                                l = bpf_expr(e->l.expr, check, report, rlen);
+                                r = l ? bpf_expr(e->r.expr, check, report, rlen) : NULL;
+                                if (l && r) ret = bpf_printf("(%s or %s)", l, r);
+                                free(l);
+                                free(r);
+                                break;
+                }
+        }
+        else if (e->type == ELEM_T && e->l.operand == ACTION_O && e->subtype == ACTIONS_ST) {
+                a = (struct action *) e->r.param;
+                if (a && !a->next && a->type == MODULE_T && a->p1_type == CMDF_ST && check
+                                && a->p1.data == (void *) check && a->p2_type == STRING_ST && a->p3_type == STRING_ST) {
+                        if ((ret = bpf_msg_check(a->p2.string, a->p3.string)) != NULL)
+                                snprintf(report + pos, rlen - pos, "%smsg_check(\"%s\", \"%s\")", pos ? ", " : "", a->p2.string, a->p3.string);
+                }
+        }
+
+        /* nothing of a part that was not pushed down gets reported */
+        if (!ret) report[pos] = '\0';
+
+        return ret;
+}
+
+static int only_drop(struct action *a)
+{
+        for (; a; a = a->next)
+                if (a->type != DROP_T) return 0;
+
+        return 1;
+}
+
+int capture_plan_bpf(int idx, char *buf, size_t size, char *report, size_t rlen)
+{
+        struct action *a;
+        char *bpf = NULL;
+        int ret = 0;
+
+        buf[0] = '\0';
+        report[0] = '\0';
+
+        if (idx < 0 || idx >= CAPTURE_MAX) return 0;
+
+        pthread_mutex_lock(&plan_lock);
+
+        /* only a guard in front of everything: if (...) { ... } [else drop;] [drop;] */
+        a = main_ct.clist[idx];
+        if (a && a->type == IF_T && a->p1_type == EXPR_ST && a->p1.data
+                        && (a->p3_type != ACTIONS_ST || only_drop(a->p3.data)) && only_drop(a->next)) {
+                bpf = bpf_expr(a->p1.data, find_export("msg_check", 2, 0), report, rlen);
+        }
+
+        pthread_mutex_unlock(&plan_lock);
+
+        if (bpf && strlen(bpf) < size) {
+                snprintf(buf, size, "%s", bpf);
+                ret = 1;
+        }
+        else report[0] = '\0';
+
+        free(bpf);
+
+        return ret;
+}
+
 /* searches the module list and returns a pointer to the "name" function or
  * 0 if not found */
 
@@ -58,6 +58,8 @@ struct expr{
 
 static int eval_elem(struct run_act_ctx* h, struct expr* e, msg_t* msg);
 int eval_expr(struct run_act_ctx* h, struct expr* e, msg_t* msg);
+extern struct capture_list *parse_ct;
+
 int capture_get(struct capture_list* rt, char* name);
 void push(struct action* a, struct action** head);
 struct expr* mk_exp(int op, struct expr* left, struct expr* right);
@@ -28,11 +28,49 @@
 #define LOG_C_
 
 #include <captagent/log.h>
+#include <captagent/metrics.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_RING_SLOTS 256	/* per thread, power of two */
+#define LOG_MSG_SIZE 512
+#define LOG_WRITER_SLEEP_MS 10
+
+typedef struct log_entry {
+	int priority;
+	char msg[LOG_MSG_SIZE];
+} log_entry_t;
+
+/* single producer (the owning thread), single consumer (the writer). The
+ * list only grows, a ring of an exited thread goes to the next new thread */
+typedef struct log_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	int used;
+	struct log_ring *next;
+	log_entry_t slot[LOG_RING_SLOTS];
+} log_ring_t;
 
 static int use_syslog = 0;
-static int log_level = LOG_WARNING;
+int log_level = LOG_WARNING;
+
+/* async logging: one ring per thread, the writer thread owns the output */
+static log_ring_t *log_rings = NULL;
+static __thread log_ring_t *log_ring_self = NULL;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_once = PTHREAD_ONCE_INIT;
+static pthread_t log_writer_thread;
+static volatile int log_writer_running = 0;
+static int log_rate_limit = LOG_RATE_DEFAULT;
+static uint64_t log_dropped_reported = 0;
+static metric_t *log_dropped = NULL;
 
 void init_log(char *_prgname, int _use_syslog) {
         use_syslog = _use_syslog;
@@ -47,6 +85,7 @@ void set_log_level(int level) {
 
 
 void destroy_log(void) {
+        log_async_stop();
         if (use_syslog) closelog();
 }
 
@@ -58,13 +97,180 @@ void log_stdout(const char * format, va_list ap)
         fflush(stdout);
 }
 
+static void log_write(int priority, const char *msg)
+{
+        if (use_syslog) syslog(priority, "%s", msg);
+        else fprintf(stdout, "%s\r\n", msg);
+}
+
+/* thread exit: what is queued still goes out, then another thread may take the ring */
+static void log_ring_release(void *arg)
+{
+        log_ring_t *ring = (log_ring_t *) arg;
+
+        __atomic_store_n(&ring->used, 0, __ATOMIC_RELEASE);
+}
+
+static void log_ring_key_init(void)
+{
+        pthread_key_create(&log_ring_key, log_ring_release);
+}
+
+/* first message of a thread: take a released ring or allocate and publish one */
+static log_ring_t *log_ring_get(void)
+{
+        log_ring_t *ring = log_ring_self;
+        int unused;
+
+        if (ring) return ring;
+
+        pthread_once(&log_ring_once, log_ring_key_init);
+
+        for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+                unused = 0;
+                if (__atomic_compare_exchange_n(&ring->used, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        }
+
+        if (!ring) {
+                if ((ring = calloc(1, sizeof(log_ring_t))) == NULL) return NULL;
+                ring->used = 1;
+
+                ring->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+                while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+        }
+
+        pthread_setspecific(log_ring_key, ring);
+        log_ring_self = ring;
+
+        return ring;
+}
+
+/* format into the thread's ring, never blocks. Full ring: the message is dropped */
+static void log_enqueue(int priority, const char *fmt, va_list ap)
+{
+        log_ring_t *ring;
+        log_entry_t *entry;
+        uint32_t head;
+
+        if ((ring = log_ring_get()) == NULL) return;
+
+        head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+                __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+                return;
+        }
+
+        entry = &ring->slot[head & (LOG_RING_SLOTS - 1)];
+        entry->priority = priority;
+        vsnprintf(entry->msg, sizeof(entry->msg), fmt, ap);
+
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* write out everything queued, at most budget messages, the rest is dropped */
+static int log_drain(int *budget)
+{
+        log_ring_t *ring;
+        uint32_t head, tail;
+        uint64_t dropped = 0;
+        int written = 0;
+
+        for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+
+                tail = ring->tail;
+                head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+                for (; tail != head; tail++) {
+                        if (*budget == 0) {
+                                __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+                                continue;
+                        }
+                        if (*budget > 0) (*budget)--;
+                        log_write(ring->slot[tail & (LOG_RING_SLOTS - 1)].priority, ring->slot[tail & (LOG_RING_SLOTS - 1)].msg);
+                        written++;
+                }
+
+                __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+                dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        }
+
+        if (dropped > log_dropped_reported) {
+                metric_add(log_dropped, dropped - log_dropped_reported);
+                if (use_syslog) syslog(LOG_WARNING, "[WARNING] log: %" PRIu64 " messages dropped", dropped - log_dropped_reported);
+                else fprintf(stdout, "[WARNING] log: %" PRIu64 " messages dropped\r\n", dropped - log_dropped_reported);
+                log_dropped_reported = dropped;
+        }
+
+        if (written && !use_syslog) fflush(stdout);
+
+        return written;
+}
+
+static void *log_writer(void *arg)
+{
+        struct timespec ts = { 0, LOG_WRITER_SLEEP_MS * 1000000L };
+        time_t second = 0, now;
+        int budget = -1;
+
+        while (__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE)) {
+
+                /* rate limit: log_rate_limit lines per second over all threads */
+                now = time(NULL);
+                if (now != second) {
+                        second = now;
+                        budget = log_rate_limit > 0 ? log_rate_limit : -1;
+                }
+
+                if (!log_drain(&budget)) nanosleep(&ts, NULL);
+        }
+
+        return NULL;
+}
+
+int log_async_start(int rate)
+{
+        if (log_writer_running) return 0;
+
+        log_rate_limit = rate;
+        log_dropped = metric_counter("log_messages_dropped_total", "Log messages dropped by a full ring or the rate limit", NULL);
+
+        log_writer_running = 1;
+        if (pthread_create(&log_writer_thread, NULL, log_writer, NULL)) {
+                log_writer_running = 0;
+                metric_unregister(log_dropped);
+                log_dropped = NULL;
+                return -1;
+        }
+
+        /* exit() after an error message must not lose the message */
+        atexit(log_async_stop);
+
+        return 0;
+}
+
+void log_async_stop(void)
+{
+        int budget = -1;
+
+        if (!__atomic_exchange_n(&log_writer_running, 0, __ATOMIC_ACQ_REL)) return;
+
+        if (!pthread_equal(pthread_self(), log_writer_thread)) pthread_join(log_writer_thread, NULL);
+
+        /* the rest goes out unlimited, the rings stay for late messages of other threads */
+        log_drain(&budget);
+
+        metric_unregister(log_dropped);
+        log_dropped = NULL;
+}
+
 void data_log(int priority, const char *fmt, ...) {
 
 	va_list args;
         if (priority<=log_level) {
                 //vsnprintf("SYSLOG:%s:%d:%s: ", file, line, func);
                 va_start(args, fmt);
-                if (use_syslog) vsyslog(priority, fmt, args);
+                if (log_writer_running) log_enqueue(priority, fmt, args);
+                else if (use_syslog) vsyslog(priority, fmt, args);
                 else log_stdout(fmt, args);
                 va_end(args);
 
@@ -0,0 +1,470 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Metrics registry, per-thread counters aggregated on scrape
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <captagent/metrics.h>
+#include <captagent/log.h>
+
+__thread int metric_thread_slot = -1;
+int metric_latency_enabled = 1;
+
+static int next_slot = 0;
+static metric_t *metric_list = NULL;
+/* unregistered, other threads may still hold them, see metric_retired() */
+static metric_t *metric_retired_list = NULL;
+static pthread_mutex_t metric_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	metric_collect_f fn;
+	void *arg;
+} collectors[METRIC_MAX_COLLECTORS];
+static pthread_mutex_t collect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t collect_thread;
+static int collect_running = 0;
+
+int metric_slot_init(void)
+{
+	int slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED);
+
+	if(slot >= METRIC_MAX_THREADS - 1) {
+		if(slot == METRIC_MAX_THREADS - 1) LNOTICE("more than %d threads update metrics, the rest share one cell", METRIC_MAX_THREADS - 1);
+		slot = METRIC_MAX_THREADS - 1;
+	}
+
+	metric_thread_slot = slot;
+
+	return slot;
+}
+
+static metric_t *metric_new(int type, const char *name, const char *help, const char *labels, metric_read_f read_f, void *arg)
+{
+	metric_t *m;
+
+	if((m = calloc(1, sizeof(metric_t))) == NULL) goto error;
+
+	if(type == METRIC_HISTOGRAM) {
+		if((m->hist = calloc(METRIC_MAX_THREADS, sizeof(metric_hist_t *))) == NULL) goto error;
+	}
+	else if(!read_f) {
+		if(posix_memalign((void **) &m->cells, METRIC_CACHE_LINE, METRIC_MAX_THREADS * sizeof(metric_cell_t))) {
+			m->cells = NULL;
+			goto error;
+		}
+		memset(m->cells, 0, METRIC_MAX_THREADS * sizeof(metric_cell_t));
+	}
+
+	m->type = type;
+	m->name = strdup(name);
+	m->help = strdup(help ? help : name);
+	m->labels = labels ? strdup(labels) : NULL;
+	m->read_f = read_f;
+	m->arg = arg;
+
+	pthread_mutex_lock(&metric_lock);
+	m->next = metric_list;
+	metric_list = m;
+	pthread_mutex_unlock(&metric_lock);
+
+	return m;
+
+error:
+	LERR("no memory for metric [%s]", name);
+	if(m) {
+		if(m->hist) free(m->hist);
+		free(m);
+	}
+	return NULL;
+}
+
+metric_t *metric_counter(const char *name, const char *help, const char *labels)
+{
+	return metric_new(METRIC_COUNTER, name, help, labels, NULL, NULL);
+}
+
+metric_t *metric_gauge(const char *name, const char *help, const char *labels)
+{
+	return metric_new(METRIC_GAUGE, name, help, labels, NULL, NULL);
+}
+
+metric_t *metric_gauge_fn(const char *name, const char *help, const char *labels, metric_read_f read_f, void *arg)
+{
+	return metric_new(METRIC_GAUGE, name, help, labels, read_f, arg);
+}
+
+metric_t *metric_histogram(const char *name, const char *help, const char *labels)
+{
+	return metric_new(METRIC_HISTOGRAM, name, help, labels, NULL, NULL);
+}
+
+metric_hist_t *metric_hist_cell(metric_t *m, int slot)
+{
+	metric_hist_t *h, *expected = NULL;
+
+	if((h = calloc(1, sizeof(metric_hist_t))) == NULL) return NULL;
+
+	/* only the shared last slot can race here */
+	if(!__atomic_compare_exchange_n(&m->hist[slot], &expected, h, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(h);
+		return expected;
+	}
+
+	return h;
+}
+
+void metric_hist_merge(metric_t *m, metric_hist_t *out)
+{
+	metric_hist_t *h;
+	uint64_t v;
+	int i, b;
+
+	memset(out, 0, sizeof(metric_hist_t));
+
+	for(i = 0; i < METRIC_MAX_THREADS; i++) {
+		if((h = __atomic_load_n(&m->hist[i], __ATOMIC_ACQUIRE)) == NULL) continue;
+
+		for(b = 0; b < METRIC_HIST_BUCKETS; b++) out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+		out->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		v = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+		if(v > out->max) out->max = v;
+	}
+
+	/* count from the buckets, consistent with them while threads keep writing */
+	for(b = 0; b < METRIC_HIST_BUCKETS; b++) out->count += out->buckets[b];
+}
+
+uint64_t metric_hist_quantile(metric_hist_t *h, double q)
+{
+	uint64_t rank, seen = 0, hi;
+	unsigned int b, shift;
+
+	if(h->count == 0) return 0;
+
+	rank = (uint64_t) (q * h->count);
+	if(rank >= h->count) rank = h->count - 1;
+
+	for(b = 0; b < METRIC_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if(seen > rank) break;
+	}
+
+	if(b >= METRIC_HIST_BUCKETS - 1) return h->max;
+	if(b < METRIC_HIST_SUB) return b;
+
+	shift = b / METRIC_HIST_SUB - 1;
+	hi = ((uint64_t) (METRIC_HIST_SUB + b % METRIC_HIST_SUB + 1) << shift) - 1;
+
+	return hi < h->max ? hi : h->max;
+}
+
+void metric_foreach(int type, void (*fn)(metric_t *m, void *arg), void *arg)
+{
+	metric_t *m;
+
+	pthread_mutex_lock(&metric_lock);
+	for(m = metric_list; m; m = m->next) {
+		if(m->type == type) fn(m, arg);
+	}
+	pthread_mutex_unlock(&metric_lock);
+}
+
+metric_t *metric_drops(const char *module, const char *profile, const char *reason)
+{
+	char labels[256];
+
+	snprintf(labels, sizeof(labels), "module=\"%s\",profile=\"%s\",reason=\"%s\"", module, profile ? profile : "", reason);
+
+	return metric_counter(METRIC_DROPS, "Packets or messages lost, by module, profile and reason", labels);
+}
+
+static void *metric_collect_loop(void *arg)
+{
+	struct timespec ts = { METRIC_COLLECT_INTERVAL, 0 };
+	int i;
+
+	for(;;) {
+		nanosleep(&ts, NULL);
+
+		pthread_mutex_lock(&collect_lock);
+		for(i = 0; i < METRIC_MAX_COLLECTORS; i++) {
+			if(collectors[i].fn) collectors[i].fn(collectors[i].arg);
+		}
+		pthread_mutex_unlock(&collect_lock);
+	}
+
+	return NULL;
+}
+
+int metric_collector_add(metric_collect_f fn, void *arg)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&collect_lock);
+
+	for(i = 0; i < METRIC_MAX_COLLECTORS; i++) {
+		if(collectors[i].fn) continue;
+		collectors[i].fn = fn;
+		collectors[i].arg = arg;
+		ret = 0;
+		break;
+	}
+
+	/* started with the first collector, lives as long as the agent */
+	if(ret == 0 && !collect_running) {
+		if(pthread_create(&collect_thread, NULL, metric_collect_loop, NULL)) {
+			LERR("could not start the metrics collector thread");
+		}
+		else {
+			pthread_detach(collect_thread);
+			collect_running = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&collect_lock);
+
+	if(ret < 0) LERR("too many metric collectors, max %d", METRIC_MAX_COLLECTORS);
+
+	return ret;
+}
+
+void metric_collector_remove(metric_collect_f fn, void *arg)
+{
+	int i;
+
+	pthread_mutex_lock(&collect_lock);
+
+	for(i = 0; i < METRIC_MAX_COLLECTORS; i++) {
+		if(collectors[i].fn == fn && collectors[i].arg == arg) {
+			collectors[i].fn = NULL;
+			collectors[i].arg = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&collect_lock);
+}
+
+void metric_unregister(metric_t *m)
+{
+	metric_t **p;
+
+	if(!m) return;
+
+	pthread_mutex_lock(&metric_lock);
+	for(p = &metric_list; *p; p = &(*p)->next) {
+		if(*p == m) {
+			*p = m->next;
+			/* scrapes no longer see it, capture threads may still count */
+			m->next = metric_retired_list;
+			metric_retired_list = m;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&metric_lock);
+}
+
+metric_t *metric_retired(void)
+{
+	metric_t *m;
+
+	pthread_mutex_lock(&metric_lock);
+	m = metric_retired_list;
+	metric_retired_list = NULL;
+	pthread_mutex_unlock(&metric_lock);
+
+	return m;
+}
+
+void metric_free(metric_t *m)
+{
+	metric_t *next;
+	int i;
+
+	for(; m; m = next) {
+		next = m->next;
+		free(m->name);
+		free(m->help);
+		if(m->labels) free(m->labels);
+		if(m->cells) free(m->cells);
+		if(m->hist) {
+			for(i = 0; i < METRIC_MAX_THREADS; i++) {
+				if(m->hist[i]) free(m->hist[i]);
+			}
+			free(m->hist);
+		}
+		free(m);
+	}
+}
+
+int64_t metric_value(metric_t *m)
+{
+	uint64_t sum = 0;
+	int i;
+
+	if(!m) return 0;
+	if(m->read_f) return m->read_f(m->arg);
+
+	for(i = 0; i < METRIC_MAX_THREADS; i++) sum += __atomic_load_n(&m->cells[i].value, __ATOMIC_RELAXED);
+
+	return (int64_t) sum;
+}
+
+typedef struct metric_buf {
+	char *s;
+	size_t len;
+	size_t size;
+	int error;
+} metric_buf_t;
+
+static void buf_printf(metric_buf_t *b, const char *fmt, ...)
+{
+	va_list args;
+	size_t size;
+	char *tmp;
+	int n;
+
+	if(b->error) return;
+
+	for(;;) {
+		va_start(args, fmt);
+		n = vsnprintf(b->s + b->len, b->size - b->len, fmt, args);
+		va_end(args);
+
+		if(n < 0) {
+			b->error = 1;
+			return;
+		}
+		if(b->len + n < b->size) break;
+
+		size = b->size * 2;
+		while(size <= b->len + n) size *= 2;
+		if((tmp = realloc(b->s, size)) == NULL) {
+			b->error = 1;
+			return;
+		}
+		b->s = tmp;
+		b->size = size;
+	}
+
+	b->len += n;
+}
+
+/* help text goes out as is apart from the two characters the format escapes */
+static void buf_help(metric_buf_t *b, const char *s)
+{
+	for(; *s; s++) {
+		if(*s == '\\') buf_printf(b, "\\\\");
+		else if(*s == '\n') buf_printf(b, "\\n");
+		else buf_printf(b, "%c", *s);
+	}
+}
+
+/* cumulative buckets at every power of two, le in seconds */
+static void buf_histogram(metric_buf_t *b, metric_t *m)
+{
+	metric_hist_t h;
+	uint64_t cum = 0;
+	unsigned int i, shift;
+	const char *sep = m->labels ? "," : "";
+	const char *labels = m->labels ? m->labels : "";
+
+	metric_hist_merge(m, &h);
+
+	for(i = 0; i < METRIC_HIST_BUCKETS; i++) {
+		cum += h.buckets[i];
+		/* the last bucket also takes everything above 2^36us, +Inf only */
+		if(i % METRIC_HIST_SUB != METRIC_HIST_SUB - 1 || i == METRIC_HIST_BUCKETS - 1) continue;
+
+		shift = i / METRIC_HIST_SUB;
+		buf_printf(b, "captagent_%s_bucket{%s%sle=\"%.6f\"} %" PRIu64 "\n", m->name, labels, sep,
+				(double) ((uint64_t) METRIC_HIST_SUB << shift) / 1000000, cum);
+	}
+
+	buf_printf(b, "captagent_%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", m->name, labels, sep, h.count);
+	if(m->labels) {
+		buf_printf(b, "captagent_%s_sum{%s} %.6f\n", m->name, labels, (double) h.sum / 1000000);
+		buf_printf(b, "captagent_%s_count{%s} %" PRIu64 "\n", m->name, labels, h.count);
+	}
+	else {
+		buf_printf(b, "captagent_%s_sum %.6f\n", m->name, (double) h.sum / 1000000);
+		buf_printf(b, "captagent_%s_count %" PRIu64 "\n", m->name, h.count);
+	}
+}
+
+char *metrics_prometheus(size_t *len)
+{
+	metric_buf_t b;
+	metric_t *m, *n, *prev;
+
+	b.size = 4096;
+	b.len = 0;
+	b.error = 0;
+	if((b.s = malloc(b.size)) == NULL) return NULL;
+	b.s[0] = '\0';
+
+	pthread_mutex_lock(&metric_lock);
+
+	/* one HELP/TYPE block per name, all label sets of the name below it */
+	for(m = metric_list; m; m = m->next) {
+
+		for(prev = metric_list; prev != m; prev = prev->next) {
+			if(!strcmp(prev->name, m->name)) break;
+		}
+		if(prev != m) continue;
+
+		buf_printf(&b, "# HELP captagent_%s ", m->name);
+		buf_help(&b, m->help);
+		buf_printf(&b, "\n# TYPE captagent_%s %s\n", m->name,
+				m->type == METRIC_COUNTER ? "counter" : m->type == METRIC_GAUGE ? "gauge" : "histogram");
+
+		for(n = m; n; n = n->next) {
+			if(strcmp(n->name, m->name)) continue;
+
+			if(n->type == METRIC_HISTOGRAM) {
+				buf_histogram(&b, n);
+				continue;
+			}
+
+			if(n->labels) buf_printf(&b, "captagent_%s{%s} %" PRId64 "\n", n->name, n->labels, metric_value(n));
+			else buf_printf(&b, "captagent_%s %" PRId64 "\n", n->name, metric_value(n));
+		}
+	}
+
+	pthread_mutex_unlock(&metric_lock);
+
+	if(b.error) {
+		free(b.s);
+		return NULL;
+	}
+
+	if(len) *len = b.len;
+
+	return b.s;
+}
@@ -45,11 +45,26 @@
 #include <captagent/modules.h>
 #include "database_hash.h"
 #include <captagent/log.h>
+#include <captagent/trace.h>
 #include "localapi.h"
 #include "captarray.h"
 
 pthread_rwlock_t ipport_lock;
 
+/* SDP driven filter of a socket_pcap RTCP profile, see media_filter_loop() */
+static char *media_filter_profile = NULL;
+static int media_filter_debounce = MEDIA_FILTER_DEBOUNCE;
+static int media_filter_max = MEDIA_FILTER_MAX;
+static uint32_t media_generation = 0;
+static int media_filter_running = 0;
+static pthread_t media_filter_thread;
+
+/* the set of media pairs changed, ipport_lock held */
+static inline void media_changed(void)
+{
+        __atomic_add_fetch(&media_generation, 1, __ATOMIC_RELEASE);
+}
+
 unsigned int profile_size = 0;
 
 xml_node *module_xml_config = NULL;
@@ -132,7 +147,10 @@ int w_is_rtcp_exists(msg_t *msg)
         ipport = find_ipport(msg->rcinfo.src_ip, msg->rcinfo.src_port);
         if(!ipport) {
                ipport = find_ipport( msg->rcinfo.dst_ip, msg->rcinfo.dst_port);
-               if(!ipport) return -1;
+               if(!ipport) {
+                      TRACE_PROBE(correlation_miss);
+                      return -1;
+               }
                msg->rcinfo.direction = 0;
                ipport->modify_ts = (unsigned)time(NULL);
         }	
@@ -144,6 +162,8 @@ int w_is_rtcp_exists(msg_t *msg)
         msg->rcinfo.correlation_id.len = strlen(ipport->sessionid);
         msg->var = (void *) ipport;
 
+        TRACE_PROBE1(correlation_hit, ipport->sessionid);
+
         return 1;
 }
 
@@ -166,6 +186,7 @@ void add_ipport(char *key, char *callid) {
         }
 
         HASH_ADD_STR(ipports, name, ipport);
+        media_changed();
 
         pthread_rwlock_unlock(&ipport_lock);
 
@@ -189,6 +210,7 @@ void update_ipport(char *key, char *callid) {
         }
 
         HASH_ADD_STR(ipports, name, ipport);
+        media_changed();
 
         pthread_rwlock_unlock(&ipport_lock);
 
@@ -260,6 +282,7 @@ int clear_ipport(struct ipport_items *ipport ) {
                 LDEBUG("NAME: [%s]", ipport->name);
 
                 HASH_DEL( ipports, ipport);
+                media_changed();
 
                 /* free */
                 free(ipport);
@@ -296,6 +319,7 @@ void clear_ipports() {
         /* free the hash table contents */
         HASH_ITER(hh, ipports, s, tmp) {
                 HASH_DEL(ipports, s);
+                media_changed();
                 free(s);
         }
         
@@ -325,6 +349,7 @@ int check_ipport(char *name)  {
         	if(((unsigned) time(NULL) - ipport->modify_ts) >=  rtcp_timeout) {
 
                         HASH_DEL( ipports, ipport);
+                media_changed();
                         free(ipport);
                         ret = 2;
         	}
@@ -356,6 +381,167 @@ void print_ipports() {
         pthread_rwlock_unlock(&ipport_lock);
 }
 
+/* appends "(host ip and udp port n)" for a "ip:port" key. SDP comes off the
+ * wire, anything that is not a plain address is never put into a filter */
+static int media_filter_term(char *buf, size_t size, size_t len, const char *key)
+{
+        char ip[INET6_ADDRSTRLEN];
+        unsigned char addr[sizeof(struct in6_addr)];
+        const char *colon;
+        int port;
+
+        if ((colon = strrchr(key, ':')) == NULL || (size_t) (colon - key) >= sizeof(ip)) return -1;
+
+        memcpy(ip, key, colon - key);
+        ip[colon - key] = '\0';
+        port = atoi(colon + 1);
+
+        if (port <= 0 || port > 65535) return -1;
+        if (inet_pton(AF_INET, ip, addr) != 1 && inet_pton(AF_INET6, ip, addr) != 1) return -1;
+
+        return snprintf(buf + len, size - len, "%s(host %s and udp port %d)", len ? " or " : "", ip, port);
+}
+
+/* the filter for the media pairs alive now, NULL for the static capture-filter
+ * when there are too many. *expire is when the first of them times out */
+static char *media_filter_build(time_t now, time_t *expire)
+{
+        struct ipport_items *s, *tmp;
+        size_t size = media_filter_max * MEDIA_FILTER_TERM_LEN + 1, len = 0;
+        int count = 0, ret;
+        char *buf;
+
+        *expire = 0;
+
+        if ((buf = malloc(size)) == NULL) return NULL;
+        buf[0] = '\0';
+
+        if (pthread_rwlock_rdlock(&ipport_lock) != 0) {
+                LERR("can't acquire read lock");
+                free(buf);
+                return NULL;
+        }
+
+        HASH_ITER(hh, ipports, s, tmp) {
+
+                if (now - s->modify_ts >= rtcp_timeout) continue;
+
+                if (++count > media_filter_max) break;
+
+                if ((ret = media_filter_term(buf, size, len, s->name)) < 0) {
+                        count--;
+                        continue;
+                }
+                if ((size_t) ret >= size - len) {
+                        count = media_filter_max + 1;
+                        break;
+                }
+                len += ret;
+
+                if (!*expire || s->modify_ts + rtcp_timeout < *expire) *expire = s->modify_ts + rtcp_timeout;
+        }
+
+        pthread_rwlock_unlock(&ipport_lock);
+
+        if (count > media_filter_max) {
+                free(buf);
+                *expire = 0;
+                return NULL;
+        }
+
+        if (!count) snprintf(buf, size, "%s", MEDIA_FILTER_NONE);
+
+        return buf;
+}
+
+/* hands the filter to socket_pcap on top of the profile's configured one,
+ * NULL leaves the configured filter alone again.
+ * 0 while socket_pcap or the profile is not running (yet) */
+static int media_filter_apply(char *expr)
+{
+        bind_socket_module_api_t bind;
+        socket_module_api_t api;
+        filter_msg_t filter;
+        int ret;
+
+        memset(&api, 0, sizeof(api));
+        memset(&filter, 0, sizeof(filter));
+
+        /* socket_pcap may load after us or go away with a reload */
+        if ((bind = (bind_socket_module_api_t) find_export("socket_pcap_bind_api", 1, 0)) == NULL) return 0;
+        bind(&api);
+        if (!api.apply_filter_f) return 0;
+
+        filter.profile = media_filter_profile;
+        filter.data = expr;
+        filter.value = FILTER_GENERATED;
+
+        if ((ret = api.apply_filter_f(&filter)) < 0) LERR("media filter refused for [%s]: %s", media_filter_profile, filter.error);
+
+        return ret;
+}
+
+/* Rebuilds the RTCP profile filter from the media pairs learned by
+ * check_rtcp_ipport(), at most once per debounce interval and only when the
+ * set changed or one of its pairs timed out */
+static void *media_filter_loop(void *arg)
+{
+        struct timespec ts;
+        uint32_t generation, seen;
+        time_t now, expire = 0;
+        char *expr, *last = NULL;
+        int ret, installed = 0;
+
+        ts.tv_sec = media_filter_debounce / 1000;
+        ts.tv_nsec = (media_filter_debounce % 1000) * 1000000L;
+
+        seen = __atomic_load_n(&media_generation, __ATOMIC_ACQUIRE) - 1;
+
+        while (__atomic_load_n(&media_filter_running, __ATOMIC_ACQUIRE)) {
+
+                nanosleep(&ts, NULL);
+
+                generation = __atomic_load_n(&media_generation, __ATOMIC_ACQUIRE);
+                now = time(NULL);
+
+                if (generation == seen && (!expire || now < expire)) continue;
+
+                expr = media_filter_build(now, &expire);
+
+                /* the same filter is running, nothing to swap. last NULL
+                 * once installed: the configured filter fallback */
+                if (installed && (expr && last ? !strcmp(last, expr) : expr == last)) {
+                        free(expr);
+                        seen = generation;
+                        continue;
+                }
+
+                if (!expr) LNOTICE("more than %d media pairs, [%s] falls back to its configured filter", media_filter_max, media_filter_profile);
+
+                if ((ret = media_filter_apply(expr)) == 0) {
+                        /* try again with the next round */
+                        free(expr);
+                        continue;
+                }
+
+                /* too big for the kernel: configured filter alone until the set changes */
+                if (ret < 0 && expr) {
+                        free(expr);
+                        expr = NULL;
+                        media_filter_apply(NULL);
+                }
+
+                free(last);
+                last = expr;
+                installed = 1;
+                seen = generation;
+        }
+
+        free(last);
+
+        return NULL;
+}
+
 int reload_config (char *erbuf, int erlen) {
 
 	char module_config_name[500];
@@ -502,6 +688,12 @@ static int load_module(xml_node *config) {
 					/* cache */
 					if (!strncmp(key, "timer-timeout", 13) && atoi(value) > 200) timer_timeout = atoi(value);
 					else if (!strncmp(key, "rtcp-timeout", 12) && atoi(value) > 80) rtcp_timeout = atoi(value);
+					else if (!strncmp(key, "rtcp-filter-profile", 19)) {
+						free(media_filter_profile);
+						media_filter_profile = strdup(value);
+					}
+					else if (!strncmp(key, "rtcp-filter-debounce", 20) && atoi(value) >= 100) media_filter_debounce = atoi(value);
+					else if (!strncmp(key, "rtcp-filter-max", 15) && atoi(value) > 0) media_filter_max = atoi(value);
 				}
 
 				nextparam: params = params->next;
@@ -518,6 +710,14 @@ static int load_module(xml_node *config) {
 
 	timer_init();
 
+	if (media_filter_profile) {
+		__atomic_store_n(&media_filter_running, 1, __ATOMIC_RELEASE);
+		if (pthread_create(&media_filter_thread, NULL, media_filter_loop, NULL) != 0) {
+			LERR("could not create the media filter thread");
+			media_filter_running = 0;
+		}
+	}
+
 	return 0;
 }
 
@@ -537,6 +737,10 @@ static int unload_module(void) {
 	LNOTICE("unloaded module %s", module_name);
 	timer_loop_stop = 0;
 
+	if (__atomic_exchange_n(&media_filter_running, 0, __ATOMIC_ACQ_REL)) pthread_join(media_filter_thread, NULL);
+	free(media_filter_profile);
+	media_filter_profile = NULL;
+
 	for (i = 0; i < profile_size; i++) {
 		free_profile(i);
 	}
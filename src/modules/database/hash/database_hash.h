@@ -45,6 +45,15 @@ profile_database_t profile_database[MAX_DATABASE];
 #define EXPIRE_RTCP_HASH 80
 #define EXPIRE_TIMER_ARRAY 80
 
+/* ms between two filters installed on the RTCP profile */
+#define MEDIA_FILTER_DEBOUNCE 1000
+/* more media pairs than this and the profile gets its plain capture-filter */
+#define MEDIA_FILTER_MAX 200
+/* room for one "(host <ipv6> and udp port 65535)" plus " or " */
+#define MEDIA_FILTER_TERM_LEN 96
+/* no call with media yet */
+#define MEDIA_FILTER_NONE "ip and not ip"
+
 int expire_hash_value = EXPIRE_RTCP_HASH;
 int rtcp_timeout = EXPIRE_RTCP_HASH;
 
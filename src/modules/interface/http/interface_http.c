@@ -58,6 +58,9 @@
 #include <captagent/modules_api.h>
 #include <captagent/modules.h>
 #include <captagent/log.h>
+#include <captagent/metrics.h>
+#include <captagent/action.h>
+#include <captagent/capture.h>
 
 #include <pcap.h>
 
@@ -364,6 +367,326 @@ int api_request_handler(struct mg_connection *conn, void *cbdata) {
 	return 1;
 }
 
+/* Prometheus scrape, counters are summed up per request */
+int metrics_request_handler(struct mg_connection *conn, void *cbdata) {
+
+	char *text;
+	size_t len = 0;
+
+	stats.recieved_request_total++;
+	stats.recieved_request_get++;
+
+	if((text = metrics_prometheus(&len)) == NULL) {
+		send_reply(conn, "500 Server Error", "no memory for metrics", NULL);
+		return 1;
+	}
+
+	mg_printf(conn, "HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n", "text/plain; version=0.0.4", len);
+	mg_write(conn, text, len);
+
+	free(text);
+
+	stats.send_response_total++;
+
+	return 1;
+}
+
+/* one entry of API_SHOW_LATENCY, quantiles in microseconds */
+static void latency_json(metric_t *m, void *arg) {
+
+	json_object *jarray = (json_object *) arg, *jobj_hist;
+	metric_hist_t h;
+
+	metric_hist_merge(m, &h);
+
+	jobj_hist = json_object_new_object();
+	json_object_object_add(jobj_hist, "name", json_object_new_string(m->name));
+	if(m->labels) json_object_object_add(jobj_hist, "labels", json_object_new_string(m->labels));
+	json_object_object_add(jobj_hist, "count", json_object_new_int64(h.count));
+	json_object_object_add(jobj_hist, "p50", json_object_new_int64(metric_hist_quantile(&h, 0.5)));
+	json_object_object_add(jobj_hist, "p90", json_object_new_int64(metric_hist_quantile(&h, 0.9)));
+	json_object_object_add(jobj_hist, "p99", json_object_new_int64(metric_hist_quantile(&h, 0.99)));
+	json_object_object_add(jobj_hist, "p999", json_object_new_int64(metric_hist_quantile(&h, 0.999)));
+	json_object_object_add(jobj_hist, "max", json_object_new_int64(h.max));
+	json_object_array_add(jarray, jobj_hist);
+}
+
+/* one entry of API_SHOW_DROPS, labels as built by metric_drops() */
+static void drops_json(metric_t *m, void *arg) {
+
+	json_object *jarray = (json_object *) arg, *jobj_drop;
+	char module[64], profile[128], reason[64];
+
+	if(strcmp(m->name, METRIC_DROPS) || !m->labels) return;
+
+	profile[0] = '\0';
+	if(sscanf(m->labels, "module=\"%63[^\"]\",profile=\"%127[^\"]\",reason=\"%63[^\"]\"", module, profile, reason) != 3
+			&& sscanf(m->labels, "module=\"%63[^\"]\",profile=\"\",reason=\"%63[^\"]\"", module, reason) != 2) return;
+
+	jobj_drop = json_object_new_object();
+	json_object_object_add(jobj_drop, "module", json_object_new_string(module));
+	json_object_object_add(jobj_drop, "profile", json_object_new_string(profile));
+	json_object_object_add(jobj_drop, "reason", json_object_new_string(reason));
+	json_object_object_add(jobj_drop, "value", json_object_new_int64(metric_value(m)));
+	json_object_array_add(jarray, jobj_drop);
+}
+
+/* API_SHOW_SHED, the load shedding metrics of socket_pcap */
+static void shed_json(metric_t *m, void *arg) {
+
+	json_object *jobj = (json_object *) arg, *jarray, *jobj_class;
+	char class[128];
+	int level;
+
+	if(!strcmp(m->name, "socket_pcap_shed_level")) {
+		json_object_object_add(jobj, "level", json_object_new_int64(metric_value(m)));
+	}
+	else if(!strcmp(m->name, "socket_pcap_capture_lag_us")) {
+		json_object_object_add(jobj, "capture_lag_us", json_object_new_int64(metric_value(m)));
+	}
+	else if(!strcmp(m->name, "socket_pcap_shed_total") && m->labels
+			&& sscanf(m->labels, "level=\"%d\",class=\"%127[^\"]\"", &level, class) == 2) {
+
+		if(!json_object_object_get_ex(jobj, "classes", &jarray)) {
+			jarray = json_object_new_array();
+			json_object_object_add(jobj, "classes", jarray);
+		}
+
+		jobj_class = json_object_new_object();
+		json_object_object_add(jobj_class, "level", json_object_new_int(level));
+		json_object_object_add(jobj_class, "class", json_object_new_string(class));
+		json_object_object_add(jobj_class, "shed", json_object_new_int64(metric_value(m)));
+		json_object_array_add(jarray, jobj_class);
+	}
+}
+
+static int pcap_stream_flush(pcap_stream_t *ps) {
+
+	if(!ps->started) {
+		mg_printf(ps->conn, "HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/vnd.tcpdump.pcap\r\n"
+				"Content-Disposition: attachment; filename=\"captagent.pcap\"\r\n"
+				"Connection: close\r\n"
+				"\r\n");
+		ps->started = 1;
+	}
+
+	if(ps->len && mg_write(ps->conn, ps->buf, ps->len) != (int) ps->len) return -1;
+	ps->len = 0;
+
+	return 0;
+}
+
+/* pcap_dump_write_f of the socket modules */
+static int pcap_stream_write(void *arg, const void *data, size_t len) {
+
+	pcap_stream_t *ps = (pcap_stream_t *) arg;
+
+	if(ps->len + len > PCAP_STREAM_BUF && pcap_stream_flush(ps)) return -1;
+	if(len > PCAP_STREAM_BUF) return mg_write(ps->conn, data, len) == (int) len ? 0 : -1;
+
+	memcpy(ps->buf + ps->len, data, len);
+	ps->len += len;
+
+	return 0;
+}
+
+/* stream the socket_pcap flight recorder as pcap, capture goes on meanwhile.
+ * With callid set the frames of that call, otherwise what filter selects */
+static int pcap_reply(struct mg_connection *conn, pcap_dump_filter_t *filter, str *callid, const char *requestUuid) {
+
+	bind_socket_module_api_t bind;
+	socket_module_api_t api;
+	pcap_stream_t ps;
+	json_object *jobj_reply;
+	int ret = -1;
+
+	memset(&api, 0, sizeof(api));
+	memset(&ps, 0, sizeof(ps));
+	ps.conn = conn;
+
+	if((bind = (bind_socket_module_api_t) find_export("socket_pcap_bind_api", 1, 0)) != NULL) bind(&api);
+
+	if((callid ? api.dump_call_f != NULL : api.dump_pcap_f != NULL) && (ps.buf = malloc(PCAP_STREAM_BUF)) != NULL) {
+		if(callid) ret = api.dump_call_f(callid, pcap_stream_write, &ps);
+		else ret = api.dump_pcap_f(filter, pcap_stream_write, &ps);
+		if(ps.started || ret >= 0) pcap_stream_flush(&ps);
+		free(ps.buf);
+	}
+
+	/* nothing sent yet: no recorder for the profile or unknown call */
+	if(!ps.started) {
+		jobj_reply = json_object_new_object();
+		add_base_info(jobj_reply, "bad", callid ? "call not found" : "flight recorder not enabled");
+		send_json_reply(conn, "404 Not found", jobj_reply, requestUuid, 1);
+		return 0;
+	}
+
+	stats.send_response_total++;
+
+	return ret;
+}
+
+/* API_FLIGHT_PCAP?from=&to=&last=&ip=&port=&callid=&profile= */
+static int flight_pcap(struct mg_request_info *request_info, struct mg_connection *conn, const char *requestUuid) {
+
+	pcap_dump_filter_t filter;
+	const char *query = request_info->query_string;
+	size_t qlen = query ? strlen(query) : 0;
+	char profile[128], ip[INET6_ADDRSTRLEN], value[32], callid[256];
+
+	memset(&filter, 0, sizeof(filter));
+
+	if(query) {
+		if(mg_get_var(query, qlen, "profile", profile, sizeof(profile)) > 0) filter.profile = profile;
+		if(mg_get_var(query, qlen, "from", value, sizeof(value)) > 0) filter.from = strtoul(value, NULL, 10);
+		if(mg_get_var(query, qlen, "to", value, sizeof(value)) > 0) filter.to = strtoul(value, NULL, 10);
+		if(mg_get_var(query, qlen, "last", value, sizeof(value)) > 0) filter.from = time(NULL) - strtoul(value, NULL, 10);
+		if(mg_get_var(query, qlen, "port", value, sizeof(value)) > 0) filter.port = atoi(value);
+		if(mg_get_var(query, qlen, "callid", callid, sizeof(callid)) > 0) {
+			filter.callid.s = callid;
+			filter.callid.len = strlen(callid);
+		}
+		if(mg_get_var(query, qlen, "ip", ip, sizeof(ip)) > 0) {
+			if(inet_pton(AF_INET, ip, filter.ip) == 1) filter.family = AF_INET;
+			else if(inet_pton(AF_INET6, ip, filter.ip) == 1) filter.family = AF_INET6;
+			else {
+				send_reply(conn, "400 Bad Request", "bad ip", requestUuid);
+				return 1;
+			}
+		}
+	}
+
+	pcap_reply(conn, &filter, NULL, requestUuid);
+
+	return 1;
+}
+
+/* API_CALLS<callid>API_CALLS_PCAP, the uri is url-decoded already */
+static int call_pcap(struct mg_request_info *request_info, struct mg_connection *conn, const char *requestUuid) {
+
+	str callid;
+	size_t len = strlen(request_info->uri), plen = strlen(API_CALLS), slen = strlen(API_CALLS_PCAP);
+
+	if(len <= plen + slen || strcmp(request_info->uri + len - slen, API_CALLS_PCAP)) {
+		send_reply(conn, "404 Not found", "use " API_CALLS "<callid>" API_CALLS_PCAP, requestUuid);
+		return 1;
+	}
+
+	callid.s = (char *) request_info->uri + plen;
+	callid.len = len - plen - slen;
+
+	pcap_reply(conn, NULL, &callid, requestUuid);
+
+	return 1;
+}
+
+/* API_SOCKET_FILTER {"profile": "...", "filter": "udp port 5060"}, no profile: all */
+static int socket_filter(struct mg_connection *conn, char *post_data, const char *requestUuid) {
+
+	bind_socket_module_api_t bind;
+	socket_module_api_t api;
+	filter_msg_t filter;
+	json_object *jobj, *obj, *jobj_reply;
+	int ret;
+
+	memset(&api, 0, sizeof(api));
+	memset(&filter, 0, sizeof(filter));
+
+	if((bind = (bind_socket_module_api_t) find_export("socket_pcap_bind_api", 1, 0)) != NULL) bind(&api);
+
+	if(api.apply_filter_f == NULL) {
+		send_reply(conn, "404 Not found", "socket_pcap not loaded", requestUuid);
+		return 1;
+	}
+
+	if((jobj = json_tokener_parse(post_data)) == NULL) {
+		send_reply(conn, "400 Bad Request", "couldnot parse", requestUuid);
+		return 1;
+	}
+
+	if(json_object_object_get_ex(jobj, "profile", &obj) && obj != NULL) filter.profile = (char *) json_object_get_string(obj);
+	if(json_object_object_get_ex(jobj, "filter", &obj) && obj != NULL) filter.data = (char *) json_object_get_string(obj);
+
+	jobj_reply = json_object_new_object();
+
+	if(filter.data == NULL) {
+		add_base_info(jobj_reply, "bad", "no filter provided");
+	}
+	else if((ret = api.apply_filter_f(&filter)) <= 0) {
+		add_base_info(jobj_reply, "bad", filter.error);
+	}
+	else if(filter.value & FILTER_PENDING) {
+		add_base_info(jobj_reply, "pending", filter.error);
+		json_object_object_add(jobj_reply, "data", json_object_new_int(ret));
+	}
+	else {
+		add_base_info(jobj_reply, "ok", "all good");
+		json_object_object_add(jobj_reply, "data", json_object_new_int(ret));
+	}
+
+	json_object_put(jobj);
+
+	send_json_reply(conn, "200 OK", jobj_reply, requestUuid, 1);
+
+	return 1;
+}
+
+/* API_PLAN_PROFILE, reset: the counters go back to zero as they are read, so
+ * no call counted between the reply and the reset is lost */
+static int plan_profile(struct mg_connection *conn, const char *requestUuid, int reset) {
+
+	json_object *jobj_reply, *jarray, *jobj_action;
+	action_prof_t *p;
+	uint64_t calls, ret_true, ret_false, ret_drop, cycles;
+
+	jobj_reply = json_object_new_object();
+	jarray = json_object_new_array();
+
+	pthread_mutex_lock(&action_prof_lock);
+	for (p = action_prof_list; p; p = p->next) {
+
+		if (reset) {
+			calls = __atomic_exchange_n(&p->calls, 0, __ATOMIC_RELAXED);
+			ret_true = __atomic_exchange_n(&p->ret_true, 0, __ATOMIC_RELAXED);
+			ret_false = __atomic_exchange_n(&p->ret_false, 0, __ATOMIC_RELAXED);
+			ret_drop = __atomic_exchange_n(&p->ret_drop, 0, __ATOMIC_RELAXED);
+			cycles = __atomic_exchange_n(&p->cycles, 0, __ATOMIC_RELAXED);
+		}
+		else {
+			calls = __atomic_load_n(&p->calls, __ATOMIC_RELAXED);
+			ret_true = __atomic_load_n(&p->ret_true, __ATOMIC_RELAXED);
+			ret_false = __atomic_load_n(&p->ret_false, __ATOMIC_RELAXED);
+			ret_drop = __atomic_load_n(&p->ret_drop, __ATOMIC_RELAXED);
+			cycles = __atomic_load_n(&p->cycles, __ATOMIC_RELAXED);
+		}
+
+		jobj_action = json_object_new_object();
+		json_object_object_add(jobj_action, "plan", json_object_new_string(p->plan));
+		json_object_object_add(jobj_action, "line", json_object_new_int(p->line));
+		json_object_object_add(jobj_action, "function", json_object_new_string(p->name));
+		json_object_object_add(jobj_action, "calls", json_object_new_int64(calls));
+		json_object_object_add(jobj_action, "true", json_object_new_int64(ret_true));
+		json_object_object_add(jobj_action, "false", json_object_new_int64(ret_false));
+		json_object_object_add(jobj_action, "drop", json_object_new_int64(ret_drop));
+		json_object_object_add(jobj_action, "cycles", json_object_new_int64(cycles));
+		json_object_object_add(jobj_action, "cycles_per_call", json_object_new_int64(calls ? cycles / calls : 0));
+		json_object_array_add(jarray, jobj_action);
+	}
+	pthread_mutex_unlock(&action_prof_lock);
+
+	add_base_info(jobj_reply, "ok", action_profile_enabled ? "all good" : "action_profile disabled");
+	json_object_object_add(jobj_reply, "unit", json_object_new_string(action_profile_unit));
+	json_object_object_add(jobj_reply, "data", jarray);
+
+	send_json_reply(conn, "200 OK", jobj_reply, requestUuid, 1);
+
+	return 1;
+}
+
 int proceed_delete_request(struct mg_request_info * request_info, struct mg_connection *conn) {
 
 	json_object *jobj_reply = NULL;
@@ -614,6 +937,35 @@ int proceed_post_request(struct mg_request_info * request_info, struct mg_connec
 			return 1;
 			
         }
+	else if (!strncmp(request_info->uri, API_SOCKET_FILTER, strlen(API_SOCKET_FILTER))) {
+
+			post_data_len = mg_read(conn, post_data, sizeof(post_data) - 1);
+
+			if (post_data_len <= 0) {
+				send_reply(conn, "503 Server Error", "no post data!", requestUuid);
+				return 1;
+			}
+			post_data[post_data_len] = '\0';
+
+			return socket_filter(conn, post_data, requestUuid);
+	}
+	else if (!strncmp(request_info->uri, API_PLAN_PROFILE_RESET, strlen(API_PLAN_PROFILE_RESET))) {
+
+			return plan_profile(conn, requestUuid, 1);
+	}
+	else if (!strncmp(request_info->uri, API_PLAN_RELOAD, strlen(API_PLAN_RELOAD))) {
+
+			jobj_reply = json_object_new_object();
+
+			ret = capture_plan_reload();
+
+			if (ret < 0) add_base_info(jobj_reply, "bad", "capture plan failed to parse, see the log");
+			else add_base_info(jobj_reply, "ok", "all good");
+			json_object_object_add(jobj_reply, "data", json_object_new_int(ret));
+
+			send_json_reply(conn, "200 OK", jobj_reply, requestUuid, typeReply);
+			return 1;
+	}
         else if((ret = check_extra_create(conn, (char *)request_info->uri, &jobj_reply, post_data, requestUuid)) != 0) 
         {
                 if(ret == 1) send_json_reply(conn, "200 OK", jobj_reply, requestUuid, typeReply);
@@ -755,6 +1107,69 @@ int proceed_get_request(struct mg_request_info * request_info, struct mg_connect
 		return 1;
 
 	} 	
+	else if (!strncmp(request_info->uri, API_PLAN_RELOAD, strlen(API_PLAN_RELOAD))) {
+
+		send_reply(conn, "405 Method Not Allowed", "use POST " API_PLAN_RELOAD, requestUuid);
+		return 1;
+	}
+	else if (!strncmp(request_info->uri, API_PLAN_PROFILE_RESET, strlen(API_PLAN_PROFILE_RESET))) {
+
+		send_reply(conn, "405 Method Not Allowed", "use POST " API_PLAN_PROFILE_RESET, requestUuid);
+		return 1;
+	}
+	else if (!strncmp(request_info->uri, API_PLAN_PROFILE, strlen(API_PLAN_PROFILE))) {
+
+		return plan_profile(conn, requestUuid, 0);
+	}
+	else if (!strncmp(request_info->uri, API_SHOW_DROPS, strlen(API_SHOW_DROPS))) {
+
+		jobj_reply = json_object_new_object();
+		json_object *jarray = json_object_new_array();
+
+		metric_foreach(METRIC_COUNTER, drops_json, jarray);
+
+		add_base_info(jobj_reply, "ok", "all good");
+		json_object_object_add(jobj_reply, "data", jarray);
+
+		send_json_reply(conn, "200 OK", jobj_reply, requestUuid, typeReply);
+		return 1;
+	}
+	else if (!strncmp(request_info->uri, API_SHOW_SHED, strlen(API_SHOW_SHED))) {
+
+		jobj_reply = json_object_new_object();
+		json_object *jobj_shed = json_object_new_object();
+
+		metric_foreach(METRIC_GAUGE, shed_json, jobj_shed);
+		metric_foreach(METRIC_COUNTER, shed_json, jobj_shed);
+
+		if(json_object_object_get_ex(jobj_shed, "level", NULL)) add_base_info(jobj_reply, "ok", "all good");
+		else add_base_info(jobj_reply, "ok", "load shedding not enabled");
+		json_object_object_add(jobj_reply, "data", jobj_shed);
+
+		send_json_reply(conn, "200 OK", jobj_reply, requestUuid, typeReply);
+		return 1;
+	}
+	else if (!strncmp(request_info->uri, API_SHOW_LATENCY, strlen(API_SHOW_LATENCY))) {
+
+		jobj_reply = json_object_new_object();
+		json_object *jarray = json_object_new_array();
+
+		metric_foreach(METRIC_HISTOGRAM, latency_json, jarray);
+
+		add_base_info(jobj_reply, "ok", metric_latency_enabled ? "all good" : "latency_stats disabled");
+		json_object_object_add(jobj_reply, "data", jarray);
+
+		send_json_reply(conn, "200 OK", jobj_reply, requestUuid, typeReply);
+		return 1;
+	}
+	else if (!strncmp(request_info->uri, API_FLIGHT_PCAP, strlen(API_FLIGHT_PCAP))) {
+
+		return flight_pcap(request_info, conn, requestUuid);
+	}
+	else if (!strncmp(request_info->uri, API_CALLS, strlen(API_CALLS))) {
+
+		return call_pcap(request_info, conn, requestUuid);
+	}
 	else if((ret = check_extra_get(conn, (char *)request_info->uri, &jobj_reply, requestUuid)) != 0) 
         {
                 if(ret == 1) send_json_reply(conn, "200 OK", jobj_reply, requestUuid, typeReply);
@@ -1380,6 +1795,7 @@ static int load_module(xml_node *config) {
 		}
 
 		mg_set_request_handler(ctx, "/api", api_request_handler, 0);
+		mg_set_request_handler(ctx, API_METRICS, metrics_request_handler, 0);
 
 	    if(profile_interface.server_type == 2) {
 	    	  // start thread
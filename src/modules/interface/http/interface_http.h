@@ -60,6 +60,27 @@ int readbody = 0;
 #define API_AGENT_INFO "/api/agent/info"
 #define API_MODULE_STATS "/api/module/stats"
 #define API_MODULE_EXEC "/api/module/exec"
+#define API_METRICS "/metrics"
+#define API_SHOW_LATENCY "/api/status/latency"
+#define API_SHOW_DROPS "/api/status/drops"
+#define API_SHOW_SHED "/api/status/shed"
+#define API_PLAN_PROFILE "/api/plan/profile"
+#define API_PLAN_PROFILE_RESET "/api/plan/profile/reset"
+#define API_PLAN_RELOAD "/api/plan/reload"
+#define API_FLIGHT_PCAP "/api/flight/pcap"
+#define API_CALLS "/api/v1/calls/"
+#define API_SOCKET_FILTER "/api/socket/filter"
+#define API_CALLS_PCAP "/pcap"
+
+#define PCAP_STREAM_BUF (64 * 1024)
+
+/* pcap reply, the HTTP header goes out with the first flush */
+typedef struct pcap_stream {
+	struct mg_connection *conn;
+	char *buf;
+	size_t len;
+	int started;
+} pcap_stream_t;
 
 typedef struct interface_http_stats {
 	uint64_t recieved_request_total;
@@ -96,6 +117,7 @@ bind_statistic_module_api_t statistic_bind_api;
 bind_database_module_api_t database_bind_api;
 
 int api_request_handler(struct mg_connection *conn, void *cbdata);
+int metrics_request_handler(struct mg_connection *conn, void *cbdata);
 int send_data_x2 (int socket, void *buf, unsigned int len);
 int sigPipe(void);
 char* read_file(char *name );
@@ -35,6 +35,7 @@
 #include <captagent/modules.h>
 #include "protocol_sip.h"
 #include <captagent/log.h>
+#include <captagent/trace.h>
 
 xml_node *module_xml_config = NULL;
 char *module_name="protocol_sip";
@@ -60,6 +61,7 @@ static cmd_export_t cmds[] = {
         {"parse_sip", (cmd_function) w_parse_sip, 0, 0, 0, 0 },
         {"parse_full_sip", (cmd_function) w_parse_full_sip, 0, 0, 0, 0 },
         {"clog", (cmd_function) w_clog, 2, 0, 0, 0 },
+        {"sample_call", (cmd_function) w_sample_call, 1, 0, 0, 0 },
         /* ================================ */
         {"sip_has_sdp", (cmd_function) w_sip_has_sdp, 0, 0, 0, 0 },
         {"is_flag_set", (cmd_function) w_is_flag_set, 2, 0, 0, 0 },
@@ -233,6 +235,50 @@ int send_sip_reply(msg_t *_m, int code, char *description)
 
 
 
+/* FNV-1a with the MurmurHash3 finalizer, Call-IDs often differ only at the end */
+static uint64_t sample_hash(const char *s, int len)
+{
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        while (len--) {
+                h ^= (unsigned char) *s++;
+                h *= 0x100000001b3ULL;
+        }
+
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb93fe53cc49bULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
+/* true for the same param1 percent of calls on every agent: the hash of the
+ * Call-ID, or of the correlation ID set by is_rtcp_exist() for RTCP, decides.
+ * Messages without either are not sampled out */
+int w_sample_call(msg_t *_m, char *param1)
+{
+        str *id;
+        double percent = param1 ? atof(param1) : 100;
+        int len;
+
+        if (_m->rcinfo.correlation_id.s && _m->rcinfo.correlation_id.len > 0) id = &_m->rcinfo.correlation_id;
+        else if (_m->sip.callId.s && _m->sip.callId.len > 0) id = &_m->sip.callId;
+        else return 1;
+
+        len = id->len > SAMPLE_CALLID_MAX ? SAMPLE_CALLID_MAX : id->len;
+
+        /* top 53 bits as a fraction of 1 */
+        if (percent >= 100 || (percent > 0 && (sample_hash(id->s, len) >> 11) * (100.0 / 9007199254740992.0) < percent)) {
+                metric_inc(stats.sample_kept);
+                return 1;
+        }
+
+        metric_inc(stats.sample_skipped);
+        return -1;
+}
+
 int w_proto_check_size(msg_t *_m, char *param1, char *param2)
 {
 
@@ -342,14 +388,19 @@ int parse_sip(msg_t *msg, unsigned int type) {
 	msg->rcinfo.proto_type = PROTO_SIP;
 	msg->parsed_data = NULL;
 
+	TRACE_PROBE2(sip_parse_start, msg->data, msg->len);
+
 	if (parse_packet(msg, &msg->sip, type)) {
 
 		ret = 1;
 		msg->sip.validMessage = TRUE;		        
 		stats.parsed_packets++;
+		metric_latency(stats.parse_latency, msg->rcinfo.time_sec, msg->rcinfo.time_usec);
+		TRACE_PROBE3(sip_parse_end, ret, msg->sip.callId.s, msg->sip.callId.len);
 
 	} else {
 
+		TRACE_PROBE3(sip_parse_end, ret, NULL, 0);
 		LERR("SIP PARSE ERROR [%d]\n", ret);
 
 		goto error;
@@ -410,17 +461,23 @@ int light_parse_sip(msg_t *msg) {
 	msg->rcinfo.proto_type = PROTO_SIP;
 	msg->parsed_data = NULL;
 
+	TRACE_PROBE2(sip_parse_start, msg->data, msg->len);
 
 	if (!light_parse_message(msg->data, msg->len,  &bytes_parsed,  &msg->sip)) {
+		TRACE_PROBE3(sip_parse_end, -1, NULL, 0);
 		LERR("bad parsing");
 		return -1;
 	}
 
 	if (msg->sip.callId.len == 0) {
+		TRACE_PROBE3(sip_parse_end, -1, NULL, 0);
 		LERR("sipPacket CALLID has 0 len");
 		return -1;
 	}
 
+	metric_latency(stats.parse_latency, msg->rcinfo.time_sec, msg->rcinfo.time_usec);
+	TRACE_PROBE3(sip_parse_end, ret, msg->sip.callId.s, msg->sip.callId.len);
+
 	stats.send_packets++;
 
 	return ret;
@@ -525,6 +582,10 @@ static int load_module(xml_node *config) {
 
 	LNOTICE("Loaded %s", module_name);
 
+	stats.parse_latency = metric_histogram("latency_seconds", "Time from the capture timestamp to a pipeline stage", "stage=\"sip_parse\"");
+	stats.sample_kept = metric_counter("protocol_sip_sample_total", "Messages checked by sample_call()", "result=\"kept\"");
+	stats.sample_skipped = metric_counter("protocol_sip_sample_total", "Messages checked by sample_call()", "result=\"skipped\"");
+
 	load_module_xml_config();
 	/* READ CONFIG */
 	profile = module_xml_config;
@@ -628,6 +689,13 @@ static int unload_module(void)
 		free_profile(i);
 	}
 
+	metric_unregister(stats.parse_latency);
+	stats.parse_latency = NULL;
+	metric_unregister(stats.sample_kept);
+	stats.sample_kept = NULL;
+	metric_unregister(stats.sample_skipped);
+	stats.sample_skipped = NULL;
+
 	 /* Close socket */
        //pcap_close(sniffer_proto);
 
@@ -667,6 +735,8 @@ static int statistic(char *buf, size_t len)
 		ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", stats.recieved_packets_total);
 		ret += snprintf(buf+ret, len-ret, "Parsed packets: [%" PRId64 "]\r\n", stats.parsed_packets);
 		ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", stats.send_packets);
+		ret += snprintf(buf+ret, len-ret, "Sampled calls: kept [%" PRId64 "], skipped [%" PRId64 "]\r\n",
+				metric_value(stats.sample_kept), metric_value(stats.sample_skipped));
 
 		return 1;
 }
@@ -27,6 +27,7 @@
 #define _PROTOCOL_SIP_H_
 
 #include <captagent/xmlread.h>
+#include <captagent/metrics.h>
 #include "parser_sip.h"
 
 #define FILTER_LEN 4080
@@ -52,8 +53,17 @@ typedef struct protocol_sip_stats {
 	uint64_t recieved_packets_total;
 	uint64_t parsed_packets;
 	uint64_t send_packets;
+	/* capture timestamp to a parsed SIP message */
+	metric_t *parse_latency;
+	/* sample_call() */
+	metric_t *sample_kept;
+	metric_t *sample_skipped;
 } protocol_sip_stats_t;
 
+/* bytes of the Call-ID sample_call() hashes: database_hash keeps no more of it
+ * as the correlation ID of the RTCP, both have to land on the same side */
+#define SAMPLE_CALLID_MAX 249
+
 static protocol_sip_stats_t stats;
 
 extern char* usefile;
@@ -88,6 +98,7 @@ int w_parse_sip(msg_t *_m);
 int w_clog(msg_t *_m, char *param1, char* param2);
 int w_sip_is_method(msg_t *_m);
 int w_sip_check(msg_t *_m, char *param1, char *param2);
+int w_sample_call(msg_t *_m, char *param1);
 
 int w_send_reply_p(msg_t *_m, char *param1, char *param2);
 int w_send_reply(msg_t *_m);
@@ -0,0 +1,225 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Call-ID index into the socket_pcap flight recorder
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <captagent/log.h>
+#include "call_index.h"
+
+typedef struct call_match_ctx {
+	call_entry_t call;
+	int linktype;
+	uint8_t link_offset;
+} call_match_ctx_t;
+
+call_index_t *call_index_new(unsigned int max_calls, uint32_t max_age)
+{
+	call_index_t *ci;
+
+	if ((ci = calloc(1, sizeof(call_index_t))) == NULL) return NULL;
+
+	ci->max_calls = max_calls;
+	ci->max_age = max_age;
+	pthread_mutex_init(&ci->lock, NULL);
+
+	return ci;
+}
+
+static void call_unlink(call_index_t *ci, call_entry_t *call)
+{
+	if (call->prev) call->prev->next = call->next;
+	else ci->oldest = call->next;
+	if (call->next) call->next->prev = call->prev;
+	else ci->newest = call->prev;
+	call->prev = call->next = NULL;
+}
+
+static void call_link_newest(call_index_t *ci, call_entry_t *call)
+{
+	call->prev = ci->newest;
+	call->next = NULL;
+	if (ci->newest) ci->newest->next = call;
+	else ci->oldest = call;
+	ci->newest = call;
+}
+
+static void call_evict(call_index_t *ci, call_entry_t *call)
+{
+	HASH_DEL(ci->calls, call);
+	call_unlink(ci, call);
+	free(call->callid);
+	free(call);
+	ci->count--;
+	ci->evicted++;
+}
+
+void call_index_free(call_index_t *ci)
+{
+	if (!ci) return;
+
+	while (ci->oldest) call_evict(ci, ci->oldest);
+
+	pthread_mutex_destroy(&ci->lock);
+	free(ci);
+}
+
+static void call_add_media(call_entry_t *call, str *ip, int port)
+{
+	call_media_t m;
+	char buf[INET6_ADDRSTRLEN];
+	unsigned int i;
+
+	if (!ip->s || !ip->len || ip->len >= sizeof(buf) || port <= 0 || port > 65535) return;
+
+	memcpy(buf, ip->s, ip->len);
+	buf[ip->len] = '\0';
+
+	memset(&m, 0, sizeof(m));
+	if (inet_pton(AF_INET, buf, m.ip) == 1) m.family = AF_INET;
+	else if (inet_pton(AF_INET6, buf, m.ip) == 1) m.family = AF_INET6;
+	else return;
+	m.port = port;
+
+	for (i = 0; i < call->media_count; i++) {
+		if (!memcmp(&call->media[i], &m, sizeof(m))) return;
+	}
+
+	/* a re-INVITE to new endpoints replaces the oldest ones */
+	if (call->media_count == CALL_MEDIA_MAX) {
+		memmove(call->media, call->media + 1, sizeof(call_media_t) * (CALL_MEDIA_MAX - 1));
+		call->media_count--;
+	}
+	call->media[call->media_count++] = m;
+}
+
+void call_index_add(call_index_t *ci, sip_msg_t *sip, uint64_t pos, uint32_t ts)
+{
+	call_entry_t *call;
+	unsigned int i;
+
+	if (!sip->callId.s || !sip->callId.len) return;
+
+	pthread_mutex_lock(&ci->lock);
+
+	HASH_FIND(hh, ci->calls, sip->callId.s, sip->callId.len, call);
+
+	if (call) {
+		call_unlink(ci, call);
+	} else {
+		if ((call = calloc(1, sizeof(call_entry_t))) == NULL
+				|| (call->callid = malloc(sip->callId.len)) == NULL) {
+			free(call);
+			pthread_mutex_unlock(&ci->lock);
+			return;
+		}
+		memcpy(call->callid, sip->callId.s, sip->callId.len);
+		call->callid_len = sip->callId.len;
+		call->first_pos = pos;
+		call->first_ts = ts;
+		HASH_ADD_KEYPTR(hh, ci->calls, call->callid, call->callid_len, call);
+		ci->count++;
+	}
+
+	call->last_ts = ts;
+	if (sip->isRequest && sip->methodType == BYE) call->bye_ts = ts;
+
+	if (sip->hasSdp) {
+		for (i = 0; i < sip->mrp_size && i < MAX_MEDIA_HOSTS; i++) {
+			call_add_media(call, &sip->mrp[i].media_ip, sip->mrp[i].media_port);
+			call_add_media(call, &sip->mrp[i].rtcp_ip, sip->mrp[i].rtcp_port);
+		}
+	}
+
+	call_link_newest(ci, call);
+
+	/* least recently seen first: over the limit or older than max_age */
+	while (ci->oldest && ci->oldest != call
+			&& (ci->count > ci->max_calls || (ci->max_age && ci->oldest->last_ts + ci->max_age < ts))) {
+		call_evict(ci, ci->oldest);
+	}
+
+	pthread_mutex_unlock(&ci->lock);
+}
+
+static int call_match(void *arg, flight_record_t *rec, const unsigned char *frame)
+{
+	call_match_ctx_t *ctx = (call_match_ctx_t *) arg;
+	call_entry_t *call = &ctx->call;
+	flight_addr_t addr;
+	unsigned int i;
+	int alen;
+
+	if (memmem(frame, rec->caplen, call->callid, call->callid_len)) return 1;
+
+	if (!call->media_count || rec->ts_sec < call->first_ts) return 0;
+	if (call->bye_ts && rec->ts_sec > call->bye_ts + CALL_MEDIA_GRACE) return 0;
+
+	if (!flight_frame_addr(frame, rec->caplen, ctx->linktype, ctx->link_offset, &addr) || addr.proto != IPPROTO_UDP) return 0;
+
+	alen = addr.family == AF_INET ? 4 : 16;
+	for (i = 0; i < call->media_count; i++) {
+		if (call->media[i].family != addr.family) continue;
+		if ((addr.sport == call->media[i].port && !memcmp(addr.src, call->media[i].ip, alen))
+				|| (addr.dport == call->media[i].port && !memcmp(addr.dst, call->media[i].ip, alen))) return 1;
+	}
+
+	return 0;
+}
+
+int call_index_dump(call_index_t *ci, flight_recorder_t *fr, str *callid, uint8_t link_offset,
+		pcap_dump_write_f write, void *arg)
+{
+	call_match_ctx_t ctx;
+	call_entry_t *call;
+	int ret;
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	/* work on a copy, capture goes on indexing meanwhile */
+	pthread_mutex_lock(&ci->lock);
+	HASH_FIND(hh, ci->calls, callid->s, callid->len, call);
+	if (call) {
+		ctx.call = *call;
+		ctx.call.callid = malloc(call->callid_len);
+		if (ctx.call.callid) memcpy(ctx.call.callid, call->callid, call->callid_len);
+	}
+	pthread_mutex_unlock(&ci->lock);
+
+	if (!call || !ctx.call.callid) return -1;
+
+	ctx.linktype = fr->linktype;
+	ctx.link_offset = link_offset;
+
+	ret = flight_recorder_scan(fr, ctx.call.first_pos, call_match, &ctx, write, arg);
+
+	free(ctx.call.callid);
+
+	return ret;
+}
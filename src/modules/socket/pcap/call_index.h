@@ -0,0 +1,91 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Call-ID index into the socket_pcap flight recorder
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _CALL_INDEX_H_
+#define _CALL_INDEX_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <captagent/api.h>
+#include <captagent/proto_sip.h>
+#include "flight_recorder.h"
+#include "uthash.h"
+
+/*
+ * Maps the Call-ID of every indexed SIP message to the position of its first
+ * frame in the flight recorder and to the RTP/RTCP endpoints of its SDP. The
+ * frames stay in the recorder, a dump scans it from that position on for
+ * frames carrying the Call-ID or sent from/to one of the endpoints.
+ * Bounded by count and age, least recently seen calls are evicted first.
+ */
+
+#define CALL_MEDIA_MAX 8
+/* media after the BYE still belongs to the call for this many seconds */
+#define CALL_MEDIA_GRACE 2
+
+typedef struct call_media {
+	int family;
+	uint8_t ip[16];
+	uint16_t port;
+} call_media_t;
+
+typedef struct call_entry {
+	char *callid;
+	unsigned int callid_len;
+	uint64_t first_pos;
+	uint32_t first_ts;
+	uint32_t last_ts;
+	uint32_t bye_ts;
+	call_media_t media[CALL_MEDIA_MAX];
+	unsigned int media_count;
+	struct call_entry *prev;	/* towards the least recently seen */
+	struct call_entry *next;
+	UT_hash_handle hh;
+} call_entry_t;
+
+typedef struct call_index {
+	call_entry_t *calls;
+	call_entry_t *oldest;
+	call_entry_t *newest;
+	unsigned int count;
+	unsigned int max_calls;
+	uint32_t max_age;	/* seconds of capture time */
+	uint64_t evicted;
+	pthread_mutex_t lock;
+} call_index_t;
+
+call_index_t *call_index_new(unsigned int max_calls, uint32_t max_age);
+void call_index_free(call_index_t *ci);
+
+/* pos: flight recorder position of the frame that carried the message */
+void call_index_add(call_index_t *ci, sip_msg_t *sip, uint64_t pos, uint32_t ts);
+
+/* pcap of the call, -1 if the call is not in the index or write() failed */
+int call_index_dump(call_index_t *ci, flight_recorder_t *fr, str *callid, uint8_t link_offset,
+		pcap_dump_write_f write, void *arg);
+
+#endif /* _CALL_INDEX_H_ */
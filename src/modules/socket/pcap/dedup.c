@@ -0,0 +1,131 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Drops copies of a packet seen on several interfaces
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+dedup_t *dedup_new(unsigned int size, uint64_t window)
+{
+	dedup_t *d;
+	unsigned int per_shard = 1, i;
+
+	if (!size) size = DEDUP_SIZE;
+	while (per_shard * DEDUP_SHARDS < size) per_shard <<= 1;
+	if (per_shard < DEDUP_PROBE) per_shard = DEDUP_PROBE;
+
+	if ((d = calloc(1, sizeof(dedup_t))) == NULL) return NULL;
+
+	d->mask = per_shard - 1;
+	d->window = window ? window : DEDUP_WINDOW;
+
+	for (i = 0; i < DEDUP_SHARDS; i++) {
+		pthread_mutex_init(&d->shards[i].lock, NULL);
+		if ((d->shards[i].slots = calloc(per_shard, sizeof(dedup_slot_t))) == NULL) {
+			dedup_free(d);
+			return NULL;
+		}
+	}
+
+	return d;
+}
+
+void dedup_free(dedup_t *d)
+{
+	unsigned int i;
+
+	if (!d) return;
+
+	for (i = 0; i < DEDUP_SHARDS; i++) {
+		pthread_mutex_destroy(&d->shards[i].lock);
+		free(d->shards[i].slots);
+	}
+	free(d);
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+uint64_t dedup_key(msg_t *msg, uint64_t id)
+{
+	rc_info_t *rc = &msg->rcinfo;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	if (rc->src_ip) h = hash_bytes(h, rc->src_ip, strlen(rc->src_ip) + 1);
+	if (rc->dst_ip) h = hash_bytes(h, rc->dst_ip, strlen(rc->dst_ip) + 1);
+	h = hash_bytes(h, &rc->src_port, sizeof(rc->src_port));
+	h = hash_bytes(h, &rc->dst_port, sizeof(rc->dst_port));
+	h = hash_bytes(h, &rc->ip_proto, sizeof(rc->ip_proto));
+	h = hash_bytes(h, &id, sizeof(id));
+	h = hash_bytes(h, msg->data, msg->len);
+
+	/* 0 is an empty slot */
+	return h ? h : 1;
+}
+
+int dedup_check(dedup_t *d, uint64_t key, uint64_t ts)
+{
+	/* the low bits pick the shard, the high ones the slot */
+	dedup_shard_t *shard = &d->shards[key % DEDUP_SHARDS];
+	dedup_slot_t *slot, *victim = NULL;
+	unsigned int i, pos = (key >> 32) & d->mask;
+	int dup = 0;
+
+	pthread_mutex_lock(&shard->lock);
+
+	for (i = 0; i < DEDUP_PROBE; i++) {
+		slot = &shard->slots[(pos + i) & d->mask];
+
+		if (slot->key == key && slot->ts + d->window > ts) {
+			dup = 1;
+			victim = slot;
+			break;
+		}
+		/* the copy may come with an older timestamp from another interface */
+		if (!victim || slot->ts < victim->ts) victim = slot;
+	}
+
+	/* a copy keeps the first one's time, the window does not slide */
+	if (!dup) {
+		victim->key = key;
+		victim->ts = ts;
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return dup;
+}
@@ -0,0 +1,78 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Drops copies of a packet seen on several interfaces
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+
+/*
+ * Set of the packets seen in the last window, shared by all capture threads
+ * so that a SPAN copy from another interface is found as well. A packet is
+ * the hash of its addresses, ports, IP ID / TCP sequence and payload. The
+ * set is split into shards with their own lock, each a table probed
+ * linearly; slots older than the window are free, a full probe run reuses
+ * its oldest slot.
+ */
+
+#define DEDUP_SHARDS 16
+#define DEDUP_PROBE 8
+/* slots of all shards together */
+#define DEDUP_SIZE 65536
+/* microseconds of capture time */
+#define DEDUP_WINDOW 5000
+
+typedef struct dedup_slot {
+	uint64_t key;
+	uint64_t ts;
+} dedup_slot_t;
+
+typedef struct dedup_shard {
+	pthread_mutex_t lock;
+	dedup_slot_t *slots;
+} __attribute__((aligned(64))) dedup_shard_t;
+
+typedef struct dedup {
+	dedup_shard_t shards[DEDUP_SHARDS];
+	unsigned int mask;	/* slots per shard - 1 */
+	uint64_t window;
+} dedup_t;
+
+/* size: slots in total, rounded up to a power of two. window in us */
+dedup_t *dedup_new(unsigned int size, uint64_t window);
+void dedup_free(dedup_t *d);
+
+/* id: IP ID and TCP sequence of the packet the message came in */
+uint64_t dedup_key(msg_t *msg, uint64_t id);
+
+/* 1 if key was seen less than the window before ts, it is recorded either way */
+int dedup_check(dedup_t *d, uint64_t key, uint64_t ts);
+
+#endif /* _DEDUP_H_ */
@@ -0,0 +1,328 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  In-memory flight recorder of raw frames for socket_pcap
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <captagent/log.h>
+#include "flight_recorder.h"
+
+#define FLIGHT_HUGEPAGE (2 * 1024 * 1024)
+#define FLIGHT_ROUND(x) (((x) + FLIGHT_ALIGN - 1) & ~((uint64_t) FLIGHT_ALIGN - 1))
+
+/* pcap file header, native byte order */
+typedef struct flight_pcap_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} flight_pcap_hdr_t;
+
+typedef struct flight_pcap_rec {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t caplen;
+	uint32_t len;
+} flight_pcap_rec_t;
+
+flight_recorder_t *flight_recorder_new(uint64_t size, int hugepages, int linktype, uint32_t snaplen)
+{
+	flight_recorder_t *fr;
+	uint64_t ring = FLIGHT_MIN_SIZE;
+
+	if (hugepages && ring < FLIGHT_HUGEPAGE) ring = FLIGHT_HUGEPAGE;
+	while (ring < size) ring <<= 1;
+
+	if ((fr = calloc(1, sizeof(flight_recorder_t))) == NULL) return NULL;
+
+	fr->buf = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (hugepages) {
+		fr->buf = mmap(NULL, ring, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (fr->buf == MAP_FAILED) LWARNING("flight recorder: no hugepages for [%" PRIu64 "] bytes, using normal pages", ring);
+		else fr->hugepages = 1;
+	}
+#endif
+	if (fr->buf == MAP_FAILED) fr->buf = mmap(NULL, ring, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (fr->buf == MAP_FAILED) {
+		LERR("flight recorder: could not map [%" PRIu64 "] bytes", ring);
+		free(fr);
+		return NULL;
+	}
+
+	fr->size = ring;
+	fr->linktype = linktype;
+	fr->snaplen = snaplen ? snaplen : FLIGHT_MAX_FRAME;
+
+	return fr;
+}
+
+void flight_recorder_free(flight_recorder_t *fr)
+{
+	if (!fr) return;
+
+	munmap(fr->buf, fr->size);
+	free(fr);
+}
+
+/* no room for a record header before the end of the buffer: continue at the start */
+static inline uint64_t flight_skip(flight_recorder_t *fr, uint64_t pos)
+{
+	uint64_t off = pos & (fr->size - 1);
+
+	if (off + sizeof(flight_record_t) > fr->size) return pos + fr->size - off;
+
+	return pos;
+}
+
+/* move tail past everything that writing up to end overwrites, before writing */
+static void flight_reserve(flight_recorder_t *fr, uint64_t end)
+{
+	uint64_t tail = fr->tail;
+	flight_record_t *rec;
+
+	if (end - tail <= fr->size) return;
+
+	while (tail < end - fr->size) {
+		tail = flight_skip(fr, tail);
+		if (tail >= end - fr->size) break;
+		rec = (flight_record_t *) (fr->buf + (tail & (fr->size - 1)));
+		if (rec->caplen) fr->overwritten++;
+		tail += rec->size;
+	}
+
+	__atomic_store_n(&fr->tail, tail, __ATOMIC_RELAXED);
+	/* readers must see the new tail before any overwritten byte */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+uint64_t flight_recorder_add(flight_recorder_t *fr, const struct pcap_pkthdr *hdr, const unsigned char *packet)
+{
+	flight_record_t *rec;
+	uint64_t head, off, pad = 0, need;
+	uint32_t caplen = hdr->caplen;
+
+	if (caplen > FLIGHT_MAX_FRAME) caplen = FLIGHT_MAX_FRAME;
+	need = FLIGHT_ROUND(sizeof(flight_record_t) + caplen);
+
+	head = flight_skip(fr, fr->head);
+	off = head & (fr->size - 1);
+	if (off + need > fr->size) pad = fr->size - off;
+
+	flight_reserve(fr, head + pad + need);
+
+	if (pad) {
+		rec = (flight_record_t *) (fr->buf + off);
+		rec->size = pad;
+		rec->caplen = 0;
+		head += pad;
+		off = 0;
+	}
+
+	rec = (flight_record_t *) (fr->buf + off);
+	rec->size = need;
+	rec->caplen = caplen;
+	rec->len = hdr->len;
+	rec->ts_sec = hdr->ts.tv_sec;
+	rec->ts_usec = hdr->ts.tv_usec;
+	memcpy(rec + 1, packet, caplen);
+
+	fr->records++;
+	__atomic_store_n(&fr->head, head + need, __ATOMIC_RELEASE);
+
+	return head;
+}
+
+int flight_frame_addr(const unsigned char *p, uint32_t caplen, int linktype, uint8_t link_offset, flight_addr_t *addr)
+{
+	uint32_t off = link_offset, l4 = 0;
+	uint16_t type;
+
+	memset(addr, 0, sizeof(flight_addr_t));
+
+	if (linktype == DLT_EN10MB) {
+		/* ethertype behind any number of 802.1Q / 802.1ad tags */
+		off = 12;
+		do {
+			if (off + 2 > caplen) return 0;
+			type = (p[off] << 8) | p[off + 1];
+			off += 2;
+			if (type == 0x8100 || type == 0x88a8) off += 2;
+		} while (type == 0x8100 || type == 0x88a8);
+		if (type != 0x0800 && type != 0x86dd) return 0;
+	}
+
+	if (off >= caplen) return 0;
+
+	switch (p[off] >> 4) {
+		case 4:
+			if (off + 20 > caplen) return 0;
+			addr->family = AF_INET;
+			memcpy(addr->src, p + off + 12, 4);
+			memcpy(addr->dst, p + off + 16, 4);
+			addr->proto = p[off + 9];
+			/* only the first fragment has ports */
+			if (!((p[off + 6] & 0x1f) | p[off + 7])) l4 = off + (p[off] & 0x0f) * 4;
+			break;
+		case 6:
+			if (off + 40 > caplen) return 0;
+			addr->family = AF_INET6;
+			memcpy(addr->src, p + off + 8, 16);
+			memcpy(addr->dst, p + off + 24, 16);
+			addr->proto = p[off + 6];
+			l4 = off + 40;
+			break;
+		default:
+			return 0;
+	}
+
+	if (l4 && l4 + 4 <= caplen
+			&& (addr->proto == IPPROTO_UDP || addr->proto == IPPROTO_TCP || addr->proto == IPPROTO_SCTP)) {
+		addr->sport = (p[l4] << 8) | p[l4 + 1];
+		addr->dport = (p[l4 + 2] << 8) | p[l4 + 3];
+	}
+
+	return 1;
+}
+
+typedef struct flight_filter_ctx {
+	pcap_dump_filter_t *filter;
+	int linktype;
+	uint8_t link_offset;
+} flight_filter_ctx_t;
+
+static int flight_match_filter(void *arg, flight_record_t *rec, const unsigned char *frame)
+{
+	flight_filter_ctx_t *ctx = (flight_filter_ctx_t *) arg;
+	pcap_dump_filter_t *f = ctx->filter;
+	flight_addr_t addr;
+	int alen;
+
+	if (f->from && rec->ts_sec < f->from) return 0;
+	if (f->to && rec->ts_sec > f->to) return 0;
+	if (f->callid.len && !memmem(frame, rec->caplen, f->callid.s, f->callid.len)) return 0;
+
+	if (!f->family && !f->port) return 1;
+
+	if (!flight_frame_addr(frame, rec->caplen, ctx->linktype, ctx->link_offset, &addr)) return 0;
+
+	if (f->family) {
+		if (f->family != addr.family) return 0;
+		alen = addr.family == AF_INET ? 4 : 16;
+		if (memcmp(addr.src, f->ip, alen) && memcmp(addr.dst, f->ip, alen)) return 0;
+	}
+
+	return !f->port || addr.sport == f->port || addr.dport == f->port;
+}
+
+int flight_recorder_dump(flight_recorder_t *fr, pcap_dump_filter_t *filter, uint8_t link_offset,
+		pcap_dump_write_f write, void *arg)
+{
+	flight_filter_ctx_t ctx;
+
+	ctx.filter = filter;
+	ctx.linktype = fr->linktype;
+	ctx.link_offset = link_offset;
+
+	return flight_recorder_scan(fr, 0, flight_match_filter, &ctx, write, arg);
+}
+
+int flight_recorder_scan(flight_recorder_t *fr, uint64_t from, flight_match_f match, void *match_arg,
+		pcap_dump_write_f write, void *arg)
+{
+	flight_pcap_hdr_t fh;
+	flight_pcap_rec_t ph;
+	flight_record_t rec;
+	unsigned char *frame;
+	uint64_t pos, end, off, tail;
+	int count = 0, ok;
+
+	if ((frame = malloc(FLIGHT_MAX_FRAME)) == NULL) return -1;
+
+	fh.magic = 0xa1b2c3d4;
+	fh.version_major = 2;
+	fh.version_minor = 4;
+	fh.thiszone = 0;
+	fh.sigfigs = 0;
+	fh.snaplen = fr->snaplen;
+	fh.linktype = fr->linktype;
+
+	if (write(arg, &fh, sizeof(fh))) goto error;
+
+	/* frames captured after this point are not part of the dump */
+	end = __atomic_load_n(&fr->head, __ATOMIC_ACQUIRE);
+	pos = __atomic_load_n(&fr->tail, __ATOMIC_ACQUIRE);
+	if (pos < from) pos = from;
+
+	while (pos < end) {
+
+		pos = flight_skip(fr, pos);
+		if (pos >= end) break;
+
+		off = pos & (fr->size - 1);
+		memcpy(&rec, fr->buf + off, sizeof(rec));
+		ok = rec.size >= sizeof(rec) && rec.size <= fr->size - off && rec.caplen <= rec.size - sizeof(rec);
+		if (ok && rec.caplen) memcpy(frame, fr->buf + off + sizeof(rec), rec.caplen);
+
+		/* the copy is only good if the writer did not start to overwrite it */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&fr->tail, __ATOMIC_RELAXED);
+		if (tail > pos) {
+			pos = tail;
+			continue;
+		}
+		if (!ok) break;
+
+		pos += rec.size;
+
+		if (!rec.caplen || !match(match_arg, &rec, frame)) continue;
+
+		ph.ts_sec = rec.ts_sec;
+		ph.ts_usec = rec.ts_usec;
+		ph.caplen = rec.caplen;
+		ph.len = rec.len;
+
+		if (write(arg, &ph, sizeof(ph)) || write(arg, frame, rec.caplen)) goto error;
+		count++;
+	}
+
+	free(frame);
+	return count;
+
+error:
+	free(frame);
+	return -1;
+}
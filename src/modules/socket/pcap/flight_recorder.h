@@ -0,0 +1,101 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  In-memory flight recorder of raw frames for socket_pcap
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _FLIGHT_RECORDER_H_
+#define _FLIGHT_RECORDER_H_
+
+#include <stdint.h>
+#include <pcap.h>
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+
+/*
+ * Byte ring of the most recent frames of one capture profile. Only the
+ * capture thread writes; any other thread may dump at the same time without
+ * a lock. The writer moves tail past the records it is about to overwrite
+ * before it touches them, a reader copies a record and then checks that
+ * tail did not pass it (seqlock style), so capture never waits for a dump.
+ */
+
+#define FLIGHT_ALIGN 8
+#define FLIGHT_MIN_SIZE (1024 * 1024)
+#define FLIGHT_MAX_FRAME 65535
+
+typedef struct flight_record {
+	uint32_t size;		/* whole record, aligned to FLIGHT_ALIGN */
+	uint32_t caplen;	/* 0: padding up to the end of the buffer */
+	uint32_t len;
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t reserved;
+} flight_record_t;
+
+typedef struct flight_recorder {
+	unsigned char *buf;
+	uint64_t size;		/* power of two */
+	uint64_t head;		/* byte position of the next record */
+	uint64_t tail;		/* byte position of the oldest intact record */
+	uint64_t records;
+	uint64_t overwritten;
+	int hugepages;		/* buf is a MAP_HUGETLB mapping */
+	int linktype;
+	uint32_t snaplen;
+} flight_recorder_t;
+
+/* addresses of a frame, ports are 0 if it has none */
+typedef struct flight_addr {
+	int family;
+	uint8_t src[16];
+	uint8_t dst[16];
+	uint8_t proto;
+	uint16_t sport;
+	uint16_t dport;
+} flight_addr_t;
+
+/* 1: the frame goes into the dump */
+typedef int (*flight_match_f)(void *arg, flight_record_t *rec, const unsigned char *frame);
+
+/* size is rounded up to a power of two, hugepages falls back to normal pages */
+flight_recorder_t *flight_recorder_new(uint64_t size, int hugepages, int linktype, uint32_t snaplen);
+void flight_recorder_free(flight_recorder_t *fr);
+
+/* capture thread only, returns the position of the record */
+uint64_t flight_recorder_add(flight_recorder_t *fr, const struct pcap_pkthdr *hdr, const unsigned char *packet);
+
+/* 0 if the frame is not IPv4/IPv6 behind link_offset (or the VLAN tags of ethernet) */
+int flight_frame_addr(const unsigned char *p, uint32_t caplen, int linktype, uint8_t link_offset, flight_addr_t *addr);
+
+/* writes a pcap file of the frames from position from on that match() accepts.
+ * Returns the number of frames written, -1 if write() failed */
+int flight_recorder_scan(flight_recorder_t *fr, uint64_t from, flight_match_f match, void *match_arg,
+		pcap_dump_write_f write, void *arg);
+
+/* flight_recorder_scan() with a pcap_dump_filter_t, link_offset as used by the capture */
+int flight_recorder_dump(flight_recorder_t *fr, pcap_dump_filter_t *filter, uint8_t link_offset,
+		pcap_dump_write_f write, void *arg);
+
+#endif /* _FLIGHT_RECORDER_H_ */
@@ -25,6 +25,22 @@
 
 #define REASM_IP_HASH_SIZE 1021U
 
+/* objects per slab of a pool, slabs are kept until reasm_ip_free() */
+#define REASM_SLAB_OBJECTS 64U
+
+/* pooled fragment, descriptor and data. Bigger fragments take several */
+#define REASM_FRAG_SIZE 2048U
+#define REASM_FRAG_DATA ((REASM_FRAG_SIZE - sizeof (struct reasm_frag_entry)) & ~7U)
+
+/* IPv6 unfragmentable part with extension headers, IPv4 header with options */
+#define REASM_HDR_MAX 256U
+#define REASM_PAYLOAD_MAX 65536U
+
+/* parse_packet() result, len == 0 for a packet that is no fragment */
+#define REASM_OK 0
+#define REASM_BAD 1
+#define REASM_OVERLAP 2
+
 
 enum entry_state {
 	STATE_ACTIVE,
@@ -69,11 +85,37 @@ union reasm_id {
 struct reasm_frag_entry {
 	unsigned len;  /* payload length of this fragment */
 	unsigned offset; /* offset of this fragment into the payload of the reassembled packet */
-	unsigned data_offset; /* offset to the data pointer where payload starts */
-	unsigned char *data; /* payload starts at data + data_offset */
+	const unsigned char *data; /* the payload, in the input packet until it is kept */
 	struct reasm_frag_entry *next;
 };
 
+/* pooled data of a fragment follows its descriptor */
+#define FRAG_STORE(frag) ((unsigned char *) ((frag) + 1))
+
+
+/*
+ * Where a fragment is found in its packet.
+ */
+struct reasm_frag_info {
+	unsigned len, offset, data_offset;
+	unsigned hdr_len;       /* part repeated in every fragment, without the IPv6 fragment header */
+	unsigned last_nxt;      /* IPv6: Next Header that pointed to the fragment header */
+	uint8_t nxt;            /* IPv6: Next Header of the fragment header */
+	bool last_frag;
+};
+
+
+/*
+ * Fixed size objects carved from malloc'd slabs, a free list links the
+ * unused ones through their first word.
+ */
+struct reasm_pool {
+	size_t size;
+	void *free;
+	void *slabs;
+	unsigned used;
+};
+
 
 /*
  * Reception of a complete packet is detected by counting the number
@@ -88,9 +130,11 @@ struct reasm_ip_entry {
 	reasm_time_t timeout;
 	enum entry_state state;
 	enum reasm_proto protocol;
-	struct reasm_frag_entry *frags;
+	struct reasm_frag_entry head, *frags;
 	struct reasm_ip_entry *prev, *next;
 	struct reasm_ip_entry *time_prev, *time_next;
+	unsigned hdr_len, hdr_offset;   /* hdr_offset: fragment offset hdr was taken from */
+	unsigned char hdr[REASM_HDR_MAX];
 };
 
 
@@ -105,8 +149,11 @@ struct reasm_ip_entry {
 struct reasm_ip {
 	struct reasm_ip_entry *table[REASM_IP_HASH_SIZE];
 	struct reasm_ip_entry *time_first, *time_last;
-	unsigned waiting, max_waiting, timed_out, dropped_frags;
+	unsigned waiting, max_waiting, timed_out, dropped_frags, overlaps;
 	reasm_time_t timeout;
+	struct reasm_pool entries, frags;
+	size_t memory, memory_max;
+	unsigned char *out;     /* the last reassembled packet */
 };
 
 
@@ -123,7 +170,7 @@ static unsigned reasm_ipv6_hash (const struct reasm_id_ipv6 *id);
  * Check for fragment overlap and other error conditions. Update the
  * "hole count".
  */
-static bool add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool last_frag);
+static int add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool last_frag);
 
 /*
  * Is the entry complete, ready for reassembly?
@@ -133,13 +180,13 @@ static bool is_complete (struct reasm_ip_entry *entry);
 /*
  * Create the reassembled packet.
  */
-static unsigned char *assemble (struct reasm_ip_entry *entry, unsigned *output_len);
+static unsigned char *assemble (struct reasm_ip *reasm, struct reasm_ip_entry *entry, unsigned *output_len);
 
 /*
  * Drop and free entries.
  */
 static void drop_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry);
-static void free_entry (struct reasm_ip_entry *entry);
+static void free_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry);
 
 /*
  * Dispose of any entries which have expired before "now".
@@ -147,12 +194,12 @@ static void free_entry (struct reasm_ip_entry *entry);
 static void process_timeouts (struct reasm_ip *reasm, reasm_time_t now);
 
 /*
- * Create fragment structure from IPv6 packet. Returns NULL if the input
+ * Find the fragment in an IPv6 packet. Returns false if the input
  * is not a fragment.
  * This function is called by parse_packet(), don't call it directly.
  */
 #if USE_IPv6
-static struct reasm_frag_entry *frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag);
+static bool frag_from_ipv6 (const unsigned char *packet, uint32_t *ip_id, struct reasm_frag_info *info);
 #endif /* USE_IPv6 */
 
 /*
@@ -161,10 +208,85 @@ static struct reasm_frag_entry *frag_from_ipv6 (unsigned char *packet, uint32_t
 static bool reasm_id_equal (enum reasm_proto proto, const union reasm_id *left, const union reasm_id *right);
 
 /*
- * Create fragment structure from an IPv4 or IPv6 packet. Returns NULL
+ * Find the fragment in an IPv4 or IPv6 packet. Returns false
  * if the input is not a fragment.
  */
-static struct reasm_frag_entry *parse_packet (unsigned char *packet, unsigned len, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash, bool *last_frag);
+static bool parse_packet (const unsigned char *packet, unsigned len, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash, struct reasm_frag_info *info);
+
+
+static void *
+pool_get (struct reasm_ip *reasm, struct reasm_pool *pool)
+{
+	const size_t hdr = sizeof (max_align_t);
+	unsigned char *slab;
+	void *obj;
+	unsigned i;
+
+	if (pool->free == NULL) {
+		if (reasm->memory + hdr + pool->size * REASM_SLAB_OBJECTS > reasm->memory_max)
+			return NULL;
+		if ((slab = malloc (hdr + pool->size * REASM_SLAB_OBJECTS)) == NULL)
+			return NULL;
+
+		*(void **) slab = pool->slabs;
+		pool->slabs = slab;
+		reasm->memory += hdr + pool->size * REASM_SLAB_OBJECTS;
+
+		for (i = 0; i < REASM_SLAB_OBJECTS; i++) {
+			obj = slab + hdr + i * pool->size;
+			*(void **) obj = pool->free;
+			pool->free = obj;
+		}
+	}
+
+	obj = pool->free;
+	pool->free = *(void **) obj;
+	pool->used++;
+
+	return obj;
+}
+
+
+static void
+pool_put (struct reasm_pool *pool, void *obj)
+{
+	*(void **) obj = pool->free;
+	pool->free = obj;
+	pool->used--;
+}
+
+
+static void
+pool_destroy (struct reasm_pool *pool)
+{
+	void *slab, *next;
+
+	for (slab = pool->slabs; slab != NULL; slab = next) {
+		next = *(void **) slab;
+		free (slab);
+	}
+	pool->slabs = pool->free = NULL;
+}
+
+
+/*
+ * Object of a pool, the oldest incomplete packets make room if the memory
+ * cap is reached. keep is never dropped.
+ */
+static void *
+reasm_alloc (struct reasm_ip *reasm, struct reasm_pool *pool, struct reasm_ip_entry *keep)
+{
+	void *obj;
+
+	while ((obj = pool_get (reasm, pool)) == NULL) {
+		if (reasm->time_first == NULL || reasm->time_first == keep)
+			return NULL;
+		reasm->dropped_frags += reasm->time_first->frag_count;
+		drop_entry (reasm, reasm->time_first);
+	}
+
+	return obj;
+}
 
 
 static unsigned
@@ -210,13 +332,14 @@ reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reas
 {
 	enum reasm_proto proto;
 	union reasm_id id;
-	unsigned hash;
-	bool last_frag;
+	struct reasm_frag_info info;
+	struct reasm_frag_entry *frag, empty;
+	unsigned hash, done, n;
+	int ret;
 
 	process_timeouts (reasm, timestamp);
 
-	struct reasm_frag_entry *frag = parse_packet (packet, len, &proto, &id, &hash, &last_frag);
-	if (frag == NULL) {
+	if (!parse_packet (packet, len, &proto, &id, &hash, &info)) {
 		*output_len = len;
 		return packet; /* some packet that we don't recognize as a fragment */
 	}
@@ -227,24 +350,16 @@ reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reas
 		entry = entry->next;
 
 	if (entry == NULL) {
-		entry = malloc (sizeof (*entry));
+		entry = reasm_alloc (reasm, &reasm->entries, NULL);
 		if (entry == NULL) {
-			free (frag);
-			abort ();
-		}
-
-		struct reasm_frag_entry *list_head = malloc (sizeof (*list_head));
-		if (list_head == NULL) {
-			free (frag);
-			free (entry);
-			abort ();
+			reasm->dropped_frags++;
+			return NULL;
 		}
 
 		*entry = (struct reasm_ip_entry) {
 			.id = id,
 			.len = 0,
 			.holes = 1,
-			.frags = list_head,
 			.hash = hash,
 			.protocol = proto,
 			.timeout = timestamp + reasm->timeout,
@@ -253,14 +368,10 @@ reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reas
 			.next = reasm->table[hash],
 			.time_prev = reasm->time_last,
 			.time_next = NULL,
+			.hdr_len = 0,
 		};
-
-		*list_head = (struct reasm_frag_entry) {
-			.len = 0,
-			.offset = 0,
-			.data_offset = 0,
-			.data = NULL,
-		};
+		entry->head = (struct reasm_frag_entry) { .len = 0, .offset = 0, .data = NULL, .next = NULL };
+		entry->frags = &entry->head;
 
 		if (entry->next != NULL)
 			entry->next->prev = entry;
@@ -282,22 +393,85 @@ reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reas
 		return NULL;
 	}
 
-	if (!add_fragment (entry, frag, last_frag)) {
-		entry->state = STATE_INVALID;
-		reasm->dropped_frags += entry->frag_count + 1;
-		return NULL;
+	/* the header of the lowest fragment goes into the packet, it has all IPv4 options */
+	if (entry->hdr_len == 0 || info.offset < entry->hdr_offset) {
+		if (info.hdr_len > REASM_HDR_MAX) {
+			entry->state = STATE_INVALID;
+			reasm->dropped_frags += entry->frag_count + 1;
+			return NULL;
+		}
+		memcpy (entry->hdr, packet, info.hdr_len);
+#if USE_IPv6
+		/*
+		 * The Fragment header will be removed on reassembly, so we have to
+		 * replace the Next Header field of the previous header (which is
+		 * currently IPPROTO_FRAGMENT), with the Next Header field of the
+		 * Fragment header.
+		 */
+		if (proto == PROTO_IPV6)
+			entry->hdr[info.last_nxt] = info.nxt;
+#endif /* USE_IPv6 */
+		entry->hdr_len = info.hdr_len;
+		entry->hdr_offset = info.offset;
 	}
 
-	if (!is_complete (entry))
-		return NULL;
+	/* pooled pieces, the data stays in the packet until we know it has to wait */
+	done = 0;
+	do {
+		n = info.len - done;
+		if (n > REASM_FRAG_DATA)
+			n = REASM_FRAG_DATA;
 
-	unsigned char *r = assemble (entry, output_len);
-	drop_entry (reasm, entry);
-	return r;
+		if (n == 0) {
+			/* a zero size fragment is not inserted */
+			frag = &empty;
+		}
+		else if ((frag = reasm_alloc (reasm, &reasm->frags, entry)) == NULL) {
+			entry->state = STATE_INVALID;
+			reasm->dropped_frags += entry->frag_count + 1;
+			return NULL;
+		}
+
+		*frag = (struct reasm_frag_entry) {
+			.len = n,
+			.offset = info.offset + done,
+			.data = packet + info.data_offset + done,
+		};
+
+		ret = add_fragment (entry, frag, info.last_frag && done + n == info.len);
+		if (ret != REASM_OK) {
+			if (frag != &empty)
+				pool_put (&reasm->frags, frag);
+			entry->state = STATE_INVALID;
+			if (ret == REASM_OVERLAP)
+				reasm->overlaps += entry->frag_count + 1;
+			else
+				reasm->dropped_frags += entry->frag_count + 1;
+			return NULL;
+		}
+
+		done += n;
+	} while (done < info.len);
+
+	if (is_complete (entry)) {
+		unsigned char *r = assemble (reasm, entry, output_len);
+		drop_entry (reasm, entry);
+		return r;
+	}
+
+	/* has to wait, the input is gone after this call */
+	for (frag = entry->frags->next; frag != NULL; frag = frag->next) {
+		if (frag->data != FRAG_STORE (frag)) {
+			memcpy (FRAG_STORE (frag), frag->data, frag->len);
+			frag->data = FRAG_STORE (frag);
+		}
+	}
+
+	return NULL;
 }
 
 
-static bool
+static int
 add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool last_frag)
 {
 	/*
@@ -317,17 +491,20 @@ add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool
 	 * multiple of 8, the packet will never be reassembled completely.
 	 */
 	if (!last_frag && (frag->len & 7) != 0)
-		return false;
+		return REASM_BAD;
 
 	if (entry->len != 0 && frag->len + frag->offset > entry->len)
-		return false; /* fragment extends past end of packet */
+		return REASM_BAD; /* fragment extends past end of packet */
+
+	if (frag->len + frag->offset > REASM_PAYLOAD_MAX)
+		return REASM_BAD;
 
 	bool fit_left = false, fit_right = false;
 
 	if (last_frag) {
 		if (entry->len != 0) {
 			fprintf (stderr, "* ERROR: Multiple final fragments.\n");
-			return false;
+			return REASM_OVERLAP;
 		}
 		entry->len = frag->offset + frag->len;
 		fit_right = true;
@@ -343,15 +520,15 @@ add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool
 
 	/* Overlap checks. */
 	if (cur->offset + cur->len > frag->offset)
-		return false; /* overlaps with cur */
+		return REASM_OVERLAP; /* overlaps with cur */
 	else if (cur->offset + cur->len == frag->offset)
 		fit_left = true;
 
 	if (next != NULL) {
 		if (last_frag)
-			return false; /* next extends past end of packet */
+			return REASM_OVERLAP; /* next extends past end of packet */
 		if (frag->offset + frag->len > next->offset)
-			return false; /* overlaps with next */
+			return REASM_OVERLAP; /* overlaps with next */
 		else if (frag->offset + frag->len == next->offset)
 			fit_right = true;
 	}
@@ -381,7 +558,7 @@ add_fragment (struct reasm_ip_entry *entry, struct reasm_frag_entry *frag, bool
 	}
 
 
-	return true;
+	return REASM_OK;
 }
 
 
@@ -393,6 +570,15 @@ reasm_ip_new (void)
 		return NULL;
 
 	memset (reasm, 0, sizeof (*reasm));
+	reasm->entries.size = (sizeof (struct reasm_ip_entry) + 15) & ~(size_t) 15;
+	reasm->frags.size = REASM_FRAG_SIZE;
+	reasm->memory_max = REASM_MEMORY_MAX;
+
+	if ((reasm->out = malloc (REASM_HDR_MAX + REASM_PAYLOAD_MAX)) == NULL) {
+		free (reasm);
+		return NULL;
+	}
+
 	return reasm;
 }
 
@@ -402,6 +588,9 @@ reasm_ip_free (struct reasm_ip *reasm)
 {
 	while (reasm->time_first != NULL)
 		drop_entry (reasm, reasm->time_first);
+	pool_destroy (&reasm->entries);
+	pool_destroy (&reasm->frags);
+	free (reasm->out);
 	free (reasm);
 }
 
@@ -414,36 +603,20 @@ is_complete (struct reasm_ip_entry *entry)
 
 
 static unsigned char *
-assemble (struct reasm_ip_entry *entry, unsigned *output_len)
+assemble (struct reasm_ip *reasm, struct reasm_ip_entry *entry, unsigned *output_len)
 {
 	struct reasm_frag_entry *frag = entry->frags->next; /* skip list head */
-	unsigned offset0 = frag->data_offset;
-	unsigned char *p = malloc (entry->len + offset0);
-	if (p == NULL)
-		abort ();
-
-	switch (entry->protocol) {
-		case PROTO_IPV4:
-			break;
-
-#if USE_IPv6
-		case PROTO_IPV6:
-			offset0 -= 8; /* size of frag header */
-			break;
-#endif /* USE_IPv6 */
-
-		default:
-			abort ();
-	}
+	unsigned offset0 = entry->hdr_len;
+	unsigned char *p = reasm->out;
 
 	*output_len = entry->len + offset0;
 
-	/* copy the (unfragmentable) header from the first fragment received */
-	memcpy (p, frag->data, offset0);
+	/* copy the (unfragmentable) header of the lowest fragment */
+	memcpy (p, entry->hdr, offset0);
 
 	/* join all the payload fragments together */
 	while (frag != NULL) {
-		memcpy (p + offset0 + frag->offset, frag->data + frag->data_offset, frag->len);
+		memcpy (p + offset0 + frag->offset, frag->data, frag->len);
 		frag = frag->next;
 	}
 
@@ -496,23 +669,21 @@ drop_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry)
 
 	reasm->waiting--;
 
-	free_entry (entry);
+	free_entry (reasm, entry);
 }
 
 
 static void
-free_entry (struct reasm_ip_entry *entry)
+free_entry (struct reasm_ip *reasm, struct reasm_ip_entry *entry)
 {
-	struct reasm_frag_entry *frag = entry->frags, *next;
+	struct reasm_frag_entry *frag = entry->frags->next, *next; /* the head is part of entry */
 	while (frag != NULL) {
 		next = frag->next;
-		if (frag->data != NULL)
-			free (frag->data);
-		free (frag);
+		pool_put (&reasm->frags, frag);
 		frag = next;
 	}
 
-	free (entry);
+	pool_put (&reasm->entries, entry);
 }
 
 
@@ -544,6 +715,13 @@ reasm_ip_dropped_frags (const struct reasm_ip *reasm)
 }
 
 
+unsigned
+reasm_ip_overlaps (const struct reasm_ip *reasm)
+{
+	return reasm->overlaps;
+}
+
+
 bool
 reasm_ip_set_timeout (struct reasm_ip *reasm, reasm_time_t timeout)
 {
@@ -555,6 +733,18 @@ reasm_ip_set_timeout (struct reasm_ip *reasm, reasm_time_t timeout)
 }
 
 
+bool
+reasm_ip_set_memory (struct reasm_ip *reasm, size_t memory_max)
+{
+	if (reasm->time_first != NULL)
+		return false;
+
+	if (memory_max)
+		reasm->memory_max = memory_max;
+	return true;
+}
+
+
 static void
 process_timeouts (struct reasm_ip *reasm, reasm_time_t now)
 {
@@ -566,10 +756,10 @@ process_timeouts (struct reasm_ip *reasm, reasm_time_t now)
 
 
 #if USE_IPv6
-static struct reasm_frag_entry *
-frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
+static bool
+frag_from_ipv6 (const unsigned char *packet, uint32_t *ip_id, struct reasm_frag_info *info)
 {
-	struct ip6_hdr *ip6_header = (struct ip6_hdr *) packet;
+	const struct ip6_hdr *ip6_header = (const struct ip6_hdr *) packet;
 	unsigned offset = 40; /* IPv6 header size */
 	uint8_t nxt = ip6_header->ip6_nxt;
 	unsigned total_len = 40 + ntohs (ip6_header->ip6_plen);
@@ -590,11 +780,11 @@ frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
 	 */
 	while (nxt == IPPROTO_HOPOPTS || nxt == IPPROTO_ROUTING || nxt == IPPROTO_DSTOPTS) {
 		if (offset + 2 > total_len)
-			return NULL;  /* header extends past end of packet */
+			return false;  /* header extends past end of packet */
 
 		unsigned exthdr_len = 8 + 8 * packet[offset + 1];
 		if (offset + exthdr_len > total_len)
-			return NULL;  /* header extends past end of packet */
+			return false;  /* header extends past end of packet */
 
 		nxt = packet[offset];
 		last_nxt = offset;
@@ -602,39 +792,27 @@ frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
 	}
 
 	if (nxt != IPPROTO_FRAGMENT)
-		return NULL;
+		return false;
 
 	if (offset + 8 > total_len)
-		return NULL;  /* Fragment header extends past end of packet */
-
-	struct reasm_frag_entry *frag = malloc (sizeof (*frag));
-	if (frag == NULL)
-		abort ();
+		return false;  /* Fragment header extends past end of packet */
 
-	struct ip6_frag *frag_header = (struct ip6_frag *) (packet + offset);
-	offset += 8;
+	const struct ip6_frag *frag_header = (const struct ip6_frag *) (packet + offset);
 
-	/*
-	 * The Fragment header will be removed on reassembly, so we have to
-	 * replace the Next Header field of the previous header (which is
-	 * currently IPPROTO_FRAGMENT), with the Next Header field of the
-	 * Fragment header.
-	 *
-	 * XXX We really shouldn't manipulate the input packet in-place.
-	 */
-	packet[last_nxt] = frag_header->ip6f_nxt;
-
-	*frag = (struct reasm_frag_entry) {
-		.len = total_len - offset,
-		.data_offset = offset,
+	/* the input is not touched, the Next Header is fixed in the copy of the header */
+	*info = (struct reasm_frag_info) {
+		.len = total_len - offset - 8,
+		.data_offset = offset + 8,
 		.offset = ntohs (frag_header->ip6f_offlg & IP6F_OFF_MASK),
-		.data = packet,
+		.hdr_len = offset,
+		.last_nxt = last_nxt,
+		.nxt = frag_header->ip6f_nxt,
+		.last_frag = (frag_header->ip6f_offlg & IP6F_MORE_FRAG) == 0,
 	};
 
 	*ip_id = ntohl (frag_header->ip6f_ident);
-	*last_frag = (frag_header->ip6f_offlg & IP6F_MORE_FRAG) == 0;
 
-	return frag;
+	return true;
 }
 #endif /* USE_IPv6 */
 
@@ -660,29 +838,26 @@ reasm_id_equal (enum reasm_proto proto, const union reasm_id *left, const union
 }
 
 
-static struct reasm_frag_entry *
-parse_packet (unsigned char *packet, unsigned len, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash, bool *last_frag)
+static bool
+parse_packet (const unsigned char *packet, unsigned len, enum reasm_proto *protocol, union reasm_id *id, unsigned *hash, struct reasm_frag_info *info)
 {
-	struct ip *ip_header = (struct ip *) packet;
-	struct reasm_frag_entry *frag = NULL;
+	const struct ip *ip_header = (const struct ip *) packet;
+	bool frag = false;
 
 	switch (ip_header->ip_v) {
 		case 4: {
 			*protocol = PROTO_IPV4;
 			uint16_t offset = ntohs (ip_header->ip_off);
-			if (len >= ntohs (ip_header->ip_len) && (offset & (IP_MF | IP_OFFMASK)) != 0) {
-				frag = malloc (sizeof (*frag));
-				if (frag == NULL)
-					abort ();
-
-				*frag = (struct reasm_frag_entry) {
+			if (len >= ntohs (ip_header->ip_len) && (offset & (IP_MF | IP_OFFMASK)) != 0
+					&& ntohs (ip_header->ip_len) >= ip_header->ip_hl * 4) {
+				*info = (struct reasm_frag_info) {
 					.len = ntohs (ip_header->ip_len) - ip_header->ip_hl * 4,
 					.offset = (offset & IP_OFFMASK) * 8,
 					.data_offset = ip_header->ip_hl * 4,
-					.data = packet,
+					.hdr_len = ip_header->ip_hl * 4,
+					.last_frag = (offset & IP_MF) == 0,
 				};
-
-				*last_frag = (offset & IP_MF) == 0;
+				frag = true;
 
 				memcpy (id->ipv4.ip_src, &ip_header->ip_src, 4);
 				memcpy (id->ipv4.ip_dst, &ip_header->ip_dst, 4);
@@ -696,11 +871,11 @@ parse_packet (unsigned char *packet, unsigned len, enum reasm_proto *protocol, u
 
 #if USE_IPv6
 		case 6: {
-			struct ip6_hdr *ip6_header = (struct ip6_hdr *) packet;
+			const struct ip6_hdr *ip6_header = (const struct ip6_hdr *) packet;
 			*protocol = PROTO_IPV6;
 			if (len >= ntohs (ip6_header->ip6_plen) + 40)
-				frag = frag_from_ipv6 (packet, &id->ipv6.ip_id, last_frag);
-			if (frag != NULL) {
+				frag = frag_from_ipv6 (packet, &id->ipv6.ip_id, info);
+			if (frag) {
 				memcpy (id->ipv6.ip_src, &ip6_header->ip6_src, 16);
 				memcpy (id->ipv6.ip_dst, &ip6_header->ip6_dst, 16);
 				*hash = reasm_ipv6_hash (&id->ipv6);
@@ -2,6 +2,8 @@
 #define _IPREASM_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <pcap.h>
 
@@ -16,6 +18,9 @@ typedef uint64_t reasm_time_t;
 
 struct reasm_ip;
 
+/* fragments and datagrams waiting for them, all together */
+#define REASM_MEMORY_MAX (32 * 1024 * 1024)
+
 /*
  * Functions to create and destroy the reassembly environment.
  */
@@ -30,12 +35,10 @@ void reasm_ip_free (struct reasm_ip *reasm);
  * If more fragments are required for reassembly, or the input packet
  * is invalid for some reason, a NULL pointer is returned.
  *
- * The input must be a pointer allocated by malloc(). The output will
- * be a pointer allocated by malloc().
- *
- * Note that in the case of an IPv6 fragment, the input buffer will be
- * modified in-place. This is considered a bug and should be fixed in
- * the future.
+ * The input is only read during the call, it may be the capture buffer.
+ * Fragments that have to wait are copied into pooled memory. The output
+ * is the input itself or a buffer of the reassembly environment that is
+ * valid until the next call, neither has to be freed.
  */
 unsigned char *reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, unsigned len, reasm_time_t timestamp, unsigned *output_len);
 
@@ -45,6 +48,12 @@ unsigned char *reasm_ip_next (struct reasm_ip *reasm, unsigned char *packet, uns
  */
 bool reasm_ip_set_timeout (struct reasm_ip *reasm, reasm_time_t timeout);
 
+/*
+ * Cap on the pooled memory, 0 keeps the default. The oldest incomplete
+ * packets are dropped when it is reached.
+ */
+bool reasm_ip_set_memory (struct reasm_ip *reasm, size_t memory_max);
+
 /*
  * Query certain information about the current state.
  */
@@ -52,6 +61,8 @@ unsigned reasm_ip_waiting (const struct reasm_ip *reasm);
 unsigned reasm_ip_max_waiting (const struct reasm_ip *reasm);
 unsigned reasm_ip_timed_out (const struct reasm_ip *reasm);
 unsigned reasm_ip_dropped_frags (const struct reasm_ip *reasm);
+/* fragments overlapping others, not in dropped_frags */
+unsigned reasm_ip_overlaps (const struct reasm_ip *reasm);
 
 
 #endif /* _IPREASM_H */
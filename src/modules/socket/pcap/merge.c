@@ -0,0 +1,286 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Capture timestamp ordered merge of several profiles
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <captagent/log.h>
+#include <captagent/capture.h>
+#include "merge.h"
+
+static uint64_t mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+merge_t *merge_new(uint64_t window, merge_emit_f emit)
+{
+	merge_t *m;
+
+	if ((m = calloc(1, sizeof(merge_t))) == NULL) return NULL;
+
+	m->window = window ? window : MERGE_WINDOW;
+	m->emit = emit;
+
+	return m;
+}
+
+int merge_add_source(merge_t *m, unsigned int src, uint64_t ring_size)
+{
+	merge_ring_t *r = &m->rings[src];
+	uint64_t size = MERGE_MIN_RING;
+
+	if (src >= MERGE_SOURCES || r->active) return -1;
+
+	while (size < ring_size) size <<= 1;
+
+	if ((r->buf = malloc(size)) == NULL) return -1;
+
+	r->size = size;
+	r->head = r->tail = 0;
+	r->active = 1;
+	m->sources++;
+
+	return 0;
+}
+
+int merge_push(merge_t *m, unsigned int src, const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+	merge_ring_t *r = &m->rings[src];
+	merge_record_t *rec;
+	uint64_t tail, pos, pad, size;
+	int64_t depth;
+
+	size = (sizeof(merge_record_t) + hdr->caplen + MERGE_ALIGN - 1) & ~(uint64_t) (MERGE_ALIGN - 1);
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	pos = r->head & (r->size - 1);
+
+	/* a record never wraps, the rest of the ring is padding then */
+	pad = pos + size > r->size ? r->size - pos : 0;
+
+	if (r->head + pad + size - tail > r->size) {
+		__atomic_add_fetch(&r->full, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (pad) {
+		rec = (merge_record_t *) (r->buf + pos);
+		rec->size = pad;
+		rec->caplen = 0;
+		pos = 0;
+	}
+
+	rec = (merge_record_t *) (r->buf + pos);
+	rec->size = size;
+	rec->caplen = hdr->caplen;
+	rec->len = hdr->len;
+	rec->ts = (uint64_t) hdr->ts.tv_sec * 1000000 + hdr->ts.tv_usec;
+	rec->arrival = mono_us();
+	memcpy(rec + 1, packet, hdr->caplen);
+
+	__atomic_store_n(&r->head, r->head + pad + size, __ATOMIC_RELEASE);
+
+	depth = __atomic_add_fetch(&m->depth, 1, __ATOMIC_RELAXED);
+	if (depth > __atomic_load_n(&m->max_depth, __ATOMIC_RELAXED))
+		__atomic_store_n(&m->max_depth, depth, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/* the oldest record of a ring, NULL if it is empty. Skips the padding */
+static merge_record_t *ring_peek(merge_ring_t *r)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	merge_record_t *rec;
+
+	while (r->tail != head) {
+		rec = (merge_record_t *) (r->buf + (r->tail & (r->size - 1)));
+		if (rec->caplen) return rec;
+		__atomic_store_n(&r->tail, r->tail + rec->size, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static uint64_t heap_key(merge_t *m, unsigned int i)
+{
+	return ring_peek(&m->rings[m->heap[i]])->ts;
+}
+
+static void heap_swap(merge_t *m, unsigned int a, unsigned int b)
+{
+	unsigned int tmp = m->heap[a];
+
+	m->heap[a] = m->heap[b];
+	m->heap[b] = tmp;
+}
+
+static void heap_up(merge_t *m, unsigned int i)
+{
+	while (i > 0 && heap_key(m, (i - 1) / 2) > heap_key(m, i)) {
+		heap_swap(m, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(merge_t *m, unsigned int i)
+{
+	unsigned int min, l, r;
+
+	for (;;) {
+		min = i;
+		l = 2 * i + 1;
+		r = l + 1;
+		if (l < m->heap_len && heap_key(m, l) < heap_key(m, min)) min = l;
+		if (r < m->heap_len && heap_key(m, r) < heap_key(m, min)) min = r;
+		if (min == i) break;
+		heap_swap(m, i, min);
+		i = min;
+	}
+}
+
+static void heap_add_waiting(merge_t *m)
+{
+	unsigned int src;
+
+	for (src = 0; src < MERGE_SOURCES; src++) {
+		if (!m->rings[src].active || m->in_heap[src] || !ring_peek(&m->rings[src])) continue;
+		m->in_heap[src] = 1;
+		m->heap[m->heap_len++] = src;
+		heap_up(m, m->heap_len - 1);
+	}
+}
+
+/* pass on the oldest frame, 0 if it has to wait for other sources */
+static int merge_next(merge_t *m, int drain)
+{
+	struct pcap_pkthdr hdr;
+	merge_ring_t *r;
+	merge_record_t *rec;
+	unsigned int src;
+	uint64_t now;
+
+	if (!m->heap_len) return 0;
+
+	src = m->heap[0];
+	r = &m->rings[src];
+	rec = ring_peek(r);
+
+	/* a source without a frame may still send an older one */
+	if (m->heap_len < m->sources && !drain) {
+		now = mono_us();
+		if (rec->arrival + m->window > now) return 0;
+	}
+
+	if (rec->ts < m->last_ts) __atomic_add_fetch(&m->late, 1, __ATOMIC_RELAXED);
+	else m->last_ts = rec->ts;
+
+	hdr.ts.tv_sec = rec->ts / 1000000;
+	hdr.ts.tv_usec = rec->ts % 1000000;
+	hdr.caplen = rec->caplen;
+	hdr.len = rec->len;
+
+	m->emit(src, &hdr, (u_char *) (rec + 1));
+
+	__atomic_store_n(&r->tail, r->tail + rec->size, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&m->depth, 1, __ATOMIC_RELAXED);
+
+	if (ring_peek(r)) {
+		heap_down(m, 0);
+	}
+	else {
+		m->in_heap[src] = 0;
+		m->heap[0] = m->heap[--m->heap_len];
+		if (m->heap_len) heap_down(m, 0);
+	}
+
+	return 1;
+}
+
+static void *merge_thread(void *arg)
+{
+	merge_t *m = arg;
+	struct timespec idle = { 0, MERGE_IDLE_US * 1000 };
+	int stopping, n;
+
+	for (;;) {
+		capture_batch_begin();
+		for (n = 0; n < MERGE_BATCH; n++) {
+			stopping = __atomic_load_n(&m->stopping, __ATOMIC_ACQUIRE);
+
+			heap_add_waiting(m);
+
+			if (!merge_next(m, stopping)) break;
+		}
+		capture_batch_end();
+
+		if (n) continue;
+
+		if (stopping && !m->heap_len) break;
+
+		nanosleep(&idle, NULL);
+	}
+
+	return NULL;
+}
+
+int merge_start(merge_t *m)
+{
+	if (pthread_create(&m->thread, NULL, merge_thread, m)) {
+		LERR("couldn't start the merge thread");
+		return -1;
+	}
+	m->running = 1;
+
+	return 0;
+}
+
+void merge_stop(merge_t *m)
+{
+	if (!m->running) return;
+
+	__atomic_store_n(&m->stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(m->thread, NULL);
+	m->running = 0;
+}
+
+void merge_free(merge_t *m)
+{
+	unsigned int i;
+
+	if (!m) return;
+
+	merge_stop(m);
+
+	for (i = 0; i < MERGE_SOURCES; i++) free(m->rings[i].buf);
+	free(m);
+}
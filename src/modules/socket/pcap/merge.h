@@ -0,0 +1,105 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Capture timestamp ordered merge of several profiles
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _MERGE_H_
+#define _MERGE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <pcap.h>
+
+#include <captagent/api.h>
+
+/*
+ * Frames of several capture threads handed to one merge thread in the order
+ * of their capture timestamps. Every source has its own single producer,
+ * single consumer byte ring, so capture threads never lock. The merge
+ * thread keeps the sources with a waiting frame in a heap keyed by the
+ * timestamp of that frame and passes on the oldest one once every source
+ * has a frame waiting, or once it has waited the reorder window.
+ */
+
+/* one per socket_pcap profile, MAX_SOCKETS */
+#define MERGE_SOURCES 10
+#define MERGE_ALIGN 8
+#define MERGE_MIN_RING (64 * 1024)
+/* microseconds a frame may wait for older frames of other sources */
+#define MERGE_WINDOW 2000
+#define MERGE_IDLE_US 100
+/* frames emitted in one capture batch */
+#define MERGE_BATCH 64
+
+typedef struct merge_record {
+	uint32_t size;		/* whole record, aligned to MERGE_ALIGN */
+	uint32_t caplen;	/* 0: padding up to the end of the ring */
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t ts;		/* capture time, us */
+	uint64_t arrival;	/* monotonic, us */
+} merge_record_t;
+
+typedef struct merge_ring {
+	unsigned char *buf;
+	uint64_t size;		/* power of two */
+	uint64_t head;		/* written by the capture thread */
+	uint64_t tail;		/* written by the merge thread */
+	int active;
+	uint64_t full;		/* frames that did not fit */
+} merge_ring_t;
+
+/* called in the merge thread, packet is only valid during the call */
+typedef void (*merge_emit_f)(unsigned int src, struct pcap_pkthdr *hdr, u_char *packet);
+
+typedef struct merge {
+	merge_ring_t rings[MERGE_SOURCES];
+	unsigned int heap[MERGE_SOURCES];
+	unsigned int heap_len;
+	unsigned int in_heap[MERGE_SOURCES];
+	unsigned int sources;
+	uint64_t window;
+	merge_emit_f emit;
+	pthread_t thread;
+	int running;
+	int stopping;
+	uint64_t last_ts;
+	/* statistics, read by any thread */
+	int64_t depth;		/* frames waiting in all rings */
+	int64_t max_depth;
+	uint64_t late;		/* frames older than one already passed on */
+} merge_t;
+
+merge_t *merge_new(uint64_t window, merge_emit_f emit);
+/* ring_size in bytes, rounded up to a power of two. Before merge_start() */
+int merge_add_source(merge_t *m, unsigned int src, uint64_t ring_size);
+int merge_start(merge_t *m);
+/* after the capture threads are gone: passes on what is left and joins */
+void merge_stop(merge_t *m);
+void merge_free(merge_t *m);
+
+/* capture thread of src. -1 if the ring is full and the frame is dropped */
+int merge_push(merge_t *m, unsigned int src, const struct pcap_pkthdr *hdr, const u_char *packet);
+
+#endif /* _MERGE_H_ */
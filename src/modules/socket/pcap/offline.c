@@ -0,0 +1,541 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Parallel ingestion of pcap files
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <captagent/log.h>
+#include <captagent/capture.h>
+#include "offline.h"
+
+static uint64_t mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+int offline_is_batch(const char *pattern)
+{
+	struct stat st;
+
+	if (strpbrk(pattern, "*?[")) return 1;
+
+	return stat(pattern, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+int offline_expand(const char *pattern, char ***files)
+{
+	struct stat st;
+	struct dirent *de;
+	glob_t gl;
+	DIR *dir;
+	char **list = NULL, **tmp, path[4096];
+	unsigned int count = 0, size = 0, i;
+
+	*files = NULL;
+
+	if (stat(pattern, &st) == 0 && S_ISDIR(st.st_mode)) {
+
+		if ((dir = opendir(pattern)) == NULL) {
+			LERR("couldn't open directory %s", pattern);
+			return -1;
+		}
+
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_name[0] == '.') continue;
+			snprintf(path, sizeof(path), "%s/%s", pattern, de->d_name);
+			if (stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+
+			if (count == size) {
+				size = size ? size * 2 : 64;
+				if ((tmp = realloc(list, size * sizeof(char *))) == NULL) break;
+				list = tmp;
+			}
+			if ((list[count] = strdup(path)) == NULL) break;
+			count++;
+		}
+		closedir(dir);
+
+		if (count) qsort(list, count, sizeof(char *), name_cmp);
+	}
+	else {
+		if (glob(pattern, 0, NULL, &gl)) return 0;
+
+		if ((list = calloc(gl.gl_pathc, sizeof(char *))) != NULL) {
+			for (i = 0; i < gl.gl_pathc; i++) {
+				if (stat(gl.gl_pathv[i], &st) || !S_ISREG(st.st_mode)) continue;
+				if ((list[count] = strdup(gl.gl_pathv[i])) == NULL) break;
+				count++;
+			}
+		}
+		globfree(&gl);
+	}
+
+	*files = list;
+
+	return count;
+}
+
+/* worker of the frame, by its IP address pair in either direction */
+static unsigned int frame_shard(offline_t *off, const u_char *packet, uint32_t caplen)
+{
+	const u_char *ip, *a, *b;
+	unsigned int off_ip = off->link_offset, alen, i;
+	uint32_t h = 2166136261U;
+
+	/* the same vlan/mpls skip as the decoder, ethernet only */
+	if (off->datalink == DLT_EN10MB && caplen >= 18 && packet[12] == 0x81 && packet[13] == 0x00)
+		off_ip += (packet[16] == 0x88 && packet[17] == 0x47) ? 8 : 4;
+
+	if (caplen < off_ip + 20) return 0;
+	ip = packet + off_ip;
+
+	switch (ip[0] >> 4) {
+	case 4:
+		a = ip + 12;
+		b = ip + 16;
+		alen = 4;
+		break;
+	case 6:
+		if (caplen < off_ip + 40) return 0;
+		a = ip + 8;
+		b = ip + 24;
+		alen = 16;
+		break;
+	default:
+		return 0;
+	}
+
+	/* the lower address first, so both directions hash the same */
+	if (memcmp(a, b, alen) > 0) {
+		ip = a;
+		a = b;
+		b = ip;
+	}
+
+	for (i = 0; i < alen; i++) h = (h ^ a[i]) * 16777619U;
+	for (i = 0; i < alen; i++) h = (h ^ b[i]) * 16777619U;
+
+	return h % off->workers;
+}
+
+static offline_batch_t *batch_get(offline_t *off)
+{
+	offline_batch_t *b;
+
+	pthread_mutex_lock(&off->lock);
+	if ((b = off->free) != NULL) off->free = b->next;
+	pthread_mutex_unlock(&off->lock);
+
+	if (!b && (b = malloc(sizeof(offline_batch_t))) == NULL) return NULL;
+
+	b->next = NULL;
+	b->used = 0;
+	b->frames = 0;
+
+	return b;
+}
+
+/*
+ * Waits for the turn of file seq and while the worker has OFFLINE_QUEUE
+ * batches, unless stopping. A reader ahead of the others reads into its own
+ * batches only, so the workers see the frames in file order.
+ */
+static void batch_send(offline_t *off, unsigned int seq, unsigned int idx, offline_batch_t *b)
+{
+	offline_worker_t *w = &off->w[idx];
+
+	pthread_mutex_lock(&off->lock);
+
+	while ((off->turn != seq || w->queued >= OFFLINE_QUEUE) && !off->stopping) pthread_cond_wait(&off->cond, &off->lock);
+
+	if (w->tail) w->tail->next = b;
+	else w->head = b;
+	w->tail = b;
+	w->queued++;
+
+	pthread_cond_broadcast(&off->cond);
+	pthread_mutex_unlock(&off->lock);
+}
+
+static void batch_flush(offline_t *off, unsigned int seq, offline_batch_t **batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < off->workers; i++) {
+		if (batch[i] && batch[i]->frames) {
+			batch_send(off, seq, i, batch[i]);
+			batch[i] = NULL;
+		}
+	}
+}
+
+static void file_turn_wait(offline_t *off, unsigned int seq)
+{
+	pthread_mutex_lock(&off->lock);
+	while (off->turn != seq && !off->stopping) pthread_cond_wait(&off->cond, &off->lock);
+	pthread_mutex_unlock(&off->lock);
+}
+
+/* file seq is done or failed, the next one may send */
+static void file_turn_end(offline_t *off, unsigned int seq)
+{
+	pthread_mutex_lock(&off->lock);
+	while (off->turn != seq && !off->stopping) pthread_cond_wait(&off->cond, &off->lock);
+	off->turn++;
+	pthread_cond_broadcast(&off->cond);
+	pthread_mutex_unlock(&off->lock);
+}
+
+static int read_file(offline_t *off, unsigned int seq, offline_batch_t **batch)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct bpf_program prog;
+	struct pcap_pkthdr *hdr;
+	const u_char *data;
+	offline_record_t *rec;
+	offline_batch_t *b;
+	uint64_t ts, due, now;
+	uint32_t size;
+	unsigned int idx;
+	struct timespec wait;
+	const char *file = off->files[seq];
+	pcap_t *p;
+	int ret;
+
+	if ((p = pcap_open_offline(file, errbuf)) == NULL) {
+		LERR("couldn't open %s: %s", file, errbuf);
+		return -1;
+	}
+
+	/* one link offset for the whole set */
+	if (pcap_datalink(p) != off->datalink) {
+		LERR("skipping %s, link type %d is not the one of the first file (%d)", file, pcap_datalink(p), off->datalink);
+		pcap_close(p);
+		return -1;
+	}
+
+	if (off->filter && *off->filter) {
+		if (pcap_compile(p, &prog, off->filter, 1, 0) == -1 || pcap_setfilter(p, &prog)) {
+			LERR("couldn't set filter on %s: %s", file, pcap_geterr(p));
+			pcap_close(p);
+			return -1;
+		}
+		pcap_freecode(&prog);
+	}
+
+	LDEBUG("reading %s", file);
+
+	/* a paced file has nothing to read ahead, and the clock is the set's */
+	if (off->speed > 0) file_turn_wait(off, seq);
+
+	while (!__atomic_load_n(&off->stopping, __ATOMIC_ACQUIRE) && (ret = pcap_next_ex(p, &hdr, &data)) >= 0) {
+
+		if (ret == 0) continue;
+
+		if (off->speed > 0) {
+			ts = (uint64_t) hdr->ts.tv_sec * 1000000 + hdr->ts.tv_usec;
+			now = mono_us();
+			if (!off->replay_t0) {
+				off->replay_ts0 = ts;
+				off->replay_t0 = now;
+			}
+
+			due = off->replay_t0 + (uint64_t) ((ts > off->replay_ts0 ? ts - off->replay_ts0 : 0) / off->speed);
+			if (due > now + 1000) {
+				/* what was read so far is due now */
+				batch_flush(off, seq, batch);
+				wait.tv_sec = (due - now) / 1000000;
+				wait.tv_nsec = ((due - now) % 1000000) * 1000;
+				nanosleep(&wait, NULL);
+			}
+		}
+
+		idx = frame_shard(off, data, hdr->caplen);
+		size = (sizeof(offline_record_t) + hdr->caplen + OFFLINE_ALIGN - 1) & ~(OFFLINE_ALIGN - 1);
+		if (size > OFFLINE_BATCH) continue;
+
+		if (batch[idx] && batch[idx]->used + size > OFFLINE_BATCH) {
+			batch_send(off, seq, idx, batch[idx]);
+			batch[idx] = NULL;
+		}
+		if (!batch[idx] && (batch[idx] = batch_get(off)) == NULL) {
+			LERR("no memory for a batch, stopped reading %s", file);
+			break;
+		}
+
+		b = batch[idx];
+		rec = (offline_record_t *) (b->data + b->used);
+		rec->size = size;
+		rec->caplen = hdr->caplen;
+		rec->len = hdr->len;
+		rec->ts_sec = hdr->ts.tv_sec;
+		rec->ts_usec = hdr->ts.tv_usec;
+		memcpy(rec + 1, data, hdr->caplen);
+		b->used += size;
+		b->frames++;
+	}
+
+	pcap_close(p);
+
+	/* the next file may come from the same conversations */
+	batch_flush(off, seq, batch);
+
+	return 0;
+}
+
+static void *reader_thread(void *arg)
+{
+	offline_t *off = arg;
+	offline_batch_t *batch[OFFLINE_MAX_WORKERS] = { NULL };
+	unsigned int i;
+
+	while (!__atomic_load_n(&off->stopping, __ATOMIC_ACQUIRE)
+			&& (i = __atomic_fetch_add(&off->next_file, 1, __ATOMIC_RELAXED)) < off->files_count) {
+		if (read_file(off, i, batch)) __atomic_add_fetch(&off->files_failed, 1, __ATOMIC_RELAXED);
+		else __atomic_add_fetch(&off->files_done, 1, __ATOMIC_RELAXED);
+		file_turn_end(off, i);
+	}
+
+	for (i = 0; i < off->workers; i++) free(batch[i]);
+
+	pthread_mutex_lock(&off->lock);
+	off->readers_left--;
+	pthread_cond_broadcast(&off->cond);
+	pthread_mutex_unlock(&off->lock);
+
+	return NULL;
+}
+
+static void *worker_thread(void *arg)
+{
+	offline_worker_t *w = arg;
+	offline_t *off = w->off;
+	offline_batch_t *b;
+	offline_record_t *rec;
+	struct pcap_pkthdr hdr;
+	uint32_t pos;
+	double secs;
+
+	if (off->thread_f) off->thread_f(1, off->arg);
+
+	pthread_mutex_lock(&off->lock);
+
+	for (;;) {
+		while (!w->head && off->readers_left) pthread_cond_wait(&off->cond, &off->lock);
+		if ((b = w->head) == NULL) break;
+
+		if ((w->head = b->next) == NULL) w->tail = NULL;
+		w->queued--;
+		pthread_cond_broadcast(&off->cond);
+		pthread_mutex_unlock(&off->lock);
+
+		capture_batch_begin();
+		for (pos = 0; pos < b->used; pos += rec->size) {
+			rec = (offline_record_t *) (b->data + pos);
+			hdr.ts.tv_sec = rec->ts_sec;
+			hdr.ts.tv_usec = rec->ts_usec;
+			hdr.caplen = rec->caplen;
+			hdr.len = rec->len;
+			off->frame_f(&hdr, (u_char *) (rec + 1), off->arg);
+		}
+		capture_batch_end();
+		__atomic_add_fetch(&off->packets, b->frames, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&off->lock);
+		b->next = off->free;
+		off->free = b;
+	}
+
+	pthread_mutex_unlock(&off->lock);
+
+	if (off->thread_f) off->thread_f(0, off->arg);
+
+	if (__atomic_sub_fetch(&off->workers_left, 1, __ATOMIC_ACQ_REL) == 0) {
+		__atomic_store_n(&off->end_us, mono_us(), __ATOMIC_RELEASE);
+		if ((secs = offline_elapsed(off)) <= 0) secs = 1e-6;
+		LNOTICE("offline: %" PRIu64 " files (%" PRIu64 " failed), %" PRIu64 " packets in %.3f s, %.1f files/s, %.0f packets/s",
+				off->files_done, off->files_failed, off->packets, secs, off->files_done / secs, off->packets / secs);
+	}
+
+	return NULL;
+}
+
+offline_t *offline_new(char **files, unsigned int files_count, unsigned int readers, unsigned int workers,
+		double speed, const char *filter, int datalink, unsigned int link_offset,
+		offline_thread_f thread_f, offline_frame_f frame_f, void *arg)
+{
+	offline_t *off;
+	unsigned int i;
+
+	if ((off = calloc(1, sizeof(offline_t))) == NULL) return NULL;
+
+	if (!workers) workers = 1;
+	if (workers > OFFLINE_MAX_WORKERS) workers = OFFLINE_MAX_WORKERS;
+	/* more readers only open and filter ahead, frames still go out in file order */
+	if (!readers) readers = 1;
+	if (readers > workers) readers = workers;
+	if (readers > files_count) readers = files_count ? files_count : 1;
+
+	off->files = files;
+	off->files_count = files_count;
+	off->readers = readers;
+	off->workers = workers;
+	off->speed = speed;
+	off->filter = filter ? strdup(filter) : NULL;
+	off->datalink = datalink;
+	off->link_offset = link_offset;
+	off->thread_f = thread_f;
+	off->frame_f = frame_f;
+	off->arg = arg;
+	pthread_mutex_init(&off->lock, NULL);
+	pthread_cond_init(&off->cond, NULL);
+
+	off->reader_threads = calloc(readers, sizeof(pthread_t));
+	off->w = calloc(workers, sizeof(offline_worker_t));
+	if (!off->reader_threads || !off->w) {
+		offline_free(off);
+		return NULL;
+	}
+
+	for (i = 0; i < workers; i++) {
+		off->w[i].off = off;
+		off->w[i].idx = i;
+	}
+
+	return off;
+}
+
+int offline_start(offline_t *off)
+{
+	unsigned int i;
+
+	off->start_us = mono_us();
+	off->readers_left = off->readers;
+	off->workers_left = off->workers;
+
+	for (i = 0; i < off->workers; i++) {
+		if (pthread_create(&off->w[i].thread, NULL, worker_thread, &off->w[i])) goto error;
+		off->running++;
+	}
+
+	for (i = 0; i < off->readers; i++) {
+		if (pthread_create(&off->reader_threads[i], NULL, reader_thread, off)) {
+			/* the workers wait for readers that never come */
+			pthread_mutex_lock(&off->lock);
+			off->readers_left -= off->readers - i;
+			pthread_cond_broadcast(&off->cond);
+			pthread_mutex_unlock(&off->lock);
+			off->readers = i;
+			break;
+		}
+	}
+
+	if (off->speed > 0)
+		LNOTICE("offline: %u files, %u readers, %u workers, replay at %.2f x real time", off->files_count, off->readers, off->workers, off->speed);
+	else
+		LNOTICE("offline: %u files, %u readers, %u workers, as fast as possible", off->files_count, off->readers, off->workers);
+
+	return 0;
+
+error:
+	LERR("couldn't start the offline workers");
+	pthread_mutex_lock(&off->lock);
+	off->readers_left = 0;
+	off->workers_left -= off->workers - i;
+	pthread_cond_broadcast(&off->cond);
+	pthread_mutex_unlock(&off->lock);
+	off->readers = 0;
+	off->workers = i;
+	offline_stop(off);
+
+	return -1;
+}
+
+void offline_stop(offline_t *off)
+{
+	unsigned int i;
+
+	if (!off->running) return;
+
+	pthread_mutex_lock(&off->lock);
+	__atomic_store_n(&off->stopping, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&off->cond);
+	pthread_mutex_unlock(&off->lock);
+
+	for (i = 0; i < off->readers; i++) pthread_join(off->reader_threads[i], NULL);
+	for (i = 0; i < off->workers; i++) pthread_join(off->w[i].thread, NULL);
+
+	off->running = 0;
+}
+
+double offline_elapsed(offline_t *off)
+{
+	uint64_t end = __atomic_load_n(&off->end_us, __ATOMIC_ACQUIRE);
+
+	if (!off->start_us) return 0;
+
+	return ((end ? end : mono_us()) - off->start_us) / 1e6;
+}
+
+void offline_free(offline_t *off)
+{
+	offline_batch_t *b;
+	unsigned int i;
+
+	if (!off) return;
+
+	offline_stop(off);
+
+	while ((b = off->free) != NULL) {
+		off->free = b->next;
+		free(b);
+	}
+
+	for (i = 0; i < off->files_count; i++) free(off->files[i]);
+	free(off->files);
+	free(off->filter);
+	free(off->reader_threads);
+	free(off->w);
+	pthread_mutex_destroy(&off->lock);
+	pthread_cond_destroy(&off->cond);
+	free(off);
+}
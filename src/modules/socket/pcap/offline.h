@@ -0,0 +1,137 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Parallel ingestion of pcap files
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _OFFLINE_H_
+#define _OFFLINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <pcap.h>
+
+/*
+ * Reads a set of pcap files and hands the frames to a pool of workers. A
+ * frame goes to the worker of its IP address pair, so both directions of a
+ * conversation and all fragments of a datagram are decoded in file order by
+ * one thread. Extra reader threads open and read the next files ahead, but a
+ * file's frames are only handed out once the files before it are done, so
+ * a call rotated over several files still arrives in order. Frames travel in
+ * batches; a worker that falls behind makes the readers wait rather than
+ * drop anything.
+ *
+ * With a speed the set replays at that multiple of real time on one clock,
+ * started by its first packet, so a file plays at its place in the set.
+ */
+
+#define OFFLINE_MAX_WORKERS 64
+#define OFFLINE_BATCH (256 * 1024)
+/* batches waiting for one worker before its readers wait */
+#define OFFLINE_QUEUE 32
+#define OFFLINE_ALIGN 8
+
+typedef struct offline_batch {
+	struct offline_batch *next;
+	uint32_t used;
+	uint32_t frames;
+	unsigned char data[OFFLINE_BATCH];
+} offline_batch_t;
+
+typedef struct offline_record {
+	uint32_t size;		/* whole record, aligned to OFFLINE_ALIGN */
+	uint32_t caplen;
+	uint32_t len;
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t reserved;
+} offline_record_t;
+
+struct offline;
+
+typedef struct offline_worker {
+	struct offline *off;
+	unsigned int idx;
+	pthread_t thread;
+	offline_batch_t *head;
+	offline_batch_t *tail;
+	unsigned int queued;
+} offline_worker_t;
+
+/* worker thread: start 1 before its first frame, 0 after its last one */
+typedef void (*offline_thread_f)(int start, void *arg);
+/* worker thread, packet is only valid during the call */
+typedef void (*offline_frame_f)(struct pcap_pkthdr *hdr, u_char *packet, void *arg);
+
+typedef struct offline {
+	char **files;
+	unsigned int files_count;
+	unsigned int next_file;
+	/* the file whose frames go to the workers now, under lock */
+	unsigned int turn;
+	unsigned int readers;
+	unsigned int workers;
+	double speed;		/* 0: as fast as possible */
+	/* replay clock, only used by the reader of the file in turn */
+	uint64_t replay_t0;
+	uint64_t replay_ts0;
+	char *filter;
+	int datalink;
+	unsigned int link_offset;
+	offline_thread_f thread_f;
+	offline_frame_f frame_f;
+	void *arg;
+	pthread_t *reader_threads;
+	offline_worker_t *w;
+	/* worker queues and the free batches */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	offline_batch_t *free;
+	unsigned int readers_left;
+	unsigned int workers_left;
+	int stopping;
+	int running;
+	/* statistics, read by any thread */
+	uint64_t files_done;
+	uint64_t files_failed;
+	uint64_t packets;
+	uint64_t start_us;
+	uint64_t end_us;	/* 0 while running */
+} offline_t;
+
+/* pattern: a file, a directory (its files) or a glob. Sorted by name */
+int offline_expand(const char *pattern, char ***files);
+int offline_is_batch(const char *pattern);
+
+offline_t *offline_new(char **files, unsigned int files_count, unsigned int readers, unsigned int workers,
+		double speed, const char *filter, int datalink, unsigned int link_offset,
+		offline_thread_f thread_f, offline_frame_f frame_f, void *arg);
+int offline_start(offline_t *off);
+/* stops the readers, the workers finish what was read. Joins all */
+void offline_stop(offline_t *off);
+void offline_free(offline_t *off);
+
+/* seconds since offline_start(), until the last worker is done */
+double offline_elapsed(offline_t *off);
+
+#endif /* _OFFLINE_H_ */
@@ -0,0 +1,222 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Sheds low priority traffic while the capture falls behind
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include <captagent/log.h>
+#include "shed.h"
+
+static int is_space(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* adds name of len bytes to class, "rtcp" is not a method */
+static void add_name(shed_t *s, const char *name, unsigned int len, int class)
+{
+	shed_method_t *m;
+
+	if (len == 4 && !strncasecmp(name, "rtcp", 4)) {
+		s->rtcp = class;
+		return;
+	}
+
+	if (len >= sizeof(m->name)) {
+		LERR("shed: method [%.*s] too long, ignored", (int) len, name);
+		return;
+	}
+
+	if (s->method_count == SHED_METHODS) {
+		LERR("shed: too many methods, max %d", SHED_METHODS);
+		return;
+	}
+
+	m = &s->methods[s->method_count++];
+	memcpy(m->name, name, len);
+	m->name[len] = '\0';
+	m->len = len;
+	m->class = class;
+}
+
+shed_t *shed_new(const char *order, uint64_t lag_limit, uint64_t hold)
+{
+	shed_t *s;
+	const char *p, *end, *last, *name;
+	int class = 0;
+
+	if ((s = calloc(1, sizeof(shed_t))) == NULL) return NULL;
+
+	s->lag_limit = lag_limit ? lag_limit : SHED_LAG;
+	s->hold = hold ? hold : SHED_HOLD;
+
+	for (p = order ? order : SHED_ORDER; *p; p = *end ? end + 1 : end) {
+
+		if ((end = strchr(p, ';')) == NULL) end = p + strlen(p);
+
+		while (p < end && is_space(*p)) p++;
+		if (p == end) continue;
+
+		if (class == SHED_CLASSES) {
+			LERR("shed: more than %d classes, [%s] ignored", SHED_CLASSES, p);
+			break;
+		}
+		class++;
+
+		for (last = end; is_space(last[-1]); last--)
+			;
+		snprintf(s->names[class], sizeof(s->names[class]), "%.*s", (int) (last - p), p);
+
+		while (p < end) {
+			while (p < end && (is_space(*p) || *p == ',')) p++;
+			name = p;
+			while (p < end && !is_space(*p) && *p != ',') p++;
+			if (p > name) add_name(s, name, p - name, class);
+		}
+	}
+
+	s->classes = class;
+
+	return s;
+}
+
+void shed_free(shed_t *s)
+{
+	free(s);
+}
+
+/* one decision, only the thread that moved next_tick gets here */
+static void shed_tick(shed_t *s, uint64_t now)
+{
+	uint64_t lag = __atomic_exchange_n(&s->lag_max, 0, __ATOMIC_RELAXED);
+	int level = s->level;
+
+	__atomic_store_n(&s->lag, lag, __ATOMIC_RELAXED);
+
+	if (lag > s->lag_limit) {
+		s->calm_since = 0;
+		if (level < s->classes) level++;
+	} else if (lag < s->lag_limit / 2 && level > 0) {
+		if (!s->calm_since) {
+			s->calm_since = now;
+		} else if (now - s->calm_since >= s->hold) {
+			level--;
+			s->calm_since = now;
+		}
+	} else {
+		s->calm_since = 0;
+	}
+
+	if (level == s->level) return;
+
+	if (level) LNOTICE("load shedding level %d [%s], capture lag %" PRIu64 " ms", level, s->names[level], lag / 1000);
+	else LNOTICE("load shedding off, capture lag %" PRIu64 " ms", lag / 1000);
+
+	__atomic_store_n(&s->level, level, __ATOMIC_RELAXED);
+}
+
+void shed_observe(shed_t *s, uint64_t lag, uint64_t now)
+{
+	uint64_t cur = __atomic_load_n(&s->lag_max, __ATOMIC_RELAXED);
+	uint64_t tick;
+
+	while (lag > cur && !__atomic_compare_exchange_n(&s->lag_max, &cur, lag, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	tick = __atomic_load_n(&s->next_tick, __ATOMIC_RELAXED);
+	if (now < tick) return;
+	if (!__atomic_compare_exchange_n(&s->next_tick, &tick, now + SHED_TICK, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return;
+
+	shed_tick(s, now);
+}
+
+/* method of the CSeq header, NULL if there is none */
+static const unsigned char *cseq_method(const unsigned char *data, const unsigned char *end)
+{
+	const unsigned char *p = data;
+
+	for (;;) {
+		if ((p = memchr(p, '\n', end - p)) == NULL) return NULL;
+		p++;
+
+		/* end of the headers */
+		if (p < end && (*p == '\r' || *p == '\n')) return NULL;
+
+		if (end - p < 5 || strncasecmp((const char *) p, "CSeq:", 5)) continue;
+
+		p += 5;
+		while (p < end && is_space(*p)) p++;
+		while (p < end && *p >= '0' && *p <= '9') p++;
+		while (p < end && is_space(*p)) p++;
+
+		return p;
+	}
+}
+
+int shed_class(shed_t *s, const unsigned char *data, unsigned int len)
+{
+	const unsigned char *end = data + len, *method = data, *p;
+	unsigned int i, mlen;
+
+	/* version 2, SR to APP */
+	if (len >= 8 && (data[0] & 0xc0) == 0x80 && data[1] >= 200 && data[1] <= 204) return s->rtcp;
+
+	if (len > 8 && !memcmp(data, "SIP/2.0 ", 8) && (method = cseq_method(data, end)) == NULL) return 0;
+
+	for (p = method; p < end && *p >= 'A' && *p <= 'Z'; p++)
+		;
+	mlen = p - method;
+
+	for (i = 0; i < s->method_count; i++) {
+		if (s->methods[i].len == mlen && !memcmp(s->methods[i].name, method, mlen)) return s->methods[i].class;
+	}
+
+	return 0;
+}
+
+int shed_check(shed_t *s, const unsigned char *data, unsigned int len)
+{
+	int level = __atomic_load_n(&s->level, __ATOMIC_RELAXED), class;
+
+	if (!level) return 0;
+
+	class = shed_class(s, data, len);
+
+	return class && class <= level ? class : 0;
+}
+
+int shed_level(shed_t *s)
+{
+	return __atomic_load_n(&s->level, __ATOMIC_RELAXED);
+}
+
+uint64_t shed_lag(shed_t *s)
+{
+	return __atomic_load_n(&s->lag, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,96 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Sheds low priority traffic while the capture falls behind
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or
+ * modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _SHED_H_
+#define _SHED_H_
+
+#include <stdint.h>
+
+/*
+ * Load shedding. The capture threads report how far behind the wire they
+ * run, the capture lag. While it stays above the limit the level goes up one
+ * step per tick, once it stayed below half of it for the hold time it goes
+ * down one step. Traffic is sorted into classes by priority, level N sheds
+ * classes 1 to N; whatever no class names, INVITE and BYE with the defaults,
+ * is never shed.
+ *
+ * The order is the classes from first to last shed, separated by ';', each a
+ * list of SIP methods separated by ','. "rtcp" stands for RTCP packets.
+ * Responses belong to the class of their CSeq method.
+ */
+
+#define SHED_CLASSES 4
+#define SHED_METHODS 32
+#define SHED_ORDER "rtcp;OPTIONS,REGISTER;SUBSCRIBE,NOTIFY,PUBLISH,MESSAGE,REFER"
+/* microseconds of capture lag that raise the level */
+#define SHED_LAG 300000
+/* microseconds below half the lag before a step down */
+#define SHED_HOLD 5000000
+/* microseconds between two decisions */
+#define SHED_TICK 100000
+/* packets per capture thread between two lag samples */
+#define SHED_SAMPLE 16
+
+typedef struct shed_method {
+	char name[16];
+	unsigned int len;
+	int class;
+} shed_method_t;
+
+typedef struct shed {
+	shed_method_t methods[SHED_METHODS];
+	unsigned int method_count;
+	int rtcp;			/* class of RTCP, 0 keeps it */
+	int classes;
+	char names[SHED_CLASSES + 1][64];
+	uint64_t lag_limit;
+	uint64_t hold;
+	/* written by the thread that won the tick */
+	int level;
+	uint64_t calm_since;
+	uint64_t lag;			/* worst lag of the last tick */
+	/* all capture threads */
+	uint64_t next_tick;
+	uint64_t lag_max;
+} shed_t;
+
+/* order NULL for SHED_ORDER, lag_limit and hold in us, 0 for the defaults */
+shed_t *shed_new(const char *order, uint64_t lag_limit, uint64_t hold);
+void shed_free(shed_t *s);
+
+/* a capture thread saw a packet lag us behind, now in us */
+void shed_observe(shed_t *s, uint64_t lag, uint64_t now);
+
+/* class of a message payload, 0 for none */
+int shed_class(shed_t *s, const unsigned char *data, unsigned int len);
+
+/* class of the payload if the current level sheds it, 0 keeps it */
+int shed_check(shed_t *s, const unsigned char *data, unsigned int len);
+
+int shed_level(shed_t *s);
+uint64_t shed_lag(shed_t *s);
+
+#endif /* _SHED_H_ */
@@ -62,8 +62,15 @@
 #include "socket_pcap.h"
 #include <captagent/log.h>
 #include <captagent/action.h>
+#include <captagent/trace.h>
 #include "ipreasm.h"
 #include "tcpreasm.h"
+#include "flight_recorder.h"
+#include "call_index.h"
+#include "dedup.h"
+#include "merge.h"
+#include "offline.h"
+#include "shed.h"
 #include "localapi.h"
 #include "sctp_support.h"
 
@@ -87,19 +94,63 @@ char *module_description;
 int debug_socket_pcap_enable = 0;
 
 static socket_pcap_stats_t stats;
+static socket_pcap_drops_t drops[MAX_SOCKETS];
+static socket_pcap_offline_stats_t offline_stats[MAX_SOCKETS];
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_t call_thread[MAX_SOCKETS];
 pcap_t *sniffer_proto[MAX_SOCKETS];
 struct reasm_ip *reasm[MAX_SOCKETS];
 struct tcpreasm_ip *tcpreasm[MAX_SOCKETS];
+flight_recorder_t *flight[MAX_SOCKETS];
+call_index_t *calls[MAX_SOCKETS];
+/* one set for all profiles, the copies come from other interfaces */
+static dedup_t *dedup_set = NULL;
+/* IP ID << 32 | TCP sequence of the packet in the capture plan right now */
+static __thread uint64_t dedup_id = 0;
+/* frames of the merge profiles, decoded in capture timestamp order */
+static merge_t *merger = NULL;
+static __thread int merging = 0;
+/* overload controller of the profiles with shed=true, see shed.h */
+static shed_t *shedder = NULL;
+static __thread unsigned int shed_sample = 0;
+/* -D with a directory or a glob: files read in parallel, see offline.h */
+static int batch_mode = 0;
+offline_t *offline[MAX_SOCKETS];
+static unsigned int offline_idx[MAX_SOCKETS];
+/* an offline worker has reassembly tables of its own */
+static __thread int offline_worker = 0;
+static __thread struct reasm_ip *worker_reasm = NULL;
+/* what the worker's tables reported so far, see offline_reasm_report() */
+static __thread unsigned int worker_frames = 0, worker_dropped = 0, worker_timeout = 0, worker_overlap = 0;
+static __thread struct tcpreasm_ip *worker_tcpreasm = NULL;
+/* profile and recorder position of the frame in the capture plan right now */
+static __thread int flight_idx = -1;
+static __thread uint64_t flight_pos = 0;
+/* dumps read the recorders, unload frees them */
+static pthread_rwlock_t flight_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* compiled filters waiting for their capture thread, see set_live_filter() */
+static struct bpf_program *filter_pending[MAX_SOCKETS];
+static uint32_t filter_installed[MAX_SOCKETS];
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static int capture_stopping = 0;
+/* BPF of the capture plan checks, see capture_plan_bpf(). Under filter_lock */
+static char *filter_pushdown[MAX_SOCKETS];
+/* terms a module generated for the configured filter, FILTER_GENERATED. Under filter_lock */
+static char *filter_generated[MAX_SOCKETS];
 
 static int load_module(xml_node *config);
 static int unload_module(void);
+static void collect_drops(void *arg);
 static int description(char *descr);
 static int statistic(char *buf, size_t len);
 static uint64_t serial_module(void);
 static int free_profile(unsigned int idx);
+static void plan_pushdown(unsigned int loc_idx);
+static void plan_reloaded(void *arg);
+static void merge_emit(unsigned int src, struct pcap_pkthdr *hdr, u_char *packet);
+static int datalink_offset(int dl);
+void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet);
 
 unsigned int profile_size = 0;
 int verbose = 0;
@@ -111,6 +162,9 @@ static cmd_export_t cmds[] = {
         { "socket_pcap_check", (cmd_function) bind_check_size, 3, 0, 0, 0 }, 
         { "bind_socket_pcap",  (cmd_function)bind_socket_pcap,  0, 0, 0, 0}, 
         {"tzsp_payload_extract", (cmd_function) w_tzsp_payload_extract, 0, 0, 0, 0 },                                   
+        {"call_index", (cmd_function) w_call_index, 0, 0, 0, 0 },
+        {"dedup", (cmd_function) w_dedup, 0, 0, 0, 0 },
+        {"shed", (cmd_function) w_shed, 0, 0, 0, 0 },
         { 0, 0, 0, 0, 0, 0 } 
 };
 
@@ -128,6 +182,8 @@ int bind_api(socket_module_api_t* api)
 {
     api->reload_f = reload_config;
     api->apply_filter_f = apply_filter;
+    api->dump_pcap_f = dump_pcap;
+    api->dump_call_f = dump_call;
     api->module_name = module_name;
     return 0;
 }
@@ -137,11 +193,116 @@ int bind_check_size(msg_t *_m, char *param1, char *param2)
         return 0;
 }
 
+/* filter->data on filter->profile or on every profile. Returns the number of
+ * profiles running it or about to, -1 with filter->error set if it does not
+ * compile. FILTER_PENDING in filter->value if a capture has not taken it yet */
 int apply_filter (filter_msg_t *filter) {
 
+	unsigned int i;
+	int ret, done = 0;
+
+	filter->error[0] = '\0';
+	filter->value &= ~FILTER_PENDING;
+
+	for (i = 0; i < profile_size; i++) {
+		if (filter->profile && strcmp(filter->profile, profile_socket[i].name)) continue;
+
+		ret = set_live_filter(i, filter->data, filter->value & FILTER_GENERATED, filter->error, sizeof(filter->error));
+		if (ret < 0) return -1;
+		if (ret == FILTER_SWAP_PENDING) {
+			filter->value |= FILTER_PENDING;
+			snprintf(filter->error, sizeof(filter->error), "filter queued, capture of [%s] has not taken it within %d ms",
+					profile_socket[i].name, FILTER_SWAP_WAIT_MS);
+			ret = 1;
+		}
+		done += ret;
+	}
+
+	if (!done && !filter->error[0]) snprintf(filter->error, sizeof(filter->error), "no capture running for profile [%s]", filter->profile ? filter->profile : "any");
+
+	return done;
+}
+
+int dump_pcap(pcap_dump_filter_t *filter, pcap_dump_write_f write, void *arg) {
+
+	unsigned int i;
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&flight_lock);
+
+	for (i = 0; i < profile_size; i++) {
+		if (!flight[i]) continue;
+		if (filter->profile && strcmp(filter->profile, profile_socket[i].name)) continue;
+
+		ret = flight_recorder_dump(flight[i], filter, link_offset, write, arg);
+		break;
+	}
+
+	pthread_rwlock_unlock(&flight_lock);
+
+	return ret;
+}
+
+int dump_call(str *callid, pcap_dump_write_f write, void *arg) {
+
+	unsigned int i;
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&flight_lock);
+
+	for (i = 0; i < profile_size && ret < 0; i++) {
+		if (!flight[i] || !calls[i]) continue;
+
+		ret = call_index_dump(calls[i], flight[i], callid, link_offset, write, arg);
+	}
+
+	pthread_rwlock_unlock(&flight_lock);
+
+	return ret;
+}
+
+/* capture plan: remember where the frames of this SIP call are */
+int w_call_index(msg_t *_m) {
+
+	if (flight_idx < 0 || !calls[flight_idx] || !_m->sip.callId.len) return -1;
+
+	call_index_add(calls[flight_idx], &_m->sip, flight_pos, _m->rcinfo.time_sec);
+
 	return 1;
 }
 
+/* false for a copy of a message seen within dedup-window */
+int w_dedup(msg_t *_m) {
+
+	if (!dedup_set || !_m->data) return 1;
+
+	metric_inc(stats.dedup_checked);
+
+	if (dedup_check(dedup_set, dedup_key(_m, dedup_id),
+			(uint64_t) _m->rcinfo.time_sec * 1000000 + _m->rcinfo.time_usec)) {
+		metric_inc(stats.dedup_hits);
+		return -1;
+	}
+
+	return 1;
+}
+
+int w_shed(msg_t *_m) {
+
+	int class;
+
+	if (!shedder || !_m->data) return 1;
+	/* only shed=true profiles feed the controller, the rest are not its to drop */
+	if (flight_idx < 0 || !profile_socket[flight_idx].shed) return 1;
+
+	if ((class = shed_check(shedder, (const unsigned char *) _m->data, _m->len)) == 0) return 1;
+
+	metric_inc(stats.shed[class]);
+	if (flight_idx >= 0) metric_inc(drops[flight_idx].load_shed);
+
+	return -1;
+}
+
 int reload_config (char *erbuf, int erlen) {
 
 	char module_config_name[500];
@@ -160,7 +321,128 @@ int reload_config (char *erbuf, int erlen) {
 	return 0;
 }
 
-/* Callback function that is passed to pcap_loop() */
+/* a SIP message tcpreasm framed out of a stream, arg has the addressing of
+ * the segment completing it */
+static void tcp_message(const unsigned char *data, unsigned len, void *arg) {
+
+	msg_t _msg;
+	struct run_act_ctx ctx;
+
+	TRACE_PROBE1(tcp_reasm_done, len);
+
+	if(debug_socket_pcap_enable) LDEBUG("COMPLETE TCP DEFRAG: LEN[%d], PACKET:[%.*s]\n", len, len, data);
+
+	memcpy(&_msg, arg, sizeof(msg_t));
+	memset(&ctx, 0, sizeof(struct run_act_ctx));
+
+	_msg.data = (void *) data;
+	_msg.len = len;
+
+	metric_latency(stats.decode_latency, _msg.rcinfo.time_sec, _msg.rcinfo.time_usec);
+	/* flight_idx is the profile of the frame */
+	run_capture(&ctx, profile_socket[flight_idx].action, &_msg);
+
+	metric_inc(stats.send_packets);
+}
+
+/* merge thread, the frame goes through callback_proto() as if captured now */
+static void merge_emit(unsigned int src, struct pcap_pkthdr *hdr, u_char *packet) {
+
+	unsigned int loc_idx = src;
+
+	merging = 1;
+	callback_proto((u_char *) &loc_idx, hdr, packet);
+}
+
+/* adds what is new in the worker's own reassembly tables to its profile */
+static void offline_reasm_report(unsigned int loc_idx) {
+
+	unsigned int dropped = 0, timeout = 0, overlap = 0;
+
+	if (worker_reasm) {
+		dropped += reasm_ip_dropped_frags(worker_reasm);
+		timeout += reasm_ip_timed_out(worker_reasm);
+		overlap += reasm_ip_overlaps(worker_reasm);
+	}
+	if (worker_tcpreasm) {
+		dropped += tcpreasm_ip_dropped_frags(worker_tcpreasm);
+		timeout += tcpreasm_ip_timed_out(worker_tcpreasm);
+	}
+
+	__atomic_add_fetch(&offline_stats[loc_idx].reasm_dropped, dropped - worker_dropped, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&offline_stats[loc_idx].reasm_timeout, timeout - worker_timeout, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&offline_stats[loc_idx].reasm_overlap, overlap - worker_overlap, __ATOMIC_RELAXED);
+	worker_dropped = dropped;
+	worker_timeout = timeout;
+	worker_overlap = overlap;
+}
+
+/* offline worker of the profile arg, before its first and after its last frame */
+static void offline_thread(int start, void *arg) {
+
+	unsigned int loc_idx = *(unsigned int *) arg;
+
+	if (start) {
+		offline_worker = 1;
+		worker_frames = worker_dropped = worker_timeout = worker_overlap = 0;
+		if (profile_socket[loc_idx].reasm == 1 || profile_socket[loc_idx].reasm == 3) {
+			worker_reasm = reasm_ip_new();
+			reasm_ip_set_timeout(worker_reasm, 30000000);
+			reasm_ip_set_memory(worker_reasm, (size_t) profile_socket[loc_idx].reasm_memory * 1024 * 1024);
+		}
+		if (profile_socket[loc_idx].reasm == 2 || profile_socket[loc_idx].reasm == 3) {
+			worker_tcpreasm = tcpreasm_ip_new();
+			tcpreasm_ip_set_timeout(worker_tcpreasm, 30000000);
+			tcpreasm_ip_set_limits(worker_tcpreasm, profile_socket[loc_idx].tcp_flow_buffer, (size_t) profile_socket[loc_idx].tcp_memory * 1024 * 1024);
+		}
+		return;
+	}
+
+	offline_reasm_report(loc_idx);
+
+	if (worker_reasm) reasm_ip_free(worker_reasm);
+	if (worker_tcpreasm) tcpreasm_ip_free(worker_tcpreasm);
+	worker_reasm = NULL;
+	worker_tcpreasm = NULL;
+}
+
+static void offline_frame(struct pcap_pkthdr *hdr, u_char *packet, void *arg) {
+	callback_proto((u_char *) arg, hdr, packet);
+	if (++worker_frames % OFFLINE_REASM_REPORT == 0) offline_reasm_report(*(unsigned int *) arg);
+}
+
+static int64_t merge_depth(void *arg) {
+	return __atomic_load_n(&merger->depth, __ATOMIC_RELAXED);
+}
+
+static int64_t merge_max_depth(void *arg) {
+	return __atomic_load_n(&merger->max_depth, __ATOMIC_RELAXED);
+}
+
+static int64_t shed_level_read(void *arg) {
+	return shed_level(shedder);
+}
+
+static int64_t shed_lag_read(void *arg) {
+	return shed_lag(shedder);
+}
+
+/* capture lag of every SHED_SAMPLE-th frame of the thread, for the controller */
+static void shed_sample_lag(struct pcap_pkthdr *pkthdr) {
+
+	struct timeval now;
+	uint64_t now_us, ts_us;
+
+	if (++shed_sample % SHED_SAMPLE) return;
+
+	gettimeofday(&now, NULL);
+	now_us = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+	ts_us = (uint64_t) pkthdr->ts.tv_sec * 1000000 + pkthdr->ts.tv_usec;
+
+	shed_observe(shedder, now_us > ts_us ? now_us - ts_us : 0, now_us);
+}
+
+/* Callback function that is passed to pcap_dispatch() */
 void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet) {
 
 	uint8_t hdr_offset = 0;
@@ -173,6 +455,17 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 	uint16_t mplsaddr;
 
 	uint8_t loc_index = (uint8_t) *useless;
+	struct reasm_ip *ip_reasm = offline_worker ? worker_reasm : reasm[loc_index];
+	struct tcpreasm_ip *tcp_reasm = offline_worker ? worker_tcpreasm : tcpreasm[loc_index];
+
+	/* decoded by the merge thread once older frames of the other profiles are through */
+	if (merger && profile_socket[loc_index].merge && !merging) {
+		if (merge_push(merger, loc_index, pkthdr, packet) < 0) metric_inc(drops[loc_index].queue_full);
+		return;
+	}
+
+	/* after the merge, its wait is part of the lag */
+	if (shedder && profile_socket[loc_index].shed) shed_sample_lag(pkthdr);
 
 	if (profile_socket[loc_index].erspan == 1) {
 		memcpy(&tmp_ip_proto, (packet + ETHHDR_SIZE + IPPROTO_OFFSET), 1);
@@ -218,24 +511,27 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 	char ip_src[INET6_ADDRSTRLEN + 1], ip_dst[INET6_ADDRSTRLEN + 1];
 	char mac_src[20], mac_dst[20];
 	u_char *pack = NULL;
-	unsigned char *data, *datatcp;	        
+	unsigned char *data;
 	int action_idx = 0;	
 	uint32_t len = pkthdr->caplen;
-	uint8_t  psh = 0;
 	        
 	/* stats */
-	stats.recieved_packets_total++;
+	metric_inc(stats.recieved_packets_total);
+	TRACE_PROBE3(packet_receive, module_name, loc_index, len);
 
-	if (profile_socket[loc_index].reasm == 1 && reasm[loc_index] != NULL) {
-		unsigned new_len;
+	flight_idx = loc_index;
+	if (flight[loc_index]) flight_pos = flight_recorder_add(flight[loc_index], pkthdr, packet);
 
-		u_char *new_p = malloc(len - link_offset - hdr_offset);
-		memcpy(new_p, ip4_pkt, len - link_offset - hdr_offset);
+	if (ip_reasm != NULL) {
+		unsigned new_len;
 
-		pack = reasm_ip_next(reasm[loc_index], new_p, len - link_offset - hdr_offset,
+		/* no copy: a fragment that has to wait is kept in the pool, a whole
+		 * packet comes back as it is, a reassembled one in reasm's buffer */
+		pack = reasm_ip_next(ip_reasm, (unsigned char *) ip4_pkt, len - link_offset - hdr_offset,
 				(reasm_time_t) 1000000UL * pkthdr->ts.tv_sec + pkthdr->ts.tv_usec, &new_len);
 
 		if (pack == NULL) return;
+		TRACE_PROBE1(ip_reasm_done, new_len);
 
 		len = new_len + link_offset + hdr_offset;
 		pkthdr->len = new_len;
@@ -273,6 +569,7 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 		fragmented = ip_off & (IP_MF | IP_OFFMASK);
 		frag_offset = (fragmented) ? (ip_off & IP_OFFMASK) * 8 : 0;
 		//frag_id = ntohs(ip4_pkt->ip_id);
+		dedup_id = (uint64_t) ntohs(ip4_pkt->ip_id) << 32;
 
 		inet_ntop(AF_INET, (const void *) &ip4_pkt->ip_src, ip_src, sizeof(ip_src));
 		inet_ntop(AF_INET, (const void *) &ip4_pkt->ip_dst, ip_dst, sizeof(ip_dst));
@@ -283,6 +580,8 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 		case 6: {
 			ip_hl = sizeof(struct ip6_hdr);
 			ip_proto = ip6_pkt->ip6_nxt;
+			/* no ID outside of fragments, the flow label is the closest */
+			dedup_id = (uint64_t) (ntohl(ip6_pkt->ip6_flow) & 0xfffff) << 32;
 
 			if (ip_proto == IPPROTO_FRAGMENT) {
 				struct ip6_frag *ip6_fraghdr;
@@ -315,7 +614,7 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 		
 		len -= link_offset + hdr_offset + ip_hl + tcphdr_offset;
 
-		stats.recieved_tcp_packets++;
+		metric_inc(stats.recieved_tcp_packets);
 
 #if USE_IPv6
 		/* if (ip_ver == 6)
@@ -330,37 +629,19 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 
 		if ((int32_t) len < 0) len = 0;
 
-		if(tcpreasm[loc_index] != NULL &&  (len > 0) && (tcp_pkt->th_flags & TH_ACK)) {
-
-                        unsigned new_len;
-                        u_char *new_p_2 = malloc(len+10);
-                        memcpy(new_p_2, data, len);
-        
-                        if((tcp_pkt->th_flags & TH_PUSH)) psh = 1;
+		if (!frag_offset) dedup_id |= ntohl(tcp_pkt->th_seq);
 
-                                        
-                        if(debug_socket_pcap_enable) LDEBUG("DEFRAG TCP process: LEN:[%d], ACK:[%d], PSH[%d]\n", len, (tcp_pkt->th_flags & TH_ACK), psh);
-                        
-                        datatcp = tcpreasm_ip_next_tcp(tcpreasm[loc_index], new_p_2, len , (tcpreasm_time_t) 1000000UL * pkthdr->ts.tv_sec + pkthdr->ts.tv_usec, &new_len, &ip4_pkt->ip_src, &ip4_pkt->ip_dst, ntohs(tcp_pkt->th_sport), ntohs(tcp_pkt->th_dport), psh);
+		if(tcp_reasm != NULL && !frag_offset) {
 
-                        if (datatcp == NULL) return;
-                                                
-                        len = new_len;
-                        
-                        if(debug_socket_pcap_enable)
-                                LDEBUG("COMPLETE TCP DEFRAG: LEN[%d], PACKET:[%s]\n", len, datatcp);
-                        
+			const void *tcp_src = &ip4_pkt->ip_src, *tcp_dst = &ip4_pkt->ip_dst;
+#if USE_IPv6
+			if (ip_ver == 6) {
+				tcp_src = &ip6_pkt->ip6_src;
+				tcp_dst = &ip6_pkt->ip6_dst;
+			}
+#endif
 
-			if(!profile_socket[profile_size].full_packet) {
-		        	_msg.data = datatcp;
-	        		_msg.len = len;
-        	        }
-			else {
-			       // _msg.len = pkthdr->caplen - link_offset;
-			       // _msg.data = (packet + link_offset);
-			       _msg.data = datatcp;
-	        		_msg.len = len;		        
-                	}
+			if(debug_socket_pcap_enable) LDEBUG("DEFRAG TCP process: LEN:[%d], SEQ:[%u], FLAGS:[0x%x]\n", len, ntohl(tcp_pkt->th_seq), tcp_pkt->th_flags);
 
 			_msg.rcinfo.src_port = ntohs(tcp_pkt->th_sport);
 			_msg.rcinfo.dst_port = ntohs(tcp_pkt->th_dport);
@@ -375,17 +656,10 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 			_msg.tcpflag = tcp_pkt->th_flags;
 			_msg.parse_it = 1;
 
-			action_idx = profile_socket[loc_index].action;		
-			run_actions(&ctx, main_ct.clist[action_idx], &_msg);
-			
-			/**
-			   hook to function process_packet:
-			   in process_packet I have to prepare the Key
-			   and the Handshake for Hashtable 
-			*/
-			
-                        /* clear datatcp */
-                        free(datatcp);                    
+			/* every SIP message of the stream comes back through tcp_message() */
+			tcpreasm_ip_next_tcp(tcp_reasm, _msg.rcinfo.ip_family, tcp_src, tcp_dst,
+					ntohs(tcp_pkt->th_sport), ntohs(tcp_pkt->th_dport), ntohl(tcp_pkt->th_seq), tcp_pkt->th_flags,
+					data, len, (tcpreasm_time_t) 1000000UL * pkthdr->ts.tv_sec + pkthdr->ts.tv_usec, tcp_message, &_msg);
 		}
 		else {
 
@@ -412,9 +686,10 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 			_msg.parse_it = 1;
 
 			action_idx = profile_socket[loc_index].action;		
-			run_actions(&ctx, main_ct.clist[action_idx], &_msg);
+			metric_latency(stats.decode_latency, pkthdr->ts.tv_sec, pkthdr->ts.tv_usec);
+			run_capture(&ctx, action_idx, &_msg);
 		        
-			stats.send_packets++;
+			metric_inc(stats.send_packets);
 
                 }
 
@@ -441,7 +716,7 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 #endif
 
 		/* stats */
-		stats.recieved_udp_packets++;
+		metric_inc(stats.recieved_udp_packets);
 
 		if ((int32_t) len < 0) len = 0;
 
@@ -471,10 +746,11 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 
 
 		action_idx = profile_socket[loc_index].action;
-		run_actions(&ctx, main_ct.clist[action_idx], &_msg);
+		metric_latency(stats.decode_latency, pkthdr->ts.tv_sec, pkthdr->ts.tv_usec);
+		run_capture(&ctx, action_idx, &_msg);
 
 
-		stats.send_packets++;
+		metric_inc(stats.send_packets);
 
 	}
 		break;
@@ -501,7 +777,7 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 		len -= plen;
 
 		/* stats */
-		stats.recieved_sctp_packets++;
+		metric_inc(stats.recieved_sctp_packets);
 
 		/* I don't understand the frag_offset in other protos */
 
@@ -541,7 +817,8 @@ void callback_proto(u_char *useless, struct pcap_pkthdr *pkthdr, u_char *packet)
 				_msg.data = chunk_data + 16;
 			}
 			action_idx = profile_socket[loc_index].action;
-			run_actions(&ctx, main_ct.clist[action_idx], &_msg);
+			metric_latency(stats.decode_latency, pkthdr->ts.tv_sec, pkthdr->ts.tv_usec);
+			run_capture(&ctx, action_idx, &_msg);
 
 next:
 			padding = (4 - (plen % 4)) & 0x3;
@@ -549,7 +826,7 @@ next:
 			chunk_data += plen + padding;
 		}
 
-		stats.send_packets++;
+		metric_inc(stats.send_packets);
 	}
 		break;
 
@@ -558,7 +835,67 @@ next:
 	}
 
 error:
-	if(pack != NULL) free(pack);
+	return;
+}
+
+/* the user filter and generated terms plus what reassembly and capture-filter need on top */
+static void build_filter(unsigned int loc_idx, char *user, char *generated, char *filter_expr, size_t size) {
+
+	char *pushdown = filter_pushdown[loc_idx];
+	int len = 0;
+
+	filter_expr[0] = '\0';
+
+	if(user && strlen(user) == 0) user = NULL;
+	if(generated && strlen(generated) == 0) generated = NULL;
+
+	if(user)
+	{
+		len += snprintf(filter_expr+len, size-len, "(%s)%s", user, generated || pushdown ? " and " : "");
+	}
+
+	if(generated && len < (int) size)
+	{
+		len += snprintf(filter_expr+len, size-len, "(%s)%s", generated, pushdown ? " and " : "");
+	}
+
+	if(pushdown && len < (int) size)
+	{
+		/* ip[] is off by the tag on vlan/mpls frames, the plan sorts those out */
+		if(sniffer_proto[loc_idx] && pcap_datalink(sniffer_proto[loc_idx]) == DLT_EN10MB)
+			len += snprintf(filter_expr+len, size-len, "((%s) or (ether[12:2] != 0x0800 and ether[12:2] != 0x86dd))", pushdown);
+		else
+			len += snprintf(filter_expr+len, size-len, "(%s)", pushdown);
+	}
+
+	if(len > 0 && len < (int) size)
+	{
+		if(ipv4fragments || ipv6fragments)
+		{
+			if (ipv4fragments)
+			{
+				LDEBUG("Reassembling of IPv4 packets is enabled, adding '%s' to filter", BPF_DEFRAGMENTION_FILTER_IPV4);
+				len += snprintf(filter_expr+len, size-len, " or %s", BPF_DEFRAGMENTION_FILTER_IPV4);
+			}
+			if (ipv6fragments)
+			{
+				LDEBUG("Reassembling of IPv6 packets is enabled, adding '%s' to filter", BPF_DEFRAGMENTION_FILTER_IPV6);
+				len += snprintf(filter_expr+len, size-len, " or %s", BPF_DEFRAGMENTION_FILTER_IPV6);
+			}
+		}
+	}
+
+	if(profile_socket[loc_idx].capture_filter && len < (int) size)
+	{
+		if(!strncmp(profile_socket[loc_idx].capture_filter, "rtcp", 4))
+		{
+			len += snprintf(filter_expr+len, size-len, "%s %s", len ? " and" : "", RTCP_FILTER);
+		}
+		else if(!strncmp(profile_socket[loc_idx].capture_filter, "rtp", 3))
+		{
+			len += snprintf(filter_expr+len, size-len, "%s %s", len ? " and" : "", RTP_FILTER);
+		}
+	}
 }
 
 int init_socket(unsigned int loc_idx) {
@@ -566,7 +903,7 @@ int init_socket(unsigned int loc_idx) {
 	struct bpf_program filter;
 	char errbuf[PCAP_ERRBUF_SIZE];
 	char filter_expr[FILTER_LEN];
-	int len=0, buffer_size = 0;
+	int buffer_size = 0;
 
 	LDEBUG("Activating device: %s\n", profile_socket[loc_idx].device);
         
@@ -606,48 +943,74 @@ int init_socket(unsigned int loc_idx) {
 		
 		LDEBUG("Activated device: [%s]\n", profile_socket[loc_idx].device);
 						
-	} else {
+	} else if (batch_mode) {
 
-		if ((sniffer_proto[loc_idx] = pcap_open_offline(usefile, errbuf)) == NULL) {
-			LERR("%s: Failed to open packet sniffer on %s: pcap_open_offline(): %s", module_name, usefile, errbuf);
+		char **files = NULL;
+		int count, dl, offset;
+
+		if ((count = offline_expand(usefile, &files)) <= 0) {
+			LERR("%s: no pcap files in %s", module_name, usefile);
+			free(files);
 			return -1;
 		}
-		
-		LNOTICE("Sending file: %s", usefile);
-	}
 
-	/* create filter string */
-	if(profile_socket[loc_idx].filter && strlen(profile_socket[loc_idx].filter) > 0)
-	{
-		len += snprintf(filter_expr+len, sizeof(filter_expr)-len, "(%s)", profile_socket[loc_idx].filter);
+		/* the first file tells the link type, the filter is checked against it */
+		if ((sniffer_proto[loc_idx] = pcap_open_offline(files[0], errbuf)) == NULL) {
+			LERR("%s: Failed to open packet sniffer on %s: pcap_open_offline(): %s", module_name, files[0], errbuf);
+			goto batch_error;
+		}
 
-		if(ipv4fragments || ipv6fragments)
-		{
-			if (ipv4fragments)
-			{
-				LDEBUG("Reassembling of IPv4 packets is enabled, adding '%s' to filter", BPF_DEFRAGMENTION_FILTER_IPV4);
-				len += snprintf(filter_expr+len, sizeof(filter_expr), " or %s", BPF_DEFRAGMENTION_FILTER_IPV4);
-			}
-			if (ipv6fragments)
-			{
-				LDEBUG("Reassembling of IPv6 packets is enabled, adding '%s' to filter", BPF_DEFRAGMENTION_FILTER_IPV6);
-				len += snprintf(filter_expr+len, sizeof(filter_expr), " or %s", BPF_DEFRAGMENTION_FILTER_IPV6);
-			}
+		build_filter(loc_idx, profile_socket[loc_idx].filter, filter_generated[loc_idx], filter_expr, sizeof(filter_expr));
+		if (pcap_compile(sniffer_proto[loc_idx], &filter, filter_expr, 1, 0) == -1) {
+			LERR("Failed to compile filter \"%s\": %s", filter_expr, pcap_geterr(sniffer_proto[loc_idx]));
+			goto batch_error;
 		}
-	}
+		pcap_freecode(&filter);
 
-	if(profile_socket[loc_idx].capture_filter)
-	{
-		if(!strncmp(profile_socket[loc_idx].capture_filter, "rtcp", 4))
-		{
-			len += snprintf(filter_expr+len, sizeof(filter_expr), "%s %s", len ? " and" : "", RTCP_FILTER);
+		dl = pcap_datalink(sniffer_proto[loc_idx]);
+		if ((offset = datalink_offset(dl)) < 0) {
+			LERR("unsupported link type [%d] of %s", dl, files[0]);
+			goto batch_error;
 		}
-		else if(!strncmp(profile_socket[loc_idx].capture_filter, "rtp", 3))
-		{
-			len += snprintf(filter_expr+len, sizeof(filter_expr), "%s %s", len ? " and" : "", RTP_FILTER);
+		link_offset = offset;
+
+		/* the handle was only for the checks, readers open their own */
+		pcap_close(sniffer_proto[loc_idx]);
+		sniffer_proto[loc_idx] = NULL;
+
+		LNOTICE("Using filter: %s", filter_expr);
+
+		offline_idx[loc_idx] = loc_idx;
+		offline[loc_idx] = offline_new(files, count, profile_socket[loc_idx].offline_readers,
+				profile_socket[loc_idx].offline_workers ? profile_socket[loc_idx].offline_workers : sysconf(_SC_NPROCESSORS_ONLN),
+				profile_socket[loc_idx].offline_speed, filter_expr, dl, link_offset,
+				offline_thread, offline_frame, &offline_idx[loc_idx]);
+		if (!offline[loc_idx]) {
+			LERR("couldn't set up reading %s", usefile);
+			return -1;
+		}
+
+		return 1;
+
+batch_error:
+		if (sniffer_proto[loc_idx]) pcap_close(sniffer_proto[loc_idx]);
+		sniffer_proto[loc_idx] = NULL;
+		while (count--) free(files[count]);
+		free(files);
+		return -1;
+
+	} else {
+
+		if ((sniffer_proto[loc_idx] = pcap_open_offline(usefile, errbuf)) == NULL) {
+			LERR("%s: Failed to open packet sniffer on %s: pcap_open_offline(): %s", module_name, usefile, errbuf);
+			return -1;
 		}
+		
+		LNOTICE("Sending file: %s", usefile);
 	}
 
+	build_filter(loc_idx, profile_socket[loc_idx].filter, filter_generated[loc_idx], filter_expr, sizeof(filter_expr));
+
 	LNOTICE("Using filter: %s", filter_expr);
 	/* compile filter expression (global constant, see above) */
 	if (pcap_compile(sniffer_proto[loc_idx], &filter, filter_expr, 1, 0) == -1) {
@@ -708,60 +1071,185 @@ int set_raw_filter(unsigned int loc_idx, char *filter) {
 }
 
 
-void* proto_collect(void *arg) {
+/* compiles the new filter aside and hands it to the capture thread, which
+ * installs it between two pcap_dispatch() runs on the same handle: the ring and
+ * everything queued in it survive. The running filter stays if it fails.
+ * generated: filter goes on top of the configured one, NULL drops it again.
+ * 1 once running, FILTER_SWAP_PENDING while still queued, -1 if refused */
+int set_live_filter(unsigned int loc_idx, char *filter, int generated, char *err, size_t errlen) {
 
-	unsigned int loc_idx = *((int *)arg);
-	int ret = 0, dl = 0;
+	struct bpf_program *prog = NULL, *old;
+	struct timespec ts = { 0, 10000000 };
+	size_t size;
+	char *filter_expr, *copy = NULL, *user, *terms, **slot;
+	uint32_t installed;
+	pcap_t *dead;
+	int i, ret = -1;
+
+	if(loc_idx >= MAX_SOCKETS || sniffer_proto[loc_idx] == NULL) return 0;
+
+	pthread_mutex_lock(&filter_lock);
+
+	user = generated ? profile_socket[loc_idx].filter : filter;
+	terms = generated ? filter : filter_generated[loc_idx];
+	slot = generated ? &filter_generated[loc_idx] : &profile_socket[loc_idx].filter;
+
+	/* generated filters, one term per call, outgrow FILTER_LEN */
+	size = (user ? strlen(user) : 0) + (terms ? strlen(terms) : 0)
+		+ (filter_pushdown[loc_idx] ? strlen(filter_pushdown[loc_idx]) : 0) + FILTER_LEN;
+	if ((filter_expr = malloc(size)) == NULL || (filter && (copy = strdup(filter)) == NULL)) {
+		snprintf(err, errlen, "no memory for the filter");
+		goto done;
+	}
+
+	build_filter(loc_idx, user, terms, filter_expr, size);
+
+	/* never compile on the live handle, its thread is inside pcap_dispatch */
+	if ((prog = calloc(1, sizeof(struct bpf_program))) == NULL
+			|| (dead = pcap_open_dead(pcap_datalink(sniffer_proto[loc_idx]), pcap_snapshot(sniffer_proto[loc_idx]))) == NULL) {
+		snprintf(err, errlen, "no memory for the filter");
+		free(prog);
+		goto done;
+	}
+
+	if (pcap_compile(dead, prog, filter_expr, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		snprintf(err, errlen, "%s", pcap_geterr(dead));
+		LERR("Refused filter \"%s\" for [%s]: %s", filter_expr, profile_socket[loc_idx].name, err);
+		pcap_close(dead);
+		free(prog);
+		goto done;
+	}
+	pcap_close(dead);
+
+	installed = __atomic_load_n(&filter_installed[loc_idx], __ATOMIC_ACQUIRE);
+
+	/* a filter still waiting is replaced, only the last one counts */
+	if ((old = __atomic_exchange_n(&filter_pending[loc_idx], prog, __ATOMIC_ACQ_REL)) != NULL) {
+		pcap_freecode(old);
+		free(old);
+	}
+	pcap_breakloop(sniffer_proto[loc_idx]);
+
+	/* the queued program is the one the capture thread takes next, the next
+	 * call builds on it even before it runs. filter may be the one it replaces */
+	free(*slot);
+	*slot = copy;
+	copy = NULL;
+
+	/* the loop returns with the next packet or read timeout */
+	ret = FILTER_SWAP_PENDING;
+	for (i = 0; i < FILTER_SWAP_WAIT_MS / 10; i++) {
+		if (__atomic_load_n(&filter_installed[loc_idx], __ATOMIC_ACQUIRE) != installed) {
+			ret = 1;
+			break;
+		}
+		nanosleep(&ts, NULL);
+	}
+
+	if (ret == 1) LNOTICE("Using filter on [%s]: %.*s%s", profile_socket[loc_idx].name, 512, filter_expr, strlen(filter_expr) > 512 ? "..." : "");
+	else LNOTICE("Filter queued on [%s], not taken within %d ms: %.*s%s", profile_socket[loc_idx].name, FILTER_SWAP_WAIT_MS,
+			512, filter_expr, strlen(filter_expr) > 512 ? "..." : "");
+
+done:
+	pthread_mutex_unlock(&filter_lock);
+	free(filter_expr);
+	free(copy);
+
+	return ret;
+}
+
+/* capture thread, pcap_dispatch() left by breakloop: install a pending filter */
+static int install_pending_filter(unsigned int loc_idx) {
+
+	struct bpf_program *prog;
+
+	if (__atomic_load_n(&capture_stopping, __ATOMIC_ACQUIRE)) return 0;
+	if ((prog = __atomic_exchange_n(&filter_pending[loc_idx], NULL, __ATOMIC_ACQ_REL)) == NULL) return 0;
+
+	if (pcap_setfilter(sniffer_proto[loc_idx], prog)) {
+		LERR("Failed to install filter: %s", pcap_geterr(sniffer_proto[loc_idx]));
+	}
+
+	pcap_freecode(prog);
+	free(prog);
+
+	__atomic_add_fetch(&filter_installed[loc_idx], 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/* detect link_offset. Thanks ngrep for this. -1 if dl is not supported */
+static int datalink_offset(int dl) {
 
-	dl = pcap_datalink(sniffer_proto[loc_idx]);
-	/* detect link_offset. Thanks ngrep for this. */
 	switch (dl) {
 	case DLT_EN10MB:
-		link_offset = ETHHDR_SIZE;
-		break;
+		return ETHHDR_SIZE;
 
 	case DLT_IEEE802:
-		link_offset = TOKENRING_SIZE;
-		break;
+		return TOKENRING_SIZE;
 
 	case DLT_FDDI:
-		link_offset = FDDIHDR_SIZE;
-		break;
+		return FDDIHDR_SIZE;
 
 	case DLT_SLIP:
-		link_offset = SLIPHDR_SIZE;
-		break;
+		return SLIPHDR_SIZE;
 
 	case DLT_PPP:
-		link_offset = PPPHDR_SIZE;
-		break;
+		return PPPHDR_SIZE;
 
 	case DLT_LOOP:
 	case DLT_NULL:
-		link_offset = LOOPHDR_SIZE;
-		break;
+		return LOOPHDR_SIZE;
 
 	case DLT_RAW:
-		link_offset = RAWHDR_SIZE;
-		break;
+		return RAWHDR_SIZE;
 
 	case DLT_LINUX_SLL:
-		link_offset = ISDNHDR_SIZE;
-		break;
+		return ISDNHDR_SIZE;
 
 	case DLT_IEEE802_11:
-		link_offset = IEEE80211HDR_SIZE;
-		break;
+		return IEEE80211HDR_SIZE;
 
 	default:
+		return -1;
+	}
+}
+
+void* proto_collect(void *arg) {
+
+	unsigned int loc_idx = *((int *)arg);
+	int ret = 0, dl = 0, batch;
+	struct pcap_stat ps;
+	time_t now, stats_next = 0;
+
+	dl = pcap_datalink(sniffer_proto[loc_idx]);
+	if ((ret = datalink_offset(dl)) < 0) {
 		LERR("fatal: unsupported interface type [%u] [%d]", dl, dl);
 		exit(-1);
 	}
+	link_offset = ret;
 
 	LDEBUG("Link offset interface type [%u] [%d] [%d]", dl, dl, link_offset);
 
+	batch = profile_socket[loc_idx].batch ? profile_socket[loc_idx].batch : PCAP_BATCH;
+
 	while(1) {
-		ret = pcap_loop(sniffer_proto[loc_idx], 0, (pcap_handler) callback_proto, (u_char *) &loc_idx);
+		/* a batch of packets per call, transports send what they got at its end */
+		capture_batch_begin();
+		ret = pcap_dispatch(sniffer_proto[loc_idx], batch, (pcap_handler) callback_proto, (u_char *) &loc_idx);
+		capture_batch_end();
+
+		/* only this thread may touch the handle, collect_drops() reads the copy */
+		if (!usefile && (now = time(NULL)) >= stats_next) {
+			stats_next = now + PCAP_STATS_INTERVAL;
+			if (pcap_stats(sniffer_proto[loc_idx], &ps) == 0) {
+				__atomic_store_n(&drops[loc_idx].ps_drop, ps.ps_drop, __ATOMIC_RELAXED);
+				__atomic_store_n(&drops[loc_idx].ps_ifdrop, ps.ps_ifdrop, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (ret > 0 || (ret == 0 && !usefile)) continue;
+
 		if (ret == 0)
 		{
 			LDEBUG("loop stopped by EOF");
@@ -769,6 +1257,9 @@ void* proto_collect(void *arg) {
 			break;
 		} else if (ret == -2)
 		{
+			/* a new filter, not a stop */
+			if (install_pending_filter(loc_idx)) continue;
+
 			LDEBUG("loop stopped by breakloop");
 			pcap_close(sniffer_proto[loc_idx]);	
 			break;
@@ -849,12 +1340,23 @@ static int load_module(xml_node *config) {
 	char errbuf[PCAP_ERRBUF_SIZE];
 	xml_node *params, *profile=NULL, *settings;
 	char *key, *value = NULL;
-	unsigned int i = 0;
-	char loadplan[1024];
-        FILE* cfg_stream;
+	unsigned int i = 0, merge_size = 0;
+	uint32_t dedup_window = 0, dedup_size = 0, merge_window = 0;
+	uint32_t shed_lag, shed_timeout;
+	int shed_first;
+	char loadplan[1024], label[256];
 
 	LNOTICE("Loaded %s", module_name);
 
+	stats.recieved_packets_total = metric_counter("socket_pcap_packets_received_total", "Packets received from pcap", NULL);
+	stats.recieved_tcp_packets = metric_counter("socket_pcap_packets_received_proto_total", "Packets received by transport protocol", "proto=\"tcp\"");
+	stats.recieved_udp_packets = metric_counter("socket_pcap_packets_received_proto_total", "Packets received by transport protocol", "proto=\"udp\"");
+	stats.recieved_sctp_packets = metric_counter("socket_pcap_packets_received_proto_total", "Packets received by transport protocol", "proto=\"sctp\"");
+	stats.send_packets = metric_counter("socket_pcap_packets_sent_total", "Packets handed to the capture plan", NULL);
+	stats.dedup_checked = metric_counter("socket_pcap_dedup_checked_total", "Messages looked up by dedup()", NULL);
+	stats.dedup_hits = metric_counter("socket_pcap_dedup_hits_total", "Copies dropped by dedup() within the window", NULL);
+	stats.decode_latency = metric_histogram("latency_seconds", "Time from the capture timestamp to a pipeline stage", "stage=\"decode\"");
+
 	load_module_xml_config();
 
 	/* READ CONFIG */
@@ -862,6 +1364,7 @@ static int load_module(xml_node *config) {
 
 	/* reset profile */
 	profile_size = 0;
+	capture_stopping = 0;
 
 	memset(sniffer_proto, 0, sizeof sniffer_proto);
 	        
@@ -905,6 +1408,7 @@ static int load_module(xml_node *config) {
 		profile_socket[profile_size].full_packet = 0;
 		profile_socket[profile_size].reasm = 0;         		                
 		profile_socket[profile_size].erspan = 0;
+		profile_socket[profile_size].call_index_minutes = 10;
 
 		/* SETTINGS */
 		settings = xml_get("settings", profile, 1);
@@ -943,12 +1447,18 @@ static int load_module(xml_node *config) {
 
 					if (!usefile && !strncmp(key, "dev", 3))
 						profile_socket[profile_size].device = strdup(value);
+					else if (!strncmp(key, "reasm-memory", 12))
+						profile_socket[profile_size].reasm_memory = atoi(value);
 					else if (!strncmp(key, "reasm", 5) && !strncmp(value, "true", 4))
 						profile_socket[profile_size].reasm = +1;
                                         else if (!strncmp(key, "ipv4fragments", 13) && !strncmp(value, "true", 4))
 						ipv4fragments = 1;
                                         else if (!strncmp(key, "ipv6fragments", 13) && !strncmp(value, "true", 4))
 						ipv6fragments = 1;
+					else if (!strncmp(key, "tcpdefrag-flow-buffer", 21))
+						profile_socket[profile_size].tcp_flow_buffer = atoi(value);
+					else if (!strncmp(key, "tcpdefrag-memory", 16))
+						profile_socket[profile_size].tcp_memory = atoi(value);
                                         else if(!strncmp(key, "tcpdefrag", 9) && !strncmp(value, "true", 4))
                                                 profile_socket[profile_size].reasm +=2;                                                    						
 					else if (!strncmp(key, "ring-buffer", 11))					        
@@ -963,6 +1473,8 @@ static int load_module(xml_node *config) {
 						profile_socket[profile_size].promisc = 1;
 					else if (!strncmp(key, "filter", 6))
 						profile_socket[profile_size].filter = strdup(value);
+					else if (!strncmp(key, "plan-pushdown", 13) && !strncmp(value, "true", 4))
+						profile_socket[profile_size].plan_pushdown = 1;
 					else if (!strncmp(key, "capture-plan", 12))
 						profile_socket[profile_size].capture_plan = strdup(value);
                                         else if (!strncmp(key, "capture-filter", 14))
@@ -971,6 +1483,40 @@ static int load_module(xml_node *config) {
                                                 debug_socket_pcap_enable = 1;	
 					else if (!strncmp(key, "erspan", 6) && !strncmp(value, "true", 4))
 						profile_socket[profile_size].erspan = 1;
+					else if (!strncmp(key, "flight-recorder-hugepages", 25) && !strncmp(value, "true", 4))
+						profile_socket[profile_size].flight_hugepages = 1;
+					else if (!strncmp(key, "flight-recorder", 15))
+						profile_socket[profile_size].flight_recorder = atoi(value);
+					else if (!strncmp(key, "offline-workers", 15))
+						profile_socket[profile_size].offline_workers = atoi(value);
+					else if (!strncmp(key, "offline-readers", 15))
+						profile_socket[profile_size].offline_readers = atoi(value);
+					else if (!strncmp(key, "offline-speed", 13))
+						profile_socket[profile_size].offline_speed = atof(value);
+					else if (!strncmp(key, "merge-window", 12))
+						profile_socket[profile_size].merge_window = atoi(value);
+					else if (!strncmp(key, "merge-ring", 10))
+						profile_socket[profile_size].merge_ring = atoi(value);
+					else if (!strncmp(key, "merge", 5) && !strncmp(value, "true", 4))
+						profile_socket[profile_size].merge = 1;
+					else if (!strncmp(key, "shed-order", 10))
+						profile_socket[profile_size].shed_order = strdup(value);
+					else if (!strncmp(key, "shed-lag", 8))
+						profile_socket[profile_size].shed_lag = atoi(value);
+					else if (!strncmp(key, "shed-hold", 9))
+						profile_socket[profile_size].shed_hold = atoi(value);
+					else if (!strncmp(key, "shed", 4) && !strncmp(value, "true", 4))
+						profile_socket[profile_size].shed = 1;
+					else if (!strncmp(key, "dedup-window", 12))
+						profile_socket[profile_size].dedup_window = atoi(value);
+					else if (!strncmp(key, "dedup-size", 10))
+						profile_socket[profile_size].dedup_size = atoi(value);
+					else if (!strncmp(key, "batch", 5))
+						profile_socket[profile_size].batch = atoi(value);
+					else if (!strncmp(key, "call-index-minutes", 18))
+						profile_socket[profile_size].call_index_minutes = atoi(value);
+					else if (!strncmp(key, "call-index", 10))
+						profile_socket[profile_size].call_index = atoi(value);
 				}
 
 				nextparam: params = params->next;
@@ -986,6 +1532,74 @@ static int load_module(xml_node *config) {
 	/* free */
 	free_module_xml_config();
 
+	/* DEDUP, shared: the widest window and the biggest set of all profiles */
+	for (i = 0; i < profile_size; i++) {
+		if (profile_socket[i].dedup_window > dedup_window) dedup_window = profile_socket[i].dedup_window;
+		if (profile_socket[i].dedup_size > dedup_size) dedup_size = profile_socket[i].dedup_size;
+	}
+	dedup_set = dedup_new(dedup_size, (uint64_t) dedup_window * 1000);
+	if (!dedup_set) LERR("couldn't allocate the dedup set, dedup() lets everything through");
+
+	/* a directory or glob of files, read by offline workers */
+	batch_mode = usefile && offline_is_batch(usefile);
+
+	/* SHED, one controller: files have no capture lag. Settings of the first profile with shed=true,
+	 * the lag limit clear of the longest read timeout of them all */
+	for (i = 0, shed_first = -1, shed_timeout = 0; i < profile_size && !usefile; i++) {
+		if (!profile_socket[i].shed) continue;
+		if (shed_first < 0) shed_first = i;
+		if (profile_socket[i].timeout > shed_timeout) shed_timeout = profile_socket[i].timeout;
+	}
+
+	if (shed_first >= 0) {
+		shed_lag = profile_socket[shed_first].shed_lag ? profile_socket[shed_first].shed_lag : SHED_LAG / 1000;
+		if (shed_lag < SHED_LAG_TIMEOUTS * shed_timeout) {
+			LNOTICE("shed-lag %u ms is within reach of the %u ms read timeout, raised to %u ms",
+					shed_lag, shed_timeout, SHED_LAG_TIMEOUTS * shed_timeout);
+			shed_lag = SHED_LAG_TIMEOUTS * shed_timeout;
+		}
+		if ((shedder = shed_new(profile_socket[shed_first].shed_order, (uint64_t) shed_lag * 1000,
+				(uint64_t) profile_socket[shed_first].shed_hold * 1000000)) == NULL)
+			LERR("couldn't allocate the load shedding controller, shed() lets everything through");
+	}
+
+	if (shedder) {
+		LNOTICE("load shedding at %" PRIu64 " ms capture lag, %d classes", shedder->lag_limit / 1000, shedder->classes);
+		stats.shed_level = metric_gauge_fn("socket_pcap_shed_level", "Classes of traffic shed by shed() right now", NULL, shed_level_read, NULL);
+		stats.shed_lag = metric_gauge_fn("socket_pcap_capture_lag_us", "Worst capture lag seen by the shedding controller in its last tick", NULL, shed_lag_read, NULL);
+		for (i = 1; i <= shedder->classes; i++) {
+			snprintf(label, sizeof(label), "level=\"%u\",class=\"%s\"", i, shedder->names[i]);
+			stats.shed[i] = metric_counter("socket_pcap_shed_total", "Messages dropped by shed() per class", label);
+		}
+	}
+
+	/* MERGE, the widest window, ring MB per profile. Offline workers are many writers */
+	for (i = 0; i < profile_size && !batch_mode; i++) {
+		if (!profile_socket[i].merge) continue;
+		if (profile_socket[i].merge_window > merge_window) merge_window = profile_socket[i].merge_window;
+		merge_size++;
+	}
+	if (merge_size > 1 && (merger = merge_new(merge_window, merge_emit)) != NULL) {
+		for (i = 0; i < profile_size; i++) {
+			if (profile_socket[i].merge && merge_add_source(merger, i, (uint64_t) (profile_socket[i].merge_ring ? profile_socket[i].merge_ring : 4) * 1024 * 1024)) {
+				LERR("couldn't allocate the merge ring of [%s]", profile_socket[i].name);
+				profile_socket[i].merge = 0;
+			}
+		}
+		if (merge_start(merger)) {
+			merge_free(merger);
+			merger = NULL;
+		}
+		else LNOTICE("merging %u profiles by capture time, window %" PRIu64 " us", merger->sources, merger->window);
+	}
+	else if (merge_size == 1) LNOTICE("merge needs at least two profiles, frames are decoded as captured");
+
+	if (merger) {
+		stats.merge_depth = metric_gauge_fn("socket_pcap_merge_depth", "Frames waiting in the merge rings", NULL, merge_depth, NULL);
+		stats.merge_max_depth = metric_gauge_fn("socket_pcap_merge_depth_max", "Most frames waiting in the merge rings at once", NULL, merge_max_depth, NULL);
+		stats.merge_late = metric_counter("socket_pcap_merge_late_total", "Frames merged after a newer one, later than the window", NULL);
+	}
+
 	for (i = 0; i < profile_size; i++) {
 
 		unsigned int *arg = malloc(sizeof(arg));		
@@ -1002,50 +1616,190 @@ static int load_module(xml_node *config) {
 			}
 		}
 		
+		/* before the socket, its filter takes the plan checks */
+		if(profile_socket[i].capture_plan != NULL)
+		{
+
+			snprintf(loadplan, sizeof(loadplan), "%s/%s", global_capture_plan_path, profile_socket[i].capture_plan);
+			profile_socket[i].action = capture_plan_load(loadplan);
+			plan_pushdown(i);
+			
+		}
+
 		// start thread
 		if (!init_socket(i)) {
 			LERR("couldn't init pcap");
 			return -1;
 		}
 
-		 /* REASM */
-                if (profile_socket[i].reasm == 1 || profile_socket[i].reasm == 3) {
+		/* FLIGHT RECORDER, size in MB */
+		flight[i] = NULL;
+		if (profile_socket[i].flight_recorder && sniffer_proto[i]) {
+			flight[i] = flight_recorder_new((uint64_t) profile_socket[i].flight_recorder * 1024 * 1024,
+					profile_socket[i].flight_hugepages, pcap_datalink(sniffer_proto[i]), profile_socket[i].snap_len);
+		}
+
+		/* CALL INDEX, max calls, the frames stay in the flight recorder */
+		calls[i] = NULL;
+		if (profile_socket[i].call_index && flight[i]) {
+			calls[i] = call_index_new(profile_socket[i].call_index, profile_socket[i].call_index_minutes * 60);
+		}
+
+		 /* REASM, the offline workers of a directory have their own */
+                if (!batch_mode && (profile_socket[i].reasm == 1 || profile_socket[i].reasm == 3)) {
                         reasm[i] = reasm_ip_new();
                         reasm_ip_set_timeout(reasm[i], 30000000);
+                        /* MB for fragments waiting for the rest */
+                        reasm_ip_set_memory(reasm[i], (size_t) profile_socket[i].reasm_memory * 1024 * 1024);
                 }
                 else reasm[i] = NULL;
 
                 /* TCPREASM */
-                if (profile_socket[i].reasm == 2 || profile_socket[i].reasm == 3) {
+                if (!batch_mode && (profile_socket[i].reasm == 2 || profile_socket[i].reasm == 3)) {
                         tcpreasm[i] = tcpreasm_ip_new ();
                         tcpreasm_ip_set_timeout(tcpreasm[i], 30000000);
+                        /* bytes per stream, MB in total */
+                        tcpreasm_ip_set_limits(tcpreasm[i], profile_socket[i].tcp_flow_buffer, (size_t) profile_socket[i].tcp_memory * 1024 * 1024);
                 }
                 else tcpreasm[i] = NULL;
 
-		if(profile_socket[i].capture_plan != NULL)
-		{
+		drops[i].kernel = metric_drops(module_name, profile_socket[i].name, DROP_KERNEL);
+		drops[i].interface = metric_drops(module_name, profile_socket[i].name, DROP_INTERFACE);
+		drops[i].reassembly = metric_drops(module_name, profile_socket[i].name, DROP_REASSEMBLY);
+		drops[i].reassembly_timeout = metric_drops(module_name, profile_socket[i].name, DROP_REASSEMBLY_TIMEOUT);
+		drops[i].reassembly_overlap = metric_drops(module_name, profile_socket[i].name, DROP_REASSEMBLY_OVERLAP);
+		if (merger && profile_socket[i].merge)
+			drops[i].queue_full = metric_drops(module_name, profile_socket[i].name, DROP_QUEUE_FULL);
+		if (shedder)
+			drops[i].load_shed = metric_drops(module_name, profile_socket[i].name, DROP_LOAD_SHED);
+
+		if (offline[i]) {
+			snprintf(label, sizeof(label), "profile=\"%s\"", profile_socket[i].name);
+			offline_stats[i].files = metric_counter("socket_pcap_offline_files_total", "pcap files read by the offline workers", label);
+			offline_stats[i].packets = metric_counter("socket_pcap_offline_packets_total", "Frames decoded by the offline workers", label);
+			free(arg);
+			offline_start(offline[i]);
+			continue;
+		}
 
-			snprintf(loadplan, sizeof(loadplan), "%s/%s", global_capture_plan_path, profile_socket[i].capture_plan);
+		pthread_create(&call_thread[i], NULL, proto_collect, arg);		
+	}
 
-						cfg_stream=fopen (loadplan, "r");
-			if (cfg_stream==0){
-			   fprintf(stderr, "ERROR: loading config file(%s): %s\n", loadplan, strerror(errno));
-			}
+	metric_collector_add(collect_drops, NULL);
+	capture_plan_watch_add(plan_reloaded, NULL);
 
-			yyin=cfg_stream;
-			if ((yyparse()!=0)||(cfg_errors)){
-			          fprintf(stderr, "ERROR: bad config file (%d errors)\n", cfg_errors);
-			          //goto error;
-			}
+	return 0;
+}
 
-			profile_socket[i].action = main_ct.idx;
-			
+/* checks of the plan the kernel can do for us, only with plan-pushdown */
+static void plan_pushdown(unsigned int loc_idx) {
+
+	char buf[PUSHDOWN_LEN], report[512];
+
+	free(filter_pushdown[loc_idx]);
+	filter_pushdown[loc_idx] = NULL;
+
+	if (!profile_socket[loc_idx].plan_pushdown || !profile_socket[loc_idx].capture_plan || profile_socket[loc_idx].action < 0) return;
+
+	/* the plan looks at the encapsulated packet */
+	if (profile_socket[loc_idx].erspan) {
+		LNOTICE("plan-pushdown on [%s] is not done with erspan", profile_socket[loc_idx].name);
+		return;
+	}
+
+	if (capture_plan_bpf(profile_socket[loc_idx].action, buf, sizeof(buf), report, sizeof(report)) > 0) {
+		filter_pushdown[loc_idx] = strdup(buf);
+		LNOTICE("capture plan checks done by the filter on [%s]: %s", profile_socket[loc_idx].name, report);
+	}
+	else LNOTICE("no capture plan checks to push down on [%s]", profile_socket[loc_idx].name);
+}
+
+/* a reloaded plan may guard with other checks, rebuild the filter if so */
+static void plan_reloaded(void *arg) {
+
+	char err[256], *old, *filter;
+	unsigned int i;
+	int changed;
+
+	for (i = 0; i < profile_size; i++) {
+
+		if (!profile_socket[i].plan_pushdown || !sniffer_proto[i]) continue;
+
+		pthread_mutex_lock(&filter_lock);
+		old = filter_pushdown[i];
+		filter_pushdown[i] = NULL;
+		plan_pushdown(i);
+		changed = (old == NULL) != (filter_pushdown[i] == NULL) || (old && strcmp(old, filter_pushdown[i]));
+		filter = profile_socket[i].filter ? strdup(profile_socket[i].filter) : NULL;
+		pthread_mutex_unlock(&filter_lock);
+
+		free(old);
+
+		if (changed && set_live_filter(i, filter, 0, err, sizeof(err)) < 0)
+			LERR("capture plan checks not pushed down on [%s]: %s", profile_socket[i].name, err);
+
+		free(filter);
+	}
+}
+
+/* kernel and reassembly counters are cumulative, add what is new since the last run */
+static void collect_drops(void *arg) {
+
+	socket_pcap_drops_t *d;
+	unsigned int i, dropped, timeout, overlap, kernel, interface;
+	static uint64_t last_merge_late = 0;
+	uint64_t late, files, packets;
+
+	for (i = 0; i < profile_size; i++) {
+
+		d = &drops[i];
+
+		/* published by the capture thread, files have no kernel stats */
+		kernel = __atomic_load_n(&d->ps_drop, __ATOMIC_RELAXED);
+		interface = __atomic_load_n(&d->ps_ifdrop, __ATOMIC_RELAXED);
+		metric_add(d->kernel, kernel - d->last.ps_drop);
+		metric_add(d->interface, interface - d->last.ps_ifdrop);
+		d->last.ps_drop = kernel;
+		d->last.ps_ifdrop = interface;
+
+		dropped = timeout = overlap = 0;
+		if (reasm[i]) {
+			dropped += reasm_ip_dropped_frags(reasm[i]);
+			timeout += reasm_ip_timed_out(reasm[i]);
+			overlap += reasm_ip_overlaps(reasm[i]);
+		}
+		if (tcpreasm[i]) {
+			dropped += tcpreasm_ip_dropped_frags(tcpreasm[i]);
+			timeout += tcpreasm_ip_timed_out(tcpreasm[i]);
 		}
+		/* what the offline workers reported of theirs */
+		dropped += __atomic_load_n(&offline_stats[i].reasm_dropped, __ATOMIC_RELAXED);
+		timeout += __atomic_load_n(&offline_stats[i].reasm_timeout, __ATOMIC_RELAXED);
+		overlap += __atomic_load_n(&offline_stats[i].reasm_overlap, __ATOMIC_RELAXED);
+
+		metric_add(d->reassembly, dropped - d->last_reasm_dropped);
+		metric_add(d->reassembly_timeout, timeout - d->last_reasm_timeout);
+		d->last_reasm_dropped = dropped;
+		d->last_reasm_timeout = timeout;
+		metric_add(d->reassembly_overlap, overlap - d->last_reasm_overlap);
+		d->last_reasm_overlap = overlap;
+	}
 
-		pthread_create(&call_thread[i], NULL, proto_collect, arg);		
+	for (i = 0; i < profile_size; i++) {
+		if (!offline[i]) continue;
+		files = __atomic_load_n(&offline[i]->files_done, __ATOMIC_RELAXED);
+		packets = __atomic_load_n(&offline[i]->packets, __ATOMIC_RELAXED);
+		metric_add(offline_stats[i].files, files - offline_stats[i].last_files);
+		metric_add(offline_stats[i].packets, packets - offline_stats[i].last_packets);
+		offline_stats[i].last_files = files;
+		offline_stats[i].last_packets = packets;
 	}
 
-	return 0;
+	if (merger) {
+		late = __atomic_load_n(&merger->late, __ATOMIC_RELAXED);
+		metric_add(stats.merge_late, late - last_merge_late);
+		last_merge_late = late;
+	}
 }
 
 static int unload_module(void) {
@@ -1053,12 +1807,45 @@ static int unload_module(void) {
 
 	LNOTICE("unloaded module %s", module_name);
 
-	for (i = 0; i < profile_size; i++) {
+	/* before any handle or reassembly table goes away */
+	metric_collector_remove(collect_drops, NULL);
+	capture_plan_watch_remove(plan_reloaded, NULL);
+
+	/* breakloop means stop from now on, not a filter swap */
+	__atomic_store_n(&capture_stopping, 1, __ATOMIC_RELEASE);
 
+	for (i = 0; i < profile_size; i++) {
 		if(sniffer_proto[i]) {
   		    pcap_breakloop(sniffer_proto[i]);
   		    pthread_join(call_thread[i],NULL);
 		}
+		/* the workers decode what was read, with their own tables */
+		if (offline[i]) {
+			offline_free(offline[i]);
+			offline[i] = NULL;
+		}
+	}
+
+	/* what is still in the rings goes through the plan, the tables are there yet */
+	if (merger) {
+		merge_free(merger);
+		merger = NULL;
+		metric_unregister(stats.merge_depth);
+		metric_unregister(stats.merge_max_depth);
+		metric_unregister(stats.merge_late);
+	}
+
+	for (i = 0; i < profile_size; i++) {
+
+		if (filter_pending[i]) {
+			pcap_freecode(filter_pending[i]);
+			free(filter_pending[i]);
+			filter_pending[i] = NULL;
+		}
+		free(filter_pushdown[i]);
+		filter_pushdown[i] = NULL;
+		free(filter_generated[i]);
+		filter_generated[i] = NULL;
 
 		if (reasm[i] != NULL) {
                 	reasm_ip_free(reasm[i]);  
@@ -1070,9 +1857,49 @@ static int unload_module(void) {
                         tcpreasm[i] = NULL;
                 }
 
+		pthread_rwlock_wrlock(&flight_lock);
+		call_index_free(calls[i]);
+		calls[i] = NULL;
+		flight_recorder_free(flight[i]);
+		flight[i] = NULL;
+		pthread_rwlock_unlock(&flight_lock);
+
+
+		metric_unregister(drops[i].kernel);
+		metric_unregister(drops[i].interface);
+		metric_unregister(drops[i].reassembly);
+		metric_unregister(drops[i].reassembly_timeout);
+		metric_unregister(drops[i].reassembly_overlap);
+		metric_unregister(drops[i].queue_full);
+		metric_unregister(drops[i].load_shed);
+		metric_unregister(offline_stats[i].files);
+		metric_unregister(offline_stats[i].packets);
 
 		free_profile(i);
 	}
+
+	memset(drops, 0, sizeof(drops));
+	memset(offline_stats, 0, sizeof(offline_stats));
+
+	/* capture threads are gone */
+	metric_unregister(stats.recieved_packets_total);
+	metric_unregister(stats.recieved_tcp_packets);
+	metric_unregister(stats.recieved_udp_packets);
+	metric_unregister(stats.recieved_sctp_packets);
+	metric_unregister(stats.send_packets);
+	metric_unregister(stats.decode_latency);
+	metric_unregister(stats.dedup_checked);
+	metric_unregister(stats.dedup_hits);
+	metric_unregister(stats.shed_level);
+	metric_unregister(stats.shed_lag);
+	for (i = 0; i <= SHED_CLASSES; i++) metric_unregister(stats.shed[i]);
+	memset(&stats, 0, sizeof(stats));
+
+	dedup_free(dedup_set);
+	dedup_set = NULL;
+	shed_free(shedder);
+	shedder = NULL;
+
 	/* Close socket */
 	//pcap_close(sniffer_proto);
 	return 0;
@@ -1087,6 +1914,7 @@ static int free_profile(unsigned int idx) {
 	if (profile_socket[idx].filter) free(profile_socket[idx].filter);
 	if (profile_socket[idx].capture_plan) free(profile_socket[idx].capture_plan);
 	if (profile_socket[idx].capture_filter) free(profile_socket[idx].capture_filter);
+	if (profile_socket[idx].shed_order) free(profile_socket[idx].shed_order);
 
 	return 1;
 }
@@ -1100,13 +1928,48 @@ static int description(char *descr) {
 static int statistic(char *buf, size_t len) {
 
 	int ret = 0;
+	unsigned int i;
+
+	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", metric_value(stats.recieved_packets_total));
+	ret += snprintf(buf+ret, len-ret, "TCP received: [%" PRId64 "]\r\n", metric_value(stats.recieved_tcp_packets));
+	ret += snprintf(buf+ret, len-ret, "UDP received: [%" PRId64 "]\r\n", metric_value(stats.recieved_udp_packets));
+	ret += snprintf(buf+ret, len-ret, "SCTP received: [%" PRId64 "]\r\n", metric_value(stats.recieved_sctp_packets));
+	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", metric_value(stats.send_packets));
+	ret += snprintf(buf+ret, len-ret, "Dedup: checked [%" PRId64 "], duplicates [%" PRId64 "]\r\n",
+			metric_value(stats.dedup_checked), metric_value(stats.dedup_hits));
+	if (shedder) {
+		ret += snprintf(buf+ret, len-ret, "Shed: level [%d/%d], capture lag [%" PRIu64 " ms]",
+				shed_level(shedder), shedder->classes, shed_lag(shedder) / 1000);
+		for (i = 1; i <= shedder->classes && ret < len; i++)
+			ret += snprintf(buf+ret, len-ret, ", %s [%" PRId64 "]", shedder->names[i], metric_value(stats.shed[i]));
+		if (ret < len) ret += snprintf(buf+ret, len-ret, "\r\n");
+	}
 
-	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", stats.recieved_packets_total);
-	ret += snprintf(buf+ret, len-ret, "TCP received: [%" PRId64 "]\r\n", stats.recieved_tcp_packets);
-	ret += snprintf(buf+ret, len-ret, "UDP received: [%" PRId64 "]\r\n", stats.recieved_udp_packets);
-	ret += snprintf(buf+ret, len-ret, "SCTP received: [%" PRId64 "]\r\n", stats.recieved_sctp_packets);
-	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", stats.send_packets);
-
+	for (i = 0; i < profile_size && ret < len; i++) {
+		ret += snprintf(buf+ret, len-ret, "Drops [%s]: kernel [%" PRId64 "], interface [%" PRId64 "], reassembly [%" PRId64 "], reassembly timeout [%" PRId64 "], overlap [%" PRId64 "]\r\n",
+				profile_socket[i].name, metric_value(drops[i].kernel), metric_value(drops[i].interface),
+				metric_value(drops[i].reassembly), metric_value(drops[i].reassembly_timeout), metric_value(drops[i].reassembly_overlap));
+		if (offline[i]) {
+			double secs = offline_elapsed(offline[i]);
+			uint64_t files = __atomic_load_n(&offline[i]->files_done, __ATOMIC_RELAXED);
+			uint64_t packets = __atomic_load_n(&offline[i]->packets, __ATOMIC_RELAXED);
+			if (secs <= 0) secs = 1e-6;
+			ret += snprintf(buf+ret, len-ret, "Offline [%s]: files [%" PRIu64 "/%u], failed [%" PRIu64 "], packets [%" PRIu64 "], %.1f files/s, %.0f packets/s%s\r\n",
+					profile_socket[i].name, files, offline[i]->files_count, __atomic_load_n(&offline[i]->files_failed, __ATOMIC_RELAXED),
+					packets, files / secs, packets / secs, offline[i]->end_us ? ", done" : "");
+		}
+		if (flight[i]) {
+			ret += snprintf(buf+ret, len-ret, "Flight recorder [%s]: size [%" PRIu64 "]%s, recorded [%" PRIu64 "], overwritten [%" PRIu64 "]\r\n",
+					profile_socket[i].name, flight[i]->size, flight[i]->hugepages ? " hugepages" : "",
+					__atomic_load_n(&flight[i]->records, __ATOMIC_RELAXED), __atomic_load_n(&flight[i]->overwritten, __ATOMIC_RELAXED));
+		}
+		if (calls[i]) {
+			pthread_mutex_lock(&calls[i]->lock);
+			ret += snprintf(buf+ret, len-ret, "Call index [%s]: calls [%u], max [%u], evicted [%" PRIu64 "]\r\n",
+					profile_socket[i].name, calls[i]->count, calls[i]->max_calls, calls[i]->evicted);
+			pthread_mutex_unlock(&calls[i]->lock);
+		}
+	}
 
 	return 1;
 }
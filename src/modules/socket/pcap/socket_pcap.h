@@ -28,6 +28,8 @@
 #define _SOCKET_PCAP_H_
 
 #include <captagent/xmlread.h>
+#include <captagent/metrics.h>
+#include "shed.h"
 
 extern char *usefile;
 extern int handler(int value);
@@ -54,36 +56,103 @@ int ipv6fragments=0;
 #define IPLEN_MASK 0b00001111
 
 #define MAX_SOCKETS 10
+/* packets per pcap_dispatch(), one capture batch */
+#define PCAP_BATCH 64
 profile_socket_t profile_socket[MAX_SOCKETS];
 
+/* updated by all capture threads, see captagent/metrics.h */
 typedef struct socket_pcap_stats {
-	uint64_t recieved_packets_total;
-	uint64_t recieved_tcp_packets;
-	uint64_t recieved_udp_packets;
-	uint64_t recieved_sctp_packets;
-	uint64_t send_packets;
+	metric_t *recieved_packets_total;
+	metric_t *recieved_tcp_packets;
+	metric_t *recieved_udp_packets;
+	metric_t *recieved_sctp_packets;
+	metric_t *send_packets;
+	metric_t *dedup_checked;
+	metric_t *dedup_hits;
+	/* merge of the profiles with merge=true */
+	metric_t *merge_depth;
+	metric_t *merge_max_depth;
+	metric_t *merge_late;
+	/* load shedding, shed per class */
+	metric_t *shed_level;
+	metric_t *shed_lag;
+	metric_t *shed[SHED_CLASSES + 1];
+	/* capture timestamp to the end of L2-L4 decode */
+	metric_t *decode_latency;
 } socket_pcap_stats_t;
 
-extern FILE* yyin;
-extern int yyparse();
+/* per profile drops_total, polled by collect_drops() */
+typedef struct socket_pcap_drops {
+	metric_t *kernel;
+	metric_t *interface;
+	metric_t *reassembly;
+	metric_t *reassembly_timeout;
+	metric_t *reassembly_overlap;
+	metric_t *queue_full;
+	metric_t *load_shed;
+	/* pcap_stats() of the capture thread, handles are not shared: atomic */
+	unsigned int ps_drop;
+	unsigned int ps_ifdrop;
+	struct pcap_stat last;
+	unsigned int last_reasm_dropped;
+	unsigned int last_reasm_timeout;
+	unsigned int last_reasm_overlap;
+} socket_pcap_drops_t;
+
+/* offline workers of a profile, polled by collect_drops() as well */
+typedef struct socket_pcap_offline_stats {
+	metric_t *files;
+	metric_t *packets;
+	uint64_t last_files;
+	uint64_t last_packets;
+	/* reassembly of the workers, each adds what is new in its own tables */
+	unsigned int reasm_dropped;
+	unsigned int reasm_timeout;
+	unsigned int reasm_overlap;
+} socket_pcap_offline_stats_t;
+
+/* frames an offline worker decodes between two reassembly reports */
+#define OFFLINE_REASM_REPORT 4096
+
 
 //lua_State *LUAScript[MAX_SOCKETS];
 
 int bind_api(socket_module_api_t* api);
 int reload_config (char *erbuf, int erlen);
 int apply_filter (filter_msg_t *filter);
+int dump_pcap(pcap_dump_filter_t *filter, pcap_dump_write_f write, void *arg);
+int dump_call(str *callid, pcap_dump_write_f write, void *arg);
+int w_call_index(msg_t *_m);
+int w_dedup(msg_t *_m);
+int w_shed(msg_t *_m);
 void free_module_xml_config();
 int load_module_xml_config();
 
 /* BIND */
 int bind_check_size(msg_t *_m, char *param1, char *param2);
 int set_raw_filter(unsigned int loc_idx, char *filter);
+int set_live_filter(unsigned int loc_idx, char *filter, int generated, char *err, size_t errlen);
 pcap_t* get_pcap_handler(unsigned int loc_idx);
 
 int dump_proto_packet(struct pcap_pkthdr *, u_char *, uint8_t, char *, uint32_t, char *,
             char *, uint16_t, uint16_t, uint8_t,uint16_t, uint8_t, uint16_t, uint32_t, uint32_t);
 
 
+/* how long set_live_filter() waits for the capture thread to take the filter */
+#define FILTER_SWAP_WAIT_MS 2000
+/* set_live_filter(): queued, the capture thread did not take it within the wait */
+#define FILTER_SWAP_PENDING 2
+
+/* seconds between two pcap_stats() of a capture thread */
+#define PCAP_STATS_INTERVAL 1
+
+/* frames wait in the kernel up to the read timeout, shed-lag has to clear
+ * that many timeouts or an idle capture would look late */
+#define SHED_LAG_TIMEOUTS 3
+
+/* longest BPF taken from the capture plan, leaves room for the filter */
+#define PUSHDOWN_LEN 1024
+
 /*IPv4 filter*/
 #define BPF_DEFRAGMENTION_FILTER_IPV4 "(ip[6:2] & 0x3fff != 0)"
 /*IPv6 filter*/
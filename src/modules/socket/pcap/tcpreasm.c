@@ -1,6 +1,7 @@
 /*
- * tcpreasm -- Routines for reassembly of fragmented IPv4 and IPv6 packets.
- * added tcp stream reassembling
+ * tcpreasm -- Routines for reassembly of TCP streams carrying SIP.
+ * Every direction of a connection is one stream, segments are put in
+ * sequence order and the bytes are framed into SIP messages.
  *
  * Copyright (c) 2007  Jan Andres <jandres@gmx.net>
  * Copyright (c) 2014  Alexandr Dubovikov  <alexandr.dubovikov@gmail.com>
@@ -11,483 +12,740 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <strings.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif /* HAVE_CONFIG_H */
 
-#include <netinet/ip.h>
-#include <netinet/udp.h>
-#if USE_IPv6
-#include <netinet/ip6.h>
-#endif /* USE_IPv6 */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 extern int debug_socket_pcap_enable;
 
 #include "tcpreasm.h"
 
 
-#define REASM_IP_HASH_SIZE 1021U
-
-
-enum entry_state {
-	STATE_ACTIVE,
-	STATE_INVALID,
-};
-
-
-enum tcpreasm_proto {
-	PROTO_IPV4,
-#if USE_IPv6
-	PROTO_IPV6,
-#endif /* USE_IPv6 */
-};
-
+#define REASM_IP_HASH_SIZE 4093U
 
 /*
- * This tuple uniquely identifies all fragments belonging to
- * the same IPv4 packet.
+ * Idle streams are found with a timer wheel. A stream sits in the slot of
+ * the tick it expires in, the timeout spans half the wheel so a slot never
+ * holds streams of two rounds.
  */
-struct tcpreasm_id_ipv4 {
-	uint8_t ip_src[4], ip_dst[4];
-	uint16_t ip_id;
-	uint8_t ip_proto;
-	uint16_t sport;
-	uint16_t dport;
-};
+#define TCPREASM_WHEEL 256U
 
+/* longest request method, "SIP/2.0 " for responses */
+#define SIP_METHOD_MAX 16
 
-/*
- * Same for IPv6.
- */
-struct tcpreasm_id_ipv6 {
+
+struct tcpreasm_key {
+	uint8_t family;
 	uint8_t ip_src[16], ip_dst[16];
-	uint32_t ip_id;
 	uint16_t sport;
 	uint16_t dport;
 };
 
 
-union tcpreasm_id {
-	struct tcpreasm_id_ipv4 ipv4;
-	struct tcpreasm_id_ipv6 ipv6;
+/* segment that arrived ahead of a hole, a copy */
+struct tcpreasm_seg {
+	uint32_t seq;
+	unsigned len;
+	struct tcpreasm_seg *next;
+	unsigned char data[];
 };
 
 
-struct tcpreasm_frag_entry {
-	unsigned len;  /* payload length of this fragment */
-	unsigned offset; /* offset of this fragment into the payload of the reassembled packet */
-	unsigned data_offset; /* offset to the data pointer where payload starts */
-	unsigned char *data; /* payload starts at data + data_offset */
-	struct tcpreasm_frag_entry *next;
-};
+struct tcpreasm_flow {
+	struct tcpreasm_key key;
+	unsigned hash;
+	uint32_t next_seq;
+	tcpreasm_time_t expire;
 
+	/* start of a message that did not fit in its segment */
+	unsigned char *buf;
+	unsigned buf_len, buf_size;
+	unsigned msg_len;       /* known once the headers are complete */
+	unsigned scan;          /* buffered bytes already searched for the header end */
+	unsigned skip;          /* rest of a message too big to buffer */
 
-/*
- * Reception of a complete packet is detected by counting the number
- * of "holes" that remain between the cached fragments. A hole is
- * assumed to exist at the upper end of the packet until the final
- * fragment has been received. When the number of holes drops to 0,
- * all fragments have been received and the packet can be reassembled.
- */
-struct tcpreasm_ip_entry {
-	union tcpreasm_id id;
-	unsigned len, holes, frag_count, hash, mss;
-	tcpreasm_time_t timeout;
-	enum entry_state state;
-	enum tcpreasm_proto protocol;
-	struct tcpreasm_frag_entry *frags;
-	struct tcpreasm_ip_entry *prev, *next;
-	struct tcpreasm_ip_entry *time_prev, *time_next;
+	struct tcpreasm_seg *ooo;
+	unsigned ooo_len;
+
+	struct tcpreasm_flow *next;
+	struct tcpreasm_flow *time_prev, *time_next;
 };
 
 
-/*
- * This struct contains some metadata, the main hash table, and a pointer
- * to the first entry that will time out. A linked list is kept in the
- * order in which packets will time out. Using a linked list for this
- * purpose requires that packets are input in chronological order, and
- * that a constant timeout value is used, which doesn't change even when
- * the entry's state transitions from active to invalid.
- */
 struct tcpreasm_ip {
-	struct tcpreasm_ip_entry *table[REASM_IP_HASH_SIZE];
-	struct tcpreasm_ip_entry *time_first, *time_last;
+	struct tcpreasm_flow *table[REASM_IP_HASH_SIZE];
+	struct tcpreasm_flow *wheel[TCPREASM_WHEEL];
+	tcpreasm_time_t timeout, tick_len;
+	uint64_t tick;
+	unsigned flow_max;
+	size_t memory, memory_max;
 	unsigned waiting, max_waiting, timed_out, dropped_frags;
-	tcpreasm_time_t timeout;
 };
 
 
-/*
- * Hash functions.
- */
-static unsigned tcpreasm_ipv4_hash (const struct tcpreasm_id_ipv4 *id);
-#if USE_IPv6
-static unsigned tcpreasm_ipv6_hash (const struct tcpreasm_id_ipv6 *id);
-#endif /* USE_IPv6 */
+static unsigned
+tcpreasm_hash (const struct tcpreasm_key *key)
+{
+	unsigned hash = 0;
+	int i;
 
-/*
- * Insert a new fragment to the correct position in the list of fragments.
- * Check for fragment overlap and other error conditions. Update the
- * "hole count".
- */
-static bool add_fragment_tcp (struct tcpreasm_ip_entry *entry, struct tcpreasm_frag_entry *frag, bool last_frag);
+	for (i = 0; i < 16; i++) {
+		hash = 37U * hash + key->ip_src[i];
+		hash = 37U * hash + key->ip_dst[i];
+	}
 
-/*
- * Is the entry complete, ready for reassembly?
- */
-/*
-static bool is_complete (struct tcpreasm_ip_entry *entry);
-*/
+	hash = 47U * hash + key->dport;
+	hash = 47U * hash + key->sport;
 
-static unsigned char *assemble_tcp (struct tcpreasm_ip_entry *entry, unsigned *output_len);
+	return hash;
+}
 
-/*
- * Drop and free entries.
- */
-static void drop_entry (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry);
-static void free_entry (struct tcpreasm_ip_entry *entry);
 
 /*
- * Dispose of any entries which have expired before "now".
+ * Timer wheel.
  */
-static void process_timeouts (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t now);
+static void
+wheel_unlink (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow)
+{
+	if (flow->time_prev != NULL)
+		flow->time_prev->time_next = flow->time_next;
+	else
+		tcpreasm->wheel[(flow->expire / tcpreasm->tick_len) % TCPREASM_WHEEL] = flow->time_next;
 
-/*
- * Create fragment structure from IPv6 packet. Returns NULL if the input
- * is not a fragment.
- * This function is called by parse_packet(), don't call it directly.
- */
-#if USE_IPv6
-static struct tcpreasm_frag_entry *frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag);
-#endif /* USE_IPv6 */
+	if (flow->time_next != NULL)
+		flow->time_next->time_prev = flow->time_prev;
+}
 
-/*
- * Compare packet identification tuples for specified protocol.
- */
-static bool tcpreasm_id_equal_tcp (enum tcpreasm_proto proto, const union tcpreasm_id *left, const union tcpreasm_id *right);
 
+static void
+wheel_link (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow, tcpreasm_time_t expire)
+{
+	unsigned slot = (expire / tcpreasm->tick_len) % TCPREASM_WHEEL;
+
+	flow->expire = expire;
+	flow->time_prev = NULL;
+	flow->time_next = tcpreasm->wheel[slot];
+	if (flow->time_next != NULL)
+		flow->time_next->time_prev = flow;
+	tcpreasm->wheel[slot] = flow;
+}
 
-static unsigned
-tcpreasm_ipv4_hash (const struct tcpreasm_id_ipv4 *id)
+
+static void
+free_flow (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow)
 {
-	unsigned hash = 0;
-	int i;
+	struct tcpreasm_seg *seg, *next;
 
-	for (i = 0; i < 4; i++) {
-		hash = 37U * hash + id->ip_src[i];
-		hash = 37U * hash + id->ip_dst[i];
+	for (seg = flow->ooo; seg != NULL; seg = next) {
+		next = seg->next;
+		tcpreasm->memory -= sizeof (*seg) + seg->len;
+		free (seg);
 	}
 
-	hash = 59U * hash + id->ip_id;
+	tcpreasm->memory -= sizeof (*flow) + flow->buf_size;
+	free (flow->buf);
+	free (flow);
+}
 
-	hash = 47U * hash + id->ip_proto;
-	hash = 47U * hash + id->dport;
-	hash = 47U * hash + id->sport;
 
-	return hash;
+/* a message was cut short if the stream still holds bytes */
+static inline bool
+pending (const struct tcpreasm_flow *flow)
+{
+	return flow->buf_len || flow->ooo || flow->skip;
 }
 
 
-#if USE_IPv6
-static unsigned
-tcpreasm_ipv6_hash (const struct tcpreasm_id_ipv6 *id)
+static void
+drop_flow (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow)
 {
-	unsigned hash = 0;
-	int i;
+	struct tcpreasm_flow **p = &tcpreasm->table[flow->hash];
 
-	for (i = 0; i < 16; i++) {
-		hash = 37U * hash + id->ip_src[i];
-		hash = 37U * hash + id->ip_dst[i];
-	}
+	while (*p != flow)
+		p = &(*p)->next;
+	*p = flow->next;
 
-	hash = 59U * hash + id->ip_id;
-	hash = 47U * hash + id->dport;
-	hash = 47U * hash + id->sport;
-	return hash;
+	wheel_unlink (tcpreasm, flow);
+
+	tcpreasm->waiting--;
+
+	free_flow (tcpreasm, flow);
 }
-#endif /* USE_IPv6 */
 
 
-unsigned char *
-tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len, struct in_addr *ip_src, struct in_addr *ip_dst, uint16_t sport, uint16_t dport, uint8_t psh)
+static void
+process_timeouts (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t now)
 {
-	enum tcpreasm_proto proto;
-	union tcpreasm_id id;
-	unsigned hash;
-	bool last_frag;
+	uint64_t now_tick = now / tcpreasm->tick_len, t;
+	struct tcpreasm_flow *flow, *next;
 
+	if (tcpreasm->tick == 0 || now_tick < tcpreasm->tick) {
+		tcpreasm->tick = now_tick;
+		return;
+	}
 
-	process_timeouts (tcpreasm, timestamp);
-		
-	struct tcpreasm_frag_entry *frag = NULL;
-	frag = malloc (sizeof (*frag));
-        if (frag == NULL)
-        	return NULL;
-
-	*frag = (struct tcpreasm_frag_entry) {
-        	.len = len,
-                .offset = 10 * 8,
-                .data_offset = len,
-                .data = packet,
-	};
-	
-	proto = PROTO_IPV4;
-	
-	memcpy (id.ipv4.ip_src, ip_src, 4);
-        memcpy (id.ipv4.ip_dst, ip_dst, 4);
-        id.ipv4.ip_id = 200;
-        id.ipv4.ip_proto = PROTO_IPV4;
-        id.ipv4.sport = sport;
-        id.ipv4.dport = dport;        
-        
-        hash = tcpreasm_ipv4_hash (&id.ipv4);
-                
-        if(debug_socket_pcap_enable) {
-        
-        	printf("\nTCPREASM: Proto [%d], Hash:[%d] SPORT: [%d], DPORT: [%d]\n", proto, hash, sport, dport);
-        }
-        
-	hash %= REASM_IP_HASH_SIZE;
-	struct tcpreasm_ip_entry *entry = tcpreasm->table[hash];
-		
-	while (entry != NULL && (!tcpreasm_id_equal_tcp (proto, &id, &entry->id)))
-		entry = entry->next;
-	
-	/* no buffer, go out */
-	if(psh == 1 && entry == NULL) {
-		free(frag);
-		if(debug_socket_pcap_enable) printf("RETURN PACKET BACK\n");
-		*output_len = len;
-		return packet;
-	}		
-
-	if (entry == NULL) {
-	
-		if(debug_socket_pcap_enable) printf("EMPTY ENTRY\n");
-        			
-		entry = malloc (sizeof (*entry));
-		if (entry == NULL) {
-			free (frag);
-			return NULL;
+	/* a jump of a whole round or more visits every slot once */
+	t = now_tick - tcpreasm->tick >= TCPREASM_WHEEL ? now_tick - TCPREASM_WHEEL + 1 : tcpreasm->tick;
+
+	for (; t <= now_tick; t++) {
+		for (flow = tcpreasm->wheel[t % TCPREASM_WHEEL]; flow != NULL; flow = next) {
+			next = flow->time_next;
+			if (flow->expire > now)
+				continue;
+			if (pending (flow))
+				tcpreasm->timed_out++;
+			drop_flow (tcpreasm, flow);
 		}
+	}
+
+	tcpreasm->tick = now_tick;
+}
 
-		struct tcpreasm_frag_entry *list_head = malloc (sizeof (*list_head));
-		if (list_head == NULL) {
-			free (frag);
-			free (entry);
-			return NULL;
+
+/*
+ * Makes room for size more bytes, dropping the streams that expire first
+ * but never keep. False if that is not enough.
+ */
+static bool
+reserve (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *keep, size_t size)
+{
+	struct tcpreasm_flow *flow, *next;
+	uint64_t t;
+
+	for (t = tcpreasm->tick; t < tcpreasm->tick + TCPREASM_WHEEL; t++) {
+		if (tcpreasm->memory + size <= tcpreasm->memory_max)
+			return true;
+
+		for (flow = tcpreasm->wheel[t % TCPREASM_WHEEL]; flow != NULL; flow = next) {
+			next = flow->time_next;
+			if (flow == keep)
+				continue;
+			if (pending (flow))
+				tcpreasm->dropped_frags++;
+			drop_flow (tcpreasm, flow);
+			if (tcpreasm->memory + size <= tcpreasm->memory_max)
+				return true;
 		}
+	}
 
-		*entry = (struct tcpreasm_ip_entry) {
-			.id = id,
-			.len = 0,
-			.holes = 1,
-			.frags = list_head,
-			.hash = hash,
-			.protocol = proto,
-			.mss = len,
-			.timeout = timestamp + tcpreasm->timeout,
-			.state = STATE_ACTIVE,
-			.prev = NULL,
-			.next = tcpreasm->table[hash],
-			.time_prev = tcpreasm->time_last,
-			.time_next = NULL,
-		};
-
-		*list_head = (struct tcpreasm_frag_entry) {
-			.len = 0,
-			.offset = 0,
-			.data_offset = 0,
-			.data = NULL,
-		};
-
-		if (entry->next != NULL)
-			entry->next->prev = entry;
-		tcpreasm->table[hash] = entry;
-
-		if (tcpreasm->time_last != NULL)
-			tcpreasm->time_last->time_next = entry;
-		else
-			tcpreasm->time_first = entry;
-		tcpreasm->time_last = entry;
+	return tcpreasm->memory + size <= tcpreasm->memory_max;
+}
+
+
+/*
+ * SIP framing.
+ */
+
+/* 1: a request or status line starts at p, 0: it does not, -1: too short to tell */
+static int
+sip_start (const unsigned char *p, unsigned len)
+{
+	unsigned i, n = len < 8 ? len : 8;
+
+	if (!memcmp (p, "SIP/2.0 ", n))
+		return n == 8 ? 1 : -1;
+
+	for (i = 0; i < len && i <= SIP_METHOD_MAX && p[i] >= 'A' && p[i] <= 'Z'; i++)
+		;
+
+	if (i == 0 || i > SIP_METHOD_MAX)
+		return 0;
+	if (i == len)
+		return -1;
+
+	return p[i] == ' ';
+}
 
-		tcpreasm->waiting++;
-		if (tcpreasm->waiting > tcpreasm->max_waiting)
-			tcpreasm->max_waiting = tcpreasm->waiting;
+
+/* offset of the next line that looks like the start of a message, len if none */
+static unsigned
+sip_resync (const unsigned char *p, unsigned len)
+{
+	const unsigned char *c = p, *end = p + len;
+
+	while ((c = memchr (c, '\n', end - c)) != NULL) {
+		c++;
+		if (c == end || sip_start (c, end - c) != 0)
+			return c - p;
 	}
 
-	if (entry->state != STATE_ACTIVE) {
-		tcpreasm->dropped_frags++;
-		return NULL;
+	return len;
+}
+
+
+/*
+ * 1 with *msg_len once the headers are in, the message may be longer than
+ * len. 0 if more bytes are needed, *scan keeps the search position.
+ * -1 if this is not a SIP message.
+ */
+static int
+sip_frame (const unsigned char *p, unsigned len, unsigned *msg_len, unsigned *scan)
+{
+	const unsigned char *c, *end = p + len, *line, *eol;
+	unsigned hdr_len, i;
+	long clen = 0;
+	int start;
+
+	if ((start = sip_start (p, len)) <= 0)
+		return start < 0 ? 0 : -1;
+
+	/* header end, an empty line */
+	for (c = p + (*scan > 3 ? *scan - 3 : 0); ; c++) {
+		if ((c = memchr (c, '\r', end - c)) == NULL || end - c < 4) {
+			*scan = len;
+			return 0;
+		}
+		if (c[1] == '\n' && c[2] == '\r' && c[3] == '\n')
+			break;
 	}
+	hdr_len = c + 4 - p;
 
-	
-	
-	if (!add_fragment_tcp (entry, frag, last_frag)) {
-		entry->state = STATE_INVALID;
-		tcpreasm->dropped_frags += entry->frag_count + 1;
-		return NULL;
+	/* Content-Length or its compact form, 0 without one */
+	for (line = memchr (p, '\n', hdr_len); line != NULL && line < p + hdr_len - 2; line = eol) {
+		line++;
+		eol = memchr (line, '\n', p + hdr_len - line);
+		if (eol == NULL)
+			break;
+
+		if (eol - line > 15 && !strncasecmp ((const char *) line, "content-length", 14))
+			i = 14;
+		else if (eol - line > 2 && (line[0] == 'l' || line[0] == 'L') && (line[1] == ':' || line[1] == ' ' || line[1] == '\t'))
+			i = 1;
+		else
+			continue;
+
+		while (line + i < eol && (line[i] == ' ' || line[i] == '\t'))
+			i++;
+		if (line[i] != ':')
+			continue;
+		for (i++; line + i < eol && (line[i] == ' ' || line[i] == '\t'); i++)
+			;
+		for (clen = 0; line + i < eol && line[i] >= '0' && line[i] <= '9' && clen < 0x7fffffff; i++)
+			clen = clen * 10 + (line[i] - '0');
+		break;
 	}
 
-	if(psh == 0) return NULL;
-	
-	/* workaround for ACK/PSH big messages */
-	if(entry->mss == len) return NULL;
-	
-	unsigned char *r = assemble_tcp (entry, output_len);
-
-	//printf("TCP REASSEM: [%d]\n", *output_len);
-	//printf("MESSAGE: [%s]\n", r);
-	
-	drop_entry (tcpreasm, entry);
-	return r;
+	if (clen > 0x7fffffff - (long) hdr_len)
+		return -1;
+
+	*msg_len = hdr_len + clen;
+
+	return 1;
 }
 
 
+/* appends len bytes to the stream buffer, false if over a limit */
 static bool
-add_fragment_tcp (struct tcpreasm_ip_entry *entry, struct tcpreasm_frag_entry *frag, bool last_frag)
+buffer_add (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow, const unsigned char *data, unsigned len)
 {
-	/*
-	 * When a fragment is inserted into the list, different cases can occur
-	 * concerning the number of holes.
-	 * - The new fragment can be inserted in the middle of a hole, such that
-	 *   it will split the hole in two. The number of holes increases by 1.
-	 * - The new fragment can be attached to one end of a hole, such that
-	 *   the rest of the hole remains at the opposite side of the fragment.
-	 *   The number of holes remains constant.
-	 * - The new fragment can fill a hole completely. The number of holes
-	 *   decreases by 1.
-	 */
-
-	struct tcpreasm_frag_entry *cur = entry->frags, *next = cur->next;
-
-	entry->len+=frag->len;
-
-	while (cur->next != NULL) cur = cur->next;
-	next = cur->next;
-
-	/* Fragment is to be inserted between cur and next; next may be NULL. */
-
-	if (frag->len != 0) {
-		frag->next = cur->next;
-		cur->next = frag;
-		entry->frag_count++;
-	} 
-	
+	unsigned size;
+	unsigned char *buf;
+
+	if (flow->buf_len + len > flow->buf_size) {
+
+		if (flow->buf_len + len + flow->ooo_len > tcpreasm->flow_max)
+			return false;
+
+		size = flow->buf_size ? flow->buf_size : 2048;
+		while (size < flow->buf_len + len)
+			size *= 2;
+		if (size > tcpreasm->flow_max)
+			size = tcpreasm->flow_max;
+
+		if (!reserve (tcpreasm, flow, size - flow->buf_size))
+			return false;
+		if ((buf = realloc (flow->buf, size)) == NULL)
+			return false;
+
+		tcpreasm->memory += size - flow->buf_size;
+		flow->buf = buf;
+		flow->buf_size = size;
+	}
+
+	memcpy (flow->buf + flow->buf_len, data, len);
+	flow->buf_len += len;
+
 	return true;
 }
 
 
+static void
+buffer_reset (struct tcpreasm_flow *flow)
+{
+	flow->buf_len = 0;
+	flow->msg_len = 0;
+	flow->scan = 0;
+}
 
-struct tcpreasm_ip *
-tcpreasm_ip_new (void)
+
+/* in order bytes of a stream, hands every complete message to fn */
+static void
+stream_data (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow, const unsigned char *data, unsigned len, tcpreasm_msg_f fn, void *arg)
 {
-	struct tcpreasm_ip *tcpreasm = malloc (sizeof (*tcpreasm));
-	if (tcpreasm == NULL)
-		return NULL;
+	unsigned n, msg_len, scan, extra;
+	int ret;
+
+	while (len > 0) {
+
+		/* body of a message too big to keep */
+		if (flow->skip) {
+			n = flow->skip < len ? flow->skip : len;
+			flow->skip -= n;
+			data += n;
+			len -= n;
+			continue;
+		}
 
-	memset (tcpreasm, 0, sizeof (*tcpreasm));
-	return tcpreasm;
+		if (flow->buf_len == 0) {
+
+			/* keepalive CRLFs between messages */
+			while (len > 0 && (*data == '\r' || *data == '\n')) {
+				data++;
+				len--;
+			}
+			if (len == 0)
+				break;
+
+			scan = 0;
+			ret = sip_frame (data, len, &msg_len, &scan);
+
+			if (ret < 0) {
+				/* not SIP, up to where a message may start */
+				n = sip_resync (data, len);
+				fn (data, n, arg);
+				data += n;
+				len -= n;
+				continue;
+			}
+
+			/* contiguous in the segment, no copy */
+			if (ret > 0 && msg_len <= len) {
+				fn (data, msg_len, arg);
+				data += msg_len;
+				len -= msg_len;
+				continue;
+			}
+
+			if (ret > 0 && msg_len > tcpreasm->flow_max) {
+				tcpreasm->dropped_frags++;
+				flow->skip = msg_len;
+				continue;
+			}
+
+			/* keep the start, the rest comes with the next segments */
+			if (!buffer_add (tcpreasm, flow, data, len)) {
+				tcpreasm->dropped_frags++;
+				fn (data, len, arg);
+				break;
+			}
+			flow->msg_len = ret > 0 ? msg_len : 0;
+			flow->scan = scan;
+			break;
+		}
+
+		if (flow->msg_len) {
+			n = flow->msg_len - flow->buf_len;
+			if (n > len)
+				n = len;
+			if (!buffer_add (tcpreasm, flow, data, n)) {
+				tcpreasm->dropped_frags++;
+				flow->skip = flow->msg_len - flow->buf_len;
+				buffer_reset (flow);
+				continue;
+			}
+			data += n;
+			len -= n;
+		}
+		else {
+			n = len;
+			if (!buffer_add (tcpreasm, flow, data, n)) {
+				/* headers never end, hand over what there is */
+				tcpreasm->dropped_frags++;
+				fn (flow->buf, flow->buf_len, arg);
+				buffer_reset (flow);
+				continue;
+			}
+			data += n;
+			len -= n;
+
+			ret = sip_frame (flow->buf, flow->buf_len, &msg_len, &flow->scan);
+			if (ret < 0) {
+				fn (flow->buf, flow->buf_len, arg);
+				buffer_reset (flow);
+				continue;
+			}
+			if (ret == 0)
+				continue;
+
+			/* the header end was not in the buffer before, so msg_len
+			 * is past that and the surplus is from this segment */
+			if (flow->buf_len > msg_len) {
+				extra = flow->buf_len - msg_len;
+				data -= extra;
+				len += extra;
+				flow->buf_len = msg_len;
+			}
+			flow->msg_len = msg_len;
+
+			if (msg_len > tcpreasm->flow_max) {
+				tcpreasm->dropped_frags++;
+				flow->skip = msg_len - flow->buf_len;
+				buffer_reset (flow);
+				continue;
+			}
+		}
+
+		if (flow->buf_len == flow->msg_len) {
+			fn (flow->buf, flow->msg_len, arg);
+			buffer_reset (flow);
+		}
+	}
 }
 
 
-void
-tcpreasm_ip_free (struct tcpreasm_ip *tcpreasm)
+/* keeps a segment that is ahead of the stream, sorted by sequence */
+static bool
+queue_segment (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow, uint32_t seq, const unsigned char *data, unsigned len)
 {
-	while (tcpreasm->time_first != NULL)
-		drop_entry (tcpreasm, tcpreasm->time_first);
-	free (tcpreasm);
+	struct tcpreasm_seg **p, *seg;
+
+	for (p = &flow->ooo; *p != NULL && (int32_t) ((*p)->seq - seq) < 0; p = &(*p)->next)
+		;
+
+	/* retransmitted */
+	if (*p != NULL && (*p)->seq == seq && (*p)->len >= len)
+		return true;
+
+	if (flow->buf_len + flow->ooo_len + len > tcpreasm->flow_max)
+		return false;
+	if (!reserve (tcpreasm, flow, sizeof (*seg) + len))
+		return false;
+	if ((seg = malloc (sizeof (*seg) + len)) == NULL)
+		return false;
+
+	seg->seq = seq;
+	seg->len = len;
+	memcpy (seg->data, data, len);
+	seg->next = *p;
+	*p = seg;
+
+	flow->ooo_len += len;
+	tcpreasm->memory += sizeof (*seg) + len;
+
+	return true;
 }
 
-/*
-static bool
-is_complete (struct tcpreasm_ip_entry *entry)
+
+/* feeds the queued segments the stream has caught up with */
+static void
+drain_queue (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow, tcpreasm_msg_f fn, void *arg)
+{
+	struct tcpreasm_seg *seg;
+	uint32_t off;
+
+	while ((seg = flow->ooo) != NULL && (int32_t) (seg->seq - flow->next_seq) <= 0) {
+
+		flow->ooo = seg->next;
+		flow->ooo_len -= seg->len;
+		tcpreasm->memory -= sizeof (*seg) + seg->len;
+
+		off = flow->next_seq - seg->seq;
+		if (off < seg->len) {
+			flow->next_seq += seg->len - off;
+			stream_data (tcpreasm, flow, seg->data + off, seg->len - off, fn, arg);
+		}
+
+		free (seg);
+	}
+}
+
+
+/* the hole won't be filled, go on after it with a fresh message */
+static void
+skip_hole (struct tcpreasm_ip *tcpreasm, struct tcpreasm_flow *flow, tcpreasm_msg_f fn, void *arg)
 {
-	return entry->holes == 0;
+	tcpreasm->dropped_frags++;
+
+	buffer_reset (flow);
+	flow->skip = 0;
+	flow->next_seq = flow->ooo->seq;
+
+	drain_queue (tcpreasm, flow, fn, arg);
 }
-*/
 
-static unsigned char *
-assemble_tcp (struct tcpreasm_ip_entry *entry, unsigned *output_len)
+
+static struct tcpreasm_flow *
+new_flow (struct tcpreasm_ip *tcpreasm, const struct tcpreasm_key *key, unsigned hash, tcpreasm_time_t now)
 {
-	struct tcpreasm_frag_entry *frag = entry->frags->next; /* skip list head */
-	unsigned offset0 = frag->data_offset;
-	unsigned char *p = malloc (entry->len + offset0);
-	unsigned tlen = 0;
-	
-	//printf("TOTAL LEN: %d\n", entry->len);
-	
-	if (p == NULL)
+	struct tcpreasm_flow *flow;
+
+	if (!reserve (tcpreasm, NULL, sizeof (*flow)))
+		return NULL;
+	if ((flow = calloc (1, sizeof (*flow))) == NULL)
 		return NULL;
 
-	switch (entry->protocol) {
-		case PROTO_IPV4:
-			break;
+	flow->key = *key;
+	flow->hash = hash;
+	flow->next = tcpreasm->table[hash];
+	tcpreasm->table[hash] = flow;
+	wheel_link (tcpreasm, flow, now + tcpreasm->timeout);
 
-#if USE_IPv6
-		case PROTO_IPV6:
-			offset0 -= 8; /* size of frag header */
-			break;
-#endif /* USE_IPv6 */
+	tcpreasm->memory += sizeof (*flow);
+	tcpreasm->waiting++;
+	if (tcpreasm->waiting > tcpreasm->max_waiting)
+		tcpreasm->max_waiting = tcpreasm->waiting;
+
+	return flow;
+}
+
+
+void
+tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, int family, const void *ip_src, const void *ip_dst,
+		uint16_t sport, uint16_t dport, uint32_t seq, uint8_t flags,
+		const unsigned char *data, unsigned len, tcpreasm_time_t timestamp, tcpreasm_msg_f fn, void *arg)
+{
+	struct tcpreasm_key key;
+	struct tcpreasm_flow *flow;
+	unsigned hash, alen = family == AF_INET6 ? 16 : 4;
+	int32_t diff;
+
+	process_timeouts (tcpreasm, timestamp);
+
+	memset (&key, 0, sizeof (key));
+	key.family = family;
+	memcpy (key.ip_src, ip_src, alen);
+	memcpy (key.ip_dst, ip_dst, alen);
+	key.sport = sport;
+	key.dport = dport;
 
-		default:
+	hash = tcpreasm_hash (&key) % REASM_IP_HASH_SIZE;
+
+	for (flow = tcpreasm->table[hash]; flow != NULL; flow = flow->next)
+		if (!memcmp (&flow->key, &key, sizeof (key)))
 			break;
+
+	if (debug_socket_pcap_enable)
+		printf ("\nTCPREASM: Hash:[%u] SPORT: [%d], DPORT: [%d], SEQ: [%u], LEN: [%u], FLAGS: [0x%x]\n", hash, sport, dport, seq, len, flags);
+
+	if (flags & TH_RST) {
+		if (flow != NULL) {
+			if (pending (flow))
+				tcpreasm->dropped_frags++;
+			drop_flow (tcpreasm, flow);
+		}
+		return;
+	}
+
+	/* a new connection on the same ports starts over */
+	if (flow != NULL && (flags & TH_SYN)) {
+		if (pending (flow))
+			tcpreasm->dropped_frags++;
+		drop_flow (tcpreasm, flow);
+		flow = NULL;
 	}
 
-	*output_len = entry->len;
+	if (flow == NULL) {
+		if (len == 0 && !(flags & TH_SYN))
+			return;
 
-	/* join all the payload fragments together */
-	while (frag != NULL) {		
-		memcpy (p + tlen, frag->data, frag->len);
-		tlen += frag->len;			
-		frag = frag->next;
+		if ((flow = new_flow (tcpreasm, &key, hash, timestamp)) == NULL) {
+			/* no memory for another stream, the segment goes as it is */
+			tcpreasm->dropped_frags++;
+			if (len)
+				fn (data, len, arg);
+			return;
+		}
+
+		/* joined a running connection, its bytes start here */
+		flow->next_seq = seq;
+	}
+	else {
+		wheel_unlink (tcpreasm, flow);
+		wheel_link (tcpreasm, flow, timestamp + tcpreasm->timeout);
 	}
 
-	return p;
-}
+	/* SYN takes one sequence number */
+	if (flags & TH_SYN) {
+		seq++;
+		flow->next_seq = seq;
+	}
 
+	if (len > 0) {
+		diff = (int32_t) (seq - flow->next_seq);
 
-static void
-drop_entry (struct tcpreasm_ip *tcpreasm, struct tcpreasm_ip_entry *entry)
-{
-	if (entry->prev != NULL)
-		entry->prev->next = entry->next;
-	else
-		tcpreasm->table[entry->hash] = entry->next;
+		if (diff < 0) {
+			/* retransmission, maybe with some new bytes */
+			if ((unsigned) -diff >= len)
+				goto fin;
+			data += -diff;
+			len -= -diff;
+			diff = 0;
+		}
 
-	if (entry->next != NULL)
-		entry->next->prev = entry->prev;
+		if (diff > 0) {
+			if (!queue_segment (tcpreasm, flow, seq, data, len)) {
+				/* can't wait for the hole any longer */
+				if (flow->ooo == NULL || (int32_t) (seq - flow->ooo->seq) < 0) {
+					tcpreasm->dropped_frags++;
+					buffer_reset (flow);
+					flow->skip = 0;
+					flow->next_seq = seq + len;
+					stream_data (tcpreasm, flow, data, len, fn, arg);
+					drain_queue (tcpreasm, flow, fn, arg);
+				}
+				else {
+					skip_hole (tcpreasm, flow, fn, arg);
+					if (queue_segment (tcpreasm, flow, seq, data, len))
+						drain_queue (tcpreasm, flow, fn, arg);
+				}
+			}
+		}
+		else {
+			flow->next_seq += len;
+			stream_data (tcpreasm, flow, data, len, fn, arg);
+			drain_queue (tcpreasm, flow, fn, arg);
+		}
+	}
 
-	if (entry->time_prev != NULL)
-		entry->time_prev->time_next = entry->time_next;
-	else
-		tcpreasm->time_first = entry->time_next;
+fin:
+	if (flags & TH_FIN) {
+		if (pending (flow))
+			tcpreasm->dropped_frags++;
+		drop_flow (tcpreasm, flow);
+	}
+}
 
-	if (entry->time_next != NULL)
-		entry->time_next->time_prev = entry->time_prev;
-	else
-		tcpreasm->time_last = entry->time_prev;
 
-	tcpreasm->waiting--;
+struct tcpreasm_ip *
+tcpreasm_ip_new (void)
+{
+	struct tcpreasm_ip *tcpreasm = malloc (sizeof (*tcpreasm));
+	if (tcpreasm == NULL)
+		return NULL;
 
-	free_entry (entry);
+	memset (tcpreasm, 0, sizeof (*tcpreasm));
+	tcpreasm->tick_len = 1;
+	tcpreasm->flow_max = TCPREASM_FLOW_MAX;
+	tcpreasm->memory_max = TCPREASM_MEMORY_MAX;
+	return tcpreasm;
 }
 
 
-static void
-free_entry (struct tcpreasm_ip_entry *entry)
+void
+tcpreasm_ip_free (struct tcpreasm_ip *tcpreasm)
 {
-	struct tcpreasm_frag_entry *frag = entry->frags, *next;
-	while (frag != NULL) {
-		next = frag->next;
-		if (frag->data != NULL)
-			free (frag->data);
-		free (frag);
-		frag = next;
-	}
+	unsigned i;
 
-	free (entry);
+	for (i = 0; i < REASM_IP_HASH_SIZE; i++)
+		while (tcpreasm->table[i] != NULL)
+			drop_flow (tcpreasm, tcpreasm->table[i]);
+	free (tcpreasm);
 }
 
 
@@ -522,124 +780,26 @@ tcpreasm_ip_dropped_frags (const struct tcpreasm_ip *tcpreasm)
 bool
 tcpreasm_ip_set_timeout (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t timeout)
 {
-	if (tcpreasm->time_first != NULL)
+	if (tcpreasm->waiting != 0)
 		return false;
 
 	tcpreasm->timeout = timeout;
+	tcpreasm->tick_len = timeout / (TCPREASM_WHEEL / 2);
+	if (tcpreasm->tick_len == 0)
+		tcpreasm->tick_len = 1;
 	return true;
 }
 
 
-static void
-process_timeouts (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t now)
-{
-	while (tcpreasm->time_first != NULL && tcpreasm->time_first->timeout < now) {
-		tcpreasm->timed_out++;
-		drop_entry (tcpreasm, tcpreasm->time_first);
-	}
-}
-
-
-#if USE_IPv6
-static struct tcpreasm_frag_entry *
-frag_from_ipv6 (unsigned char *packet, uint32_t *ip_id, bool *last_frag)
+bool
+tcpreasm_ip_set_limits (struct tcpreasm_ip *tcpreasm, unsigned flow_max, size_t memory_max)
 {
-	struct ip6_hdr *ip6_header = (struct ip6_hdr *) packet;
-	unsigned offset = 40; /* IPv6 header size */
-	uint8_t nxt = ip6_header->ip6_nxt;
-	unsigned total_len = 40 + ntohs (ip6_header->ip6_plen);
-	unsigned last_nxt = offsetof (struct ip6_hdr, ip6_nxt);
-
-	/*
-	 * IPv6 extension headers from RFC 2460:
-	 *   0 Hop-by-Hop Options
-	 *  43 Routing
-	 *  44 Fragment
-	 *  60 Destination Options
-	 *
-	 * We look out for the Fragment header; the other 3 header
-	 * types listed above are recognized and considered safe to
-	 * skip over if they occur before the Fragment header.
-	 * Any unrecognized header will cause processing to stop and
-	 * a subsequent Fragment header to stay unrecognized.
-	 */
-	while (nxt == IPPROTO_HOPOPTS || nxt == IPPROTO_ROUTING || nxt == IPPROTO_DSTOPTS) {
-		if (offset + 2 > total_len)
-			return NULL;  /* header extends past end of packet */
-
-		unsigned exthdr_len = 8 + 8 * packet[offset + 1];
-		if (offset + exthdr_len > total_len)
-			return NULL;  /* header extends past end of packet */
-
-		nxt = packet[offset];
-		last_nxt = offset;
-		offset += exthdr_len;
-	}
-
-	if (nxt != IPPROTO_FRAGMENT)
-		return NULL;
-
-	if (offset + 8 > total_len)
-		return NULL;  /* Fragment header extends past end of packet */
-
-	struct tcpreasm_frag_entry *frag = malloc (sizeof (*frag));
-	if (frag == NULL)
-		return NULL;
-
-	struct ip6_frag *frag_header = (struct ip6_frag *) (packet + offset);
-	offset += 8;
-
-	/*
-	 * The Fragment header will be removed on reassembly, so we have to
-	 * replace the Next Header field of the previous header (which is
-	 * currently IPPROTO_FRAGMENT), with the Next Header field of the
-	 * Fragment header.
-	 *
-	 * XXX We really shouldn't manipulate the input packet in-place.
-	 */
-	packet[last_nxt] = frag_header->ip6f_nxt;
-
-	*frag = (struct tcpreasm_frag_entry) {
-		.len = total_len - offset,
-		.data_offset = offset,
-		.offset = ntohs (frag_header->ip6f_offlg & IP6F_OFF_MASK),
-		.data = packet,
-	};
-
-	*ip_id = ntohl (frag_header->ip6f_ident);
-	*last_frag = (frag_header->ip6f_offlg & IP6F_MORE_FRAG) == 0;
-
-	return frag;
-}
-#endif /* USE_IPv6 */
-
+	if (tcpreasm->waiting != 0)
+		return false;
 
-static bool
-tcpreasm_id_equal_tcp (enum tcpreasm_proto proto, const union tcpreasm_id *left, const union tcpreasm_id *right)
-{
-	switch (proto) {
-		case PROTO_IPV4:
-			return memcmp (left->ipv4.ip_src, right->ipv4.ip_src, 4) == 0
-				&& memcmp (left->ipv4.ip_dst, right->ipv4.ip_dst, 4) == 0
-				&& left->ipv4.ip_id == right->ipv4.ip_id
-				&& left->ipv4.sport == right->ipv4.sport
-				&& left->ipv4.dport == right->ipv4.dport
-				&& left->ipv4.ip_proto == right->ipv4.ip_proto;
-#if USE_IPv6
-		case PROTO_IPV6:
-			return memcmp (left->ipv6.ip_src, right->ipv6.ip_src, 16) == 0
-				&& memcmp (left->ipv6.ip_dst, right->ipv6.ip_dst, 16) == 0
-				&& left->ipv6.sport == right->ipv6.sport
-				&& left->ipv6.dport == right->ipv6.dport
-				&& left->ipv6.ip_id == right->ipv6.ip_id;
-#endif /* USE_IPv6 */
-		default:
-			return memcmp (left->ipv4.ip_src, right->ipv4.ip_src, 4) == 0
-				&& memcmp (left->ipv4.ip_dst, right->ipv4.ip_dst, 4) == 0
-				&& left->ipv4.ip_id == right->ipv4.ip_id
-				&& left->ipv4.sport == right->ipv4.sport
-				&& left->ipv4.dport == right->ipv4.dport
-				&& left->ipv4.ip_proto == right->ipv4.ip_proto;
-	}
+	if (flow_max)
+		tcpreasm->flow_max = flow_max;
+	if (memory_max)
+		tcpreasm->memory_max = memory_max;
+	return true;
 }
-
@@ -2,20 +2,35 @@
 #define _TCPIPREASM_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include <pcap.h>
 
 
 /*
- * This is an abstract time stamp. iptcpreasm doesn't care whether it is
+ * This is an abstract time stamp. tcpreasm doesn't care whether it is
  * in seconds, milliseconds, or nanodecades. All it does it add the
  * configured timeout value to it, and then compare it to the timstamps
- * of subsequent packets to decide whether a fragment has expired.
+ * of subsequent segments to decide whether a stream has gone idle.
  */
 typedef uint64_t tcpreasm_time_t;
 
 struct tcpreasm_ip;
 
+/* bytes one direction of a connection may hold back, the largest message */
+#define TCPREASM_FLOW_MAX (64 * 1024)
+/* all streams of one reassembly environment together */
+#define TCPREASM_MEMORY_MAX (64 * 1024 * 1024)
+
+/*
+ * Called for every SIP message framed out of a stream. data points into
+ * the captured segment when the message was contiguous in it, into the
+ * stream buffer otherwise, and is only valid during the call. Bytes that
+ * can't be framed as SIP are handed over as they came.
+ */
+typedef void (*tcpreasm_msg_f) (const unsigned char *data, unsigned len, void *arg);
+
 /*
  * Functions to create and destroy the reassembly environment.
  */
@@ -23,31 +38,29 @@ struct tcpreasm_ip *tcpreasm_ip_new (void);
 void tcpreasm_ip_free (struct tcpreasm_ip *tcpreasm);
 
 /*
- * This is the main packet processing function. It inputs one packet,
- * and MAY output one packet in turn. If the input was not a fragment,
- * it is passed unmodified. If the input was a fragment that completed
- * reassembly of a packet, the reassembled packet is output.
- * If more fragments are required for reassembly, or the input packet
- * is invalid for some reason, a NULL pointer is returned.
- *
- * The input must be a pointer allocated by malloc(). The output will
- * be a pointer allocated by malloc().
- *
- * Note that in the case of an IPv6 fragment, the input buffer will be
- * modified in-place. This is considered a bug and should be fixed in
- * the future.
+ * This is the main segment processing function. It inputs the payload of
+ * one TCP segment, family AF_INET or AF_INET6 with ip_src and ip_dst of 4
+ * or 16 bytes, flags the TCP flags. Segments are put in sequence order per
+ * direction of a connection, the byte stream is split into SIP messages
+ * with Content-Length and each one is passed to fn.
  */
-unsigned char *tcpreasm_ip_next (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len);
-
-unsigned char *tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, unsigned char *packet, unsigned len, tcpreasm_time_t timestamp, unsigned *output_len, struct in_addr *ip_src, struct in_addr *ip_dst, uint16_t sport, uint16_t dport, uint8_t psh);
+void tcpreasm_ip_next_tcp (struct tcpreasm_ip *tcpreasm, int family, const void *ip_src, const void *ip_dst,
+		uint16_t sport, uint16_t dport, uint32_t seq, uint8_t flags,
+		const unsigned char *data, unsigned len, tcpreasm_time_t timestamp, tcpreasm_msg_f fn, void *arg);
 
 
 /*
- * Set the timeout after which a noncompleted reassembly expires, in
- * abstract time units (see above for the definition of tcpreasm_time_t).
+ * Set the timeout after which an idle stream is dropped, in abstract time
+ * units (see above for the definition of tcpreasm_time_t).
  */
 bool tcpreasm_ip_set_timeout (struct tcpreasm_ip *tcpreasm, tcpreasm_time_t timeout);
 
+/*
+ * Bytes held per stream and in total, 0 keeps the default. The oldest
+ * streams are dropped when the total is reached.
+ */
+bool tcpreasm_ip_set_limits (struct tcpreasm_ip *tcpreasm, unsigned flow_max, size_t memory_max);
+
 /*
  * Query certain information about the current state.
  */
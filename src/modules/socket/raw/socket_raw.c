@@ -23,7 +23,7 @@
  *
 */
 
-
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -75,6 +75,7 @@
 #include "socket_raw.h"
 #include <captagent/log.h>
 #include <captagent/action.h>
+#include <captagent/trace.h>
 #include "localapi.h"
 
 
@@ -87,6 +88,7 @@ uint64_t module_serial = 0;
 char *module_description;
 
 static socket_raw_stats_t stats;
+static socket_raw_drops_t drops[MAX_SOCKETS];
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_t raw_thread[MAX_SOCKETS];
@@ -94,6 +96,7 @@ int socket_desc[MAX_SOCKETS];
 
 static int load_module(xml_node *config);
 static int unload_module(void);
+static void collect_drops(void *arg);
 static int description(char *descr);
 static int statistic(char *buf, size_t len);
 static uint64_t serial_module(void);
@@ -353,12 +356,10 @@ int set_raw_filter(unsigned int loc_idx, char *filter) {
 
 }
 
-/* Local raw receive loop */
-int raw_capture_rcv_loop(unsigned int loc_idx) {
+/* decodes the packet in slot s into s->msg, 0 if it is not one for the plan */
+static int raw_decode(unsigned int loc_idx, raw_slot_t *s, int len, struct timeval *tv) {
 
-	static char buf[BUF_SIZE + 1];
-	int len;
-	struct timeval tv;
+	char *buf = s->buf;
 	struct ip *iph;
 	struct udphdr *udph;
 	char* udph_start;
@@ -367,135 +368,163 @@ int raw_capture_rcv_loop(unsigned int loc_idx) {
 	char* end;
 	unsigned short dst_port;
 	unsigned short src_port;
-	char src_ip[250], dst_ip[250];
-	msg_t _msg;
+	msg_t *_msg = &s->msg;
 	uint32_t ip_ver;
 	uint8_t ip_proto = 0;
-	int action_idx = 0;
-	char mac_src[20], mac_dst[20];	        
 	struct ethhdr *eth = NULL;
-	struct run_act_ctx ctx;  
-	        
 
-	for (;;) {
+	TRACE_PROBE3(packet_receive, module_name, loc_idx, len);
 
-		len = recvfrom(socket_desc[loc_idx], buf, BUF_SIZE, 0x20, 0, 0);
+	/* MSG_TRUNC reports the length on the wire */
+	if (len > BUF_SIZE) len = BUF_SIZE;
 
-		gettimeofday(&tv, NULL);
+	end = buf + len;
 
-		if (len < 0) {
-			if (len == -1) {
-				LDEBUG("ERROR: raw_capture_rcv_loop:recvfrom: %s [%d]", strerror(errno), errno);
-				if ((errno == EINTR) || (errno == EWOULDBLOCK))
-					continue;
-				if(errno == EBADF)
-				{
-					break;
-					return 0;
-				}
-			} else {
-				LDEBUG("raw_capture_rcv_loop: recvfrom error: %d", len);
-				continue;
-			}
-		}
+	offset = link_offset[loc_idx];
 
-		end = buf + len;
+	if (len < (sizeof(struct ip) + sizeof(struct udphdr) + offset)) {
+		LDEBUG("received small packet: %d. Ignore it", len);
+		return 0;
+	}
 
-		offset = link_offset[loc_idx];
+	eth = (struct ethhdr *)buf;		        
 
-		if (len < (sizeof(struct ip) + sizeof(struct udphdr) + offset)) {
-			LDEBUG("received small packet: %d. Ignore it", len);
-			continue;
+	offset += ((ntohs((uint16_t) *(buf + 12)) == 0x8100) ? 4 : 0);
+
+	iph = (struct ip*) (buf + offset);
+
+	offset += iph->ip_hl * 4;
+
+	udph_start = buf + offset;
+
+	udph = (struct udphdr*) udph_start;
+	offset += sizeof(struct udphdr);
+
+	if ((buf + offset) > end) {
+		return 0;
+	}
+
+	udp_len = ntohs(udph->uh_ulen);
+	if ((udph_start + udp_len) != end) {
+		if ((udph_start + udp_len) > end) {
+			return 0;
 		}
+	}
 
-		eth = (struct ethhdr *)buf;		        
+	/* cut off the offset */
+	len -= offset;
 
-		offset += ((ntohs((uint16_t) *(buf + 12)) == 0x8100) ? 4 : 0);
+	if (len < MIN_UDP_PACKET) {
+		LDEBUG("probing packet received from: %d\n", len);
+		return 0;
+	}
 
-		iph = (struct ip*) (buf + offset);
+	snprintf(s->mac_src, sizeof(s->mac_src), "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X",eth->h_source[0] , eth->h_source[1] , eth->h_source[2] , eth->h_source[3] , eth->h_source[4] , eth->h_source[5]);
+	snprintf(s->mac_dst, sizeof(s->mac_dst), "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X", eth->h_dest[0] , eth->h_dest[1] , eth->h_dest[2] , eth->h_dest[3] , eth->h_dest[4] , eth->h_dest[5]);		        
 
-		offset += iph->ip_hl * 4;
+	/* currently only IPv4 */
+	snprintf(s->src_ip, 250, "%s", inet_ntoa(iph->ip_src));
+	snprintf(s->dst_ip, 250, "%s", inet_ntoa(iph->ip_dst));
 
-		udph_start = buf + offset;
+	/* fill dst_port && src_port */
+	dst_port = ntohs(udph->uh_dport);
+	src_port = ntohs(udph->uh_sport);
 
-		udph = (struct udphdr*) udph_start;
-		offset += sizeof(struct udphdr);
+	/* stats */
+	metric_inc(stats.recieved_packets_total);
+	metric_inc(stats.recieved_udp_packets);
+	if ((int32_t) len < 0)
+		len = 0;
 
-		if ((buf + offset) > end) {
-			continue;
-		}
+	memset(_msg, 0, sizeof(msg_t));
 
-		udp_len = ntohs(udph->uh_ulen);
-		if ((udph_start + udp_len) != end) {
-			if ((udph_start + udp_len) > end) {
-				continue;
-			}
-		}
+	if(!profile_socket[profile_size].full_packet) {
+		_msg->data = buf + offset;
+		_msg->len = len;		
+	}
+	else {
+		_msg->len = len + offset;
+		_msg->data = buf;				
+	}
+	
+	_msg->rcinfo.src_port = src_port;
+	_msg->rcinfo.dst_port = dst_port;
+	_msg->rcinfo.src_ip = s->src_ip;
+	_msg->rcinfo.dst_ip = s->dst_ip;
+	_msg->rcinfo.src_mac = s->mac_src;
+	_msg->rcinfo.dst_mac = s->mac_dst;		                 
+	_msg->rcinfo.ip_family = ip_ver = 4 ? AF_INET : AF_INET6;
+	_msg->rcinfo.ip_proto = ip_proto;
+	_msg->rcinfo.time_sec = tv->tv_sec;
+	_msg->rcinfo.time_usec = tv->tv_usec;
+	_msg->tcpflag = 0;
+	_msg->parse_it = 1;
 
-		/* cut off the offset */
-		len -= offset;
+	return 1;
+}
 
-		if (len < MIN_UDP_PACKET) {
-			LDEBUG("probing packet received from: %d\n", len);
-			continue;
-		}
+/* Local raw receive loop, up to batch packets per recvmmsg() go through the
+ * plan together */
+int raw_capture_rcv_loop(unsigned int loc_idx) {
 
-		snprintf(mac_src, sizeof(mac_src), "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X",eth->h_source[0] , eth->h_source[1] , eth->h_source[2] , eth->h_source[3] , eth->h_source[4] , eth->h_source[5]);
-		snprintf(mac_dst, sizeof(mac_dst), "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X", eth->h_dest[0] , eth->h_dest[1] , eth->h_dest[2] , eth->h_dest[3] , eth->h_dest[4] , eth->h_dest[5]);		        
+	raw_slot_t *slots;
+	struct mmsghdr *hdrs;
+	struct iovec *iov;
+	msg_t **msgs;
+	struct timeval tv;
+	struct run_act_ctx ctx;  
+	unsigned int batch, i;
+	int ret, count;
 
-		/* currently only IPv4 */
-		snprintf(src_ip, 250, "%s", inet_ntoa(iph->ip_src));
-		snprintf(dst_ip, 250, "%s", inet_ntoa(iph->ip_dst));
+	batch = profile_socket[loc_idx].batch ? profile_socket[loc_idx].batch : RAW_BATCH;
+	if (batch > CAPTURE_BATCH_MAX) batch = CAPTURE_BATCH_MAX;
 
-		/* fill dst_port && src_port */
-		dst_port = ntohs(udph->uh_dport);
-		src_port = ntohs(udph->uh_sport);
+	slots = malloc(batch * sizeof(raw_slot_t));
+	hdrs = calloc(batch, sizeof(struct mmsghdr));
+	iov = calloc(batch, sizeof(struct iovec));
+	msgs = calloc(batch, sizeof(msg_t *));
 
-		//LERR("IP: [%s:%d] ===> IP: [%s:%d]", src_ip, src_port, dst_ip, dst_port);
-		//LDEBUG("SNAPLEN: %d\n", offset);
+	if (!slots || !hdrs || !iov || !msgs) {
+		LERR("no memory for %u receive buffers", batch);
+		goto done;
+	}
 
-		/* stats */
-		stats.recieved_udp_packets++;
-		if ((int32_t) len < 0)
-			len = 0;
+	for (i = 0; i < batch; i++) {
+		iov[i].iov_base = slots[i].buf;
+		iov[i].iov_len = BUF_SIZE;
+		hdrs[i].msg_hdr.msg_iov = &iov[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-		memset(&_msg, 0, sizeof(msg_t));
+	for (;;) {
 
-		
-		//_msg.data = buf + ETHHDR_SIZE;
-		//_msg.len = len + offset;
-		if(!profile_socket[profile_size].full_packet) {
-			_msg.data = buf + offset;
-			_msg.len = len;		
+		ret = recvmmsg(socket_desc[loc_idx], hdrs, batch, MSG_TRUNC | MSG_WAITFORONE, NULL);
+
+		gettimeofday(&tv, NULL);
+
+		if (ret < 0) {
+			LDEBUG("ERROR: raw_capture_rcv_loop:recvmmsg: %s [%d]", strerror(errno), errno);
+			if(errno == EBADF)
+				break;
+			continue;
 		}
-		else {
-			_msg.len = len + offset;
-			_msg.data = buf;				
+
+		for (i = 0, count = 0; i < ret; i++) {
+			if (raw_decode(loc_idx, &slots[i], hdrs[i].msg_len, &tv))
+				msgs[count++] = &slots[i].msg;
 		}
-		
-		_msg.rcinfo.src_port = src_port;
-		_msg.rcinfo.dst_port = dst_port;
-		_msg.rcinfo.src_ip = src_ip;
-		_msg.rcinfo.dst_ip = dst_ip;
-		_msg.rcinfo.src_mac = mac_src;
-		_msg.rcinfo.dst_mac = mac_dst;		                 
-		_msg.rcinfo.ip_family = ip_ver = 4 ? AF_INET : AF_INET6;
-		_msg.rcinfo.ip_proto = ip_proto;
-		_msg.rcinfo.time_sec = tv.tv_sec;
-		_msg.rcinfo.time_usec = tv.tv_usec;
-		_msg.tcpflag = 0;
-		_msg.parse_it = 1;
-
-		//LERR("PACKET LEN: [%d], D: [%.*s]", _msg.len, _msg.len, buf);
-		memset(&ctx, 0, sizeof(struct run_act_ctx));
-		
-		action_idx = profile_socket[loc_idx].action;
-		run_actions(&ctx, main_ct.clist[action_idx], &_msg);
 
-		stats.send_packets++;
+		run_capture_batch(&ctx, profile_socket[loc_idx].action, msgs, count);
 
+		metric_add(stats.send_packets, count);
 	}
 
+done:
+	free(slots);
+	free(hdrs);
+	free(iov);
+	free(msgs);
+
 	return 0;
 }
 
@@ -621,10 +650,15 @@ static int load_module(xml_node *config) {
 	char *key, *value = NULL;
 	unsigned int i = 0;
 	char loadplan[1024];
-	FILE* cfg_stream;
 
 	LNOTICE("Loaded %s", module_name);
 
+	stats.recieved_packets_total = metric_counter("socket_raw_packets_received_total", "Packets received from the raw socket", NULL);
+	stats.recieved_tcp_packets = metric_counter("socket_raw_packets_received_proto_total", "Packets received by transport protocol", "proto=\"tcp\"");
+	stats.recieved_udp_packets = metric_counter("socket_raw_packets_received_proto_total", "Packets received by transport protocol", "proto=\"udp\"");
+	stats.recieved_sctp_packets = metric_counter("socket_raw_packets_received_proto_total", "Packets received by transport protocol", "proto=\"sctp\"");
+	stats.send_packets = metric_counter("socket_raw_packets_sent_total", "Packets handed to the capture plan", NULL);
+
 	load_module_xml_config();
 
 	/* READ CONFIG */
@@ -722,6 +756,8 @@ static int load_module(xml_node *config) {
                                                 profile_socket[profile_size].capture_plan = strdup(value);
                                         else if (!strncmp(key, "capture-filter", 14))
                                                 profile_socket[profile_size].capture_filter = strdup(value);
+                                        else if (!strncmp(key, "batch", 5))
+                                                profile_socket[profile_size].batch = atoi(value);
 
 				}
 
@@ -765,35 +801,46 @@ static int load_module(xml_node *config) {
 		{
 
 			snprintf(loadplan, sizeof(loadplan), "%s/%s", global_capture_plan_path, profile_socket[i].capture_plan);
-
-			cfg_stream=fopen (loadplan, "r");
-			if (cfg_stream==0){
-			   fprintf(stderr, "ERROR: loading config file(%s): %s\n", loadplan, strerror(errno));
-			}
-
-			yyin=cfg_stream;
-			if ((yyparse()!=0)||(cfg_errors)){
-			          fprintf(stderr, "ERROR: bad config file (%d errors)\n", cfg_errors);
-			          //goto error;
-			}
-			
-			profile_socket[i].action = main_ct.idx;
+			profile_socket[i].action = capture_plan_load(loadplan);
 			
 			//LERR("INDEX: %d, ENT: [%d]\n", main_ct.idx, main_ct.entries);
 		}
 
+		drops[i].kernel = metric_drops(module_name, profile_socket[i].name, DROP_KERNEL);
+
 		pthread_create(&raw_thread[i], NULL, proto_collect, arg);
 
 	}
 
+	metric_collector_add(collect_drops, NULL);
+
 	return 0;
 }
 
+static void collect_drops(void *arg) {
+
+	struct tpacket_stats st;
+	socklen_t len;
+	unsigned int i;
+
+	for (i = 0; i < profile_size; i++) {
+
+		if (!socket_desc[i]) continue;
+
+		len = sizeof(st);
+		if (getsockopt(socket_desc[i], SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+			metric_add(drops[i].kernel, st.tp_drops);
+	}
+}
+
 static int unload_module(void) {
 	unsigned int i = 0;
 
 	LNOTICE("unloaded module %s", module_name);
 
+	/* before the sockets are closed */
+	metric_collector_remove(collect_drops, NULL);
+
 	for (i = 0; i < profile_size; i++) {
 
 		if(socket_desc[i]) {
@@ -801,8 +848,18 @@ static int unload_module(void) {
 			pthread_join(raw_thread[i],NULL);
 		}
 
+		metric_unregister(drops[i].kernel);
 		free_profile(i);
 	}
+
+	memset(drops, 0, sizeof(drops));
+
+	metric_unregister(stats.recieved_packets_total);
+	metric_unregister(stats.recieved_tcp_packets);
+	metric_unregister(stats.recieved_udp_packets);
+	metric_unregister(stats.recieved_sctp_packets);
+	metric_unregister(stats.send_packets);
+	memset(&stats, 0, sizeof(stats));
 	/* Close socket */
 	//pcap_close(sniffer_proto);
 	return 0;
@@ -830,13 +887,17 @@ static int description(char *descr) {
 static int statistic(char *buf, size_t len) {
 
 	int ret = 0;
+	unsigned int i;
 
-	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", stats.recieved_packets_total);
-	ret += snprintf(buf+ret, len-ret, "TCP received: [%" PRId64 "]\r\n", stats.recieved_tcp_packets);
-	ret += snprintf(buf+ret, len-ret, "UDP received: [%" PRId64 "]\r\n", stats.recieved_udp_packets);
-	ret += snprintf(buf+ret, len-ret, "SCTP received: [%" PRId64 "]\r\n", stats.recieved_sctp_packets);
-	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", stats.send_packets);
+	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", metric_value(stats.recieved_packets_total));
+	ret += snprintf(buf+ret, len-ret, "TCP received: [%" PRId64 "]\r\n", metric_value(stats.recieved_tcp_packets));
+	ret += snprintf(buf+ret, len-ret, "UDP received: [%" PRId64 "]\r\n", metric_value(stats.recieved_udp_packets));
+	ret += snprintf(buf+ret, len-ret, "SCTP received: [%" PRId64 "]\r\n", metric_value(stats.recieved_sctp_packets));
+	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", metric_value(stats.send_packets));
 
+	for (i = 0; i < profile_size && ret < len; i++) {
+		ret += snprintf(buf+ret, len-ret, "Kernel drops [%s]: [%" PRId64 "]\r\n", profile_socket[i].name, metric_value(drops[i].kernel));
+	}
 
 	return 1;
 }
@@ -28,6 +28,7 @@
 #define _socket_raw_H_
 
 #include <captagent/xmlread.h>
+#include <captagent/metrics.h>
 
 #define FILTER_LEN 4080
 
@@ -39,6 +40,8 @@ extern char *global_scripts_path;
 
 #define BUF_SIZE 65535
 #define MIN_UDP_PACKET        18
+/* packets per recvmmsg(), one capture batch */
+#define RAW_BATCH 16
 
 /* SYNC this list: http://hep.sipcapture.org */
 #define PROTO_RTP    0x04
@@ -66,15 +69,28 @@ extern char *global_scripts_path;
 profile_socket_t profile_socket[MAX_SOCKETS];
 
 typedef struct socket_raw_stats {
-	uint64_t recieved_packets_total;
-	uint64_t recieved_tcp_packets;
-	uint64_t recieved_udp_packets;
-	uint64_t recieved_sctp_packets;
-	uint64_t send_packets;
+	metric_t *recieved_packets_total;
+	metric_t *recieved_tcp_packets;
+	metric_t *recieved_udp_packets;
+	metric_t *recieved_sctp_packets;
+	metric_t *send_packets;
 } socket_raw_stats_t;
 
-extern FILE* yyin;
-extern int yyparse();
+/* one received packet and the strings its msg_t points to */
+typedef struct raw_slot {
+	char buf[BUF_SIZE + 1];
+	char src_ip[250];
+	char dst_ip[250];
+	char mac_src[20];
+	char mac_dst[20];
+	msg_t msg;
+} raw_slot_t;
+
+/* per profile drops_total, PACKET_STATISTICS resets on read so no history is kept */
+typedef struct socket_raw_drops {
+	metric_t *kernel;
+} socket_raw_drops_t;
+
 extern unsigned int if_nametoindex(const char*);
 
 //lua_State *LUAScript[MAX_SOCKETS];
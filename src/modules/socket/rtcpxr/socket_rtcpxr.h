@@ -51,8 +51,6 @@ typedef struct socket_rtcpxr_stats {
 	uint64_t send_packets;
 } socket_rtcpxr_stats_t;
 
-extern FILE* yyin;
-extern int yyparse();
 
 int bind_api(socket_module_api_t* api);
 int reload_config (char *erbuf, int erlen);
@@ -65,6 +65,7 @@
 #include <captagent/modules.h>
 #include <captagent/log.h>
 #include <captagent/action.h>
+#include <captagent/trace.h>
 
 profile_socket_t profile_socket[MAX_SOCKETS];
 
@@ -173,6 +174,7 @@ void on_recv(uv_udp_t* handle, ssize_t nread, const uv_buf_t* rcvbuf, const stru
     }
 
     loc_idx = *((uint8_t *) handle->data);
+    TRACE_PROBE3(packet_receive, module_name, loc_idx, nread);
     
     gettimeofday(&tv, NULL);
 
@@ -212,7 +214,7 @@ void on_recv(uv_udp_t* handle, ssize_t nread, const uv_buf_t* rcvbuf, const stru
     if(nread > 150)
     {
             action_idx = profile_socket[loc_idx].action;
-            run_actions(&ctx, main_ct.clist[action_idx], &_msg);		                        
+            run_capture(&ctx, action_idx, &_msg);		                        
     }
     
 #if UV_VERSION_MAJOR == 0                            
@@ -352,7 +354,6 @@ static int load_module(xml_node *config) {
 	unsigned int i = 0;
 	//char module_api_name[256];
 	char loadplan[1024];
-	FILE* cfg_stream;
 
 	LNOTICE("Loaded %s", module_name);
 
@@ -462,18 +463,7 @@ static int load_module(xml_node *config) {
 		{
 
 			snprintf(loadplan, sizeof(loadplan), "%s/%s", global_capture_plan_path, profile_socket[i].capture_plan);
-			cfg_stream=fopen (loadplan, "r");
-
-			if (cfg_stream==0){
-			   fprintf(stderr, "ERROR: loading config file(%s): %s\n", loadplan, strerror(errno));
-			}
-
-			yyin=cfg_stream;
-			if ((yyparse()!=0)||(cfg_errors)){
-			          fprintf(stderr, "ERROR: bad config file (%d errors)\n", cfg_errors);
-			}
-
-			profile_socket[i].action = main_ct.idx;
+			profile_socket[i].action = capture_plan_load(loadplan);
 		}
 
 		// start thread
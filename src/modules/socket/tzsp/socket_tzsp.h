@@ -101,8 +101,6 @@ struct tzsp_tag {
 } __attribute__((packed));
 
 
-extern FILE* yyin;
-extern int yyparse();
 
 int bind_api(socket_module_api_t* api);
 int reload_config (char *erbuf, int erlen);
@@ -0,0 +1,1065 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Rotating file transport for offline analysis
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+/* O_DIRECT */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+#include <captagent/modules_api.h>
+#include <captagent/modules.h>
+#include "transport_file.h"
+#include "json_writer.h"
+#include <captagent/log.h>
+
+xml_node *module_xml_config = NULL;
+char *module_name="transport_file";
+uint64_t module_serial = 0;
+char *module_description = NULL;
+
+static transport_file_stats_t stats;
+
+static int load_module(xml_node *config);
+static int unload_module(void);
+static int description(char *descr);
+static int statistic(char *buf, size_t len);
+static int free_profile(unsigned int idx);
+static uint64_t serial_module(void);
+
+unsigned int profile_size = 0;
+
+static cmd_export_t cmds[] = {
+        {"transport_file_bind_api",  (cmd_function)bind_usrloc,   1, 0, 0, 0},
+        { "send_file", (cmd_function) w_send_file_api, 1, 0, 0, 0 },
+        {0, 0, 0, 0, 0, 0}
+};
+
+struct module_exports exports = {
+        "transport_file",
+        cmds,        /* Exported functions */
+        load_module,    /* module initialization function */
+        unload_module,
+        description,
+        statistic,
+        serial_module
+};
+
+file_sink_t file_sink_s[MAX_TRANPORTS];
+
+/* packet_id of the JSON records */
+static uint64_t packet_seq = 0;
+
+static pthread_t maintenance_thread;
+static volatile int maintenance_running = 0;
+
+static const char *format_ext[] = { "hep", "json" };
+static const char *compress_ext[] = { "", ".gz", ".zst" };
+
+int bind_usrloc(transport_module_api_t *api)
+{
+	api->send_f = send_file;
+	api->reload_f = reload_config;
+	api->module_name = module_name;
+
+        return 0;
+}
+
+int w_send_file_api(msg_t *_m, char *param1)
+{
+
+    _m->profile_name = param1;
+
+    return send_file(_m);
+}
+
+int reload_config (char *erbuf, int erlen) {
+
+	char module_config_name[500];
+	xml_node *config = NULL;
+
+	LNOTICE("reloading config for [%s]", module_name);
+
+	snprintf(module_config_name, 500, "%s/%s.xml", global_config_path, module_name);
+
+	if(xml_parse_with_report(module_config_name, erbuf, erlen)) {
+		unload_module();
+		load_module(config);
+		return 1;
+	}
+
+	return 0;
+}
+
+profile_transport_t* get_profile_by_name(char *name) {
+
+	unsigned int i = 0;
+
+	if(profile_size == 1) return &profile_transport[0];
+
+	for (i = 0; i < profile_size; i++) {
+
+		if(!strncmp(profile_transport[i].name, name, strlen(profile_transport[i].name))) {
+			return &profile_transport[i];
+		}
+	}
+
+	return NULL;
+}
+
+unsigned int get_profile_index_by_name(char *name) {
+
+	unsigned int i = 0;
+
+	if(profile_size == 1) return 0;
+
+	for (i = 0; i < profile_size; i++) {
+		if(!strncmp(profile_transport[i].name, name, strlen(profile_transport[i].name))) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+int send_file(msg_t *msg) {
+
+	file_sink_t *sink;
+	unsigned int idx, len = 0;
+	/* reused for every message, one per capture thread */
+	static __thread json_writer_t jw;
+	unsigned char *spill;
+	int ret = -1, n;
+
+	idx = get_profile_index_by_name(msg->profile_name);
+	sink = &file_sink_s[idx];
+
+	metric_inc(stats.recieved_packets_total);
+
+	if(!sink->buf) {
+		metric_inc(stats.errors_total);
+		goto done;
+	}
+
+	if(sink->format == FILE_FORMAT_JSON) {
+		/* encode outside of the lock, one line per record */
+		n = json_encode_msg(&jw, msg, __atomic_add_fetch(&packet_seq, 1, __ATOMIC_RELAXED), profile_transport[idx].capt_id, profile_transport[idx].flag == 1);
+		if(n < 0) {
+			LERR("JSON: no memory for message");
+			metric_inc(stats.errors_total);
+			goto done;
+		}
+		jw.buf[n] = '\n';
+		len = n + 1;
+	}
+	else {
+		len = hep_encoded_len(&msg->rcinfo, msg->len, profile_transport[idx].capt_password);
+		if(len == 0) {
+			metric_inc(sink->too_big);
+			goto done;
+		}
+	}
+
+	pthread_mutex_lock(&sink->lock);
+
+	/* size rotation, a record never spans two segments */
+	if(sink->fd >= 0 && sink->written + sink->buf_len > 0
+			&& sink->written + sink->buf_len + len > sink->segment_size) {
+		file_segment_close(idx);
+	}
+
+	if(sink->fd < 0 && file_segment_open(idx) < 0) {
+		pthread_mutex_unlock(&sink->lock);
+		metric_inc(stats.errors_total);
+		metric_inc(sink->drops);
+		goto done;
+	}
+
+	if(sink->format == FILE_FORMAT_JSON) {
+		ret = file_write_record(idx, (unsigned char *) jw.buf, len);
+	}
+	else {
+		/* HEP is encoded straight into the write buffer */
+		if(sink->buf_len + len > sink->buffer_size) ret = file_flush(idx, 0);
+		else ret = 0;
+		if(ret == 0 && sink->buf_len + len <= sink->buffer_size) {
+			hep_encode(sink->buf + sink->buf_len, &msg->rcinfo, msg->data, msg->len,
+					profile_transport[idx].capt_id, profile_transport[idx].capt_password);
+			sink->buf_len += len;
+		}
+		else if(ret == 0) {
+			/* bigger than what direct-io leaves after the flush: encode aside */
+			if((spill = malloc(len)) == NULL) {
+				LERR("no memory for a file record of [%u]", len);
+				ret = -1;
+			}
+			else {
+				hep_encode(spill, &msg->rcinfo, msg->data, msg->len,
+						profile_transport[idx].capt_id, profile_transport[idx].capt_password);
+				ret = file_write_record(idx, spill, len);
+				free(spill);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&sink->lock);
+
+	if(ret < 0) {
+		metric_inc(stats.errors_total);
+		metric_inc(sink->drops);
+		goto done;
+	}
+
+	metric_inc(stats.send_packets_total);
+	metric_add(stats.bytes_total, len);
+	ret = 1;
+
+done:
+	if(msg->mfree == 1) {
+		LDEBUG("LETS FREE IT!");
+		free(msg->data);
+	}
+	if(msg->corrdata) {
+		free(msg->corrdata);
+		msg->corrdata = NULL;
+	}
+
+	return ret;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while(len > 0) {
+		n = write(fd, buf, len);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* called with the sink lock held */
+int file_flush(unsigned int idx, int final) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	size_t len = sink->buf_len, rest = 0;
+	int flags;
+
+	if(len == 0 || sink->fd < 0) return 0;
+
+	/* O_DIRECT writes whole blocks only, the tail waits for the next flush */
+	if(sink->direct) {
+		rest = len % FILE_DIRECT_ALIGN;
+		len -= rest;
+	}
+
+	if(len > 0 && write_all(sink->fd, sink->buf, len) < 0) {
+		LERR("write to [%s] failed: %s", sink->path, strerror(errno));
+		sink->buf_len = 0;
+		return -1;
+	}
+
+	if(rest > 0 && final) {
+		/* last partial block of the segment goes through the page cache */
+		flags = fcntl(sink->fd, F_GETFL);
+		fcntl(sink->fd, F_SETFL, flags & ~O_DIRECT);
+		if(write_all(sink->fd, sink->buf + len, rest) < 0) {
+			LERR("write to [%s] failed: %s", sink->path, strerror(errno));
+			sink->buf_len = 0;
+			return -1;
+		}
+		len += rest;
+		rest = 0;
+	}
+	else if(rest > 0) {
+		memmove(sink->buf, sink->buf + len, rest);
+	}
+
+	sink->written += len;
+	sink->buf_len = rest;
+
+	return 0;
+}
+
+/* called with the sink lock held */
+int file_write_record(unsigned int idx, const unsigned char *data, size_t len) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	size_t n;
+
+	while(len > 0) {
+		n = sink->buffer_size - sink->buf_len;
+		if(n > len) n = len;
+
+		memcpy(sink->buf + sink->buf_len, data, n);
+		sink->buf_len += n;
+		data += n;
+		len -= n;
+
+		if(sink->buf_len == sink->buffer_size && file_flush(idx, 0) < 0) return -1;
+	}
+
+	return 0;
+}
+
+/* called with the sink lock held */
+int file_segment_open(unsigned int idx) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	char path[PATH_MAX], part[PATH_MAX + 8], stamp[32];
+	struct tm tm;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	sink->opened = time(NULL);
+	localtime_r(&sink->opened, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+	/* names sort in creation order, the scan at startup relies on it */
+	snprintf(path, sizeof(path), "%s/%s-%s-%06u.%s", sink->directory, sink->prefix, stamp,
+			sink->seq++ % 1000000, format_ext[sink->format]);
+	snprintf(part, sizeof(part), "%s.part", path);
+
+	if(sink->direct) flags |= O_DIRECT;
+
+	sink->fd = open(part, flags, 0644);
+	if(sink->fd < 0 && sink->direct && errno == EINVAL) {
+		LERR("O_DIRECT is not supported for [%s], using buffered writes", sink->directory);
+		sink->direct = 0;
+		sink->fd = open(part, flags & ~O_DIRECT, 0644);
+	}
+
+	if(sink->fd < 0) {
+		LERR("couldn't open segment [%s]: %s", part, strerror(errno));
+		return -1;
+	}
+
+	sink->path = strdup(path);
+	sink->written = 0;
+	sink->buf_len = 0;
+
+	LDEBUG("opened segment [%s]", path);
+
+	return 0;
+}
+
+/* called with the sink lock held */
+int file_segment_close(unsigned int idx) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	file_segment_t *seg;
+	char part[PATH_MAX + 8];
+	int ret;
+
+	if(sink->fd < 0) return 0;
+
+	ret = file_flush(idx, 1);
+	close(sink->fd);
+	sink->fd = -1;
+
+	snprintf(part, sizeof(part), "%s.part", sink->path);
+	if(rename(part, sink->path) < 0) {
+		LERR("couldn't rename segment [%s]: %s", part, strerror(errno));
+		ret = -1;
+	}
+
+	/* the maintenance thread compresses it and keeps the disk budget */
+	if((seg = malloc(sizeof(file_segment_t))) != NULL) {
+		seg->path = sink->path;
+		seg->size = sink->written;
+		seg->pending = sink->compress != FILE_COMPRESS_NONE;
+		seg->next = NULL;
+		if(sink->last) sink->last->next = seg;
+		else sink->segments = seg;
+		sink->last = seg;
+		sink->disk_used += seg->size;
+	}
+	else free(sink->path);
+
+	sink->path = NULL;
+	sink->written = 0;
+	metric_inc(stats.segments_total);
+
+	return ret;
+}
+
+#ifdef USE_ZLIB
+static int compress_gzip(FILE *in, const char *out, unsigned char *buf, size_t size)
+{
+	gzFile gz;
+	size_t n;
+	int ret = 0;
+
+	if((gz = gzopen(out, "wb6")) == NULL) return -1;
+
+	while((n = fread(buf, 1, size, in)) > 0) {
+		if(gzwrite(gz, buf, n) != (int) n) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if(gzclose(gz) != Z_OK) ret = -1;
+
+	return ret;
+}
+#endif /* USE_ZLIB */
+
+#ifdef USE_ZSTD
+static int compress_zstd(FILE *in, const char *out, unsigned char *buf, size_t size)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	unsigned char *obuf;
+	size_t osize = ZSTD_CStreamOutSize(), n, rem;
+	FILE *fout;
+	int ret = 0, last;
+
+	if((fout = fopen(out, "wb")) == NULL) return -1;
+
+	cctx = ZSTD_createCCtx();
+	obuf = malloc(osize);
+	if(!cctx || !obuf) {
+		ret = -1;
+		goto end;
+	}
+
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3);
+
+	do {
+		n = fread(buf, 1, size, in);
+		last = n < size;
+		input.src = buf;
+		input.size = n;
+		input.pos = 0;
+
+		do {
+			output.dst = obuf;
+			output.size = osize;
+			output.pos = 0;
+			rem = ZSTD_compressStream2(cctx, &output, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+			if(ZSTD_isError(rem) || fwrite(obuf, 1, output.pos, fout) != output.pos) {
+				ret = -1;
+				goto end;
+			}
+		} while(last ? rem != 0 : input.pos < input.size);
+
+	} while(!last);
+
+end:
+	if(fclose(fout)) ret = -1;
+	free(obuf);
+	ZSTD_freeCCtx(cctx);
+
+	return ret;
+}
+#endif /* USE_ZSTD */
+
+/* runs in the maintenance thread, returns the compressed file name */
+int file_compress_segment(const char *src, int compress, char **path, uint64_t *size) {
+
+	char out[PATH_MAX + 8], part[PATH_MAX + 16];
+	unsigned char *buf;
+	size_t bsize = 1024 * 1024;
+	struct stat st;
+	FILE *in;
+	int ret = -1;
+
+	snprintf(out, sizeof(out), "%s%s", src, compress_ext[compress]);
+	snprintf(part, sizeof(part), "%s.part", out);
+
+	if((in = fopen(src, "rb")) == NULL) return -1;
+	if((buf = malloc(bsize)) == NULL) {
+		fclose(in);
+		return -1;
+	}
+
+#ifdef USE_ZLIB
+	if(compress == FILE_COMPRESS_GZIP) ret = compress_gzip(in, part, buf, bsize);
+#endif /* USE_ZLIB */
+#ifdef USE_ZSTD
+	if(compress == FILE_COMPRESS_ZSTD) ret = compress_zstd(in, part, buf, bsize);
+#endif /* USE_ZSTD */
+
+	fclose(in);
+	free(buf);
+
+	if(ret < 0 || rename(part, out) < 0 || stat(out, &st) < 0) {
+		LERR("couldn't compress segment [%s]", src);
+		unlink(part);
+		return -1;
+	}
+
+	unlink(src);
+	*path = strdup(out);
+	*size = st.st_size;
+
+	return 0;
+}
+
+void file_enforce_budget(unsigned int idx) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	file_segment_t *seg;
+
+	if(sink->max_disk == 0) return;
+
+	/* the open segment counts as well but is never deleted */
+	while(1) {
+		pthread_mutex_lock(&sink->lock);
+		seg = sink->segments;
+		if(!seg || sink->disk_used + sink->written + sink->buf_len <= sink->max_disk) {
+			pthread_mutex_unlock(&sink->lock);
+			break;
+		}
+		sink->segments = seg->next;
+		if(!sink->segments) sink->last = NULL;
+		sink->disk_used -= seg->size;
+		pthread_mutex_unlock(&sink->lock);
+
+		if(unlink(seg->path) < 0 && errno != ENOENT) {
+			LERR("couldn't delete segment [%s]: %s", seg->path, strerror(errno));
+			metric_inc(stats.errors_total);
+		}
+		else {
+			LDEBUG("disk budget: deleted segment [%s]", seg->path);
+			metric_inc(stats.deleted_total);
+		}
+
+		free(seg->path);
+		free(seg);
+	}
+}
+
+void file_maintenance(unsigned int idx) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	file_segment_t *seg;
+	char *src, *path;
+	uint64_t size;
+	int ret;
+
+	pthread_mutex_lock(&sink->lock);
+	/* time rotation, also for profiles that went quiet */
+	if(sink->fd >= 0 && sink->segment_time > 0 && time(NULL) - sink->opened >= sink->segment_time) {
+		file_segment_close(idx);
+	}
+	pthread_mutex_unlock(&sink->lock);
+
+	/* only this thread removes segments, seg stays valid without the lock */
+	while(maintenance_running) {
+
+		pthread_mutex_lock(&sink->lock);
+		for(seg = sink->segments; seg && !seg->pending; seg = seg->next);
+		src = seg ? strdup(seg->path) : NULL;
+		pthread_mutex_unlock(&sink->lock);
+
+		if(!src) break;
+
+		ret = file_compress_segment(src, sink->compress, &path, &size);
+
+		pthread_mutex_lock(&sink->lock);
+		seg->pending = 0;
+		if(ret == 0) {
+			free(seg->path);
+			seg->path = path;
+			sink->disk_used = sink->disk_used - seg->size + size;
+			seg->size = size;
+		}
+		pthread_mutex_unlock(&sink->lock);
+
+		if(ret == 0) metric_inc(stats.compressed_total);
+		else metric_inc(stats.errors_total);
+
+		free(src);
+
+		file_enforce_budget(idx);
+	}
+
+	file_enforce_budget(idx);
+}
+
+void *file_maintenance_thread(void *arg) {
+
+	unsigned int i;
+
+	while(maintenance_running) {
+		for (i = 0; i < profile_size && maintenance_running; i++) {
+			if(file_sink_s[i].buf) file_maintenance(i);
+		}
+		sleep(1);
+	}
+
+	return NULL;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* pick up segments of an earlier run so they count against the budget */
+int file_scan_directory(unsigned int idx) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	file_segment_t *seg;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	char **names = NULL, **tmp, path[PATH_MAX], *ext;
+	size_t plen = strlen(sink->prefix), len;
+	unsigned int count = 0, cap = 0, i;
+
+	if((dir = opendir(sink->directory)) == NULL) {
+		LERR("couldn't open directory [%s]: %s", sink->directory, strerror(errno));
+		return -1;
+	}
+
+	while((de = readdir(dir)) != NULL) {
+
+		if(strncmp(de->d_name, sink->prefix, plen) || de->d_name[plen] != '-') continue;
+
+		/* segment left open by a crash, keep what made it to disk */
+		len = strlen(de->d_name);
+		if(len > 5 && !strcmp(de->d_name + len - 5, ".part")) {
+			snprintf(path, sizeof(path), "%s/%s", sink->directory, de->d_name);
+			/* a compression cut short: its source is still there and is done again */
+			if((len > 8 && !strncmp(de->d_name + len - 8, ".gz", 3))
+					|| (len > 9 && !strncmp(de->d_name + len - 9, ".zst", 4))) {
+				unlink(path);
+				continue;
+			}
+			ext = strdup(path);
+			ext[strlen(ext) - 5] = '\0';
+			if(rename(path, ext) < 0) {
+				free(ext);
+				continue;
+			}
+			free(ext);
+			de->d_name[len - 5] = '\0';
+		}
+
+		if(count == cap) {
+			cap = cap ? cap * 2 : 64;
+			if((tmp = realloc(names, cap * sizeof(char *))) == NULL) break;
+			names = tmp;
+		}
+		names[count++] = strdup(de->d_name);
+	}
+
+	closedir(dir);
+
+	if(count) qsort(names, count, sizeof(char *), name_cmp);
+
+	for (i = 0; i < count; i++) {
+
+		snprintf(path, sizeof(path), "%s/%s", sink->directory, names[i]);
+		free(names[i]);
+
+		if(stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+		if((seg = malloc(sizeof(file_segment_t))) == NULL) continue;
+
+		ext = strrchr(path, '.');
+		seg->path = strdup(path);
+		seg->size = st.st_size;
+		seg->pending = sink->compress != FILE_COMPRESS_NONE && ext && strcmp(ext, ".gz") && strcmp(ext, ".zst");
+		seg->next = NULL;
+
+		if(sink->last) sink->last->next = seg;
+		else sink->segments = seg;
+		sink->last = seg;
+		sink->disk_used += seg->size;
+	}
+
+	free(names);
+
+	if(count) LNOTICE("found [%u] segments, [%" PRIu64 "] bytes in [%s]", count, sink->disk_used, sink->directory);
+
+	return count;
+}
+
+static int64_t file_disk_used(void *arg) {
+
+	file_sink_t *sink = (file_sink_t *) arg;
+
+	return sink->disk_used + sink->written;
+}
+
+static int file_sink_init(unsigned int idx) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	char label[128];
+	size_t size;
+
+	if(!sink->directory) sink->directory = strdup("/var/lib/captagent");
+	if(!sink->prefix) sink->prefix = strdup("captagent");
+
+	if(mkdir(sink->directory, 0755) < 0 && errno != EEXIST) {
+		LERR("couldn't create directory [%s]: %s", sink->directory, strerror(errno));
+		return -1;
+	}
+
+#ifndef USE_ZLIB
+	if(sink->compress == FILE_COMPRESS_GZIP) {
+		LERR("gzip compression needs --enable-compression, segments stay uncompressed");
+		sink->compress = FILE_COMPRESS_NONE;
+	}
+#endif /* USE_ZLIB */
+#ifndef USE_ZSTD
+	if(sink->compress == FILE_COMPRESS_ZSTD) {
+		LERR("zstd compression needs --enable-zstd, segments stay uncompressed");
+		sink->compress = FILE_COMPRESS_NONE;
+	}
+#endif /* USE_ZSTD */
+
+	sink->segment_size *= 1024 * 1024;
+	sink->max_disk *= 1024 * 1024;
+
+	/* a full HEP message has to fit, whole blocks for O_DIRECT */
+	size = sink->buffer_size * 1024;
+	if(size < 65536) size = 65536;
+	size = (size + FILE_DIRECT_ALIGN - 1) & ~((size_t) FILE_DIRECT_ALIGN - 1);
+	sink->buffer_size = size;
+
+	if(posix_memalign((void **) &sink->buf, FILE_DIRECT_ALIGN, size)) {
+		LERR("no memory for file buffer");
+		sink->buf = NULL;
+		return -1;
+	}
+
+	file_scan_directory(idx);
+
+	snprintf(label, sizeof(label), "profile=\"%s\"", profile_transport[idx].name);
+	sink->disk = metric_gauge_fn("transport_file_disk_bytes", "Bytes in segment files", label, file_disk_used, sink);
+	sink->drops = metric_drops(module_name, profile_transport[idx].name, DROP_WRITE_ERROR);
+	sink->too_big = metric_drops(module_name, profile_transport[idx].name, DROP_TOO_BIG);
+
+	LNOTICE("file sink [%s/%s] format [%s] segment [%" PRIu64 "] bytes, [%u] sec", sink->directory, sink->prefix,
+			format_ext[sink->format], sink->segment_size, sink->segment_time);
+
+	return 0;
+}
+
+int load_module_xml_config() {
+
+	char module_config_name[500];
+	xml_node *next;
+	int i = 0;
+
+	snprintf(module_config_name, 500, "%s/%s.xml", global_config_path, module_name);
+
+	if ((module_xml_config = xml_parse(module_config_name)) == NULL) {
+		LERR("Unable to open configuration file: %s", module_config_name);
+		return -1;
+	}
+
+	/* check if this module is our */
+	next = xml_get("module", module_xml_config, 1);
+
+	if (next == NULL) {
+		LERR("wrong config for module: %s", module_name);
+		return -2;
+	}
+
+	for (i = 0; next->attr[i]; i++) {
+			if (!strncmp(next->attr[i], "name", 4)) {
+				if (strncmp(next->attr[i + 1], module_name, strlen(module_name))) {
+					return -3;
+				}
+			}
+			else if (!strncmp(next->attr[i], "serial", 6)) {
+				module_serial = atol(next->attr[i + 1]);
+			}
+			else if (!strncmp(next->attr[i], "description", 11)) {
+				module_description = next->attr[i + 1];
+			}
+	}
+
+	return 1;
+}
+
+void free_module_xml_config() {
+
+	/* now we are free */
+	if(module_xml_config) xml_free(module_xml_config);
+}
+
+/* modules external API */
+
+static int load_module(xml_node *config) {
+	xml_node *params, *profile, *settings;
+	char *key, *value = NULL;
+	unsigned int i = 0;
+
+	LNOTICE("Loaded %s", module_name);
+
+	stats.recieved_packets_total = metric_counter("transport_file_packets_received_total", "Messages passed to send_file", NULL);
+	stats.send_packets_total = metric_counter("transport_file_packets_written_total", "Records written", NULL);
+	stats.bytes_total = metric_counter("transport_file_bytes_written_total", "Record bytes written", NULL);
+	stats.segments_total = metric_counter("transport_file_segments_total", "Segments closed", NULL);
+	stats.compressed_total = metric_counter("transport_file_compressed_total", "Segments compressed", NULL);
+	stats.deleted_total = metric_counter("transport_file_deleted_total", "Segments deleted for the disk budget", NULL);
+	stats.errors_total = metric_counter("transport_file_errors_total", "Write and compression errors", NULL);
+
+	load_module_xml_config();
+	/* READ CONFIG */
+	profile = module_xml_config;
+
+	/* reset profile */
+	profile_size = 0;
+
+	while (profile) {
+
+		profile = xml_get("profile", profile, 1);
+
+		if (profile == NULL)
+			break;
+
+		if(!profile->attr[4] || strncmp(profile->attr[4], "enable", 6)) {
+			goto nextprofile;
+		}
+
+		/* if not equals "true" */
+		if(!profile->attr[5] || strncmp(profile->attr[5], "true", 4)) {
+			goto nextprofile;
+		}
+
+		/* set values */
+		memset(&profile_transport[profile_size], 0, sizeof(profile_transport_t));
+		memset(&file_sink_s[profile_size], 0, sizeof(file_sink_t));
+		profile_transport[profile_size].name = strdup(profile->attr[1]);
+		profile_transport[profile_size].description = strdup(profile->attr[3]);
+		profile_transport[profile_size].serial = atoi(profile->attr[7]);
+		profile_transport[profile_size].flag = 1;
+		file_sink_s[profile_size].fd = -1;
+		file_sink_s[profile_size].segment_size = FILE_SEGMENT_SIZE;
+		file_sink_s[profile_size].segment_time = FILE_SEGMENT_TIME;
+		file_sink_s[profile_size].buffer_size = FILE_BUFFER_SIZE;
+		file_sink_s[profile_size].max_disk = FILE_MAX_DISK;
+		pthread_mutex_init(&file_sink_s[profile_size].lock, NULL);
+
+		/* SETTINGS */
+		settings = xml_get("settings", profile, 1);
+
+		if (settings != NULL) {
+
+			params = settings;
+
+			while (params) {
+
+				params = xml_get("param", params, 1);
+				if (params == NULL) break;
+
+				if (params->attr[0] != NULL) {
+
+					/* bad parser */
+					if (strncmp(params->attr[0], "name", 4)) {
+						LERR("bad keys in the config");
+						goto nextparam;
+					}
+
+					key = params->attr[1];
+
+					if(params->attr[2] && params->attr[3] && !strncmp(params->attr[2], "value", 5)) {
+							value = params->attr[3];
+					}
+					else {
+						value = params->child->value;
+					}
+
+					if (key == NULL || value == NULL) {
+						LERR("bad values in the config");
+						goto nextparam;
+
+					}
+
+					if(!strncmp(key, "directory", 9)) file_sink_s[profile_size].directory = strdup(value);
+					else if(!strncmp(key, "prefix", 6)) file_sink_s[profile_size].prefix = strdup(value);
+					else if(!strncmp(key, "format", 6) && !strncmp(value, "json", 4)) file_sink_s[profile_size].format = FILE_FORMAT_JSON;
+					else if(!strncmp(key, "segment-size", 12)) file_sink_s[profile_size].segment_size = atoi(value);
+					else if(!strncmp(key, "segment-time", 12)) file_sink_s[profile_size].segment_time = atoi(value);
+					else if(!strncmp(key, "buffer-size", 11)) file_sink_s[profile_size].buffer_size = atoi(value);
+					else if(!strncmp(key, "max-disk", 8)) file_sink_s[profile_size].max_disk = atol(value);
+					else if(!strncmp(key, "direct-io", 9) && !strncmp(value, "true", 4)) file_sink_s[profile_size].direct = 1;
+					else if(!strncmp(key, "compression", 11) && !strncmp(value, "gzip", 4)) file_sink_s[profile_size].compress = FILE_COMPRESS_GZIP;
+					else if(!strncmp(key, "compression", 11) && !strncmp(value, "zstd", 4)) file_sink_s[profile_size].compress = FILE_COMPRESS_ZSTD;
+					else if(!strncmp(key, "capture-password", 17)) profile_transport[profile_size].capt_password = strdup(value);
+					else if(!strncmp(key, "capture-id", 11)) profile_transport[profile_size].capt_id = atoi(value);
+					else if(!strncmp(key, "payload-send", 12) && !strncmp(value, "false", 5)) profile_transport[profile_size].flag = 0;
+				}
+
+				nextparam:
+					params = params->next;
+
+			}
+		}
+
+		profile_size++;
+
+		nextprofile:
+			profile = profile->next;
+	}
+
+	/* free it */
+	free_module_xml_config();
+
+	for (i = 0; i < profile_size; i++) {
+		if(file_sink_init(i) < 0) LERR("file sink [%s] is disabled", profile_transport[i].name);
+	}
+
+	/* rotation by time, compression and the disk budget */
+	if(profile_size > 0) {
+		maintenance_running = 1;
+		if(pthread_create(&maintenance_thread, NULL, file_maintenance_thread, NULL)) {
+			LERR("couldn't start file maintenance thread");
+			maintenance_running = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int unload_module(void)
+{
+	unsigned int i = 0;
+
+	LNOTICE("unloaded module transport_file");
+
+	if(maintenance_running) {
+		maintenance_running = 0;
+		pthread_join(maintenance_thread, NULL);
+	}
+
+	for (i = 0; i < profile_size; i++) {
+
+			free_profile(i);
+	}
+
+	metric_unregister(stats.recieved_packets_total);
+	metric_unregister(stats.send_packets_total);
+	metric_unregister(stats.bytes_total);
+	metric_unregister(stats.segments_total);
+	metric_unregister(stats.compressed_total);
+	metric_unregister(stats.deleted_total);
+	metric_unregister(stats.errors_total);
+	memset(&stats, 0, sizeof(stats));
+
+    return 0;
+}
+
+static uint64_t serial_module(void)
+{
+	 return module_serial;
+}
+
+static int free_profile(unsigned int idx) {
+
+	file_sink_t *sink = &file_sink_s[idx];
+	file_segment_t *seg;
+
+	metric_unregister(sink->disk);
+	metric_unregister(sink->drops);
+	metric_unregister(sink->too_big);
+	sink->disk = NULL;
+	sink->drops = NULL;
+	sink->too_big = NULL;
+
+	/* the open segment is closed, uncompressed ones are picked up at next start */
+	pthread_mutex_lock(&sink->lock);
+	file_segment_close(idx);
+	pthread_mutex_unlock(&sink->lock);
+
+	while((seg = sink->segments) != NULL) {
+		sink->segments = seg->next;
+		free(seg->path);
+		free(seg);
+	}
+	sink->last = NULL;
+
+	/*free profile chars **/
+
+	if (profile_transport[idx].name)	 free(profile_transport[idx].name);
+	if (profile_transport[idx].description) free(profile_transport[idx].description);
+	if (profile_transport[idx].capt_password) free(profile_transport[idx].capt_password);
+	if (sink->directory) free(sink->directory);
+	if (sink->prefix) free(sink->prefix);
+	if (sink->buf) free(sink->buf);
+	sink->buf = NULL;
+
+	pthread_mutex_destroy(&sink->lock);
+
+	return 1;
+}
+
+
+static int description(char *descr)
+{
+       LNOTICE("Loaded description");
+       descr = module_description;
+       return 1;
+}
+
+static int statistic(char *buf, size_t len)
+{
+	int ret = 0;
+	unsigned int i = 0;
+
+	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", metric_value(stats.recieved_packets_total));
+	ret += snprintf(buf+ret, len-ret, "Errors total: [%" PRId64 "]\r\n", metric_value(stats.errors_total));
+	ret += snprintf(buf+ret, len-ret, "Total written: [%" PRId64 "]\r\n", metric_value(stats.send_packets_total));
+	ret += snprintf(buf+ret, len-ret, "Bytes written: [%" PRId64 "]\r\n", metric_value(stats.bytes_total));
+	ret += snprintf(buf+ret, len-ret, "Segments total: [%" PRId64 "]\r\n", metric_value(stats.segments_total));
+	ret += snprintf(buf+ret, len-ret, "Compressed total: [%" PRId64 "]\r\n", metric_value(stats.compressed_total));
+	ret += snprintf(buf+ret, len-ret, "Deleted total: [%" PRId64 "]\r\n", metric_value(stats.deleted_total));
+
+	for (i = 0; i < profile_size; i++) {
+		if(!file_sink_s[i].buf) continue;
+		ret += snprintf(buf+ret, len-ret, "Sink [%s] disk used: [%" PRIu64 "/%" PRIu64 "], write errors [%" PRId64 "]\r\n", profile_transport[i].name,
+				file_sink_s[i].disk_used + file_sink_s[i].written, file_sink_s[i].max_disk, metric_value(file_sink_s[i].drops));
+	}
+
+	return 1;
+}
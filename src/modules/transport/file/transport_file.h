@@ -0,0 +1,139 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Rotating file transport for offline analysis
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _transport_file_H_
+#define _transport_file_H_
+
+#include <captagent/xmlread.h>
+#include <captagent/metrics.h>
+
+#include <netinet/ip.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "hep_encode.h"
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif /* USE_ZLIB */
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif /* USE_ZSTD */
+
+#define MAX_TRANPORTS 10
+profile_transport_t profile_transport[MAX_TRANPORTS];
+
+/* defaults: segment size and disk budget in MB, buffer in KB */
+#define FILE_SEGMENT_SIZE 64
+#define FILE_SEGMENT_TIME 300
+#define FILE_BUFFER_SIZE 1024
+#define FILE_MAX_DISK 0
+/* O_DIRECT needs buffer, offset and length aligned to the logical block */
+#define FILE_DIRECT_ALIGN 4096
+
+#define FILE_FORMAT_HEP 0
+#define FILE_FORMAT_JSON 1
+
+#define FILE_COMPRESS_NONE 0
+#define FILE_COMPRESS_GZIP 1
+#define FILE_COMPRESS_ZSTD 2
+
+typedef struct transport_file_stats {
+	metric_t *recieved_packets_total;
+	metric_t *send_packets_total;
+	metric_t *bytes_total;
+	metric_t *segments_total;
+	metric_t *compressed_total;
+	metric_t *deleted_total;
+	metric_t *errors_total;
+} transport_file_stats_t;
+
+/* a closed segment on disk, oldest first */
+typedef struct file_segment {
+	char *path;
+	uint64_t size;
+	/* still waiting for the compression thread */
+	int pending;
+	struct file_segment *next;
+} file_segment_t;
+
+typedef struct file_sink {
+	char *directory;
+	char *prefix;
+	int format;
+	int compress;
+	int direct;
+	uint64_t segment_size;
+	unsigned int segment_time;
+	uint64_t max_disk;
+
+	/* open segment, path without the .part suffix */
+	int fd;
+	char *path;
+	uint64_t written;
+	time_t opened;
+	unsigned int seq;
+
+	/* records are collected here and written in buffer_size chunks */
+	unsigned char *buf;
+	size_t buf_len;
+	size_t buffer_size;
+
+	/* closed segments, bytes on disk without the open one */
+	file_segment_t *segments;
+	file_segment_t *last;
+	uint64_t disk_used;
+
+	pthread_mutex_t lock;
+	metric_t *disk;
+	/* drops_total reason write_error */
+	metric_t *drops;
+	/* drops_total reason too_big */
+	metric_t *too_big;
+} file_sink_t;
+
+extern char *global_config_path;
+
+profile_transport_t* get_profile_by_name(char *name);
+unsigned int get_profile_index_by_name(char *name);
+int bind_usrloc(transport_module_api_t *api);
+int send_file(msg_t *msg);
+int file_segment_open(unsigned int idx);
+int file_segment_close(unsigned int idx);
+int file_flush(unsigned int idx, int final);
+int file_write_record(unsigned int idx, const unsigned char *data, size_t len);
+int file_compress_segment(const char *src, int compress, char **path, uint64_t *size);
+void file_maintenance(unsigned int idx);
+void file_enforce_budget(unsigned int idx);
+int file_scan_directory(unsigned int idx);
+void *file_maintenance_thread(void *arg);
+void free_module_xml_config();
+int load_module_xml_config();
+int reload_config (char *erbuf, int erlen);
+/*API*/
+int w_send_file_api(msg_t *_m, char *param1);
+
+#endif /* _transport_file_H_ */
@@ -0,0 +1,174 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  HEPv3 encoder of the transports that write whole records (shm, file)
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+#include "hep_encode.h"
+
+unsigned int hep_encoded_len(rc_info_t *rcinfo, unsigned int len, const char *password) {
+
+	unsigned int tlen;
+
+	tlen = sizeof(hep_ctrl_t) + 2 * sizeof(hep_chunk_uint8_t) + 2 * sizeof(hep_chunk_uint16_t)
+		+ 2 * sizeof(hep_chunk_uint32_t) + sizeof(hep_chunk_uint8_t) + sizeof(hep_chunk_uint32_t);
+
+	if(rcinfo->ip_family == AF_INET) tlen += 2 * sizeof(hep_chunk_ip4_t);
+	else if(rcinfo->ip_family == AF_INET6) tlen += 2 * sizeof(hep_chunk_ip6_t);
+
+	if(password != NULL)
+		tlen += sizeof(hep_chunk_t) + strlen(password);
+
+	if(rcinfo->correlation_id.s && rcinfo->correlation_id.len > 0)
+		tlen += sizeof(hep_chunk_t) + rcinfo->correlation_id.len;
+
+	if(rcinfo->cval1) tlen += sizeof(hep_chunk_uint16_t);
+	if(rcinfo->cval2) tlen += sizeof(hep_chunk_uint16_t);
+
+	/* payload */
+	tlen += sizeof(hep_chunk_t) + len;
+
+	/* a longer one would wrap the length fields */
+	if(len > HEP_MAX_LEN || tlen > HEP_MAX_LEN) return 0;
+
+	return tlen;
+}
+
+static inline unsigned char *put_chunk(unsigned char *p, uint16_t type, unsigned int len)
+{
+	hep_chunk_t chunk;
+
+	chunk.vendor_id = htons(0x0000);
+	chunk.type_id = htons(type);
+	chunk.length = htons(len);
+	memcpy(p, &chunk, sizeof(chunk));
+
+	return p + sizeof(chunk);
+}
+
+/* same wire format as transport_hep send_hepv3() */
+unsigned int hep_encode(unsigned char *buf, rc_info_t *rcinfo, unsigned char *data, unsigned int len, uint32_t capt_id, const char *password) {
+
+	unsigned char *p = buf;
+	uint16_t u16;
+	uint32_t u32;
+	unsigned int plen;
+
+	if(hep_encoded_len(rcinfo, len, password) == 0) return 0;
+
+	memcpy(p, "\x48\x45\x50\x33", 4);
+	p += sizeof(hep_ctrl_t);
+
+	/* IP family, IP proto */
+	p = put_chunk(p, 0x0001, sizeof(hep_chunk_uint8_t));
+	*p++ = rcinfo->ip_family;
+	p = put_chunk(p, 0x0002, sizeof(hep_chunk_uint8_t));
+	*p++ = rcinfo->ip_proto;
+
+	/* SRC/DST IP */
+	if(rcinfo->ip_family == AF_INET) {
+		p = put_chunk(p, 0x0003, sizeof(hep_chunk_ip4_t));
+		inet_pton(AF_INET, rcinfo->src_ip, p);
+		p += sizeof(struct in_addr);
+		p = put_chunk(p, 0x0004, sizeof(hep_chunk_ip4_t));
+		inet_pton(AF_INET, rcinfo->dst_ip, p);
+		p += sizeof(struct in_addr);
+	}
+	else if(rcinfo->ip_family == AF_INET6) {
+		p = put_chunk(p, 0x0005, sizeof(hep_chunk_ip6_t));
+		inet_pton(AF_INET6, rcinfo->src_ip, p);
+		p += sizeof(struct in6_addr);
+		p = put_chunk(p, 0x0006, sizeof(hep_chunk_ip6_t));
+		inet_pton(AF_INET6, rcinfo->dst_ip, p);
+		p += sizeof(struct in6_addr);
+	}
+
+	/* SRC/DST PORT */
+	p = put_chunk(p, 0x0007, sizeof(hep_chunk_uint16_t));
+	u16 = htons(rcinfo->src_port);
+	memcpy(p, &u16, 2); p += 2;
+	p = put_chunk(p, 0x0008, sizeof(hep_chunk_uint16_t));
+	u16 = htons(rcinfo->dst_port);
+	memcpy(p, &u16, 2); p += 2;
+
+	/* TIMESTAMP */
+	p = put_chunk(p, 0x0009, sizeof(hep_chunk_uint32_t));
+	u32 = htonl(rcinfo->time_sec);
+	memcpy(p, &u32, 4); p += 4;
+	p = put_chunk(p, 0x000a, sizeof(hep_chunk_uint32_t));
+	u32 = htonl(rcinfo->time_usec);
+	memcpy(p, &u32, 4); p += 4;
+
+	/* Protocol TYPE */
+	p = put_chunk(p, 0x000b, sizeof(hep_chunk_uint8_t));
+	*p++ = rcinfo->proto_type;
+
+	/* Capture ID */
+	p = put_chunk(p, 0x000c, sizeof(hep_chunk_uint32_t));
+	u32 = htonl(capt_id);
+	memcpy(p, &u32, 4); p += 4;
+
+	/* AUTH KEY */
+	if(password != NULL) {
+		plen = strlen(password);
+		p = put_chunk(p, 0x000e, sizeof(hep_chunk_t) + plen);
+		memcpy(p, password, plen);
+		p += plen;
+	}
+
+	/* Correlation KEY */
+	if(rcinfo->correlation_id.s && rcinfo->correlation_id.len > 0) {
+		p = put_chunk(p, 0x0011, sizeof(hep_chunk_t) + rcinfo->correlation_id.len);
+		memcpy(p, rcinfo->correlation_id.s, rcinfo->correlation_id.len);
+		p += rcinfo->correlation_id.len;
+	}
+
+	if(rcinfo->cval1) {
+		p = put_chunk(p, 0x0020, sizeof(hep_chunk_uint16_t));
+		u16 = htons(rcinfo->cval1);
+		memcpy(p, &u16, 2); p += 2;
+	}
+
+	if(rcinfo->cval2) {
+		p = put_chunk(p, 0x0021, sizeof(hep_chunk_uint16_t));
+		u16 = htons(rcinfo->cval2);
+		memcpy(p, &u16, 2); p += 2;
+	}
+
+	/* PAYLOAD */
+	p = put_chunk(p, 0x000f, sizeof(hep_chunk_t) + len);
+	memcpy(p, data, len);
+	p += len;
+
+	/* total */
+	u16 = htons(p - buf);
+	memcpy(buf + 4, &u16, 2);
+
+	return p - buf;
+}
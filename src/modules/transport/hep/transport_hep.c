@@ -55,8 +55,10 @@
 #include <captagent/structure.h>
 #include <captagent/modules_api.h>
 #include <captagent/modules.h>
+#include <captagent/capture.h>
 #include "transport_hep.h"
 #include <captagent/log.h>
+#include <captagent/trace.h>
 #include "localapi.h"
 
 xml_node *module_xml_config = NULL;
@@ -77,6 +79,13 @@ static uint64_t serial_module(void);
 static void reconnect(int idx);
 static void set_conn_state(hep_connection_t* conn, conn_state_type_t new_conn_state);
 
+#ifdef USE_ZSTD
+static int zstd_init_profile(unsigned int idx);
+static void zstd_free_profile(unsigned int idx);
+static void zstd_add_sample(unsigned int idx, unsigned char *data, unsigned int len);
+static unsigned char *zstd_compress_payload(unsigned int idx, unsigned char *data, unsigned int len, size_t *dlen);
+#endif /* USE_ZSTD */
+
 #if UV_VERSION_MAJOR == 0                         
         /* need implement it */
 #else
@@ -107,6 +116,15 @@ struct module_exports exports = {
 };
 
 hep_connection_t hep_connection_s[MAX_TRANPORTS];
+/* requests of the calling capture thread's open batch, per connection */
+static __thread hep_request_t *batch_head[MAX_TRANPORTS];
+static __thread hep_request_t *batch_tail[MAX_TRANPORTS];
+static __thread unsigned int batch_len[MAX_TRANPORTS];
+#ifdef USE_ZSTD
+hep_zstd_t hep_zstd_s[MAX_TRANPORTS];
+/* compression contexts are not thread safe, every capture thread gets its own */
+static __thread ZSTD_CCtx *zstd_cctx = NULL;
+#endif /* USE_ZSTD */
 //hep_connection_t *hep_conn;
 
 int bind_usrloc(transport_module_api_t *api)
@@ -214,7 +232,7 @@ int send_hep (msg_t *msg) {
         idx = get_profile_index_by_name(msg->profile_name);
         rcinfo = &msg->rcinfo;
 
-        stats.recieved_packets_total++;
+        metric_inc(stats.recieved_packets_total);
 
         // Ensure we are connected by driving our state machine.
         ensure_connected(idx);
@@ -223,7 +241,7 @@ int send_hep (msg_t *msg) {
         int status = 0;
         unsigned long dlen;
 
-        if(profile_transport[idx].compression && profile_transport[idx].version == 3) {
+        if(profile_transport[idx].compression == HEP_COMPRESS_ZLIB && profile_transport[idx].version == 3) {
                 //dlen = len/1000+len*len+13;
 
                 dlen = compressBound(msg->len);
@@ -236,17 +254,39 @@ int send_hep (msg_t *msg) {
                 	  LERR("data couldn't be compressed");
                       sendzip = 0;
                       if(zipData) free(zipData); /* release */
+                      zipData = NULL;
                 }
                 else {
-                        sendzip = 1;
+                        sendzip = HEP_COMPRESS_ZLIB;
+                        metric_add(stats.compressed_bytes_in, msg->len);
+                        metric_add(stats.compressed_bytes_out, dlen);
                         msg->len = dlen;
                 }
 
-                stats.compressed_total++;
+                metric_inc(stats.compressed_total);
         }
 
 #endif /* USE_ZLIB */
 
+#ifdef USE_ZSTD
+        size_t zlen = 0;
+
+        if(profile_transport[idx].compression == HEP_COMPRESS_ZSTD && profile_transport[idx].version == 3) {
+
+                /* no dictionary yet: feed the trainer with SIP and send plain */
+                if(!__atomic_load_n(&hep_zstd_s[idx].cdict, __ATOMIC_ACQUIRE)) {
+                        if(rcinfo->proto_type == 0x01) zstd_add_sample(idx, msg->data, msg->len);
+                }
+                else if((zipData = zstd_compress_payload(idx, msg->data, msg->len, &zlen)) != NULL) {
+                        sendzip = HEP_COMPRESS_ZSTD;
+                        metric_add(stats.compressed_bytes_in, msg->len);
+                        metric_add(stats.compressed_bytes_out, zlen);
+                        msg->len = zlen;
+                        metric_inc(stats.compressed_total);
+                }
+        }
+#endif /* USE_ZSTD */
+
         switch(profile_transport[idx].version) {
 
             case 3:
@@ -263,11 +303,7 @@ int send_hep (msg_t *msg) {
                 break;
         }
 
-#ifdef USE_ZLIB
-
-        if(profile_transport[idx].compression && zipData) free(zipData);
-
-#endif /* USE_ZLIB */
+        if(zipData) free(zipData);
 
         if(msg->mfree == 1) {
              LDEBUG("LETS FREE IT!");
@@ -297,6 +333,9 @@ int send_hepv3 (rc_info_t *rcinfo, unsigned char *data, unsigned int len, unsign
     hep_chunk_t correlation_chunk;
     hep_chunk_uint16_t cval1;
     hep_chunk_uint16_t cval2;
+#ifdef USE_ZSTD
+    hep_chunk_uint32_t dictid;
+#endif /* USE_ZSTD */
             
     hg = malloc(sizeof(struct hep_generic));
     memset(hg, 0, sizeof(struct hep_generic));
@@ -434,6 +473,17 @@ int send_hepv3 (rc_info_t *rcinfo, unsigned char *data, unsigned int len, unsign
               cval2.data = htons(rcinfo->cval2);
               cval2.chunk.length = htons(sizeof(cval2));    
     }
+
+#ifdef USE_ZSTD
+    /* zstd dictionary ID, lets the collector pick the right dictionary */
+    if(sendzip == HEP_COMPRESS_ZSTD) {
+              tlen += sizeof(hep_chunk_uint32_t);
+              dictid.chunk.vendor_id = htons(HEP_VENDOR_HOMER);
+              dictid.chunk.type_id   = htons(HEP_VENDOR_ZSTD_DICT_ID);
+              dictid.data = htonl(hep_zstd_s[idx].dict_id);
+              dictid.chunk.length = htons(sizeof(dictid));
+    }
+#endif /* USE_ZSTD */
     
     /* total */
     hg->header.length = htons(tlen);
@@ -502,6 +552,14 @@ int send_hepv3 (rc_info_t *rcinfo, unsigned char *data, unsigned int len, unsign
            buflen += sizeof(hep_chunk_uint16_t);
     }    
 
+#ifdef USE_ZSTD
+    /* ZSTD DICTIONARY ID CHUNK */
+    if(sendzip == HEP_COMPRESS_ZSTD) {
+           memcpy((void*) buffer+buflen, &dictid,  sizeof(hep_chunk_uint32_t));
+           buflen += sizeof(hep_chunk_uint32_t);
+    }
+#endif /* USE_ZSTD */
+
     /* PAYLOAD CHUNK */
     memcpy((void*) buffer+buflen, &payload_chunk,  sizeof(struct hep_chunk));
     buflen +=  sizeof(struct hep_chunk);
@@ -510,8 +568,11 @@ int send_hepv3 (rc_info_t *rcinfo, unsigned char *data, unsigned int len, unsign
     memcpy((void*) buffer+buflen, data, len);
     buflen+=len;
 
+    metric_latency(stats.encode_latency, rcinfo->time_sec, rcinfo->time_usec);
+    TRACE_PROBE2(hep_encode, idx, buflen);
+
     /* send this packet out of our socket */
-    send_data(buffer, buflen, idx);
+    send_data(rcinfo, buffer, buflen, idx);
        
 
     if(hg) free(hg);
@@ -611,8 +672,11 @@ int send_hepv2 (rc_info_t *rcinfo, unsigned char *data, unsigned int len, unsign
      memcpy((void *)(buffer + buflen) , (void*)(data), len);
      buflen +=len;
 
+     metric_latency(stats.encode_latency, rcinfo->time_sec, rcinfo->time_usec);
+     TRACE_PROBE2(hep_encode, idx, buflen);
+
      /* send this packet out of our socket */
-     send_data(buffer, buflen, idx);
+     send_data(rcinfo, buffer, buflen, idx);
 
      return 1;
 
@@ -655,13 +719,13 @@ void _udp_recv_callback(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, co
 }
 
 
-int send_data (void *buf, unsigned int len, unsigned int idx) {
+int send_data (rc_info_t *rcinfo, void *buf, unsigned int len, unsigned int idx) {
 
         /* send this packet out of our socket */
         
-	send_message(&hep_connection_s[idx], (unsigned char *)buf, len, hep_connection_s[idx].type == 1 ? SEND_UDP_REQUEST : SEND_TCP_REQUEST);
+	send_message(&hep_connection_s[idx], (unsigned char *)buf, len, hep_connection_s[idx].type == 1 ? SEND_UDP_REQUEST : SEND_TCP_REQUEST, rcinfo);
 
-        stats.send_packets_total++;
+        metric_inc(stats.send_packets_total);
 
         /* RESET ERRORS COUNTER */
         return 0;
@@ -669,16 +733,9 @@ int send_data (void *buf, unsigned int len, unsigned int idx) {
 
 /****** LIBUV *********************/
 
-int send_message(hep_connection_t *conn, unsigned char *message, size_t len, hep_request_type_t type)
+/* hands req to the loop thread of conn and waits until it took it */
+static void send_request(hep_connection_t *conn, hep_request_t *req)
 {
-
-  hep_request_t *req = malloc(sizeof(hep_request_t));
-  
-  req->message = message;
-  req->len = len;
-  req->request_type = type;
-  req->conn = conn;
-   
   uv_mutex_lock(&conn->mutex);
 
   conn->async_handle.data = req;
@@ -688,7 +745,61 @@ int send_message(hep_connection_t *conn, unsigned char *message, size_t len, hep
   uv_sem_wait(&conn->sem);
   
   uv_mutex_unlock(&conn->mutex);
+}
+
+/* hands the held back requests of connection idx over in one go */
+static void send_batch(unsigned int idx)
+{
+  hep_request_t *req;
+
+  if (!batch_head[idx]) return;
+
+  req = calloc(1, sizeof(hep_request_t));
+  req->request_type = SEND_BATCH_REQUEST;
+  req->conn = &hep_connection_s[idx];
+  req->next = batch_head[idx];
+
+  batch_head[idx] = batch_tail[idx] = NULL;
+  batch_len[idx] = 0;
+
+  send_request(req->conn, req);
+}
+
+/* capture batch flush hook, runs in the capture thread ending its batch */
+void send_batch_flush(void *arg)
+{
+  unsigned int i;
+
+  for (i = 0; i < profile_size; i++) send_batch(i);
+}
+
+int send_message(hep_connection_t *conn, unsigned char *message, size_t len, hep_request_type_t type, rc_info_t *rcinfo)
+{
+
+  hep_request_t *req = malloc(sizeof(hep_request_t));
+  unsigned int idx;
   
+  req->message = message;
+  req->len = len;
+  req->request_type = type;
+  req->conn = conn;
+  req->time_sec = rcinfo->time_sec;
+  req->time_usec = rcinfo->time_usec;
+  req->next = NULL;
+
+  TRACE_PROBE1(send_enqueue, len);
+
+  /* inside a capture batch: queue it, the whole batch goes over at its end */
+  if (capture_batch_active()) {
+    idx = conn - hep_connection_s;
+    if (batch_tail[idx]) batch_tail[idx]->next = req;
+    else batch_head[idx] = req;
+    batch_tail[idx] = req;
+    if (++batch_len[idx] >= HEP_BATCH_MAX) send_batch(idx);
+    return 0;
+  }
+   
+  send_request(conn, req);
   
   return 0;
 }
@@ -722,19 +833,47 @@ void on_tcp_close(uv_handle_t* handle)
 
 }
 
+/* a write failed on a connected stream, close it for the reconnect */
+static void on_tcp_send_error(hep_connection_t *hep_conn, uv_stream_t *handle)
+{
+        uv_close((uv_handle_t*)&hep_conn->tcp_handle, NULL);
+        if (uv_is_active((uv_handle_t*)handle)) {
+            set_conn_state(hep_conn, STATE_CLOSING);
+            uv_close((uv_handle_t*)handle, on_tcp_close);
+        }
+        else
+            set_conn_state(hep_conn, STATE_CLOSED);
+}
+
 void on_send_udp_request(uv_udp_send_t* req, int status) 
 {
+        TRACE_PROBE1(send_done, status);
+
         if (status == 0 && req) {
+                metric_latency(stats.send_latency, ((hep_send_req_t *) req)->time_sec, ((hep_send_req_t *) req)->time_usec);
                 free(req->data);
                 free(req); 
                 req = NULL;
         }        
+        else if (req) {
+#if UV_VERSION_MAJOR == 0                         
+                hep_connection_t* hep_conn = req->handle->loop->data;
+#else        
+                hep_connection_t* hep_conn = uv_key_get(&hep_conn_key);
+#endif   
+                metric_inc(stats.errors_total);
+                if (hep_conn) metric_inc(hep_conn->drops);
+                free(req->data);
+                free(req); 
+        }
 }
 
 void on_send_tcp_request(uv_write_t* req, int status) 
 {
+        TRACE_PROBE1(send_done, status);
 
         if (status == 0 && req) {
+                metric_latency(stats.send_latency, ((hep_send_req_t *) req)->time_sec, ((hep_send_req_t *) req)->time_usec);
                 free(req->data);
                 free(req); 
                 req = NULL;
@@ -751,26 +890,60 @@ void on_send_tcp_request(uv_write_t* req, int status)
 
         if ((status != 0) && (hep_conn->conn_state == STATE_CONNECTED)) {
             LERR("tcp send failed! err=%d", status);
-            uv_close((uv_handle_t*)&hep_conn->tcp_handle, NULL);
-            if (uv_is_active((uv_handle_t*)(req->handle))) {
-                set_conn_state(hep_conn, STATE_CLOSING);
-                uv_close((uv_handle_t*)(req->handle), on_tcp_close);
-            }
-            else
-                set_conn_state(hep_conn, STATE_CLOSED);
+            metric_inc(stats.errors_total);
+            metric_inc(hep_conn->drops);
+            on_tcp_send_error(hep_conn, req->handle);
+        }    
+}       
+
+void on_send_tcp_batch(uv_write_t* req, int status) 
+{
+        hep_batch_write_t *bw = (hep_batch_write_t *) req;
+        hep_request_t *r, *next;
+        unsigned int count = 0;
+
+        TRACE_PROBE1(send_done, status);
+
+        for (r = bw->list; r; r = next) {
+                next = r->next;
+                if (status == 0) metric_latency(stats.send_latency, r->time_sec, r->time_usec);
+                free(r->message);
+                free(r);
+                count++;
+        }
+
+#if UV_VERSION_MAJOR == 0                         
+        hep_connection_t* hep_conn = req->handle->loop->data;
+#else        
+        hep_connection_t* hep_conn = uv_key_get(&hep_conn_key);
+#endif   
+
+        assert(hep_conn != NULL);        
+
+        if ((status != 0) && (hep_conn->conn_state == STATE_CONNECTED)) {
+            LERR("tcp batch send failed! err=%d, messages=%u", status, count);
+            metric_add(stats.errors_total, count);
+            metric_add(hep_conn->drops, count);
+            on_tcp_send_error(hep_conn, req->handle);
         }    
+
+        free(bw);
 }       
    
-int _handle_send_udp_request(hep_connection_t *conn, unsigned char *message, size_t len)
+int _handle_send_udp_request(hep_connection_t *conn, hep_request_t *request)
 {
 
   uv_buf_t buf;
+  hep_send_req_t *sreq;
   uv_udp_send_t *send_req;
 
-  buf.base = (char *)message;
-  buf.len = len;
-  send_req = malloc(sizeof(uv_udp_send_t));
-  send_req->data = message;
+  buf.base = (char *)request->message;
+  buf.len = request->len;
+  sreq = malloc(sizeof(hep_send_req_t));
+  sreq->time_sec = request->time_sec;
+  sreq->time_usec = request->time_usec;
+  send_req = &sreq->req.udp;
+  send_req->data = request->message;
  
 #if UV_VERSION_MAJOR == 0       
         uv_udp_send(send_req, &conn->udp_handle, &buf, 1, conn->send_addr, on_send_udp_request);
@@ -781,23 +954,77 @@ int _handle_send_udp_request(hep_connection_t *conn, unsigned char *message, siz
   return 0;
 }
 
-int _handle_send_tcp_request(hep_connection_t *conn, unsigned char *message, size_t len)
+int _handle_send_tcp_request(hep_connection_t *conn, hep_request_t *request)
 {
 
   uv_buf_t buf;
+  hep_send_req_t *sreq;
   uv_write_t *write_req;
 
-  buf.base = (char *)message;
-  buf.len = len;
+  buf.base = (char *)request->message;
+  buf.len = request->len;
 
-  write_req = malloc(sizeof(uv_write_t));
-  write_req->data = message;
+  sreq = malloc(sizeof(hep_send_req_t));
+  sreq->time_sec = request->time_sec;
+  sreq->time_usec = request->time_usec;
+  write_req = &sreq->req.tcp;
+  write_req->data = request->message;
 
   uv_write(write_req, conn->connect.handle, &buf, 1, on_send_tcp_request);
 
   return 0;
 }
 
+/* UDP requests go out one datagram each, the TCP ones with a single write */
+int _handle_send_batch_request(hep_connection_t *conn, hep_request_t *request)
+{
+  hep_request_t *r, *next, *tcp = NULL, **tcp_tail = &tcp;
+  hep_batch_write_t *bw;
+  uv_buf_t *bufs;
+  unsigned int count = 0, i;
+
+  for (r = request->next; r; r = next) {
+    next = r->next;
+    r->next = NULL;
+    if (r->request_type == SEND_TCP_REQUEST) {
+      *tcp_tail = r;
+      tcp_tail = &r->next;
+      count++;
+      continue;
+    }
+    _handle_send_udp_request(conn, r);
+    free(r);
+  }
+  request->next = NULL;
+
+  if (!tcp) return 0;
+
+  bw = malloc(sizeof(hep_batch_write_t));
+  bufs = malloc(count * sizeof(uv_buf_t));
+  bw->list = tcp;
+
+  for (i = 0, r = tcp; r; r = r->next, i++) {
+    bufs[i].base = (char *)r->message;
+    bufs[i].len = r->len;
+  }
+
+  /* libuv keeps its own copy of bufs */
+  if (uv_write(&bw->req, conn->connect.handle, bufs, count, on_send_tcp_batch)) {
+    metric_add(stats.errors_total, count);
+    metric_add(conn->drops, count);
+    for (r = tcp; r; r = next) {
+      next = r->next;
+      free(r->message);
+      free(r);
+    }
+    free(bw);
+  }
+
+  free(bufs);
+
+  return 0;
+}
+
 
 #if UV_VERSION_MAJOR == 0                            
   void _async_callback(uv_async_t *async, int status)
@@ -817,14 +1044,17 @@ int _handle_send_tcp_request(hep_connection_t *conn, unsigned char *message, siz
 
   switch (request->request_type) {
     case SEND_UDP_REQUEST:
-        result = _handle_send_udp_request(conn, request->message, request->len);
+        result = _handle_send_udp_request(conn, request);
         break;
     case SEND_TCP_REQUEST:
-        result = _handle_send_tcp_request(conn, request->message, request->len);
+        result = _handle_send_tcp_request(conn, request);
         break;
     case QUIT_REQUEST:
         result = _handle_quit(conn);
         break;
+    case SEND_BATCH_REQUEST:
+        result = _handle_send_batch_request(conn, request);
+        break;
   }
    
   uv_sem_post(&conn->sem);
@@ -1123,6 +1353,16 @@ static int load_module(xml_node *config) {
 
 	LNOTICE("Loaded %s", module_name);
 
+	stats.recieved_packets_total = metric_counter("transport_hep_packets_received_total", "Messages passed to send_hep", NULL);
+	stats.send_packets_total = metric_counter("transport_hep_packets_sent_total", "HEP packets sent", NULL);
+	stats.reconnect_total = metric_counter("transport_hep_reconnects_total", "TCP reconnect attempts", NULL);
+	stats.errors_total = metric_counter("transport_hep_errors_total", "Send errors", NULL);
+	stats.compressed_total = metric_counter("transport_hep_compressed_total", "Compressed payloads", NULL);
+	stats.compressed_bytes_in = metric_counter("transport_hep_compressed_bytes_in_total", "Payload bytes before compression", NULL);
+	stats.compressed_bytes_out = metric_counter("transport_hep_compressed_bytes_out_total", "Payload bytes after compression", NULL);
+	stats.encode_latency = metric_histogram("latency_seconds", "Time from the capture timestamp to a pipeline stage", "stage=\"hep_encode\"");
+	stats.send_latency = metric_histogram("latency_seconds", "Time from the capture timestamp to a pipeline stage", "stage=\"send\"");
+
 #if UV_VERSION_MAJOR == 0                         
         /* not implemented */
 #else    
@@ -1160,6 +1400,12 @@ static int load_module(xml_node *config) {
 		profile_transport[profile_size].description = strdup(profile->attr[3]);
 		profile_transport[profile_size].serial = atoi(profile->attr[7]);
 		profile_transport[profile_size].statistic_pipe = NULL;
+#ifdef USE_ZSTD
+		memset(&hep_zstd_s[profile_size], 0, sizeof(hep_zstd_t));
+		hep_zstd_s[profile_size].level = ZSTD_DEFAULT_LEVEL;
+		hep_zstd_s[profile_size].dict_size = ZSTD_DEFAULT_DICT_SIZE;
+		hep_zstd_s[profile_size].train_samples = ZSTD_DEFAULT_TRAIN_SAMPLES;
+#endif /* USE_ZSTD */
 
 		/* SETTINGS */
 		settings = xml_get("settings", profile, 1);
@@ -1201,7 +1447,14 @@ static int load_module(xml_node *config) {
 					else if(!strncmp(key, "capture-proto", 14)) profile_transport[profile_size].capt_proto = strdup(value);
 					else if(!strncmp(key, "capture-password", 17)) profile_transport[profile_size].capt_password = strdup(value);
 					else if(!strncmp(key, "capture-id", 11)) profile_transport[profile_size].capt_id = atoi(value);
-					else if(!strncmp(key, "payload-compression", 19) && !strncmp(value, "true", 5)) profile_transport[profile_size].compression = 1;
+					else if(!strncmp(key, "payload-compression", 19) && !strncmp(value, "true", 5)) profile_transport[profile_size].compression = HEP_COMPRESS_ZLIB;
+					else if(!strncmp(key, "payload-compression", 19) && !strncmp(value, "zstd", 5)) profile_transport[profile_size].compression = HEP_COMPRESS_ZSTD;
+#ifdef USE_ZSTD
+					else if(!strncmp(key, "zstd-dictionary-size", 20)) hep_zstd_s[profile_size].dict_size = atoi(value);
+					else if(!strncmp(key, "zstd-dictionary", 15)) hep_zstd_s[profile_size].dict_path = strdup(value);
+					else if(!strncmp(key, "zstd-level", 10)) hep_zstd_s[profile_size].level = atoi(value);
+					else if(!strncmp(key, "zstd-train-samples", 18)) hep_zstd_s[profile_size].train_samples = atoi(value);
+#endif /* USE_ZSTD */
 					else if(!strncmp(key, "version", 7)) profile_transport[profile_size].version = atoi(value);
 
 
@@ -1271,12 +1524,23 @@ static int load_module(xml_node *config) {
 	for (i = 0; i < profile_size; i++) {
 
 #ifndef USE_ZLIB
-			if(profile_transport[i].compression) {
+			if(profile_transport[i].compression == HEP_COMPRESS_ZLIB) {
 				printf("The captagent has not compiled with zlib. Please reconfigure with --enable-compression\n");
 				LERR("The captagent has not compiled with zlib. Please reconfigure with --enable-compression");
 			}
 #endif /* USE_ZLIB */
+#ifdef USE_ZSTD
+			if(profile_transport[i].compression == HEP_COMPRESS_ZSTD && zstd_init_profile(i) < 0) {
+				profile_transport[i].compression = HEP_COMPRESS_NONE;
+			}
+#else
+			if(profile_transport[i].compression == HEP_COMPRESS_ZSTD) {
+				printf("The captagent has not compiled with zstd. Please reconfigure with --enable-zstd\n");
+				LERR("The captagent has not compiled with zstd. Please reconfigure with --enable-zstd");
+			}
+#endif /* USE_ZSTD */
 			homer_alloc(&hep_connection_s[i]);
+			hep_connection_s[i].drops = metric_drops(module_name, profile_transport[i].name, DROP_SEND_ERROR);
 			
 			if(!strncmp(profile_transport[i].capt_proto, "udp", 3))
 			{
@@ -1291,6 +1555,8 @@ static int load_module(xml_node *config) {
 			}
 	}
 
+	capture_batch_flush_add(send_batch_flush, NULL);
+
 	return 0;
 }
 
@@ -1300,11 +1566,26 @@ static int unload_module(void)
 
 	LNOTICE("unloaded module transport_hep");
 
+	capture_batch_flush_remove(send_batch_flush, NULL);
+
 	for (i = 0; i < profile_size; i++) {
 
 			free_profile(i);
+			metric_unregister(hep_connection_s[i].drops);
+			hep_connection_s[i].drops = NULL;
 	}
 
+	metric_unregister(stats.recieved_packets_total);
+	metric_unregister(stats.send_packets_total);
+	metric_unregister(stats.reconnect_total);
+	metric_unregister(stats.errors_total);
+	metric_unregister(stats.compressed_total);
+	metric_unregister(stats.compressed_bytes_in);
+	metric_unregister(stats.compressed_bytes_out);
+	metric_unregister(stats.encode_latency);
+	metric_unregister(stats.send_latency);
+	memset(&stats, 0, sizeof(stats));
+
 #if UV_VERSION_MAJOR == 0                         
         /* not implemented */
 #else    
@@ -1332,6 +1613,10 @@ static int free_profile(unsigned int idx) {
 	if (profile_transport[idx].statistic_pipe) free(profile_transport[idx].statistic_pipe);
 	if (profile_transport[idx].statistic_profile) free(profile_transport[idx].statistic_profile);
 
+#ifdef USE_ZSTD
+	zstd_free_profile(idx);
+#endif /* USE_ZSTD */
+
 	return 1;
 }
 
@@ -1346,13 +1631,19 @@ static int description(char *descr)
 static int statistic(char *buf, size_t len)
 {
 	int ret = 0;
-
-	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", stats.recieved_packets_total);
-	ret += snprintf(buf+ret, len-ret, "Reconnect total: [%" PRId64 "]\r\n", stats.reconnect_total);
-	ret += snprintf(buf+ret, len-ret, "Errors total: [%" PRId64 "]\r\n", stats.errors_total);
-	ret += snprintf(buf+ret, len-ret, "Compressed total: [%" PRId64 "]\r\n", stats.compressed_total);
-	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", stats.send_packets_total);
-
+	unsigned int i;
+
+	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", metric_value(stats.recieved_packets_total));
+	ret += snprintf(buf+ret, len-ret, "Reconnect total: [%" PRId64 "]\r\n", metric_value(stats.reconnect_total));
+	ret += snprintf(buf+ret, len-ret, "Errors total: [%" PRId64 "]\r\n", metric_value(stats.errors_total));
+	ret += snprintf(buf+ret, len-ret, "Compressed total: [%" PRId64 "]\r\n", metric_value(stats.compressed_total));
+	ret += snprintf(buf+ret, len-ret, "Compressed bytes in: [%" PRId64 "]\r\n", metric_value(stats.compressed_bytes_in));
+	ret += snprintf(buf+ret, len-ret, "Compressed bytes out: [%" PRId64 "]\r\n", metric_value(stats.compressed_bytes_out));
+	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", metric_value(stats.send_packets_total));
+
+	for (i = 0; i < profile_size && ret < len; i++) {
+		ret += snprintf(buf+ret, len-ret, "Send errors [%s]: [%" PRId64 "]\r\n", profile_transport[i].name, metric_value(hep_connection_s[i].drops));
+	}
 
 	return 1;
 
@@ -1366,6 +1657,8 @@ static void reconnect(int idx)
     if (cur_time - hep_connection_s[idx].conn_state_changed_time < 2)
         return;
 
+    metric_inc(stats.reconnect_total);
+
     homer_close(&hep_connection_s[idx]);
 
     init_tcp_socket(&hep_connection_s[idx], profile_transport[idx].capt_host, atoi(profile_transport[idx].capt_port));
@@ -1407,3 +1700,231 @@ static void set_conn_state(hep_connection_t* conn, conn_state_type_t new_conn_st
 
 	LNOTICE("Connection state change: %s => %s", get_state_label(old_state), get_state_label(new_conn_state));
 }
+
+#ifdef USE_ZSTD
+
+static int zstd_set_dict(unsigned int idx, void *dict, size_t size)
+{
+	hep_zstd_t *z = &hep_zstd_s[idx];
+	ZSTD_CDict *cdict;
+
+	cdict = ZSTD_createCDict(dict, size, z->level);
+	if(!cdict) {
+		LERR("zstd: couldn't create dictionary for profile [%s]", profile_transport[idx].name);
+		return -1;
+	}
+
+	z->dict_id = ZSTD_getDictID_fromDict(dict, size);
+	if(z->dict_id == 0) {
+		LNOTICE("zstd: dictionary [%s] has no ID, collectors must be configured with it explicitly", z->dict_path);
+	}
+
+	/* publish after dict_id, send_hep checks cdict without the lock */
+	__atomic_store_n(&z->cdict, cdict, __ATOMIC_RELEASE);
+
+	LNOTICE("zstd: profile [%s] uses dictionary ID [%u], size [%zu]", profile_transport[idx].name, z->dict_id, size);
+
+	return 1;
+}
+
+static int zstd_load_dict(unsigned int idx)
+{
+	hep_zstd_t *z = &hep_zstd_s[idx];
+	FILE *fp;
+	long size;
+	void *dict;
+	int ret = -1;
+
+	if((fp = fopen(z->dict_path, "rb")) == NULL) return -1;
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if(size <= 0) {
+		LERR("zstd: dictionary [%s] is empty", z->dict_path);
+		fclose(fp);
+		return -1;
+	}
+
+	dict = malloc(size);
+	if(dict && fread(dict, 1, size, fp) == (size_t) size) {
+		ret = zstd_set_dict(idx, dict, size);
+	}
+	else {
+		LERR("zstd: couldn't read dictionary [%s]", z->dict_path);
+	}
+
+	if(dict) free(dict);
+	fclose(fp);
+
+	return ret;
+}
+
+static void zstd_save_dict(unsigned int idx, void *dict, size_t size)
+{
+	hep_zstd_t *z = &hep_zstd_s[idx];
+	FILE *fp;
+
+	if((fp = fopen(z->dict_path, "wb")) == NULL) {
+		LERR("zstd: couldn't save dictionary to [%s]: %s", z->dict_path, strerror(errno));
+		return;
+	}
+
+	if(fwrite(dict, 1, size, fp) != size) {
+		LERR("zstd: couldn't write dictionary [%s]", z->dict_path);
+	}
+
+	fclose(fp);
+}
+
+static void zstd_free_samples(hep_zstd_t *z)
+{
+	if(z->samples) free(z->samples);
+	if(z->sample_sizes) free(z->sample_sizes);
+	z->samples = NULL;
+	z->sample_sizes = NULL;
+	z->samples_len = 0;
+	z->samples_cap = 0;
+	z->samples_count = 0;
+}
+
+static void *zstd_train_thread(void *arg)
+{
+	unsigned int idx = (unsigned int) (uintptr_t) arg;
+	hep_zstd_t *z = &hep_zstd_s[idx];
+	void *dict;
+	size_t size;
+
+	dict = malloc(z->dict_size);
+	if(!dict) {
+		LERR("zstd: no memory for dictionary");
+		z->failed = 1;
+		goto done;
+	}
+
+	size = ZDICT_trainFromBuffer(dict, z->dict_size, z->samples, z->sample_sizes, z->samples_count);
+	if(ZDICT_isError(size)) {
+		LERR("zstd: dictionary training failed for profile [%s]: %s", profile_transport[idx].name, ZDICT_getErrorName(size));
+		z->failed = 1;
+	}
+	else {
+		zstd_save_dict(idx, dict, size);
+		if(zstd_set_dict(idx, dict, size) < 0) z->failed = 1;
+	}
+
+	free(dict);
+
+done:
+	pthread_mutex_lock(&z->lock);
+	zstd_free_samples(z);
+	pthread_mutex_unlock(&z->lock);
+
+	return NULL;
+}
+
+static void zstd_add_sample(unsigned int idx, unsigned char *data, unsigned int len)
+{
+	hep_zstd_t *z = &hep_zstd_s[idx];
+	unsigned char *tmp;
+	size_t cap;
+	pthread_t thread;
+
+	pthread_mutex_lock(&z->lock);
+
+	/* trained, training right now or gave up */
+	if(z->failed || !z->sample_sizes || z->samples_count >= z->train_samples) goto done;
+
+	if(z->samples_len + len > z->samples_cap) {
+		cap = z->samples_cap ? z->samples_cap * 2 : 1024 * 1024;
+		while(cap < z->samples_len + len) cap *= 2;
+		if((tmp = realloc(z->samples, cap)) == NULL) goto done;
+		z->samples = tmp;
+		z->samples_cap = cap;
+	}
+
+	memcpy(z->samples + z->samples_len, data, len);
+	z->samples_len += len;
+	z->sample_sizes[z->samples_count++] = len;
+
+	if(z->samples_count < z->train_samples) goto done;
+
+	/* training takes a while, don't stall the capture thread */
+	LNOTICE("zstd: training dictionary for profile [%s] on [%u] samples", profile_transport[idx].name, z->samples_count);
+
+	if(pthread_create(&thread, NULL, zstd_train_thread, (void *) (uintptr_t) idx)) {
+		LERR("zstd: couldn't start training thread");
+		z->failed = 1;
+		zstd_free_samples(z);
+		goto done;
+	}
+	pthread_detach(thread);
+
+done:
+	pthread_mutex_unlock(&z->lock);
+}
+
+static unsigned char *zstd_compress_payload(unsigned int idx, unsigned char *data, unsigned int len, size_t *dlen)
+{
+	ZSTD_CDict *cdict = __atomic_load_n(&hep_zstd_s[idx].cdict, __ATOMIC_ACQUIRE);
+	unsigned char *zdata;
+	size_t bound, ret;
+
+	if(!zstd_cctx && (zstd_cctx = ZSTD_createCCtx()) == NULL) {
+		LERR("zstd: couldn't create compression context");
+		return NULL;
+	}
+
+	bound = ZSTD_compressBound(len);
+	if((zdata = malloc(bound)) == NULL) return NULL;
+
+	ret = ZSTD_compress_usingCDict(zstd_cctx, zdata, bound, data, len, cdict);
+	if(ZSTD_isError(ret)) {
+		LERR("zstd: data couldn't be compressed: %s", ZSTD_getErrorName(ret));
+		free(zdata);
+		return NULL;
+	}
+
+	*dlen = ret;
+
+	return zdata;
+}
+
+static int zstd_init_profile(unsigned int idx)
+{
+	hep_zstd_t *z = &hep_zstd_s[idx];
+
+	if(!z->dict_path) {
+		LERR("zstd: profile [%s] needs zstd-dictionary, collectors can't decompress without it", profile_transport[idx].name);
+		return -1;
+	}
+
+	pthread_mutex_init(&z->lock, NULL);
+
+	if(zstd_load_dict(idx) > 0) return 1;
+
+	if(z->train_samples == 0 || z->dict_size == 0) {
+		LERR("zstd: no dictionary [%s] and training is disabled", z->dict_path);
+		return -1;
+	}
+
+	z->sample_sizes = malloc(z->train_samples * sizeof(size_t));
+	if(!z->sample_sizes) return -1;
+
+	LNOTICE("zstd: no dictionary [%s], collecting [%u] SIP samples for training", z->dict_path, z->train_samples);
+
+	return 1;
+}
+
+static void zstd_free_profile(unsigned int idx)
+{
+	hep_zstd_t *z = &hep_zstd_s[idx];
+
+	if(z->cdict) ZSTD_freeCDict(z->cdict);
+	z->cdict = NULL;
+	zstd_free_samples(z);
+	if(z->dict_path) free(z->dict_path);
+	z->dict_path = NULL;
+}
+
+#endif /* USE_ZSTD */
@@ -27,6 +27,7 @@
 #define _transport_hep_H_
 
 #include <captagent/xmlread.h>
+#include <captagent/metrics.h>
 
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
@@ -44,6 +45,11 @@
 #include <zlib.h>
 #endif /* USE_ZLIB */
 
+#ifdef USE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif /* USE_ZSTD */
+
 #ifdef USE_SSL
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -54,17 +60,55 @@
 profile_transport_t profile_transport[MAX_TRANPORTS];
 
 typedef struct transport_hep_stats {
-	uint64_t recieved_packets_total;
-	uint64_t send_packets_total;
-	uint64_t reconnect_total;
-	uint64_t compressed_total;
-	uint64_t errors_total;
+	metric_t *recieved_packets_total;
+	metric_t *send_packets_total;
+	metric_t *reconnect_total;
+	metric_t *compressed_total;
+	metric_t *compressed_bytes_in;
+	metric_t *compressed_bytes_out;
+	metric_t *errors_total;
+	/* capture timestamp to an encoded packet and to the completed write */
+	metric_t *encode_latency;
+	metric_t *send_latency;
 } transport_hep_stats_t;
 
+/* payload-compression modes */
+#define HEP_COMPRESS_NONE  0
+#define HEP_COMPRESS_ZLIB  1
+#define HEP_COMPRESS_ZSTD  2
+
+/* HEP vendor chunk carrying the zstd dictionary ID (vendor: Homer Project) */
+#define HEP_VENDOR_HOMER        0x0005
+#define HEP_VENDOR_ZSTD_DICT_ID 0x0001
+
+#define ZSTD_DEFAULT_LEVEL         3
+#define ZSTD_DEFAULT_TRAIN_SAMPLES 1000
+#define ZSTD_DEFAULT_DICT_SIZE     (112 * 1024)
+
+#ifdef USE_ZSTD
+typedef struct hep_zstd {
+  char *dict_path;             /* dictionary is loaded from here or saved here after training */
+  int level;
+  unsigned int dict_size;
+  unsigned int train_samples;
+  uint32_t dict_id;
+  ZSTD_CDict *cdict;
+  /* training state: first train_samples SIP payloads are collected here */
+  pthread_mutex_t lock;
+  unsigned char *samples;
+  size_t *sample_sizes;
+  size_t samples_len;
+  size_t samples_cap;
+  unsigned int samples_count;
+  unsigned int failed;
+} hep_zstd_t;
+#endif /* USE_ZSTD */
+
 typedef enum {
   SEND_UDP_REQUEST = 0,
   SEND_TCP_REQUEST = 1,
-  QUIT_REQUEST
+  QUIT_REQUEST,
+  SEND_BATCH_REQUEST
 } hep_request_type_t;
 
 typedef enum {
@@ -95,6 +139,9 @@ typedef struct hep_connection {
 
   conn_state_type_t conn_state;
   time_t conn_state_changed_time;
+
+  /* drops_total reason send_error of this profile */
+  metric_t *drops;
 } hep_connection_t;
 
 typedef struct hep_request {
@@ -102,8 +149,31 @@ typedef struct hep_request {
   hep_connection_t *conn;
   unsigned char *message;
   int len;
+  uint32_t time_sec;
+  uint32_t time_usec;
+  /* SEND_BATCH_REQUEST: the requests handed over together */
+  struct hep_request *next;
 } hep_request_t;
 
+/* uv request plus the capture timestamp, freed in the send callbacks */
+typedef struct hep_send_req {
+  union {
+    uv_udp_send_t udp;
+    uv_write_t tcp;
+  } req;
+  uint32_t time_sec;
+  uint32_t time_usec;
+} hep_send_req_t;
+
+/* one uv_write for all TCP requests of a batch, list freed in the callback */
+typedef struct hep_batch_write {
+  uv_write_t req;
+  hep_request_t *list;
+} hep_batch_write_t;
+
+/* requests a capture thread holds back per connection during a batch */
+#define HEP_BATCH_MAX 256
+
 
 #ifdef USE_SSL
 SSL_CTX* initCTX(void);
@@ -117,7 +187,7 @@ extern char *global_config_path;
 
 int send_hepv3 (rc_info_t *rcinfo, unsigned char *data, unsigned int len, unsigned int sendzip, unsigned int idx);
 int send_hepv2 (rc_info_t *rcinfo, unsigned char *data, unsigned int len, unsigned int idx);
-int send_data (void *buf, unsigned int len, unsigned int idx);
+int send_data (rc_info_t *rcinfo, void *buf, unsigned int len, unsigned int idx);
 int sigPipe(void);
 profile_transport_t* get_profile_by_name(char *name);
 unsigned int get_profile_index_by_name(char *name);
@@ -133,7 +203,8 @@ int w_send_hep_proto(msg_t *_m, char *param1, char *param2);
 
 /*LIBUV*/
 
-int send_message(hep_connection_t *conn, unsigned char *message, size_t len, hep_request_type_t type);
+int send_message(hep_connection_t *conn, unsigned char *message, size_t len, hep_request_type_t type, rc_info_t *rcinfo);
+void send_batch_flush(void *arg);
 
 #if UV_VERSION_MAJOR == 0                         
 uv_buf_t on_alloc(uv_handle_t* client, size_t suggested);
@@ -150,8 +221,10 @@ void _async_callback(uv_async_t *async);
 void _send_callback(uv_udp_send_t *req, int status);
 void on_send_udp_request(uv_udp_send_t* req, int status);
 void on_send_tcp_request(uv_write_t* req, int status);
-int _handle_send_udp_request(hep_connection_t *conn, unsigned char *message, size_t len);
-int _handle_send_tcp_request(hep_connection_t *conn, unsigned char *message, size_t len);
+void on_send_tcp_batch(uv_write_t* req, int status);
+int _handle_send_udp_request(hep_connection_t *conn, hep_request_t *request);
+int _handle_send_tcp_request(hep_connection_t *conn, hep_request_t *request);
+int _handle_send_batch_request(hep_connection_t *conn, hep_request_t *request);
 int homer_close(hep_connection_t *conn);
 void homer_free(hep_connection_t *conn);
 int _handle_quit(hep_connection_t *conn);
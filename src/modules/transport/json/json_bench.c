@@ -0,0 +1,198 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  transport_json encoder benchmark: json-c object tree vs streaming writer
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+/*
+ * make json_bench && ./json_bench [iterations]
+ *
+ * Encodes the same SIP message with the json-c code send_json() used before
+ * and with json_encode_msg(), checks that both produce the same string and
+ * prints messages/sec for each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "config.h"
+
+#ifdef  HAVE_JSON_C_JSON_H
+#include <json-c/json.h>
+#define HAVE_JSONC 1
+#elif HAVE_JSON_JSON_H
+#include <json/json.h>
+#define HAVE_JSONC 1
+#elif HAVE_JSON_H
+#include <json.h>
+#define HAVE_JSONC 1
+#endif
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+#include "json_writer.h"
+
+static char sip_invite[] =
+	"INVITE sip:bob@biloxi.example.com SIP/2.0\r\n"
+	"Via: SIP/2.0/UDP pc33.atlanta.example.com;branch=z9hG4bK776asdhds\r\n"
+	"Max-Forwards: 70\r\n"
+	"To: Bob <sip:bob@biloxi.example.com>\r\n"
+	"From: Alice <sip:alice@atlanta.example.com>;tag=1928301774\r\n"
+	"Call-ID: a84b4c76e66710@pc33.atlanta.example.com\r\n"
+	"CSeq: 314159 INVITE\r\n"
+	"Contact: <sip:alice@pc33.atlanta.example.com>\r\n"
+	"User-Agent: \"bench\"/1.0\r\n"
+	"Content-Type: application/sdp\r\n"
+	"Content-Length: 142\r\n\r\n"
+	"v=0\r\no=alice 2890844526 2890844526 IN IP4 pc33.atlanta.example.com\r\ns=-\r\n"
+	"c=IN IP4 192.0.2.101\r\nt=0 0\r\nm=audio 49172 RTP/AVP 0\r\na=rtpmap:0 PCMU/8000\r\n";
+
+#define SETSTR(field, val) do { (field).s = (val); (field).len = strlen(val); } while(0)
+
+static void make_msg(msg_t *msg, sip_msg_t *sip)
+{
+	memset(msg, 0, sizeof(msg_t));
+	memset(sip, 0, sizeof(sip_msg_t));
+
+	msg->data = sip_invite;
+	msg->len = sizeof(sip_invite) - 1;
+	msg->rcinfo.ip_family = AF_INET;
+	msg->rcinfo.ip_proto = 17;
+	msg->rcinfo.proto_type = 1;
+	msg->rcinfo.src_ip = "192.0.2.101";
+	msg->rcinfo.dst_ip = "192.0.2.4";
+	msg->rcinfo.src_port = 5060;
+	msg->rcinfo.dst_port = 5060;
+	msg->rcinfo.time_sec = 1500000000;
+	msg->rcinfo.time_usec = 123456;
+	msg->parsed_data = sip;
+
+	sip->isRequest = 1;
+	sip->hasSdp = 1;
+	SETSTR(sip->callId, "a84b4c76e66710@pc33.atlanta.example.com");
+	SETSTR(sip->methodString, "INVITE");
+	SETSTR(sip->cSeqMethodString, "INVITE");
+	SETSTR(sip->fromURI, "sip:alice@atlanta.example.com");
+	SETSTR(sip->toURI, "sip:bob@biloxi.example.com");
+	SETSTR(sip->requestURI, "sip:bob@biloxi.example.com");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef HAVE_JSONC
+/* send_json() as it was, minus the socket */
+static char *encode_jsonc(msg_t *msg, uint64_t packet_id, unsigned int capt_id, int send_payload)
+{
+	rc_info_t *rcinfo = &msg->rcinfo;
+	sip_msg_t *sipPacket = NULL;
+	json_object *jobj_reply = json_object_new_object();
+	char tmpser[100], *ret;
+
+	if(msg->parsed_data && rcinfo->proto_type == 1) sipPacket = (sip_msg_t *) msg->parsed_data;
+
+	snprintf(tmpser, 100, "%" PRId64, (int64_t) packet_id);
+
+	json_object_object_add(jobj_reply, "packet_id", json_object_new_string(tmpser));
+	json_object_object_add(jobj_reply, "my_time", json_object_new_int(time(0)));
+	json_object_object_add(jobj_reply, "ip_family", json_object_new_int(rcinfo->ip_family));
+	json_object_object_add(jobj_reply, "ip_proto", json_object_new_int(rcinfo->ip_proto));
+	json_object_object_add(jobj_reply, "src_ip4", json_object_new_string(rcinfo->src_ip));
+	json_object_object_add(jobj_reply, "dst_ip4", json_object_new_string(rcinfo->dst_ip));
+	json_object_object_add(jobj_reply, "src_port", json_object_new_int(rcinfo->src_port));
+	json_object_object_add(jobj_reply, "dst_port", json_object_new_int(rcinfo->dst_port));
+	json_object_object_add(jobj_reply, "tss", json_object_new_int(rcinfo->time_sec));
+	json_object_object_add(jobj_reply, "tsu", json_object_new_int(rcinfo->time_usec));
+	if(send_payload) json_object_object_add(jobj_reply, "payload", json_object_new_string(msg->data));
+	json_object_object_add(jobj_reply, "proto_type", json_object_new_int(rcinfo->proto_type));
+	json_object_object_add(jobj_reply, "capt_id", json_object_new_int(capt_id));
+	json_object_object_add(jobj_reply, "sip_callid", json_object_new_string_len(sipPacket->callId.s, sipPacket->callId.len));
+	json_object_object_add(jobj_reply, "sip_method", json_object_new_string_len(sipPacket->methodString.s, sipPacket->methodString.len));
+	json_object_object_add(jobj_reply, "sip_cseq", json_object_new_string_len(sipPacket->cSeqMethodString.s, sipPacket->cSeqMethodString.len));
+	json_object_object_add(jobj_reply, "sip_cseq", json_object_new_string_len(sipPacket->cSeqMethodString.s, sipPacket->cSeqMethodString.len));
+	json_object_object_add(jobj_reply, "sip_from_uri", json_object_new_string_len(sipPacket->fromURI.s, sipPacket->fromURI.len));
+	json_object_object_add(jobj_reply, "sip_to_uri", json_object_new_string_len(sipPacket->toURI.s, sipPacket->toURI.len));
+	json_object_object_add(jobj_reply, "sip_request_uri", json_object_new_string_len(sipPacket->requestURI.s, sipPacket->requestURI.len));
+	json_object_object_add(jobj_reply, "sip_sdp", json_object_new_int(1));
+
+	ret = strdup(json_object_to_json_string(jobj_reply));
+	json_object_put(jobj_reply);
+
+	return ret;
+}
+#endif /* HAVE_JSONC */
+
+int main(int argc, char **argv)
+{
+	json_writer_t jw;
+	msg_t msg;
+	sip_msg_t sip;
+	unsigned long i, n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	size_t bytes = 0;
+	double t;
+
+	make_msg(&msg, &sip);
+	memset(&jw, 0, sizeof(jw));
+
+#ifdef HAVE_JSONC
+	char *ref = encode_jsonc(&msg, 1, 2001, 1);
+
+	json_encode_msg(&jw, &msg, 1, 2001, 1);
+	if(strcmp(ref, jw.buf)) {
+		fprintf(stderr, "OUTPUT DIFFERS\njson-c: %s\nwriter: %s\n", ref, jw.buf);
+		return 1;
+	}
+	printf("output identical [%zu bytes]\n", jw.len);
+	free(ref);
+
+	t = now();
+	for(i = 0; i < n; i++) {
+		ref = encode_jsonc(&msg, i, 2001, 1);
+		bytes += strlen(ref);
+		free(ref);
+	}
+	t = now() - t;
+	printf("json-c tree : %10.0f msg/s  %8.1f MB/s\n", n / t, bytes / t / 1e6);
+	bytes = 0;
+#endif /* HAVE_JSONC */
+
+	t = now();
+	for(i = 0; i < n; i++) {
+		bytes += json_encode_msg(&jw, &msg, i, 2001, 1);
+	}
+	t = now() - t;
+	printf("json_writer : %10.0f msg/s  %8.1f MB/s\n", n / t, bytes / t / 1e6);
+
+	free(jw.buf);
+
+	return 0;
+}
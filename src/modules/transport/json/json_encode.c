@@ -0,0 +1,111 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Streaming JSON writer for transport_json
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+#include "json_writer.h"
+
+/* fields and order as the json-c object built by send_json before */
+int json_encode_msg(json_writer_t *jw, msg_t *msg, uint64_t packet_id, unsigned int capt_id, int send_payload)
+{
+	rc_info_t *rcinfo = &msg->rcinfo;
+	sip_msg_t *sipPacket = NULL;
+	char tmpser[24];
+	int n;
+
+	if(msg->parsed_data && rcinfo->proto_type == 1) sipPacket = (sip_msg_t *) msg->parsed_data;
+
+	jw_begin(jw);
+
+	n = snprintf(tmpser, sizeof(tmpser), "%" PRId64, (int64_t) packet_id);
+	JW_STR(jw, "packet_id", tmpser, n);
+	JW_INT(jw, "my_time", time(0));
+	JW_INT(jw, "ip_family", rcinfo->ip_family);
+	JW_INT(jw, "ip_proto", rcinfo->ip_proto);
+
+	if(rcinfo->ip_family == AF_INET) {
+		JW_CSTR(jw, "src_ip4", rcinfo->src_ip);
+		JW_CSTR(jw, "dst_ip4", rcinfo->dst_ip);
+	}
+	else {
+		JW_CSTR(jw, "src_ip6", rcinfo->src_ip);
+		JW_CSTR(jw, "dst_ip6", rcinfo->dst_ip);
+	}
+
+	JW_INT(jw, "src_port", rcinfo->src_port);
+	JW_INT(jw, "dst_port", rcinfo->dst_port);
+
+	JW_INT(jw, "tss", rcinfo->time_sec);
+	JW_INT(jw, "tsu", rcinfo->time_usec);
+
+	/* payload, json_object_new_string() stopped at the first NUL */
+	if(send_payload) JW_STR(jw, "payload", msg->data, strnlen(msg->data, msg->len));
+
+	if(rcinfo->correlation_id.s && rcinfo->correlation_id.len > 0)
+		JW_STR(jw, "corr_id", rcinfo->correlation_id.s, rcinfo->correlation_id.len);
+
+	JW_INT(jw, "proto_type", rcinfo->proto_type);
+	JW_INT(jw, "capt_id", capt_id);
+
+	if(sipPacket != NULL) {
+
+		if(sipPacket->callId.s && sipPacket->callId.len > 0)
+			JW_STR(jw, "sip_callid", sipPacket->callId.s, sipPacket->callId.len);
+
+		if(sipPacket->isRequest && sipPacket->methodString.s && sipPacket->methodString.len > 0)
+			JW_STR(jw, "sip_method", sipPacket->methodString.s, sipPacket->methodString.len);
+		else if(sipPacket->responseCode > 0)
+			JW_INT(jw, "sip_response", sipPacket->responseCode);
+
+		if(sipPacket->cSeqMethodString.s && sipPacket->cSeqMethodString.len > 0)
+			JW_STR(jw, "sip_cseq", sipPacket->cSeqMethodString.s, sipPacket->cSeqMethodString.len);
+
+		if(sipPacket->fromURI.s && sipPacket->fromURI.len > 0)
+			JW_STR(jw, "sip_from_uri", sipPacket->fromURI.s, sipPacket->fromURI.len);
+
+		if(sipPacket->toURI.s && sipPacket->toURI.len > 0)
+			JW_STR(jw, "sip_to_uri", sipPacket->toURI.s, sipPacket->toURI.len);
+
+		if(sipPacket->requestURI.s && sipPacket->requestURI.len > 0)
+			JW_STR(jw, "sip_request_uri", sipPacket->requestURI.s, sipPacket->requestURI.len);
+
+		if(sipPacket->paiUser.s && sipPacket->paiUser.len > 0)
+			JW_STR(jw, "sip_pai_user", sipPacket->paiUser.s, sipPacket->paiUser.len);
+
+		if(sipPacket->hasSdp)
+			JW_INT(jw, "sip_sdp", 1);
+	}
+
+	jw_end(jw);
+
+	return jw->error ? -1 : (int) jw->len;
+}
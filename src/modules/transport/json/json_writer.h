@@ -0,0 +1,203 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Streaming JSON writer for transport_json
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+
+/*
+ * Appends one flat JSON object into a growing buffer. The output is byte for
+ * byte what json_object_to_json_string() of json-c prints for the same object:
+ * { "key": value, "key": "value" }, '/' escaped, control chars as \u00xx.
+ * Keys are trusted literals and are not escaped.
+ */
+
+typedef struct json_writer {
+	char *buf;
+	size_t len;
+	size_t size;
+	int fields;
+	int error;
+} json_writer_t;
+
+static inline int jw_reserve(json_writer_t *jw, size_t need)
+{
+	char *tmp;
+	size_t size;
+
+	if(jw->len + need <= jw->size) return 0;
+
+	size = jw->size ? jw->size : 1024;
+	while(size < jw->len + need) size *= 2;
+
+	if((tmp = realloc(jw->buf, size)) == NULL) {
+		jw->error = 1;
+		return -1;
+	}
+	jw->buf = tmp;
+	jw->size = size;
+
+	return 0;
+}
+
+static inline void jw_raw(json_writer_t *jw, const char *s, size_t len)
+{
+	if(jw_reserve(jw, len)) return;
+	memcpy(jw->buf + jw->len, s, len);
+	jw->len += len;
+}
+
+static inline void jw_begin(json_writer_t *jw)
+{
+	jw->len = 0;
+	jw->fields = 0;
+	jw->error = 0;
+	jw_raw(jw, "{", 1);
+}
+
+/* terminates the buffer, jw->buf is a C string afterwards */
+static inline void jw_end(json_writer_t *jw)
+{
+	jw_raw(jw, " }", 3);
+	jw->len -= 1;
+}
+
+static inline void jw_key(json_writer_t *jw, const char *key, size_t klen)
+{
+	char *p;
+
+	if(jw_reserve(jw, klen + 6)) return;
+	p = jw->buf + jw->len;
+
+	if(jw->fields++) *p++ = ',';
+	*p++ = ' ';
+	*p++ = '"';
+	memcpy(p, key, klen);
+	p += klen;
+	*p++ = '"';
+	*p++ = ':';
+	*p++ = ' ';
+
+	jw->len = p - jw->buf;
+}
+
+#define JW_KEY(jw, key) jw_key(jw, key, sizeof(key) - 1)
+
+static inline void jw_int(json_writer_t *jw, int32_t value)
+{
+	char tmp[12], *p = tmp + sizeof(tmp);
+	uint32_t v = value < 0 ? -(uint32_t) value : (uint32_t) value;
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while(v);
+
+	if(value < 0) *--p = '-';
+
+	jw_raw(jw, p, tmp + sizeof(tmp) - p);
+}
+
+/* 1: byte has to be escaped, json-c escapes '/' as well */
+static const unsigned char jw_escape[256] = {
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,
+};
+
+static inline void jw_str(json_writer_t *jw, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *c = (const unsigned char *) s, *end = c + len, *run;
+	char *p;
+
+	/* worst case every byte becomes \u00xx */
+	if(jw_reserve(jw, len * 6 + 2)) return;
+	p = jw->buf + jw->len;
+
+	*p++ = '"';
+
+	while(c < end) {
+
+		/* copy the run that needs no escaping in one go */
+		run = c;
+		while(c < end && !jw_escape[*c]) c++;
+		if(c > run) {
+			memcpy(p, run, c - run);
+			p += c - run;
+		}
+		if(c == end) break;
+
+		*p++ = '\\';
+		switch(*c) {
+			case '"':  *p++ = '"'; break;
+			case '\\': *p++ = '\\'; break;
+			case '/':  *p++ = '/'; break;
+			case '\b': *p++ = 'b'; break;
+			case '\f': *p++ = 'f'; break;
+			case '\n': *p++ = 'n'; break;
+			case '\r': *p++ = 'r'; break;
+			case '\t': *p++ = 't'; break;
+			default:
+				*p++ = 'u';
+				*p++ = '0';
+				*p++ = '0';
+				*p++ = hex[*c >> 4];
+				*p++ = hex[*c & 0xf];
+				break;
+		}
+		c++;
+	}
+
+	*p++ = '"';
+
+	jw->len = p - jw->buf;
+}
+
+static inline void jw_field_int(json_writer_t *jw, const char *key, size_t klen, int32_t value)
+{
+	jw_key(jw, key, klen);
+	jw_int(jw, value);
+}
+
+static inline void jw_field_str(json_writer_t *jw, const char *key, size_t klen, const char *s, size_t len)
+{
+	jw_key(jw, key, klen);
+	jw_str(jw, s, len);
+}
+
+#define JW_INT(jw, key, value) jw_field_int(jw, key, sizeof(key) - 1, value)
+#define JW_STR(jw, key, s, len) jw_field_str(jw, key, sizeof(key) - 1, s, len)
+#define JW_CSTR(jw, key, s) jw_field_str(jw, key, sizeof(key) - 1, s, strlen(s))
+
+int json_encode_msg(json_writer_t *jw, msg_t *msg, uint64_t packet_id, unsigned int capt_id, int send_payload);
+
+#endif /* _JSON_WRITER_H_ */
@@ -41,17 +41,12 @@
 #include <signal.h>
 #include <time.h>
 #include <pthread.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/time.h>
 
 #include "config.h"
 
-#ifdef  HAVE_JSON_C_JSON_H  
-#include <json-c/json.h>
-#elif HAVE_JSON_JSON_H     
-#include <json/json.h>
-#elif HAVE_JSON_H  
-#include <json.h>
-#endif
-
 #ifndef __FAVOR_BSD
 #define __FAVOR_BSD
 #endif /* __FAVOR_BSD */
@@ -67,7 +62,9 @@
 #include <captagent/modules.h>
 //#include "../protocol_sip/parser_sip.h"
 #include "transport_json.h"
+#include "json_writer.h"
 #include <captagent/log.h>
+#include <captagent/trace.h>
 
 xml_node *module_xml_config = NULL;
 char *module_name="transport_json";
@@ -75,6 +72,7 @@ uint64_t module_serial = 0;
 char *module_description = NULL;
 
 static transport_json_stats_t stats;
+static transport_json_drops_t drops[MAX_TRANPORTS];
 
 uint8_t link_offset = 14;
 static int load_module(xml_node *config);
@@ -88,6 +86,11 @@ bind_statistic_module_api_t stats_bind_api;
 unsigned int sslInit = 0;
 unsigned int profile_size = 0;
 
+json_queue_t json_queue_s[MAX_TRANPORTS];
+
+/* packet_id of the JSON records */
+static uint64_t packet_seq = 0;
+
 static cmd_export_t cmds[] = {
         {"transport_json_bind_api",  (cmd_function)bind_usrloc,   1, 0, 0, 0},
         {"send_json",  (cmd_function)w_send_json_api,   1, 0, 0, 0},
@@ -178,100 +181,36 @@ unsigned int get_profile_index_by_name(char *name) {
 
 int send_json (msg_t *msg) {
 
-        rc_info_t *rcinfo = NULL;
         unsigned int idx = 0;
-    	json_object *jobj_reply = NULL;
-    	sip_msg_t *sipPacket = NULL;
-    	const char *message = NULL;
         static int errors = 0;
-        char tmpser[100];
-
-        jobj_reply = json_object_new_object();
+        /* reused for every message, one per capture thread */
+        static __thread json_writer_t jw;
+        int len;
 
         idx = get_profile_index_by_name(msg->profile_name);
-        rcinfo = &msg->rcinfo;
-
-        if(msg->parsed_data && rcinfo->proto_type == 1) sipPacket = (sip_msg_t *) msg->parsed_data;
-
-        stats.recieved_packets_total++;
-
-        /* workaround for old json */
-        snprintf(tmpser, 100, "%" PRId64, (int64_t) stats.recieved_packets_total);
-
-	json_object_object_add(jobj_reply, "packet_id", json_object_new_string(tmpser));
-        json_object_object_add(jobj_reply, "my_time", json_object_new_int(time(0)));
-	json_object_object_add(jobj_reply, "ip_family", json_object_new_int(rcinfo->ip_family));
-	json_object_object_add(jobj_reply, "ip_proto", json_object_new_int(rcinfo->ip_proto));
-
-	if(rcinfo->ip_family == AF_INET) {
-	     json_object_object_add(jobj_reply, "src_ip4", json_object_new_string(rcinfo->src_ip));
-	     json_object_object_add(jobj_reply, "dst_ip4", json_object_new_string(rcinfo->dst_ip));
-	}
-	else {
-	     json_object_object_add(jobj_reply, "src_ip6", json_object_new_string(rcinfo->src_ip));
-	     json_object_object_add(jobj_reply, "dst_ip6", json_object_new_string(rcinfo->dst_ip));
-	}
 
-	json_object_object_add(jobj_reply, "src_port", json_object_new_int(rcinfo->src_port));
-	json_object_object_add(jobj_reply, "dst_port", json_object_new_int(rcinfo->dst_port));
+        metric_inc(stats.recieved_packets_total);
 
-	json_object_object_add(jobj_reply, "tss", json_object_new_int(rcinfo->time_sec));
-	json_object_object_add(jobj_reply, "tsu", json_object_new_int(rcinfo->time_usec));
-
-	/* payload */
-	if(profile_transport[idx].flag == 1) json_object_object_add(jobj_reply, "payload", json_object_new_string(msg->data));
-
-	if(rcinfo->correlation_id.s && rcinfo->correlation_id.len > 0) {
-	     json_object_object_add(jobj_reply, "corr_id", json_object_new_string_len(rcinfo->correlation_id.s, rcinfo->correlation_id.len));
+        len = json_encode_msg(&jw, msg, __atomic_add_fetch(&packet_seq, 1, __ATOMIC_RELAXED), profile_transport[idx].capt_id, profile_transport[idx].flag == 1);
+        if(len < 0) {
+                LERR("JSON: no memory for message");
+                metric_inc(stats.errors_total);
+                goto done;
         }
 
-	json_object_object_add(jobj_reply, "proto_type", json_object_new_int(rcinfo->proto_type));
-	json_object_object_add(jobj_reply, "capt_id", json_object_new_int(profile_transport[idx].capt_id));
-
-
-	if(sipPacket != NULL) {
-
-			if(sipPacket->callId.s && sipPacket->callId.len > 0)
-				json_object_object_add(jobj_reply, "sip_callid", json_object_new_string_len(sipPacket->callId.s, sipPacket->callId.len));
-
-			if(sipPacket->isRequest && sipPacket->methodString.s && sipPacket->methodString.len > 0)
-				json_object_object_add(jobj_reply, "sip_method", json_object_new_string_len(sipPacket->methodString.s, sipPacket->methodString.len));
-			else if(sipPacket->responseCode > 0)
-				json_object_object_add(jobj_reply, "sip_response", json_object_new_int(sipPacket->responseCode));
-
-
-			if(sipPacket->cSeqMethodString.s && sipPacket->cSeqMethodString.len > 0)
-				json_object_object_add(jobj_reply, "sip_cseq", json_object_new_string_len(sipPacket->cSeqMethodString.s, sipPacket->cSeqMethodString.len));
-
-			if(sipPacket->cSeqMethodString.s && sipPacket->cSeqMethodString.len > 0)
-				json_object_object_add(jobj_reply, "sip_cseq", json_object_new_string_len(sipPacket->cSeqMethodString.s, sipPacket->cSeqMethodString.len));
-
-			if(sipPacket->fromURI.s && sipPacket->fromURI.len > 0)
-				json_object_object_add(jobj_reply, "sip_from_uri", json_object_new_string_len(sipPacket->fromURI.s, sipPacket->fromURI.len));
-
-			if(sipPacket->toURI.s && sipPacket->toURI.len > 0)
-				json_object_object_add(jobj_reply, "sip_to_uri", json_object_new_string_len(sipPacket->toURI.s, sipPacket->toURI.len));
-
-			if(sipPacket->requestURI.s && sipPacket->requestURI.len > 0)
-				json_object_object_add(jobj_reply, "sip_request_uri", json_object_new_string_len(sipPacket->requestURI.s, sipPacket->requestURI.len));
-
-			if(sipPacket->paiUser.s && sipPacket->paiUser.len > 0)
-				json_object_object_add(jobj_reply, "sip_pai_user", json_object_new_string_len(sipPacket->paiUser.s, sipPacket->paiUser.len));
-
-
-			if(sipPacket->hasSdp)
-				json_object_object_add(jobj_reply, "sip_sdp", json_object_new_int(1));
-
+	/* async: never touch the socket from the capture thread */
+	if(json_queue_s[idx].buf) {
+		json_enqueue(idx, jw.buf, len);
+		goto done;
 	}
 
-	message = json_object_to_json_string(jobj_reply);
-
 	/* make sleep after 100 errors */
 	if(errors > 30) { sleep (2); errors = 0; }
 
 	/* send this packet out of our socket */
-	if(send_data((void *)message, strlen(message), idx) < 0) {
-		     stats.errors_total++;
+	if(send_data((void *)jw.buf, len, idx) < 0) {
+		     metric_inc(stats.errors_total);
+		     metric_inc(drops[idx].send_error);
 		     LERR( "JSON server is down...");
    		     if(!profile_transport[idx].usessl) {
       	  	           if(init_jsonsocket_blocking(idx)) {
@@ -287,8 +226,7 @@ int send_json (msg_t *msg) {
 #endif /* USE SSL */
         }
 
-	json_object_put(jobj_reply);
-	
+done:
 	if(msg->mfree == 1) free(msg->data);
 	if(msg->corrdata) {
 	   free(msg->corrdata);
@@ -323,7 +261,7 @@ int send_data (void *buf, unsigned int len, unsigned int idx) {
         }
 #endif
 
-        stats.send_packets_total++;
+        metric_inc(stats.send_packets_total);
 
         /* RESET ERRORS COUNTER */
         return 0;
@@ -418,7 +356,7 @@ int init_jsonsocket_blocking (unsigned int idx) {
     struct addrinfo *ai;
     struct addrinfo hints[1] = {{ 0 }};
 
-    stats.reconnect_total++;
+    metric_inc(stats.reconnect_total);
 
     hints->ai_flags = AI_NUMERICSERV;
     hints->ai_family = AF_UNSPEC;
@@ -432,6 +370,8 @@ int init_jsonsocket_blocking (unsigned int idx) {
                hints->ai_protocol = IPPROTO_TCP;
     }
 
+    if(!strncmp(profile_transport[idx].capt_proto, "unix", 4)) return init_jsonsocket_unix(idx);
+
     if(profile_transport[idx].socket) close(profile_transport[idx].socket);
 
     if ((s = getaddrinfo(profile_transport[idx].capt_host, profile_transport[idx].capt_port, hints, &ai)) != 0) {
@@ -456,6 +396,417 @@ int init_jsonsocket_blocking (unsigned int idx) {
     return 0;
 }
 
+/* capture-host is the socket path */
+int init_jsonsocket_unix (unsigned int idx) {
+
+    struct sockaddr_un addr;
+
+    if(profile_transport[idx].socket) close(profile_transport[idx].socket);
+
+    if((profile_transport[idx].socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+             LERR("Sender socket creation failed: %s", strerror(errno));
+             return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", profile_transport[idx].capt_host);
+
+    if(connect(profile_transport[idx].socket, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+             LERR("couldn't connect to [%s]: %s", addr.sun_path, strerror(errno));
+             return 1;
+    }
+
+    return 0;
+}
+
+static int64_t json_queue_bytes(void *arg) {
+
+	json_queue_t *q = (json_queue_t *) arg;
+
+	return __atomic_load_n(&q->head, __ATOMIC_RELAXED) - __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+}
+
+static int64_t json_queue_msgs(void *arg) {
+
+	return __atomic_load_n(&((json_queue_t *) arg)->queued, __ATOMIC_RELAXED);
+}
+
+int json_queue_init(unsigned int idx) {
+
+	json_queue_t *q = &json_queue_s[idx];
+	char label[128];
+
+	if(!strncmp(profile_transport[idx].capt_proto, "udp", 3)) {
+		LERR("async JSON needs a stream socket (tcp, ssl or unix), profile [%s] stays synchronous", profile_transport[idx].name);
+		return -1;
+	}
+
+	if(q->size == 0) q->size = JSON_QUEUE_SIZE;
+	if(q->batch == 0) q->batch = JSON_BATCH_SIZE;
+	if(q->flush_ms == 0) q->flush_ms = JSON_FLUSH_INTERVAL;
+
+	q->size *= 1024 * 1024;
+	q->batch *= 1024;
+	if(q->batch > q->size) q->batch = q->size;
+	q->head = q->tail = 0;
+	q->queued = 0;
+	q->idx = idx;
+
+	if((q->buf = malloc(q->size)) == NULL) {
+		LERR("no memory for JSON queue");
+		return -1;
+	}
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->running = 1;
+
+	if(pthread_create(&q->thread, NULL, json_sender_thread, q)) {
+		LERR("couldn't start JSON sender thread");
+		free(q->buf);
+		q->buf = NULL;
+		return -1;
+	}
+
+	snprintf(label, sizeof(label), "profile=\"%s\"", profile_transport[idx].name);
+	q->depth_bytes = metric_gauge_fn("transport_json_queue_bytes", "Bytes waiting in the async queue", label, json_queue_bytes, q);
+	q->depth_msgs = metric_gauge_fn("transport_json_queue_messages", "Messages waiting in the async queue", label, json_queue_msgs, q);
+
+	return 1;
+}
+
+void json_queue_destroy(unsigned int idx) {
+
+	json_queue_t *q = &json_queue_s[idx];
+
+	if(!q->buf) return;
+
+	metric_unregister(q->depth_bytes);
+	metric_unregister(q->depth_msgs);
+	q->depth_bytes = q->depth_msgs = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	__atomic_store_n(&q->running, 0, __ATOMIC_RELEASE);
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_join(q->thread, NULL);
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->buf);
+	q->buf = NULL;
+}
+
+/* copy one NDJSON line into the queue, drop it if the sender is behind */
+int json_enqueue(unsigned int idx, const char *data, size_t len) {
+
+	json_queue_t *q = &json_queue_s[idx];
+	size_t off, first;
+
+	pthread_mutex_lock(&q->lock);
+
+	if(q->head - q->tail + len + 1 > q->size) {
+		q->dropped++;
+		metric_inc(stats.dropped_total);
+		metric_inc(drops[idx].queue_full);
+		pthread_mutex_unlock(&q->lock);
+		return -1;
+	}
+
+	off = q->head % q->size;
+	first = q->size - off;
+	if(first > len) first = len;
+
+	memcpy(q->buf + off, data, first);
+	memcpy(q->buf, data + first, len - first);
+	q->buf[(q->head + len) % q->size] = '\n';
+	q->head += len + 1;
+	q->queued++;
+	TRACE_PROBE1(send_enqueue, len);
+
+	/* wake the sender once a batch is ready, otherwise the flush timer does it */
+	if(q->head - q->tail >= q->batch) pthread_cond_signal(&q->cond);
+
+	pthread_mutex_unlock(&q->lock);
+
+	return 1;
+}
+
+/* waits for events on the sender socket, at most timeout_ms or forever if < 0.
+ * A full socket is backpressure, not an error. -1 on timeout, error or unload */
+static int json_poll(json_queue_t *q, short events, int timeout_ms) {
+
+	struct pollfd pfd;
+	int ret, waited = 0;
+
+	pfd.fd = profile_transport[q->idx].socket;
+	pfd.events = events;
+
+	while((ret = poll(&pfd, 1, JSON_WRITE_WAIT)) == 0) {
+		/* a stuck server must not hold up unload */
+		if(!__atomic_load_n(&q->running, __ATOMIC_ACQUIRE)) return -1;
+		waited += JSON_WRITE_WAIT;
+		if(timeout_ms >= 0 && waited >= timeout_ms) return -1;
+	}
+
+	if(ret < 0 && errno != EINTR) return -1;
+	if(ret > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) return -1;
+
+	return 0;
+}
+
+/* *written counts what went out, also when it fails half way */
+static int json_write_all(json_queue_t *q, const char *buf, size_t len, size_t *written) {
+
+	unsigned int idx = q->idx;
+	ssize_t n;
+	short wait;
+
+	*written = 0;
+
+	while(len > 0) {
+		wait = 0;
+#ifdef USE_SSL
+		if(profile_transport[idx].usessl) {
+			n = SSL_write(profile_transport[idx].ssl, buf, len);
+			if(n <= 0) {
+				switch(SSL_get_error(profile_transport[idx].ssl, n)) {
+				case SSL_ERROR_WANT_WRITE: wait = POLLOUT; break;
+				case SSL_ERROR_WANT_READ: wait = POLLIN; break;
+				}
+			}
+		}
+		else
+#endif /* USE_SSL */
+		{
+			n = send(profile_transport[idx].socket, buf, len, MSG_NOSIGNAL);
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) wait = POLLOUT;
+			if(n < 0 && errno == EINTR) continue;
+		}
+
+		if(n <= 0) {
+			/* SSL wants the same buffer and length again */
+			if(wait && !json_poll(q, wait, -1)) continue;
+			LERR("JSON send error: [%d]", errno);
+			return -1;
+		}
+
+		buf += n;
+		len -= n;
+		*written += n;
+	}
+
+	return 0;
+}
+
+/* sleeps ms on the queue, an unload wakes it up */
+static void json_queue_wait(json_queue_t *q, unsigned int ms) {
+
+	struct timespec ts;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + ms / 1000;
+	ts.tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+}
+
+#ifdef USE_SSL
+/* handshake on the non-blocking socket, bounded by JSON_CONNECT_TIMEOUT per step */
+static int json_ssl_connect(json_queue_t *q) {
+
+	unsigned int idx = q->idx;
+	short wait;
+	int ret;
+
+	if((profile_transport[idx].ctx = initCTX()) == NULL) return 1;
+	SSL_CTX_set_options(profile_transport[idx].ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2);
+
+	if((profile_transport[idx].ssl = SSL_new(profile_transport[idx].ctx)) == NULL) return 1;
+	SSL_set_connect_state(profile_transport[idx].ssl);
+	SSL_set_fd(profile_transport[idx].ssl, profile_transport[idx].socket);
+
+	while((ret = SSL_connect(profile_transport[idx].ssl)) <= 0) {
+		switch(SSL_get_error(profile_transport[idx].ssl, ret)) {
+		case SSL_ERROR_WANT_READ: wait = POLLIN; break;
+		case SSL_ERROR_WANT_WRITE: wait = POLLOUT; break;
+		default:
+			ERR_print_errors_fp(stderr);
+			return 1;
+		}
+		if(json_poll(q, wait, JSON_CONNECT_TIMEOUT)) {
+			LERR("SSL handshake with [%s] timed out", profile_transport[idx].capt_host);
+			return 1;
+		}
+	}
+
+	showCerts(profile_transport[idx].ssl);
+
+	return 0;
+}
+#endif /* USE_SSL */
+
+/* the sender's own connect: non-blocking socket, connect and handshake with
+ * a timeout, so a stalled collector can neither block writes nor unload */
+static int json_reconnect(json_queue_t *q) {
+
+	unsigned int idx = q->idx;
+	struct addrinfo hints, *ai = NULL;
+	struct sockaddr_un addr;
+	socklen_t elen = sizeof(int);
+	int fd, err = 0, ret;
+
+	metric_inc(stats.reconnect_total);
+
+#ifdef USE_SSL
+	if(profile_transport[idx].ssl) SSL_free(profile_transport[idx].ssl);
+	if(profile_transport[idx].ctx) SSL_CTX_free(profile_transport[idx].ctx);
+	profile_transport[idx].ssl = NULL;
+	profile_transport[idx].ctx = NULL;
+#endif /* USE_SSL */
+
+	if(profile_transport[idx].socket > 0) close(profile_transport[idx].socket);
+	profile_transport[idx].socket = 0;
+
+	if(!strncmp(profile_transport[idx].capt_proto, "unix", 4)) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", profile_transport[idx].capt_host);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	}
+	else {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_flags = AI_NUMERICSERV;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+
+		if((ret = getaddrinfo(profile_transport[idx].capt_host, profile_transport[idx].capt_port, &hints, &ai)) != 0) {
+			LERR("capture: getaddrinfo: %s", gai_strerror(ret));
+			return 1;
+		}
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	}
+
+	if(fd < 0) {
+		LERR("Sender socket creation failed: %s", strerror(errno));
+		if(ai) freeaddrinfo(ai);
+		return 1;
+	}
+
+	profile_transport[idx].socket = fd;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if(ai) ret = connect(fd, ai->ai_addr, ai->ai_addrlen);
+	else ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+	if(ai) freeaddrinfo(ai);
+
+	if(ret < 0 && errno != EINPROGRESS) {
+		LERR("couldn't connect to [%s]: %s", profile_transport[idx].capt_host, strerror(errno));
+		return 1;
+	}
+
+	if(ret < 0 && (json_poll(q, POLLOUT, JSON_CONNECT_TIMEOUT)
+			|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &elen) < 0 || err)) {
+		LERR("couldn't connect to [%s]: %s", profile_transport[idx].capt_host, err ? strerror(err) : "timeout");
+		return 1;
+	}
+
+#ifdef USE_SSL
+	if(profile_transport[idx].usessl) return json_ssl_connect(q);
+#endif /* USE_SSL */
+
+	return 0;
+}
+
+void *json_sender_thread(void *arg) {
+
+	json_queue_t *q = (json_queue_t *) arg;
+	unsigned int idx = q->idx, backoff = 1;
+	size_t off, len, i, written, done;
+	unsigned int lines;
+	int failed;
+
+	while(1) {
+
+		/* connect here, a dead server must not block capture */
+		if(!__atomic_load_n(&q->connected, __ATOMIC_ACQUIRE)) {
+			if(json_reconnect(q)) {
+				LERR("JSON server [%s] is down, retry in [%u] sec", profile_transport[idx].capt_host, backoff);
+				metric_inc(stats.errors_total);
+				pthread_mutex_lock(&q->lock);
+				if(q->running) json_queue_wait(q, backoff * 1000);
+				pthread_mutex_unlock(&q->lock);
+				if(backoff < JSON_RECONNECT_MAX) backoff *= 2;
+				if(!__atomic_load_n(&q->running, __ATOMIC_ACQUIRE)) break;
+				continue;
+			}
+			__atomic_store_n(&q->connected, 1, __ATOMIC_RELEASE);
+			backoff = 1;
+		}
+
+		pthread_mutex_lock(&q->lock);
+
+		/* wait for a full batch or the flush interval */
+		if(q->running && q->head - q->tail < q->batch) json_queue_wait(q, q->flush_ms);
+
+		if(!q->running && q->head == q->tail) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+
+		/* the part between tail and head is ours, producers only append */
+		off = q->tail % q->size;
+		len = q->head - q->tail;
+		if(len > q->size - off) len = q->size - off;
+
+		pthread_mutex_unlock(&q->lock);
+
+		if(len == 0) continue;
+
+		failed = json_write_all(q, q->buf + off, len, &written);
+
+		/* whole lines only: a line cut by the error goes out again in
+		 * full on the new connection, the ones before it not at all */
+		for(i = 0, lines = 0, done = 0; i < written; i++) {
+			if(q->buf[off + i] == '\n') {
+				lines++;
+				done = i + 1;
+			}
+		}
+
+		/* a batch cut at the end of the ring ends mid line */
+		if(!failed) done = len;
+
+		pthread_mutex_lock(&q->lock);
+		q->tail += done;
+		q->queued -= lines;
+		pthread_mutex_unlock(&q->lock);
+
+		if(lines) metric_add(stats.send_packets_total, lines);
+
+		if(failed) {
+			__atomic_store_n(&q->connected, 0, __ATOMIC_RELEASE);
+			metric_inc(stats.errors_total);
+			TRACE_PROBE1(send_done, -1);
+			/* unloading, what is left goes with the queue */
+			if(!__atomic_load_n(&q->running, __ATOMIC_ACQUIRE)) break;
+			continue;
+		}
+
+		metric_inc(stats.batches_total);
+		TRACE_PROBE1(send_done, 0);
+	}
+
+	return NULL;
+}
+
 
 #ifdef USE_SSL
 SSL_CTX* initCTX(void) {
@@ -623,6 +974,14 @@ static int load_module(xml_node *config) {
 
 	LNOTICE("Loaded %s", module_name);
 
+	stats.recieved_packets_total = metric_counter("transport_json_packets_received_total", "Messages passed to send_json", NULL);
+	stats.send_packets_total = metric_counter("transport_json_packets_sent_total", "JSON records sent", NULL);
+	stats.reconnect_total = metric_counter("transport_json_reconnects_total", "Reconnect attempts", NULL);
+	stats.compressed_total = metric_counter("transport_json_compressed_total", "Compressed records", NULL);
+	stats.errors_total = metric_counter("transport_json_errors_total", "Send and encode errors", NULL);
+	stats.dropped_total = metric_counter("transport_json_dropped_total", "Records dropped on a full async queue", NULL);
+	stats.batches_total = metric_counter("transport_json_batches_total", "Batches written by the async senders", NULL);
+
 	load_module_xml_config();
 	/* READ CONFIG */
 	profile = module_xml_config;
@@ -652,6 +1011,7 @@ static int load_module(xml_node *config) {
 		profile_transport[profile_size].serial = atoi(profile->attr[7]);
 		profile_transport[profile_size].statistic_pipe = NULL;
 		profile_transport[profile_size].flag = 1;
+		memset(&json_queue_s[profile_size], 0, sizeof(json_queue_t));
 
 		/* SETTINGS */
 		settings = xml_get("settings", profile, 1);
@@ -696,6 +1056,10 @@ static int load_module(xml_node *config) {
 					else if(!strncmp(key, "payload-compression", 19) && !strncmp(value, "true", 5)) profile_transport[profile_size].compression = 1;
 					else if(!strncmp(key, "version", 7)) profile_transport[profile_size].version = atoi(value);
 					else if(!strncmp(key, "payload-send", 12) && !strncmp(value, "false", 5)) profile_transport[profile_size].flag = 0;
+					else if(!strncmp(key, "async", 5) && !strncmp(value, "true", 5)) json_queue_s[profile_size].async = 1;
+					else if(!strncmp(key, "queue-size", 10)) json_queue_s[profile_size].size = atoi(value);
+					else if(!strncmp(key, "batch-size", 10)) json_queue_s[profile_size].batch = atoi(value);
+					else if(!strncmp(key, "flush-interval", 14)) json_queue_s[profile_size].flush_ms = atoi(value);
 
 
 					//if (!strncmp(key, "ignore", 6))
@@ -762,6 +1126,9 @@ static int load_module(xml_node *config) {
 
 	for (i = 0; i < profile_size; i++) {
 
+			drops[i].queue_full = metric_drops(module_name, profile_transport[i].name, DROP_QUEUE_FULL);
+			drops[i].send_error = metric_drops(module_name, profile_transport[i].name, DROP_SEND_ERROR);
+
 #ifndef USE_ZLIB
 			if(profile_transport[i].compression) {
 				printf("The captagent has not compiled with zlib. Please reconfigure with --enable-compression\n");
@@ -786,6 +1153,11 @@ static int load_module(xml_node *config) {
 #endif /* end USE_SSL */
 			}
 
+			/* the sender thread connects by itself */
+			if(json_queue_s[i].async && json_queue_init(i) > 0) {
+				continue;
+			}
+
 			if(!profile_transport[i].usessl) {
 				if(init_jsonsocket_blocking(i)) {
 					LERR("capture: couldn't init socket");
@@ -821,8 +1193,21 @@ static int unload_module(void)
 	for (i = 0; i < profile_size; i++) {
 
 			free_profile(i);
+			metric_unregister(drops[i].queue_full);
+			metric_unregister(drops[i].send_error);
 	}
 
+	memset(drops, 0, sizeof(drops));
+
+	metric_unregister(stats.recieved_packets_total);
+	metric_unregister(stats.send_packets_total);
+	metric_unregister(stats.reconnect_total);
+	metric_unregister(stats.compressed_total);
+	metric_unregister(stats.errors_total);
+	metric_unregister(stats.dropped_total);
+	metric_unregister(stats.batches_total);
+	memset(&stats, 0, sizeof(stats));
+
     return 0;
 }
 
@@ -835,6 +1220,8 @@ static int free_profile(unsigned int idx) {
 
 	/*free profile chars **/
 
+	json_queue_destroy(idx);
+
 	if (profile_transport[idx].name)	 free(profile_transport[idx].name);
 	if (profile_transport[idx].description) free(profile_transport[idx].description);
 	if (profile_transport[idx].capt_host) free(profile_transport[idx].capt_host);
@@ -858,12 +1245,27 @@ static int description(char *descr)
 static int statistic(char *buf, size_t len)
 {
 	int ret = 0;
+	unsigned int i = 0;
+
+	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", metric_value(stats.recieved_packets_total));
+	ret += snprintf(buf+ret, len-ret, "Reconnect total: [%" PRId64 "]\r\n", metric_value(stats.reconnect_total));
+	ret += snprintf(buf+ret, len-ret, "Errors total: [%" PRId64 "]\r\n", metric_value(stats.errors_total));
+	ret += snprintf(buf+ret, len-ret, "Compressed total: [%" PRId64 "]\r\n", metric_value(stats.compressed_total));
+	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", metric_value(stats.send_packets_total));
+	ret += snprintf(buf+ret, len-ret, "Dropped total: [%" PRId64 "]\r\n", metric_value(stats.dropped_total));
+	ret += snprintf(buf+ret, len-ret, "Batches total: [%" PRId64 "]\r\n", metric_value(stats.batches_total));
+
+	for (i = 0; i < profile_size; i++) {
+		if(!json_queue_s[i].buf) continue;
+		ret += snprintf(buf+ret, len-ret, "Queue [%s]: [%u] messages, [%zu/%zu] bytes, dropped [%" PRId64 "], %s\r\n",
+				profile_transport[i].name, json_queue_s[i].queued, json_queue_s[i].head - json_queue_s[i].tail,
+				json_queue_s[i].size, json_queue_s[i].dropped, __atomic_load_n(&json_queue_s[i].connected, __ATOMIC_ACQUIRE) ? "connected" : "disconnected");
+	}
 
-	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", stats.recieved_packets_total);
-	ret += snprintf(buf+ret, len-ret, "Reconnect total: [%" PRId64 "]\r\n", stats.reconnect_total);
-	ret += snprintf(buf+ret, len-ret, "Errors total: [%" PRId64 "]\r\n", stats.errors_total);
-	ret += snprintf(buf+ret, len-ret, "Compressed total: [%" PRId64 "]\r\n", stats.compressed_total);
-	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", stats.send_packets_total);
+	for (i = 0; i < profile_size && ret < len; i++) {
+		ret += snprintf(buf+ret, len-ret, "Drops [%s]: queue full [%" PRId64 "], send error [%" PRId64 "]\r\n",
+				profile_transport[i].name, metric_value(drops[i].queue_full), metric_value(drops[i].send_error));
+	}
 
 
 	return 1;
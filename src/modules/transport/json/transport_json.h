@@ -28,6 +28,7 @@
 #define _transport_json_H_
 
 #include <captagent/xmlread.h>
+#include <captagent/metrics.h>
 
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
@@ -53,16 +54,55 @@
 profile_transport_t profile_transport[MAX_TRANPORTS];
 
 typedef struct transport_json_stats {
-	uint64_t recieved_packets_total;
-	uint64_t send_packets_total;
-	uint64_t reconnect_total;
-	uint64_t compressed_total;
-	uint64_t errors_total;
+	metric_t *recieved_packets_total;
+	metric_t *send_packets_total;
+	metric_t *reconnect_total;
+	metric_t *compressed_total;
+	metric_t *errors_total;
+	metric_t *dropped_total;
+	metric_t *batches_total;
 } transport_json_stats_t;
 
+/* per profile drops_total */
+typedef struct transport_json_drops {
+	metric_t *queue_full;
+	metric_t *send_error;
+} transport_json_drops_t;
+
+/* async mode defaults */
+#define JSON_QUEUE_SIZE      8       /* MB */
+#define JSON_BATCH_SIZE      64      /* KB */
+#define JSON_FLUSH_INTERVAL  100     /* ms */
+#define JSON_RECONNECT_MAX   30      /* sec */
+#define JSON_WRITE_WAIT      1000    /* ms, poll() slice on a full socket */
+#define JSON_CONNECT_TIMEOUT 5000    /* ms, connect and each handshake step */
+
+/* async mode: capture threads append NDJSON lines, one sender thread per profile writes them out */
+typedef struct json_queue {
+	int async;
+	char *buf;
+	size_t size;
+	size_t head;            /* free running byte counters */
+	size_t tail;
+	size_t batch;
+	unsigned int flush_ms;
+	unsigned int queued;    /* messages in the queue */
+	int running;
+	int connected;          /* sender thread writes, stats read: atomic */
+	unsigned int idx;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t dropped;
+	metric_t *depth_bytes;
+	metric_t *depth_msgs;
+} json_queue_t;
+
 
 #ifdef USE_SSL
 SSL_CTX* initCTX(void);
+int initSSL(unsigned int idx);
+void showCerts(SSL* ssl);
 #endif /* USE_SSL */
 
 //struct addrinfo *ai;
@@ -72,6 +112,11 @@ extern char *global_config_path;
 
 int send_data (void *buf, unsigned int len, unsigned int idx);
 int init_jsonsocket_blocking (unsigned int idx);
+int init_jsonsocket_unix (unsigned int idx);
+int json_queue_init(unsigned int idx);
+void json_queue_destroy(unsigned int idx);
+int json_enqueue(unsigned int idx, const char *data, size_t len);
+void *json_sender_thread(void *arg);
 int init_jsonsocket (unsigned int idx);
 int sigPipe(void);
 profile_transport_t* get_profile_by_name(char *name);
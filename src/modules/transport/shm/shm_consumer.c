@@ -0,0 +1,142 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Example consumer of the transport_shm ring
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "shm_reader.h"
+
+static volatile int running = 1;
+
+static void stop(int sig)
+{
+	running = 0;
+}
+
+static void usage(int e)
+{
+	printf("usage: shm_consumer [-n name] [-q]\n"
+	       "   -n  shm name of the transport_shm profile (default /captagent)\n"
+	       "   -q  quiet, count messages only\n"
+	       "   -h  is help/usage\n");
+	exit(e);
+}
+
+/* print the addressing of one HEPv3 message */
+static void dump_hep(const unsigned char *buf, uint32_t len)
+{
+	char src[INET6_ADDRSTRLEN] = "", dst[INET6_ADDRSTRLEN] = "";
+	uint16_t vendor, type, clen, sport = 0, dport = 0;
+	uint32_t i = 6, payload_len = 0, line = 0;
+	const unsigned char *payload = NULL;
+
+	if(len < 6 || memcmp(buf, "HEP3", 4)) {
+		printf("NOT HEP3 [%u]\n", len);
+		return;
+	}
+
+	while(i + 6 <= len) {
+		vendor = (buf[i] << 8) | buf[i + 1];
+		type = (buf[i + 2] << 8) | buf[i + 3];
+		clen = (buf[i + 4] << 8) | buf[i + 5];
+		if(clen < 6 || i + clen > len) break;
+
+		if(vendor == 0) {
+			switch(type) {
+				case 3: inet_ntop(AF_INET, buf + i + 6, src, sizeof(src)); break;
+				case 4: inet_ntop(AF_INET, buf + i + 6, dst, sizeof(dst)); break;
+				case 5: inet_ntop(AF_INET6, buf + i + 6, src, sizeof(src)); break;
+				case 6: inet_ntop(AF_INET6, buf + i + 6, dst, sizeof(dst)); break;
+				case 7: sport = (buf[i + 6] << 8) | buf[i + 7]; break;
+				case 8: dport = (buf[i + 6] << 8) | buf[i + 7]; break;
+				case 15:
+					payload = buf + i + 6;
+					payload_len = clen - 6;
+					break;
+			}
+		}
+		i += clen;
+	}
+
+	/* first line of the payload only */
+	while(line < payload_len && payload[line] != '\r' && payload[line] != '\n') line++;
+
+	printf("%s:%u -> %s:%u [%u] %.*s\n", src, sport, dst, dport, payload_len, (int) line, payload ? (const char *) payload : "");
+}
+
+int main(int argc, char **argv)
+{
+	shm_reader_t reader;
+	const unsigned char *msg;
+	char *name = "/captagent";
+	uint32_t len;
+	uint64_t count = 0;
+	int quiet = 0, c;
+
+	while((c = getopt(argc, argv, "n:qh")) != EOF) {
+		switch(c) {
+			case 'n':
+				name = optarg;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			case 'h':
+				usage(0);
+				break;
+			default:
+				usage(1);
+		}
+	}
+
+	if(shm_reader_open(&reader, name) < 0) return 1;
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	while(running) {
+
+		if((msg = shm_reader_next(&reader, &len, 500)) == NULL) continue;
+
+		if(!quiet) dump_hep(msg, len);
+		count++;
+
+		/* done with the message, the producer may reuse its space now */
+		shm_reader_release(&reader);
+	}
+
+	printf("received: [%" PRIu64 "], written by producer: [%" PRIu64 "], dropped by producer: [%" PRIu64 "]\n",
+			count, shm_reader_written(&reader), shm_reader_dropped(&reader));
+
+	shm_reader_close(&reader);
+
+	return 0;
+}
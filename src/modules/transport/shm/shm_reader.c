@@ -0,0 +1,161 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Reader library for the transport_shm ring
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "shm_reader.h"
+
+int shm_reader_open(shm_reader_t *reader, const char *name)
+{
+	struct stat st;
+	shm_ring_hdr_t *hdr;
+
+	memset(reader, 0, sizeof(shm_reader_t));
+
+	reader->fd = shm_open(name, O_RDWR, 0);
+	if(reader->fd < 0) {
+		fprintf(stderr, "shm_open [%s] failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	if(fstat(reader->fd, &st) < 0 || st.st_size < SHM_RING_HDR_SIZE) {
+		fprintf(stderr, "shm [%s] is too small\n", name);
+		goto error;
+	}
+
+	reader->map_len = st.st_size;
+	hdr = mmap(NULL, reader->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, reader->fd, 0);
+	if(hdr == MAP_FAILED) {
+		fprintf(stderr, "mmap [%s] failed: %s\n", name, strerror(errno));
+		goto error;
+	}
+
+	if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || hdr->version != SHM_RING_VERSION
+			|| hdr->data_offset + hdr->size > reader->map_len) {
+		fprintf(stderr, "shm [%s] is not a captagent ring\n", name);
+		munmap(hdr, reader->map_len);
+		goto error;
+	}
+
+	reader->hdr = hdr;
+
+	return 0;
+
+error:
+	close(reader->fd);
+	reader->fd = -1;
+	return -1;
+}
+
+void shm_reader_close(shm_reader_t *reader)
+{
+	if(reader->hdr) munmap(reader->hdr, reader->map_len);
+	if(reader->fd >= 0) close(reader->fd);
+	reader->hdr = NULL;
+	reader->fd = -1;
+}
+
+/* zero the record so the free part of the ring stays zero, then hand it back */
+static void consume(shm_ring_hdr_t *hdr, shm_record_t *rec, uint32_t size)
+{
+	memset(rec, 0, size);
+	__atomic_store_n(&hdr->tail, hdr->tail + size, __ATOMIC_RELEASE);
+}
+
+const unsigned char *shm_reader_peek(shm_reader_t *reader, uint32_t *len)
+{
+	shm_ring_hdr_t *hdr = reader->hdr;
+	shm_record_t *rec;
+	uint32_t size;
+
+	if(reader->current) {
+		*len = reader->current->data_len;
+		return (const unsigned char *) (reader->current + 1);
+	}
+
+	for(;;) {
+		rec = (shm_record_t *) (shm_ring_data(hdr) + (hdr->tail & (hdr->size - 1)));
+		size = __atomic_load_n(&rec->size, __ATOMIC_ACQUIRE);
+		if(size == 0) return NULL;
+
+		if(rec->type == SHM_RECORD_PAD) {
+			consume(hdr, rec, size);
+			continue;
+		}
+
+		reader->current = rec;
+		*len = rec->data_len;
+
+		return (const unsigned char *) (rec + 1);
+	}
+}
+
+void shm_reader_release(shm_reader_t *reader)
+{
+	if(!reader->current) return;
+
+	consume(reader->hdr, reader->current, reader->current->size);
+	reader->current = NULL;
+}
+
+const unsigned char *shm_reader_next(shm_reader_t *reader, uint32_t *len, int timeout_ms)
+{
+	const unsigned char *data;
+	struct timespec ts;
+	unsigned int spins = 0;
+	long waited_us = 0;
+
+	while((data = shm_reader_peek(reader, len)) == NULL) {
+
+		if(timeout_ms >= 0 && waited_us >= timeout_ms * 1000L) return NULL;
+
+		/* spin briefly, then back off to 1ms sleeps */
+		if(++spins < 1000) continue;
+
+		ts.tv_sec = 0;
+		ts.tv_nsec = (spins < 1100 ? 50 : 1000) * 1000L;
+		nanosleep(&ts, NULL);
+		waited_us += ts.tv_nsec / 1000;
+	}
+
+	return data;
+}
+
+uint64_t shm_reader_dropped(shm_reader_t *reader)
+{
+	return __atomic_load_n(&reader->hdr->dropped, __ATOMIC_RELAXED);
+}
+
+uint64_t shm_reader_written(shm_reader_t *reader)
+{
+	return __atomic_load_n(&reader->hdr->written, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,56 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Reader library for the transport_shm ring
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _SHM_READER_H_
+#define _SHM_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shm_ring.h"
+
+typedef struct shm_reader {
+	int fd;
+	shm_ring_hdr_t *hdr;
+	size_t map_len;
+	shm_record_t *current;
+} shm_reader_t;
+
+/* attach to the ring created by transport_shm, only one reader per ring */
+int shm_reader_open(shm_reader_t *reader, const char *name);
+void shm_reader_close(shm_reader_t *reader);
+
+/* next HEPv3 message or NULL if the ring is empty. The message points into
+ * the ring and stays valid until shm_reader_release() */
+const unsigned char *shm_reader_peek(shm_reader_t *reader, uint32_t *len);
+void shm_reader_release(shm_reader_t *reader);
+
+/* like shm_reader_peek() but polls up to timeout_ms (-1 forever) */
+const unsigned char *shm_reader_next(shm_reader_t *reader, uint32_t *len, int timeout_ms);
+
+uint64_t shm_reader_dropped(shm_reader_t *reader);
+uint64_t shm_reader_written(shm_reader_t *reader);
+
+#endif /* _SHM_READER_H_ */
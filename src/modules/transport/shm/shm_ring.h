@@ -0,0 +1,104 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Shared memory ring layout, shared by transport_shm and the reader library
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <stdint.h>
+
+/*
+ * Layout of the POSIX shared memory object (/dev/shm/<name>):
+ *
+ *   offset 0                     shm_ring_hdr_t (SHM_RING_HDR_SIZE bytes)
+ *   offset SHM_RING_HDR_SIZE     data area, hdr->size bytes (power of 2)
+ *
+ * The data area is a byte ring of records. head and tail are free running
+ * byte counters, the position of a record in the data area is (pos & (size - 1)).
+ * Every record starts on a 16 byte boundary:
+ *
+ *   shm_record_t  (16 bytes)
+ *   data          (record->data_len bytes, one HEPv3 message)
+ *   padding       (up to record->size)
+ *
+ * Producers (any number of capture threads) reserve space by advancing head
+ * with compare-and-swap, write type/data_len/data and commit the record by
+ * storing record->size last (release). A record that would cross the end of
+ * the data area is preceded by a SHM_RECORD_PAD record filling the rest.
+ *
+ * The single consumer waits for record->size != 0 at tail (acquire), handles
+ * the record, zeroes it and advances tail (release). All free bytes of the
+ * data area are therefore zero, which is how a not yet committed record is
+ * told apart from a committed one.
+ *
+ * If there is no room the producer drops the message and bumps hdr->dropped,
+ * it never waits for the consumer. The producer never makes a syscall either,
+ * consumers poll (see shm_reader_next()).
+ */
+
+#define SHM_RING_MAGIC    0x4d485343  /* "CSHM" */
+#define SHM_RING_VERSION  1
+
+#define SHM_RING_HDR_SIZE 256
+#define SHM_RING_ALIGN    16
+
+#define SHM_RECORD_HEP    1
+#define SHM_RECORD_PAD    0xffff
+
+typedef struct shm_ring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;            /* size of the data area */
+	uint64_t data_offset;     /* always SHM_RING_HDR_SIZE */
+	uint32_t producer_pid;
+	uint32_t reserved0;
+	uint8_t  pad0[32];
+	/* producers only, own cache line */
+	volatile uint64_t head;
+	uint8_t  pad1[56];
+	/* consumer only, own cache line */
+	volatile uint64_t tail;
+	uint8_t  pad2[56];
+	/* statistic, written by producers */
+	volatile uint64_t written;
+	volatile uint64_t dropped;
+	uint8_t  pad3[48];
+} __attribute__((aligned(64))) shm_ring_hdr_t;
+
+typedef struct shm_record {
+	volatile uint32_t size;   /* total record size incl. header and padding, 0 = not committed */
+	uint16_t type;            /* SHM_RECORD_HEP or SHM_RECORD_PAD */
+	uint16_t flags;
+	uint32_t data_len;        /* bytes of data following the header */
+	uint32_t reserved;
+} shm_record_t;
+
+#define SHM_RECORD_SIZE(len) (((sizeof(shm_record_t) + (len)) + SHM_RING_ALIGN - 1) & ~((uint64_t) SHM_RING_ALIGN - 1))
+
+static inline unsigned char *shm_ring_data(shm_ring_hdr_t *hdr)
+{
+	return (unsigned char *) hdr + hdr->data_offset;
+}
+
+#endif /* _SHM_RING_H_ */
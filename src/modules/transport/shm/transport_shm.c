@@ -0,0 +1,545 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Shared memory ring transport for local consumers
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <captagent/api.h>
+#include <captagent/structure.h>
+#include <captagent/modules_api.h>
+#include <captagent/modules.h>
+#include "transport_shm.h"
+#include <captagent/log.h>
+
+xml_node *module_xml_config = NULL;
+char *module_name="transport_shm";
+uint64_t module_serial = 0;
+char *module_description = NULL;
+
+static transport_shm_stats_t stats;
+
+static int load_module(xml_node *config);
+static int unload_module(void);
+static int description(char *descr);
+static int statistic(char *buf, size_t len);
+static int free_profile(unsigned int idx);
+static uint64_t serial_module(void);
+
+unsigned int profile_size = 0;
+
+static cmd_export_t cmds[] = {
+        {"transport_shm_bind_api",  (cmd_function)bind_usrloc,   1, 0, 0, 0},
+        { "send_shm", (cmd_function) w_send_shm_api, 1, 0, 0, 0 },
+        {0, 0, 0, 0, 0, 0}
+};
+
+struct module_exports exports = {
+        "transport_shm",
+        cmds,        /* Exported functions */
+        load_module,    /* module initialization function */
+        unload_module,
+        description,
+        statistic,
+        serial_module
+};
+
+shm_transport_t shm_transport_s[MAX_TRANPORTS];
+
+int bind_usrloc(transport_module_api_t *api)
+{
+	api->send_f = send_shm;
+	api->reload_f = reload_config;
+	api->module_name = module_name;
+
+        return 0;
+}
+
+int w_send_shm_api(msg_t *_m, char *param1)
+{
+
+    _m->profile_name = param1;
+
+    return send_shm(_m);
+}
+
+int reload_config (char *erbuf, int erlen) {
+
+	char module_config_name[500];
+	xml_node *config = NULL;
+
+	LNOTICE("reloading config for [%s]", module_name);
+
+	snprintf(module_config_name, 500, "%s/%s.xml", global_config_path, module_name);
+
+	if(xml_parse_with_report(module_config_name, erbuf, erlen)) {
+		unload_module();
+		load_module(config);
+		return 1;
+	}
+
+	return 0;
+}
+
+profile_transport_t* get_profile_by_name(char *name) {
+
+	unsigned int i = 0;
+
+	if(profile_size == 1) return &profile_transport[0];
+
+	for (i = 0; i < profile_size; i++) {
+
+		if(!strncmp(profile_transport[i].name, name, strlen(profile_transport[i].name))) {
+			return &profile_transport[i];
+		}
+	}
+
+	return NULL;
+}
+
+unsigned int get_profile_index_by_name(char *name) {
+
+	unsigned int i = 0;
+
+	if(profile_size == 1) return 0;
+
+	for (i = 0; i < profile_size; i++) {
+		if(!strncmp(profile_transport[i].name, name, strlen(profile_transport[i].name))) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+int send_shm(msg_t *msg) {
+
+	shm_ring_hdr_t *hdr;
+	shm_record_t *rec, *pad;
+	unsigned char *data;
+	unsigned int idx, len;
+	uint64_t head, tail, off, need, rec_size, size;
+	int ret = -1;
+
+	idx = get_profile_index_by_name(msg->profile_name);
+	hdr = shm_transport_s[idx].hdr;
+
+	metric_inc(stats.recieved_packets_total);
+
+	if(!hdr) {
+		metric_inc(stats.errors_total);
+		goto done;
+	}
+
+	len = hep_encoded_len(&msg->rcinfo, msg->len, profile_transport[idx].capt_password);
+	rec_size = SHM_RECORD_SIZE(len);
+	size = hdr->size;
+
+	if(len == 0) {
+		metric_inc(stats.dropped_total);
+		metric_inc(shm_transport_s[idx].too_big);
+		goto done;
+	}
+
+	if(rec_size > size / 2) {
+		LERR("message too big for shm ring [%u]", len);
+		metric_inc(stats.errors_total);
+		goto done;
+	}
+
+	/* reserve rec_size bytes, plus the rest of the data area if it wraps */
+	head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+	do {
+		off = head & (size - 1);
+		need = rec_size;
+		if(off + rec_size > size) need += size - off;
+
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+		if(head + need - tail > size) {
+			/* consumer is behind, never wait for it */
+			__atomic_fetch_add(&hdr->dropped, 1, __ATOMIC_RELAXED);
+			metric_inc(stats.dropped_total);
+			metric_inc(shm_transport_s[idx].drops);
+			goto done;
+		}
+	} while(!__atomic_compare_exchange_n(&hdr->head, &head, head + need, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	data = shm_ring_data(hdr);
+
+	if(need != rec_size) {
+		pad = (shm_record_t *) (data + off);
+		pad->type = SHM_RECORD_PAD;
+		pad->data_len = 0;
+		__atomic_store_n(&pad->size, (uint32_t) (size - off), __ATOMIC_RELEASE);
+		off = 0;
+	}
+
+	/* encode straight into the ring, no intermediate buffer */
+	rec = (shm_record_t *) (data + off);
+	rec->type = SHM_RECORD_HEP;
+	rec->flags = 0;
+	rec->data_len = hep_encode((unsigned char *) (rec + 1), &msg->rcinfo, msg->data, msg->len,
+			profile_transport[idx].capt_id, profile_transport[idx].capt_password);
+	__atomic_store_n(&rec->size, (uint32_t) rec_size, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&hdr->written, 1, __ATOMIC_RELAXED);
+	metric_inc(stats.send_packets_total);
+	ret = 1;
+
+done:
+	if(msg->mfree == 1) {
+		LDEBUG("LETS FREE IT!");
+		free(msg->data);
+	}
+	if(msg->corrdata) {
+		free(msg->corrdata);
+		msg->corrdata = NULL;
+	}
+
+	return ret;
+}
+
+static int64_t shm_ring_fill(void *arg) {
+
+	shm_ring_hdr_t *hdr = (shm_ring_hdr_t *) arg;
+
+	return __atomic_load_n(&hdr->head, __ATOMIC_RELAXED) - __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+}
+
+int shm_ring_open(unsigned int idx) {
+
+	shm_transport_t *st = &shm_transport_s[idx];
+	shm_ring_hdr_t *hdr;
+	char label[128];
+
+	st->map_len = SHM_RING_HDR_SIZE + st->size;
+
+	/* start clean, a stale ring could have uncommitted records */
+	shm_unlink(st->shm_name);
+
+	st->fd = shm_open(st->shm_name, O_CREAT | O_RDWR | O_EXCL, 0640);
+	if(st->fd < 0) {
+		LERR("shm_open [%s] failed: %s", st->shm_name, strerror(errno));
+		return -1;
+	}
+
+	if(ftruncate(st->fd, st->map_len) < 0) {
+		LERR("ftruncate [%s] failed: %s", st->shm_name, strerror(errno));
+		goto error;
+	}
+
+	hdr = mmap(NULL, st->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, st->fd, 0);
+	if(hdr == MAP_FAILED) {
+		LERR("mmap [%s] failed: %s", st->shm_name, strerror(errno));
+		goto error;
+	}
+
+	hdr->version = SHM_RING_VERSION;
+	hdr->size = st->size;
+	hdr->data_offset = SHM_RING_HDR_SIZE;
+	hdr->producer_pid = getpid();
+	hdr->head = 0;
+	hdr->tail = 0;
+	/* readers check magic last */
+	__atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+	st->hdr = hdr;
+
+	snprintf(label, sizeof(label), "profile=\"%s\"", profile_transport[idx].name);
+	st->fill = metric_gauge_fn("transport_shm_ring_bytes", "Bytes not yet consumed from the ring", label, shm_ring_fill, hdr);
+	st->drops = metric_drops(module_name, profile_transport[idx].name, DROP_QUEUE_FULL);
+	st->too_big = metric_drops(module_name, profile_transport[idx].name, DROP_TOO_BIG);
+
+	LNOTICE("shm ring [%s] size [%" PRIu64 "] ready", st->shm_name, st->size);
+
+	return 1;
+
+error:
+	close(st->fd);
+	st->fd = -1;
+	shm_unlink(st->shm_name);
+	return -1;
+}
+
+void shm_ring_close(unsigned int idx) {
+
+	shm_transport_t *st = &shm_transport_s[idx];
+
+	metric_unregister(st->fill);
+	metric_unregister(st->drops);
+	metric_unregister(st->too_big);
+	st->fill = NULL;
+	st->drops = NULL;
+	st->too_big = NULL;
+
+	if(st->hdr) {
+		munmap(st->hdr, st->map_len);
+		st->hdr = NULL;
+	}
+
+	if(st->fd >= 0) {
+		close(st->fd);
+		st->fd = -1;
+		shm_unlink(st->shm_name);
+	}
+}
+
+int load_module_xml_config() {
+
+	char module_config_name[500];
+	xml_node *next;
+	int i = 0;
+
+	snprintf(module_config_name, 500, "%s/%s.xml", global_config_path, module_name);
+
+	if ((module_xml_config = xml_parse(module_config_name)) == NULL) {
+		LERR("Unable to open configuration file: %s", module_config_name);
+		return -1;
+	}
+
+	/* check if this module is our */
+	next = xml_get("module", module_xml_config, 1);
+
+	if (next == NULL) {
+		LERR("wrong config for module: %s", module_name);
+		return -2;
+	}
+
+	for (i = 0; next->attr[i]; i++) {
+			if (!strncmp(next->attr[i], "name", 4)) {
+				if (strncmp(next->attr[i + 1], module_name, strlen(module_name))) {
+					return -3;
+				}
+			}
+			else if (!strncmp(next->attr[i], "serial", 6)) {
+				module_serial = atol(next->attr[i + 1]);
+			}
+			else if (!strncmp(next->attr[i], "description", 11)) {
+				module_description = next->attr[i + 1];
+			}
+	}
+
+	return 1;
+}
+
+void free_module_xml_config() {
+
+	/* now we are free */
+	if(module_xml_config) xml_free(module_xml_config);
+}
+
+/* modules external API */
+
+static int load_module(xml_node *config) {
+	xml_node *params, *profile, *settings;
+	char *key, *value = NULL;
+	unsigned int i = 0;
+	uint64_t size;
+
+	LNOTICE("Loaded %s", module_name);
+
+	stats.recieved_packets_total = metric_counter("transport_shm_packets_received_total", "Messages passed to send_shm", NULL);
+	stats.send_packets_total = metric_counter("transport_shm_packets_sent_total", "HEP messages written to the ring", NULL);
+	stats.dropped_total = metric_counter("transport_shm_dropped_total", "Messages dropped on a full ring", NULL);
+	stats.errors_total = metric_counter("transport_shm_errors_total", "Ring errors", NULL);
+
+	load_module_xml_config();
+	/* READ CONFIG */
+	profile = module_xml_config;
+
+	/* reset profile */
+	profile_size = 0;
+
+	while (profile) {
+
+		profile = xml_get("profile", profile, 1);
+
+		if (profile == NULL)
+			break;
+
+		if(!profile->attr[4] || strncmp(profile->attr[4], "enable", 6)) {
+			goto nextprofile;
+		}
+
+		/* if not equals "true" */
+		if(!profile->attr[5] || strncmp(profile->attr[5], "true", 4)) {
+			goto nextprofile;
+		}
+
+		/* set values */
+		memset(&profile_transport[profile_size], 0, sizeof(profile_transport_t));
+		memset(&shm_transport_s[profile_size], 0, sizeof(shm_transport_t));
+		profile_transport[profile_size].name = strdup(profile->attr[1]);
+		profile_transport[profile_size].description = strdup(profile->attr[3]);
+		profile_transport[profile_size].serial = atoi(profile->attr[7]);
+		shm_transport_s[profile_size].fd = -1;
+		shm_transport_s[profile_size].size = SHM_DEFAULT_SIZE;
+
+		/* SETTINGS */
+		settings = xml_get("settings", profile, 1);
+
+		if (settings != NULL) {
+
+			params = settings;
+
+			while (params) {
+
+				params = xml_get("param", params, 1);
+				if (params == NULL) break;
+
+				if (params->attr[0] != NULL) {
+
+					/* bad parser */
+					if (strncmp(params->attr[0], "name", 4)) {
+						LERR("bad keys in the config");
+						goto nextparam;
+					}
+
+					key = params->attr[1];
+
+					if(params->attr[2] && params->attr[3] && !strncmp(params->attr[2], "value", 5)) {
+							value = params->attr[3];
+					}
+					else {
+						value = params->child->value;
+					}
+
+					if (key == NULL || value == NULL) {
+						LERR("bad values in the config");
+						goto nextparam;
+
+					}
+
+					if(!strncmp(key, "shm-name", 8)) shm_transport_s[profile_size].shm_name = strdup(value);
+					else if(!strncmp(key, "shm-size", 8)) shm_transport_s[profile_size].size = atoi(value);
+					else if(!strncmp(key, "capture-password", 17)) profile_transport[profile_size].capt_password = strdup(value);
+					else if(!strncmp(key, "capture-id", 11)) profile_transport[profile_size].capt_id = atoi(value);
+				}
+
+				nextparam:
+					params = params->next;
+
+			}
+		}
+
+		profile_size++;
+
+		nextprofile:
+			profile = profile->next;
+	}
+
+	/* free it */
+	free_module_xml_config();
+
+	for (i = 0; i < profile_size; i++) {
+
+		if(!shm_transport_s[i].shm_name) shm_transport_s[i].shm_name = strdup("/captagent");
+
+		/* MB, rounded up to a power of 2, pad records carry a 32 bit size */
+		if(shm_transport_s[i].size == 0 || shm_transport_s[i].size > 1024) shm_transport_s[i].size = SHM_DEFAULT_SIZE;
+		for(size = 1024 * 1024; size < shm_transport_s[i].size * 1024 * 1024; size <<= 1);
+		shm_transport_s[i].size = size;
+
+		shm_ring_open(i);
+	}
+
+	return 0;
+}
+
+static int unload_module(void)
+{
+	unsigned int i = 0;
+
+	LNOTICE("unloaded module transport_shm");
+
+	for (i = 0; i < profile_size; i++) {
+
+			free_profile(i);
+	}
+
+	metric_unregister(stats.recieved_packets_total);
+	metric_unregister(stats.send_packets_total);
+	metric_unregister(stats.dropped_total);
+	metric_unregister(stats.errors_total);
+	memset(&stats, 0, sizeof(stats));
+
+    return 0;
+}
+
+static uint64_t serial_module(void)
+{
+	 return module_serial;
+}
+
+static int free_profile(unsigned int idx) {
+
+	/*free profile chars **/
+
+	shm_ring_close(idx);
+
+	if (profile_transport[idx].name)	 free(profile_transport[idx].name);
+	if (profile_transport[idx].description) free(profile_transport[idx].description);
+	if (profile_transport[idx].capt_password) free(profile_transport[idx].capt_password);
+	if (shm_transport_s[idx].shm_name) free(shm_transport_s[idx].shm_name);
+
+	return 1;
+}
+
+
+static int description(char *descr)
+{
+       LNOTICE("Loaded description");
+       descr = module_description;
+       return 1;
+}
+
+static int statistic(char *buf, size_t len)
+{
+	int ret = 0;
+	unsigned int i = 0;
+	shm_ring_hdr_t *hdr;
+
+	ret += snprintf(buf+ret, len-ret, "Total received: [%" PRId64 "]\r\n", metric_value(stats.recieved_packets_total));
+	ret += snprintf(buf+ret, len-ret, "Dropped total: [%" PRId64 "]\r\n", metric_value(stats.dropped_total));
+	ret += snprintf(buf+ret, len-ret, "Errors total: [%" PRId64 "]\r\n", metric_value(stats.errors_total));
+	ret += snprintf(buf+ret, len-ret, "Total sent: [%" PRId64 "]\r\n", metric_value(stats.send_packets_total));
+
+	for (i = 0; i < profile_size; i++) {
+		if(!(hdr = shm_transport_s[i].hdr)) continue;
+		ret += snprintf(buf+ret, len-ret, "Ring [%s] fill: [%" PRIu64 "/%" PRIu64 "], dropped [%" PRId64 "]\r\n", shm_transport_s[i].shm_name,
+				hdr->head - hdr->tail, hdr->size, metric_value(shm_transport_s[i].drops));
+	}
+
+	return 1;
+}
@@ -0,0 +1,79 @@
+/*
+ * $Id$
+ *
+ *  captagent - Homer capture agent. Modular
+ *  Shared memory ring transport for local consumers
+ *
+ *  Author: Alexandr Dubovikov <alexandr.dubovikov@gmail.com>
+ *  (C) Homer Project 2012-2015 (http://www.sipcapture.org)
+ *
+ * Homer capture agent is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version
+ *
+ * Homer capture agent is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+*/
+
+#ifndef _transport_shm_H_
+#define _transport_shm_H_
+
+#include <captagent/xmlread.h>
+#include <captagent/metrics.h>
+
+#include <netinet/ip.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include "shm_ring.h"
+#include "hep_encode.h"
+
+#define MAX_TRANPORTS 10
+profile_transport_t profile_transport[MAX_TRANPORTS];
+
+/* ring size in MB if not configured */
+#define SHM_DEFAULT_SIZE 16
+
+typedef struct transport_shm_stats {
+	metric_t *recieved_packets_total;
+	metric_t *send_packets_total;
+	metric_t *dropped_total;
+	metric_t *errors_total;
+} transport_shm_stats_t;
+
+typedef struct shm_transport {
+	char *shm_name;
+	uint64_t size;
+	int fd;
+	shm_ring_hdr_t *hdr;
+	size_t map_len;
+	metric_t *fill;
+	/* drops_total reason queue_full */
+	metric_t *drops;
+	/* drops_total reason too_big */
+	metric_t *too_big;
+} shm_transport_t;
+
+extern char *global_config_path;
+
+profile_transport_t* get_profile_by_name(char *name);
+unsigned int get_profile_index_by_name(char *name);
+int bind_usrloc(transport_module_api_t *api);
+int send_shm(msg_t *msg);
+int shm_ring_open(unsigned int idx);
+void shm_ring_close(unsigned int idx);
+void free_module_xml_config();
+int load_module_xml_config();
+int reload_config (char *erbuf, int erlen);
+/*API*/
+int w_send_shm_api(msg_t *_m, char *param1);
+
+#endif /* _transport_shm_H_ */
@@ -47,6 +47,10 @@ struct rc_info {
 typedef struct rc_info rc_info_t;
 
 
+/* vendor chunk with the zstd dictionary ID (vendor: Homer Project) */
+#define HEP_VENDOR_HOMER        0x0005
+#define HEP_VENDOR_ZSTD_DICT_ID 0x0001
+
 /* HEPv3 types */
 
 struct hep_chunk {
@@ -66,6 +66,10 @@
 
 #include "core_hep.h"
 #include "heptester.h"
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif /* USE_ZSTD */
 //#include "hep.h"
 
 #include <stdio.h>
@@ -87,15 +91,24 @@ int hepversion = 3;
 char *capt_password;
 uint8_t link_offset = 14;
 
+#ifdef USE_ZSTD
+ZSTD_DDict *zstd_ddict = NULL;
+uint32_t zstd_dict_id = 0;
+
+int load_zstd_dict(char *path);
+int zstd_payload_check(char *payload, unsigned int payload_len, uint32_t dict_id);
+#endif /* USE_ZSTD */
+
 int hepv3_received(char *buf, unsigned int len);
 int parsing_hepv3_message(char *buf, unsigned int len);
 
 
 void usage(int8_t e) {
-    printf("usage: heptester <-hvc> <-D pcap> \n"
+    printf("usage: heptester <-hvc> <-D pcap> [-Z dictionary]\n"
            "   -h  is help/usage\n"
            "   -v  is version information\n"
            "   -D  is use specified pcap file\n"           
+           "   -Z  is zstd dictionary to decompress payloads with\n"
            "   -c  is checkout\n"
            "");
 	exit(e);
@@ -109,11 +122,19 @@ int main(int argc,char **argv)
         pcap_t *sniffer;
         char *usefile = NULL;
 
-        while((c=getopt(argc, argv, "vhD:"))!=EOF) {
+        while((c=getopt(argc, argv, "vhD:Z:"))!=EOF) {
                 switch(c) {
                         case 'D':
                                         usefile = optarg;
                                         break;                                        
+                        case 'Z':
+#ifdef USE_ZSTD
+                                        if(load_zstd_dict(optarg) < 0) exit(-1);
+#else
+                                        fprintf(stderr, "heptester has been compiled without zstd support\n");
+                                        exit(-1);
+#endif /* USE_ZSTD */
+                                        break;
                         case 'h':
                                         usage(0);
                                         break;
@@ -391,6 +412,8 @@ int parsing_hepv3_message(char *buf, unsigned int len) {
         int total_length = 0;
         char *correlation_id = NULL, *authkey = NULL;
         struct hep_timehdr heptime;
+        uint32_t dict_id = 0;
+        int compressed = 0;
         
 	hg = (struct hep_generic_recv*)malloc(sizeof(struct hep_generic_recv));
 	if(hg==NULL) {
@@ -429,8 +452,14 @@ int parsing_hepv3_message(char *buf, unsigned int len) {
                         goto error;
                 }
 
+                /* zstd dictionary ID */
+                if(chunk_vendor == HEP_VENDOR_HOMER && chunk_type == HEP_VENDOR_ZSTD_DICT_ID) {
+                        dict_id = ntohl(((hep_chunk_uint32_t *) tmp)->data);
+                        printf("ZSTD DICTIONARY ID: %u\n", dict_id);
+                        i+=chunk_length;
+                }
                 /* SKIP not general Chunks */
-                if(chunk_vendor != 0) {
+                else if(chunk_vendor != 0) {
                         printf("SKIP VENDOR: %d\n",chunk_vendor);                        
                         i+=chunk_length;
                 }
@@ -545,6 +574,15 @@ int parsing_hepv3_message(char *buf, unsigned int len) {
                                         i+=chunk_length;
                                         totelem++;
                                         break;
+                                case 16:
+                                        hg->payload_chunk  = (hep_chunk_t *) (tmp);
+                                        payload = (char *) tmp+sizeof(hep_chunk_t);
+                                        payload_len = chunk_length - sizeof(hep_chunk_t);
+                                        compressed = 1;
+                                        i+=chunk_length;
+                                        totelem++;
+                                        break;
+
                                 case 17:
                                 
                                         correlation_id = (char *) tmp + sizeof(hep_chunk_t);
@@ -565,6 +603,14 @@ int parsing_hepv3_message(char *buf, unsigned int len) {
                 goto done;
         }                 
 
+        if(compressed) {
+#ifdef USE_ZSTD
+                if(zstd_payload_check(payload, payload_len, dict_id) < 0) goto error;
+#else
+                printf("COMPRESSED PAYLOAD: [%u] bytes\n", payload_len);
+#endif /* USE_ZSTD */
+        }
+
         printf("PACKET HEP DONE\n");
                         
 done:
@@ -577,4 +623,94 @@ error:
         if(hg) free(hg);                
         printf("ERROR! Exit\n");
         exit(0);
-}
\ No newline at end of file
+}
+
+
+#ifdef USE_ZSTD
+int load_zstd_dict(char *path)
+{
+        FILE *fp;
+        long size;
+        void *dict;
+
+        if((fp = fopen(path, "rb")) == NULL) {
+                fprintf(stderr, "couldn't open dictionary %s\n", path);
+                return -1;
+        }
+
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        dict = malloc(size);
+        if(size <= 0 || dict == NULL || fread(dict, 1, size, fp) != (size_t) size) {
+                fprintf(stderr, "couldn't read dictionary %s\n", path);
+                if(dict) free(dict);
+                fclose(fp);
+                return -1;
+        }
+
+        fclose(fp);
+
+        zstd_ddict = ZSTD_createDDict(dict, size);
+        zstd_dict_id = ZSTD_getDictID_fromDict(dict, size);
+        free(dict);
+
+        if(!zstd_ddict) {
+                fprintf(stderr, "bad zstd dictionary %s\n", path);
+                return -1;
+        }
+
+        printf("LOADED ZSTD DICTIONARY: ID [%u]\n", zstd_dict_id);
+
+        return 1;
+}
+
+int zstd_payload_check(char *payload, unsigned int payload_len, uint32_t dict_id)
+{
+        static ZSTD_DCtx *dctx = NULL;
+        unsigned long long size;
+        char *data;
+        size_t ret;
+
+        /* zstd frame magic 0xFD2FB528, everything else is zlib */
+        if(payload_len < 4 || memcmp(payload, "\x28\xb5\x2f\xfd", 4)) {
+                printf("COMPRESSED PAYLOAD (not zstd): [%u] bytes\n", payload_len);
+                return 1;
+        }
+
+        if(!zstd_ddict) {
+                printf("ZSTD PAYLOAD: [%u] bytes, no dictionary loaded (-Z)\n", payload_len);
+                return 1;
+        }
+
+        if(dict_id != zstd_dict_id) {
+                fprintf(stderr, "ZSTD DICTIONARY MISMATCH: packet [%u] vs loaded [%u]\n", dict_id, zstd_dict_id);
+                return -1;
+        }
+
+        size = ZSTD_getFrameContentSize(payload, payload_len);
+        if(size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+                fprintf(stderr, "ZSTD bad frame\n");
+                return -1;
+        }
+
+        if(!dctx) dctx = ZSTD_createDCtx();
+
+        data = malloc(size + 1);
+        if(!data) return -1;
+
+        ret = ZSTD_decompress_usingDDict(dctx, data, size, payload, payload_len, zstd_ddict);
+        if(ZSTD_isError(ret)) {
+                fprintf(stderr, "ZSTD decompress failed: %s\n", ZSTD_getErrorName(ret));
+                free(data);
+                return -1;
+        }
+
+        data[ret] = '\0';
+        printf("ZSTD PAYLOAD: [%u] -> [%zu] bytes\n%s\n", payload_len, ret, data);
+        free(data);
+
+        return 1;
+}
+#endif /* USE_ZSTD */